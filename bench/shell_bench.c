@@ -0,0 +1,707 @@
+// shell_bench: repeatable benchmarks for custom_shell's command hot paths.
+//
+// Every benchmark drives the shell binary the way a user or a script does
+// (-c, a script file, or a pty for interactive input) inside a scratch
+// workspace, repeats the measurement and keeps the median. Per-command
+// figures subtract the shell's own startup time, measured first. Results
+// are written as JSON; --baseline compares them with an earlier results
+// file and exits 1 if anything got worse by more than the threshold.
+//
+// Build and run with "make bench" (see the README), or by hand:
+//   gcc -O2 -Wall -Wextra bench/shell_bench.c -lutil -o bench/shell_bench
+//   bench/shell_bench --shell ./custom_shell --out results.json
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_RESULTS 128
+#define MAX_TREES 8
+#define MAX_REPS 100
+
+typedef struct Options {
+    const char *shell;
+    const char *out;      // JSON results file, stdout if NULL
+    const char *baseline; // results file to compare with
+    const char *only;     // run only benchmarks whose name contains this
+    const char *dir;      // where the scratch workspace goes
+    double threshold;     // percent change that counts as a regression
+    int reps;
+    int lines;            // script lines for the per-command benchmarks
+    int spawns;           // external commands for the spawn benchmark
+    size_t pipeMb;        // data pushed through the pipelines
+    size_t trees[MAX_TREES];
+    int ntrees;
+} Options;
+
+typedef struct Result {
+    char name[64];
+    const char *unit;
+    int higherBetter;
+    double median, min, max;
+    int reps;
+} Result;
+
+static Options opt = {
+    .shell = "./custom_shell", .dir = "/tmp", .threshold = 10, .reps = 5,
+    .lines = 20000, .spawns = 2000, .pipeMb = 256,
+    .trees = {1000, 10000, 100000}, .ntrees = 3,
+};
+static Result results[MAX_RESULTS];
+static int nresults = 0;
+static char shellPath[PATH_MAX];
+static char workspace[PATH_MAX / 2]; // leaves room for the paths made under it
+static double startupSecs = 0;
+
+// ===== Helpers =====
+
+double elapsedSince(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Should the benchmark called name run at all?
+int selected(const char *name) {
+    return opt.only == NULL || strstr(name, opt.only) != NULL;
+}
+
+// Keep the median, min and max of n samples and print them as they come
+void record(const char *name, const char *unit, int higherBetter, double *samples, int n) {
+    if (n == 0 || nresults == MAX_RESULTS) return;
+    qsort(samples, n, sizeof(double), compareDoubles);
+    Result *r = &results[nresults++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->unit = unit;
+    r->higherBetter = higherBetter;
+    r->median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    r->min = samples[0];
+    r->max = samples[n - 1];
+    r->reps = n;
+    fprintf(stderr, "%-28s %14.2f %-6s (min %.2f, max %.2f, %d runs)\n",
+            name, r->median, unit, r->min, r->max, n);
+}
+
+int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    if (remove(path) != 0 && errno != ENOENT) perror(path);
+    return 0;
+}
+
+void removePath(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) != 0) return;
+    nftw(path, removeEntry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// Write n copies of line to path
+int writeScript(const char *path, const char *line, int n) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) fprintf(f, "%s\n", line);
+    return fclose(f);
+}
+
+// Per-command cost of a run, with the shell's startup taken off
+double withoutStartup(double secs) {
+    secs -= startupSecs;
+    return secs > 1e-9 ? secs : 1e-9;
+}
+
+// ===== Running the shell =====
+
+// Run the shell in dir (also its workspace) with --profile=profile and
+// either -c command or a script file, all output to /dev/null. Returns the
+// wall time in seconds, or -1 if it could not start or was killed.
+double runShell(const char *dir, const char *profile, const char *command, const char *script) {
+    char profileArg[32];
+    snprintf(profileArg, sizeof(profileArg), "--profile=%s", profile);
+    char *argv[5] = {shellPath, profileArg, NULL, NULL, NULL};
+    if (command != NULL) {
+        argv[2] = "-c";
+        argv[3] = (char *)command;
+    } else {
+        argv[2] = (char *)script;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        if (null == -1 || chdir(dir) != 0) _exit(127);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        setenv("CUSTOM_SHELL_WORKSPACE", dir, 1);
+        execv(shellPath, argv);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {}
+    double secs = elapsedSince(&start);
+    if (WIFSIGNALED(status) || (WIFEXITED(status) && WEXITSTATUS(status) >= 126)) {
+        fprintf(stderr, "shell_bench: '%s' failed (status %d)\n",
+                command != NULL ? command : script, status);
+        return -1;
+    }
+    return secs;
+}
+
+// Type input into an interactive Core shell on a pty, output discarded,
+// and wait for it to exit. input must end with "exit". Returns the wall
+// time, or -1.
+double runInteractive(const char *dir, const char *input, size_t len, const char *histFlush) {
+    struct winsize ws = {.ws_row = 24, .ws_col = 80};
+    int master;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = forkpty(&master, NULL, NULL, &ws);
+    if (pid == -1) {
+        perror("forkpty");
+        return -1;
+    }
+    if (pid == 0) {
+        if (chdir(dir) != 0) _exit(127);
+        setenv("CUSTOM_SHELL_WORKSPACE", dir, 1);
+        if (histFlush != NULL) setenv("CUSTOM_SHELL_HISTFLUSH", histFlush, 1);
+        execl(shellPath, shellPath, "--profile=Core", (char *)NULL);
+        _exit(127);
+    }
+
+    char buf[65536];
+    size_t off = 0;
+    int timedOut = 0;
+    for (;;) {
+        struct pollfd p = {master, POLLIN | (off < len ? POLLOUT : 0), 0};
+        int n = poll(&p, 1, 60000);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            timedOut = 1;
+            break;
+        }
+        if (p.revents & POLLIN) {
+            if (read(master, buf, sizeof(buf)) <= 0) break;
+        } else if (p.revents & (POLLHUP | POLLERR)) {
+            break; // the shell is gone and its output drained
+        }
+        if (off < len && (p.revents & POLLOUT)) {
+            size_t chunk = len - off < 512 ? len - off : 512;
+            ssize_t w = write(master, input + off, chunk);
+            if (w > 0) off += w;
+        }
+    }
+    if (timedOut) kill(pid, SIGKILL);
+    close(master);
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {}
+    double secs = elapsedSince(&start);
+    if (timedOut || !WIFEXITED(status) || WEXITSTATUS(status) >= 126) {
+        fprintf(stderr, "shell_bench: interactive shell failed (status %d%s)\n",
+                status, timedOut ? ", timed out" : "");
+        return -1;
+    }
+    return secs;
+}
+
+// ===== Benchmarks =====
+
+// Time of "-c ''": process start, init and exit
+int benchStartup() {
+    double samples[MAX_REPS];
+    int n = 0;
+    runShell(workspace, "Core", "", NULL); // warm up
+    for (int r = 0; r < opt.reps; r++) {
+        double t = runShell(workspace, "Core", "", NULL);
+        if (t < 0) return -1;
+        samples[n++] = t * 1e3;
+    }
+    record("startup", "ms", 0, samples, n);
+    startupSecs = results[nresults - 1].median / 1e3;
+    return 0;
+}
+
+// A script of count copies of line. With perOp the result is microseconds
+// per line, else lines per second.
+void benchScript(const char *name, const char *profile, const char *line, int count, int perOp) {
+    if (!selected(name)) return;
+    char script[PATH_MAX];
+    snprintf(script, sizeof(script), "%s/%s.sh", workspace, name);
+    if (writeScript(script, line, count) != 0) return;
+
+    double samples[MAX_REPS];
+    int n = 0;
+    runShell(workspace, profile, NULL, script);
+    for (int r = 0; r < opt.reps; r++) {
+        double t = runShell(workspace, profile, NULL, script);
+        if (t < 0) break;
+        t = withoutStartup(t);
+        samples[n++] = perOp ? t / count * 1e6 : count / t;
+    }
+    unlink(script);
+    record(name, perOp ? "us/op" : "ops/s", !perOp, samples, n);
+}
+
+// opt.pipeMb of text lines, for the pipelines to carry
+int writeDataFile(const char *path, size_t *bytes) {
+    static char chunk[1 << 20];
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    size_t len = 0;
+    while (len + 64 < sizeof(chunk)) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        len += snprintf(chunk + len, sizeof(chunk) - len, "%016llx level=%llu bench line\n",
+                        (unsigned long long)x, (unsigned long long)(x % 5));
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    *bytes = 0;
+    for (size_t i = 0; i < opt.pipeMb; i++) {
+        if (write(fd, chunk, len) != (ssize_t)len) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        *bytes += len;
+    }
+    return close(fd);
+}
+
+// cat data | cat | ... with stages commands in all, in MB/s
+void benchPipeline(int stages, const char *data, size_t bytes) {
+    char name[32];
+    snprintf(name, sizeof(name), "pipeline_%d", stages);
+    if (!selected(name)) return;
+    char command[512];
+    int len = snprintf(command, sizeof(command), "cat %s", data);
+    for (int i = 1; i < stages && len < (int)sizeof(command) - 8; i++)
+        len += snprintf(command + len, sizeof(command) - len, " | cat");
+
+    double samples[MAX_REPS];
+    int n = 0;
+    runShell(workspace, "Data", command, NULL);
+    for (int r = 0; r < opt.reps; r++) {
+        double t = runShell(workspace, "Data", command, NULL);
+        if (t < 0) break;
+        samples[n++] = bytes / 1e6 / withoutStartup(t);
+    }
+    record(name, "MB/s", 1, samples, n);
+}
+
+// Distinct lines typed at the prompt, each read by takeInput and appended
+// to the history file, in microseconds per line; a session that only
+// types "exit" is taken off. histFlush is CUSTOM_SHELL_HISTFLUSH.
+void benchHistory(const char *name, const char *histFlush) {
+    if (!selected(name)) return;
+    int count = opt.lines / 10;
+    size_t cap = (size_t)count * 32 + 16, len = 0;
+    char *input = malloc(cap);
+    if (input == NULL) return;
+    for (int i = 0; i < count; i++) len += snprintf(input + len, cap - len, "cd . # %d\n", i);
+    len += snprintf(input + len, cap - len, "exit\n");
+    const char *exitOnly = input + len - 5;
+
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/history", workspace);
+    double base[MAX_REPS], samples[MAX_REPS];
+    int nbase = 0, n = 0;
+    for (int r = 0; r <= opt.reps; r++) {
+        // a fresh history each time, so every run appends the same lines
+        removePath(dir);
+        mkdir(dir, 0755);
+        double t0 = runInteractive(dir, exitOnly, 5, histFlush);
+        removePath(dir);
+        mkdir(dir, 0755);
+        double t = runInteractive(dir, input, len, histFlush);
+        if (t0 < 0 || t < 0) break;
+        if (r == 0) continue; // warm up
+        base[nbase++] = t0;
+        samples[n++] = t;
+    }
+    removePath(dir);
+    free(input);
+    if (n == 0) return;
+    qsort(base, nbase, sizeof(double), compareDoubles);
+    double t0 = base[nbase / 2];
+    for (int i = 0; i < n; i++) {
+        double t = samples[i] - t0;
+        samples[i] = (t > 0 ? t : 0) / count * 1e6;
+    }
+    record(name, "us/op", 0, samples, n);
+}
+
+// Fewer runs for the big trees, which take a while to rebuild
+int treeReps(size_t files) {
+    if (files >= 1000000) return 1;
+    if (files >= 100000) return opt.reps < 3 ? opt.reps : 3;
+    return opt.reps;
+}
+
+// Run command in dir with output discarded, as untimed setup
+int treeSetup(const char *dir, const char *profile, const char *command) {
+    if (runShell(dir, profile, command, NULL) >= 0) return 0;
+    fprintf(stderr, "shell_bench: setup '%s' failed\n", command);
+    return -1;
+}
+
+// backup (a fresh copy, then with nothing changed), find_target (building
+// the name index, then using it) and sanitize on a tree of files files
+void benchTree(size_t files) {
+    const char *names[] = {"backup_cold", "backup_incremental", "find_target_cold",
+                           "find_target_warm", "sanitize"};
+    int any = 0;
+    char name[64];
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        snprintf(name, sizeof(name), "%s_%zu", names[i], files);
+        any |= selected(name);
+    }
+    if (!any) return;
+
+    char dir[PATH_MAX], path[PATH_MAX + 32], command[128];
+    snprintf(dir, sizeof(dir), "%s/tree_%zu", workspace, files);
+    mkdir(dir, 0755);
+    snprintf(command, sizeof(command), "generate -n %zu -s 256 -f 1000 -S 1 -d good_files", files);
+    if (treeSetup(dir, "Data", command) != 0) {
+        removePath(dir);
+        return;
+    }
+
+    int reps = treeReps(files);
+    double samples[MAX_REPS];
+    int n;
+
+    snprintf(name, sizeof(name), "backup_cold_%zu", files);
+    snprintf(path, sizeof(path), "%s/backup_good_files", dir);
+    n = 0;
+    for (int r = 0; r < reps; r++) {
+        removePath(path);
+        double t = runShell(dir, "Core", "backup", NULL);
+        if (t < 0) break;
+        samples[n++] = files / withoutStartup(t);
+    }
+    if (selected(name)) record(name, "files/s", 1, samples, n);
+
+    snprintf(name, sizeof(name), "backup_incremental_%zu", files);
+    n = 0;
+    for (int r = 0; r < reps && selected(name); r++) {
+        double t = runShell(dir, "Core", "backup", NULL);
+        if (t < 0) break;
+        samples[n++] = files / withoutStartup(t);
+    }
+    if (selected(name)) record(name, "files/s", 1, samples, n);
+
+    // one name among the good_files and backup_good_files copies
+    const char *find = "find_target file_00000042.dat";
+    snprintf(name, sizeof(name), "find_target_cold_%zu", files);
+    snprintf(path, sizeof(path), "%s/.custom_shell_names", dir);
+    n = 0;
+    for (int r = 0; r < reps && selected(name); r++) {
+        unlink(path);
+        double t = runShell(dir, "Net", find, NULL);
+        if (t < 0) break;
+        samples[n++] = withoutStartup(t) * 1e3;
+    }
+    if (selected(name)) record(name, "ms", 0, samples, n);
+
+    snprintf(name, sizeof(name), "find_target_warm_%zu", files);
+    n = 0;
+    if (selected(name)) runShell(dir, "Net", find, NULL); // make sure the index exists
+    for (int r = 0; r < reps && selected(name); r++) {
+        double t = runShell(dir, "Net", find, NULL);
+        if (t < 0) break;
+        samples[n++] = withoutStartup(t) * 1e3;
+    }
+    if (selected(name)) record(name, "ms", 0, samples, n);
+
+    snprintf(name, sizeof(name), "sanitize_%zu", files);
+    snprintf(command, sizeof(command), "generate_corrupt -n %zu -s 0 -f 1000 -S 1", files);
+    n = 0;
+    for (int r = 0; r < reps && selected(name); r++) {
+        if (treeSetup(dir, "Ops", command) != 0) break;
+        double t = runShell(dir, "Core", "sanitize", NULL);
+        if (t < 0) break;
+        samples[n++] = files / withoutStartup(t);
+    }
+    if (selected(name)) record(name, "files/s", 1, samples, n);
+
+    removePath(dir);
+}
+
+// ===== Results =====
+
+void jsonString(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+// The results, with enough about the machine and settings to tell
+// whether two files can be compared
+int writeJson(const char *path) {
+    FILE *out = path != NULL ? fopen(path, "w") : stdout;
+    if (out == NULL) {
+        perror(path);
+        return -1;
+    }
+    struct utsname u;
+    uname(&u);
+    char date[32];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    fprintf(out, "{\n  \"version\": 1,\n  \"date\": \"%s\",\n  \"host\": ", date);
+    jsonString(out, u.nodename);
+    fprintf(out, ",\n  \"kernel\": ");
+    jsonString(out, u.release);
+    fprintf(out, ",\n  \"cpus\": %ld,\n  \"shell\": ", sysconf(_SC_NPROCESSORS_ONLN));
+    jsonString(out, opt.shell);
+    fprintf(out, ",\n  \"params\": {\"reps\": %d, \"lines\": %d, \"spawns\": %d, \"pipe_mb\": %zu},\n",
+            opt.reps, opt.lines, opt.spawns, opt.pipeMb);
+    fprintf(out, "  \"results\": [\n");
+    for (int i = 0; i < nresults; i++) {
+        const Result *r = &results[i];
+        fprintf(out, "    {\"name\": ");
+        jsonString(out, r->name);
+        fprintf(out, ", \"unit\": \"%s\", \"better\": \"%s\", \"median\": %.6g, "
+                "\"min\": %.6g, \"max\": %.6g, \"reps\": %d}%s\n",
+                r->unit, r->higherBetter ? "higher" : "lower", r->median, r->min, r->max,
+                r->reps, i + 1 < nresults ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    if (path != NULL) return fclose(out);
+    return 0;
+}
+
+// Read name/median pairs back from a file writeJson() wrote. Not a general
+// JSON parser: it relies on that layout. Returns the count, or -1.
+int readBaseline(const char *path, Result *base, int max) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    char *text = NULL;
+    size_t cap = 0;
+    ssize_t len = getdelim(&text, &cap, '\0', f);
+    fclose(f);
+    if (len <= 0) {
+        free(text);
+        fprintf(stderr, "shell_bench: %s is empty\n", path);
+        return -1;
+    }
+
+    int n = 0;
+    char *p = strstr(text, "\"results\"");
+    while (p != NULL && n < max && (p = strstr(p, "{\"name\": \"")) != NULL) {
+        p += 10;
+        char *end = strchr(p, '"');
+        char *median = strstr(p, "\"median\": ");
+        if (end == NULL || median == NULL) break;
+        snprintf(base[n].name, sizeof(base[n].name), "%.*s", (int)(end - p), p);
+        base[n].median = strtod(median + 10, NULL);
+        n++;
+        p = median;
+    }
+    free(text);
+    if (n == 0) fprintf(stderr, "shell_bench: no results in %s\n", path);
+    return n > 0 ? n : -1;
+}
+
+// Print each benchmark against the baseline. Returns the number that got
+// worse by more than the threshold.
+int compareBaseline(const char *path) {
+    static Result base[MAX_RESULTS];
+    int nbase = readBaseline(path, base, MAX_RESULTS);
+    if (nbase < 0) return -1;
+
+    int regressions = 0;
+    printf("%-28s %14s %14s %9s\n", "benchmark", "baseline", "current", "change");
+    for (int i = 0; i < nresults; i++) {
+        const Result *r = &results[i];
+        const Result *b = NULL;
+        for (int j = 0; j < nbase && b == NULL; j++)
+            if (strcmp(base[j].name, r->name) == 0) b = &base[j];
+        if (b == NULL || b->median == 0) {
+            printf("%-28s %14s %14.2f %9s  %s\n", r->name, "-", r->median, "", r->unit);
+            continue;
+        }
+        double change = (r->median - b->median) / b->median * 100;
+        double worse = r->higherBetter ? -change : change;
+        const char *verdict = "";
+        if (worse > opt.threshold) {
+            verdict = "  REGRESSED";
+            regressions++;
+        } else if (worse < -opt.threshold) {
+            verdict = "  improved";
+        }
+        printf("%-28s %14.2f %14.2f %+8.1f%%  %s%s\n", r->name, b->median, r->median, change,
+               r->unit, verdict);
+    }
+    printf("%d of %d benchmarks regressed by more than %.0f%%\n", regressions, nresults, opt.threshold);
+    return regressions;
+}
+
+// ===== Main =====
+
+void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [--shell path] [--out file] [--baseline file] [--threshold pct]\n"
+            "       [--reps N] [--lines N] [--spawns N] [--pipe-mb N] [--trees N,N,...]\n"
+            "       [--only substring] [--dir path] [--quick]\n",
+            argv0);
+}
+
+// "1000,10000" into opt.trees; 0 alone for none
+int parseTrees(const char *list) {
+    opt.ntrees = 0;
+    for (const char *p = list; *p;) {
+        char *end;
+        unsigned long long n = strtoull(p, &end, 10);
+        if (end == p || (*end != ',' && *end != '\0') || opt.ntrees == MAX_TREES) return -1;
+        if (n > 0) opt.trees[opt.ntrees++] = n;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+int parseArgs(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+        int takesValue = 1;
+        if (strcmp(a, "--quick") == 0) {
+            opt.reps = 3;
+            opt.lines = 5000;
+            opt.spawns = 500;
+            opt.pipeMb = 32;
+            opt.trees[0] = 1000;
+            opt.trees[1] = 10000;
+            opt.ntrees = 2;
+            takesValue = 0;
+        } else if (v == NULL) {
+            return -1;
+        } else if (strcmp(a, "--shell") == 0) {
+            opt.shell = v;
+        } else if (strcmp(a, "--out") == 0) {
+            opt.out = v;
+        } else if (strcmp(a, "--baseline") == 0) {
+            opt.baseline = v;
+        } else if (strcmp(a, "--only") == 0) {
+            opt.only = v;
+        } else if (strcmp(a, "--dir") == 0) {
+            opt.dir = v;
+        } else if (strcmp(a, "--threshold") == 0) {
+            opt.threshold = atof(v);
+        } else if (strcmp(a, "--reps") == 0) {
+            opt.reps = atoi(v);
+        } else if (strcmp(a, "--lines") == 0) {
+            opt.lines = atoi(v);
+        } else if (strcmp(a, "--spawns") == 0) {
+            opt.spawns = atoi(v);
+        } else if (strcmp(a, "--pipe-mb") == 0) {
+            opt.pipeMb = strtoull(v, NULL, 10);
+        } else if (strcmp(a, "--trees") == 0) {
+            if (parseTrees(v) != 0) return -1;
+        } else {
+            return -1;
+        }
+        if (takesValue) i++;
+    }
+    if (opt.reps < 1 || opt.reps > MAX_REPS - 1 || opt.lines < 10 || opt.spawns < 1 ||
+        opt.pipeMb < 1 || opt.threshold <= 0)
+        return -1;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (parseArgs(argc, argv) != 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (realpath(opt.shell, shellPath) == NULL || access(shellPath, X_OK) != 0) {
+        fprintf(stderr, "shell_bench: cannot run %s\n", opt.shell);
+        return 2;
+    }
+    snprintf(workspace, sizeof(workspace), "%s/shell_bench.XXXXXX", opt.dir);
+    if (mkdtemp(workspace) == NULL) {
+        perror(workspace);
+        return 2;
+    }
+    // measure the shell as it normally runs
+    unsetenv("CUSTOM_SHELL_TRACE");
+    unsetenv("CUSTOM_SHELL_LAUNCHER");
+    unsetenv("CUSTOM_SHELL_HISTFLUSH");
+    signal(SIGPIPE, SIG_IGN);
+
+    int status = 0;
+    if (benchStartup() != 0) {
+        removePath(workspace);
+        return 2;
+    }
+
+    benchScript("empty_command", "Core", "", opt.lines, 1);
+    benchScript("builtin_dispatch", "Core", "cd .", opt.lines, 1);
+    benchScript("spawn", "Core", "true", opt.spawns, 0);
+
+    char data[PATH_MAX + 16];
+    size_t bytes = 0;
+    snprintf(data, sizeof(data), "%s/pipe.txt", workspace);
+    if ((selected("pipeline_2") || selected("pipeline_8")) && writeDataFile(data, &bytes) == 0) {
+        benchPipeline(2, data, bytes);
+        benchPipeline(8, data, bytes);
+    }
+    unlink(data);
+
+    benchHistory("history_append", NULL);
+    benchHistory("history_append_sync", "sync");
+
+    for (int i = 0; i < opt.ntrees; i++) benchTree(opt.trees[i]);
+    removePath(workspace);
+
+    if (opt.out != NULL || opt.baseline == NULL) {
+        if (writeJson(opt.out) != 0) status = 2;
+    }
+    if (opt.baseline != NULL) {
+        int regressions = compareBaseline(opt.baseline);
+        if (regressions < 0) status = 2;
+        else if (regressions > 0 && status == 0) status = 1;
+    }
+    return status;
+}
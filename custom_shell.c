@@ -1,1011 +1,10183 @@
-// Custom Multi-Profile Linux Shell
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <readline/readline.h>
-#include <readline/history.h>
-#include <dirent.h>
-#include <sys/stat.h>
-#include <time.h>
-#include <ctype.h>
-
-#define MAXCOM 100000  // max number of letters to be supported
-#define MAXLIST 100000 // max number of commands to be supported
-
-// Clearing the shell using escape sequences
-#define clear() printf("\033[H\033[J")
-
-// Colors
-#define COLOR_RESET   "\033[0m"
-#define COLOR_RED     "\033[31m"
-#define COLOR_GREEN   "\033[32m"
-#define COLOR_YELLOW  "\033[33m"
-#define COLOR_BLUE    "\033[34m"
-#define COLOR_MAGENTA "\033[35m"
-#define COLOR_CYAN    "\033[36m"
-
-const char *HISTORY_FILE = ".custom_shell_history";
-
-// Forward declarations
-int execArgs(char **parsed);
-int execArgsPiped(char **parsed, char **parsedpipe);
-int processString(char *str, char **parsed, char **parsedpipe, int profile);
-int coreShell(char **parsed);
-int opsShell(char **parsed);
-int dataShell(char **parsed);
-int netShell(char **parsed);
-int secShell(char **parsed);
-void createFiles(void);
-
-// Helper: trim whitespace in place
-char *trimWhitespace(char *str) {
-    if (str == NULL) return NULL;
-    while (isspace((unsigned char)*str)) str++;
-    if (*str == '\0') return str;
-    char *end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
-    end[1] = '\0';
-    return str;
-}
-
-// Greeting shell during startup
-void init_shell() {
-    clear();
-    printf(COLOR_CYAN "\n\n  ===============================\n" COLOR_RESET);
-    printf(COLOR_CYAN "      Custom Multi-Profile Shell\n" COLOR_RESET);
-    printf(COLOR_CYAN "  ===============================\n" COLOR_RESET);
-    char *username = getenv("USER");
-    if (username) {
-        printf("User: %s\n", username);
-    }
-
-    printf("Initializing shell");
-    fflush(stdout);
-    for (int i = 0; i < 3; i++) {
-        printf(".");
-        fflush(stdout);
-        usleep(300000); // 0.3s
-    }
-    printf("\n");
-    sleep(1);
-    clear();
-}
-
-int isLinuxCommand(char *cmd) {
-    char command[100];
-    snprintf(command, sizeof(command), "which %s > /dev/null 2>&1", cmd);
-    int status = system(command);
-    return (status == 0);
-}
-
-// Function to take input
-int takeInput(char *str) {
-    char *buf;
-    buf = readline(" ");
-    if (buf && strlen(buf) != 0) {
-        add_history(buf);
-
-        // Save to history file
-        FILE *hf = fopen(HISTORY_FILE, "a");
-        if (hf != NULL) {
-            fprintf(hf, "%s\n", buf);
-            fclose(hf);
-        }
-
-        strcpy(str, buf);
-        free(buf);
-        return 0;
-    } else {
-        if (buf) free(buf);
-        return 1;
-    }
-}
-
-// Function to print Current Directory.
-void printDir() {
-    char cwd[1024];
-    getcwd(cwd, sizeof(cwd));
-    printf("\nDir: %s", cwd);
-}
-
-// Generic unknown command error
-void displayError() {
-    printf("Unknown command. Type 'help' to see the list of commands.\n");
-}
-
-// History display
-void showHistory() {
-    FILE *hf = fopen(HISTORY_FILE, "r");
-    if (!hf) {
-        printf("No history available.\n");
-        return;
-    }
-    char line[1024];
-    int count = 1;
-    while (fgets(line, sizeof(line), hf)) {
-        printf("%4d  %s", count++, line);
-    }
-    fclose(hf);
-}
-
-// Common built-ins: cd, history, exit handled in profiles individually for custom messages.
-// Here we only implement cd & history logic.
-int handleCommonBuiltins(char **parsed) {
-    if (parsed[0] == NULL) return 0;
-
-    if (strcmp(parsed[0], "cd") == 0) {
-        if (parsed[1] == NULL) {
-            char *home = getenv("HOME");
-            if (home == NULL) home = "/";
-            if (chdir(home) != 0) {
-                perror("cd");
-            }
-        } else {
-            if (chdir(parsed[1]) != 0) {
-                perror("cd");
-            }
-        }
-        return 1;
-    } else if (strcmp(parsed[0], "history") == 0) {
-        showHistory();
-        return 1;
-    }
-
-    return 0;
-}
-
-// Function where a simple system command is executed
-int execArgs(char **parsed) {
-    pid_t pid = fork();
-    if (pid == -1) {
-        perror("fork");
-        return 1;
-    } else if (pid == 0) {
-        if (execvp(parsed[0], parsed) < 0) {
-            perror("execvp");
-            exit(1);
-        }
-        exit(0);
-    } else {
-        int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status))
-            return WEXITSTATUS(status);
-        else
-            return 1;
-    }
-}
-
-// Function where the piped system commands are executed
-int execArgsPiped(char **parsed, char **parsedpipe) {
-    int pipefd[2];
-    pid_t p1, p2;
-
-    if (pipe(pipefd) < 0) {
-        perror("pipe");
-        return 1;
-    }
-    p1 = fork();
-    if (p1 < 0) {
-        perror("fork");
-        return 1;
-    }
-
-    if (p1 == 0) {
-        // Child 1
-        close(pipefd[0]);
-        dup2(pipefd[1], STDOUT_FILENO);
-        close(pipefd[1]);
-
-        if (execvp(parsed[0], parsed) < 0) {
-            perror("execvp");
-            exit(1);
-        }
-    } else {
-        p2 = fork();
-        if (p2 < 0) {
-            perror("fork");
-            return 1;
-        }
-
-        if (p2 == 0) {
-            // Child 2
-            close(pipefd[1]);
-            dup2(pipefd[0], STDIN_FILENO);
-            close(pipefd[0]);
-            if (execvp(parsedpipe[0], parsedpipe) < 0) {
-                perror("execvp");
-                exit(1);
-            }
-        } else {
-            close(pipefd[0]);
-            close(pipefd[1]);
-            int status1, status2;
-            waitpid(p1, &status1, 0);
-            waitpid(p2, &status2, 0);
-            if (WIFEXITED(status2))
-                return WEXITSTATUS(status2);
-            else
-                return 1;
-        }
-    }
-    return 0;
-}
-
-// ================= Profile-specific commands =================
-
-// File helpers from original logic, kept but theme-neutral
-
-void createCorruptedFilesDirectory() {
-    char *dirName = "corrupted_files";
-    char *fileName = "corrupted_files/temp_corrupt.txt";
-
-    struct stat st = {0};
-    if (stat(dirName, &st) == -1) {
-        mkdir(dirName, 0700);
-    }
-
-    FILE *file = fopen(fileName, "w");
-    if (file != NULL) {
-        fclose(file);
-    }
-}
-
-void createBackupDirectory() {
-    char *dirName = "backup_good_files";
-
-    struct stat st = {0};
-    if (stat(dirName, &st) == -1) {
-        mkdir(dirName, 0700);
-    }
-}
-
-void createGoodFilesDirectory() {
-    char *dirName = "good_files";
-    char *fileName = "good_files/base.txt";
-
-    struct stat st = {0};
-    if (stat(dirName, &st) == -1) {
-        mkdir(dirName, 0700);
-    }
-
-    FILE *file = fopen(fileName, "w");
-    if (file != NULL) {
-        fprintf(file, "Base data file\n");
-        fclose(file);
-    }
-}
-
-void createHiddenFilesDirectory() {
-    char *dirName = "hidden";
-    char *fileName = "hidden/temp_hidden.txt";
-
-    struct stat st = {0};
-    if (stat(dirName, &st) == -1) {
-        mkdir(dirName, 0700);
-    }
-
-    FILE *file = fopen(fileName, "w");
-    if (file != NULL) {
-        fprintf(file, "Hidden temp file\n");
-        fclose(file);
-    }
-}
-
-void createMainDirectory() {
-    char *dirName = "main";
-    char *fileName = "main/temp_main.txt";
-
-    struct stat st = {0};
-    if (stat(dirName, &st) == -1) {
-        mkdir(dirName, 0700);
-    }
-
-    FILE *file = fopen(fileName, "w");
-    if (file != NULL) {
-        fprintf(file, "Main temp file\n");
-        fclose(file);
-    }
-}
-
-void createTargetFiles() {
-    char *fileName1 = "target_location.txt";
-    char *fileName2 = "target.txt";
-
-    FILE *file1 = fopen(fileName1, "w");
-    if (file1 != NULL) {
-        fclose(file1);
-    }
-    FILE *file2 = fopen(fileName2, "w");
-    if (file2 != NULL) {
-        fprintf(file2, "Target file\n");
-        fclose(file2);
-    }
-}
-
-void createFiles() {
-    createBackupDirectory();
-    createCorruptedFilesDirectory();
-    createGoodFilesDirectory();
-    createHiddenFilesDirectory();
-    createMainDirectory();
-    createTargetFiles();
-}
-
-// ===== Core profile commands (similar to original Gryffindor) =====
-
-void cmd_sanitize() {
-    if (system("rm -rf ./corrupted_files") == 0) {
-        printf("sanitize: removed temporary/corrupted files.\n");
-    } else {
-        printf("sanitize: no corrupted files found or removal failed.\n");
-    }
-}
-
-void cmd_backup() {
-    if (system("cp -r ./good_files/* ./backup_good_files 2>/dev/null") == 0) {
-        printf("backup: copied good_files to backup_good_files.\n");
-    } else {
-        printf("backup: nothing to copy or backup failed.\n");
-    }
-}
-
-void cmd_unhide() {
-    DIR *dir = opendir("./hidden");
-    if (dir && readdir(dir) != NULL) {
-        if (system("mv ./hidden/* ./main/ 2>/dev/null") == 0) {
-            printf("unhide: moved hidden files to main directory.\n");
-        } else {
-            printf("unhide: no hidden files moved.\n");
-        }
-    } else {
-        printf("unhide: no files found to move.\n");
-    }
-    if (dir) closedir(dir);
-}
-
-void displayHelp_Core(const char *command) {
-    printf("\n==== Core Profile Help ====\n");
-    if (strcmp(command, "sanitize") == 0) {
-        printf("sanitize: remove temporary/corrupted files.\n");
-    } else if (strcmp(command, "backup") == 0) {
-        printf("backup: copy ./good_files to ./backup_good_files.\n");
-    } else if (strcmp(command, "unhide") == 0) {
-        printf("unhide: move files from ./hidden to ./main.\n");
-    } else if (strcmp(command, "all") == 0) {
-        printf("Available commands:\n");
-        printf("  sanitize   - remove corrupted files\n");
-        printf("  backup     - backup good_files\n");
-        printf("  unhide     - move hidden files to main\n");
-        printf("  cd         - change directory\n");
-        printf("  history    - show command history\n");
-        printf("  exit       - exit shell\n");
-    } else {
-        printf("Unknown command '%s'. Type 'help all' for list.\n", command);
-    }
-    printf("===========================\n");
-}
-
-int coreShell(char **parsed) {
-    if (parsed[0] == NULL) return 1;
-
-    if (handleCommonBuiltins(parsed)) return 1;
-
-    if (strcmp(parsed[0], "sanitize") == 0) {
-        cmd_sanitize();
-        return 1;
-    } else if (strcmp(parsed[0], "backup") == 0) {
-        cmd_backup();
-        return 1;
-    } else if (strcmp(parsed[0], "unhide") == 0) {
-        cmd_unhide();
-        return 1;
-    } else if (strcmp(parsed[0], "help") == 0) {
-        if (parsed[1] != NULL)
-            displayHelp_Core(parsed[1]);
-        else
-            displayHelp_Core("all");
-        return 1;
-    } else if (strcmp(parsed[0], "exit") == 0) {
-        printf("Exiting Core profile shell. Goodbye!\n");
-        exit(0);
-    } else {
-        if (isLinuxCommand(parsed[0])) {
-            return 0; // let caller exec
-        } else {
-            displayError();
-            return 1;
-        }
-    }
-}
-
-// ===== Ops profile commands (similar to original Slytherin) =====
-
-void cmd_truncate_important() {
-    if (system("echo '' > ./important.txt") == 0) {
-        printf("truncate_important: cleared important.txt.\n");
-    } else {
-        printf("truncate_important: could not modify important.txt.\n");
-    }
-}
-
-void cmd_generate_corrupt() {
-    createCorruptedFilesDirectory();
-    if (system("touch ./corrupted_files/file{1..5}.txt") == 0) {
-        printf("generate_corrupt: created sample corrupted files.\n");
-    } else {
-        printf("generate_corrupt: failed to create files.\n");
-    }
-}
-
-void cmd_hide_main() {
-    DIR *dir = opendir("./main");
-    if (dir && readdir(dir) != NULL) {
-        if (system("mv ./main/* ./hidden/ 2>/dev/null") == 0) {
-            printf("hide_main: moved files from main to hidden.\n");
-        } else {
-            printf("hide_main: no files moved.\n");
-        }
-    } else {
-        printf("hide_main: no files found.\n");
-    }
-    if (dir) closedir(dir);
-}
-
-void displayHelp_Ops(const char *command) {
-    printf("\n==== Ops Profile Help ====\n");
-    if (strcmp(command, "truncate_important") == 0) {
-        printf("truncate_important: clear contents of important.txt.\n");
-    } else if (strcmp(command, "generate_corrupt") == 0) {
-        printf("generate_corrupt: create test corrupted files.\n");
-    } else if (strcmp(command, "hide_main") == 0) {
-        printf("hide_main: move files from main to hidden directory.\n");
-    } else if (strcmp(command, "all") == 0) {
-        printf("Available commands:\n");
-        printf("  truncate_important - clear important.txt\n");
-        printf("  generate_corrupt   - create corrupted_files\n");
-        printf("  hide_main          - move main/* to hidden/\n");
-        printf("  cd                 - change directory\n");
-        printf("  history            - show command history\n");
-        printf("  exit               - exit shell\n");
-    } else {
-        printf("Unknown command '%s'. Type 'help all' for list.\n", command);
-    }
-    printf("=========================\n");
-}
-
-int opsShell(char **parsed) {
-    if (parsed[0] == NULL) return 1;
-
-    if (handleCommonBuiltins(parsed)) return 1;
-
-    if (strcmp(parsed[0], "truncate_important") == 0) {
-        cmd_truncate_important();
-        return 1;
-    } else if (strcmp(parsed[0], "generate_corrupt") == 0) {
-        cmd_generate_corrupt();
-        return 1;
-    } else if (strcmp(parsed[0], "hide_main") == 0) {
-        cmd_hide_main();
-        return 1;
-    } else if (strcmp(parsed[0], "help") == 0) {
-        if (parsed[1] != NULL)
-            displayHelp_Ops(parsed[1]);
-        else
-            displayHelp_Ops("all");
-        return 1;
-    } else if (strcmp(parsed[0], "exit") == 0) {
-        printf("Exiting Ops profile shell. Goodbye!\n");
-        exit(0);
-    } else {
-        if (isLinuxCommand(parsed[0])) {
-            return 0;
-        } else {
-            displayError();
-            return 1;
-        }
-    }
-}
-
-// ===== Data profile commands (similar to original Hufflepuff) =====
-
-void cmd_mkdata() {
-    const char *dir_name = "./main";
-    char file_name[128];
-    FILE *file;
-
-    srand(time(NULL));
-    snprintf(file_name, sizeof(file_name), "%s/data_%d.txt", dir_name, rand());
-
-    file = fopen(file_name, "w");
-    if (file == NULL) {
-        perror("mkdata");
-        return;
-    }
-    fprintf(file, "Data file generated by Data profile.\n");
-    fclose(file);
-    printf("mkdata: created %s\n", file_name);
-}
-
-void cmd_motivate() {
-    printf("motivate: Keep going. Small consistent progress beats perfection.\n");
-}
-
-void cmd_tips() {
-    printf("tips: File management best practices:\n");
-    printf("  - Keep directories organized by project/type.\n");
-    printf("  - Use clear filenames and dates.\n");
-    printf("  - Backup important data regularly.\n");
-}
-
-void displayHelp_Data(const char *command) {
-    printf("\n==== Data Profile Help ====\n");
-    if (strcmp(command, "mkdata") == 0) {
-        printf("mkdata: create a new data text file in ./main.\n");
-    } else if (strcmp(command, "motivate") == 0) {
-        printf("motivate: print a motivational message.\n");
-    } else if (strcmp(command, "tips") == 0) {
-        printf("tips: show file management tips.\n");
-    } else if (strcmp(command, "all") == 0) {
-        printf("Available commands:\n");
-        printf("  mkdata    - create sample data file\n");
-        printf("  motivate  - print motivational message\n");
-        printf("  tips      - show file tips\n");
-        printf("  cd        - change directory\n");
-        printf("  history   - show command history\n");
-        printf("  exit      - exit shell\n");
-    } else {
-        printf("Unknown command '%s'. Type 'help all' for list.\n", command);
-    }
-    printf("==========================\n");
-}
-
-int dataShell(char **parsed) {
-    if (parsed[0] == NULL) return 1;
-
-    if (handleCommonBuiltins(parsed)) return 1;
-
-    if (strcmp(parsed[0], "mkdata") == 0) {
-        cmd_mkdata();
-        return 1;
-    } else if (strcmp(parsed[0], "motivate") == 0) {
-        cmd_motivate();
-        return 1;
-    } else if (strcmp(parsed[0], "tips") == 0) {
-        cmd_tips();
-        return 1;
-    } else if (strcmp(parsed[0], "help") == 0) {
-        if (parsed[1] != NULL)
-            displayHelp_Data(parsed[1]);
-        else
-            displayHelp_Data("all");
-        return 1;
-    } else if (strcmp(parsed[0], "exit") == 0) {
-        printf("Exiting Data profile shell. Goodbye!\n");
-        exit(0);
-    } else {
-        if (isLinuxCommand(parsed[0])) {
-            return 0;
-        } else {
-            displayError();
-            return 1;
-        }
-    }
-}
-
-// ===== Net profile commands (similar to original Ravenclaw) =====
-
-void cmd_net_quote() {
-    const char *wisdoms[] = {
-        "Networks are built on small, reliable links.",
-        "Debugging is like solving a mystery; logs are your clues.",
-        "A good script today beats a perfect script tomorrow.",
-        "Measure first, optimize later."
-    };
-    int numWisdoms = sizeof(wisdoms) / sizeof(wisdoms[0]);
-    srand(time(0));
-    printf("\nQuote: %s\n", wisdoms[rand() % numWisdoms]);
-}
-
-void cmd_net_quiz() {
-    const char *riddles[] = {
-        "I connect machines but have no moving parts. What am I?",
-        "I identify a device in a network uniquely. What am I?"
-    };
-    const char *answers[] = {"network cable", "ip address"};
-    int numRiddles = sizeof(riddles) / sizeof(riddles[0]);
-
-    srand(time(0));
-    int index = rand() % numRiddles;
-
-    char userAnswer[100];
-    printf("\nRiddle: %s\nYour Answer: ", riddles[index]);
-    fflush(stdout);
-    if (fgets(userAnswer, sizeof(userAnswer), stdin) == NULL) {
-        printf("\nNo answer provided.\n");
-        return;
-    }
-    userAnswer[strcspn(userAnswer, "\n")] = 0;
-
-    for (char *p = userAnswer; *p; p++) *p = (char)tolower((unsigned char)*p);
-
-    if (strcmp(userAnswer, answers[index]) == 0) {
-        printf("\nCorrect!\n");
-    } else {
-        printf("\nIncorrect. The correct answer is: %s\n", answers[index]);
-    }
-}
-
-void cmd_find_target() {
-    printf("Scanning for target.txt...\n");
-    if (system("find . -name 'target.txt' > target_location.txt") == 0) {
-        printf("Search complete! Check target_location.txt for results.\n");
-    } else {
-        printf("No target file found.\n");
-    }
-}
-
-void displayHelp_Net(const char *command) {
-    printf("\n==== Net Profile Help ====\n");
-    if (strcmp(command, "netquote") == 0) {
-        printf("netquote: print a random technical quote.\n");
-    } else if (strcmp(command, "netquiz") == 0) {
-        printf("netquiz: answer a simple riddle.\n");
-    } else if (strcmp(command, "find_target") == 0) {
-        printf("find_target: search filesystem for 'target.txt'.\n");
-    } else if (strcmp(command, "all") == 0) {
-        printf("Available commands:\n");
-        printf("  netquote    - show a technical quote\n");
-        printf("  netquiz     - answer a riddle\n");
-        printf("  find_target - search for target.txt\n");
-        printf("  cd          - change directory\n");
-        printf("  history     - show command history\n");
-        printf("  exit        - exit shell\n");
-    } else {
-        printf("Unknown command '%s'. Type 'help all' for list.\n", command);
-    }
-    printf("=========================\n");
-}
-
-int netShell(char **parsed) {
-    if (parsed[0] == NULL) return 1;
-
-    if (handleCommonBuiltins(parsed)) return 1;
-
-    if (strcmp(parsed[0], "netquote") == 0) {
-        cmd_net_quote();
-        return 1;
-    } else if (strcmp(parsed[0], "netquiz") == 0) {
-        cmd_net_quiz();
-        return 1;
-    } else if (strcmp(parsed[0], "find_target") == 0) {
-        cmd_find_target();
-        return 1;
-    } else if (strcmp(parsed[0], "help") == 0) {
-        if (parsed[1] != NULL)
-            displayHelp_Net(parsed[1]);
-        else
-            displayHelp_Net("all");
-        return 1;
-    } else if (strcmp(parsed[0], "exit") == 0) {
-        printf("Exiting Net profile shell. Goodbye!\n");
-        exit(0);
-    } else {
-        if (isLinuxCommand(parsed[0])) {
-            return 0;
-        } else {
-            displayError();
-            return 1;
-        }
-    }
-}
-
-// ===== Sec profile commands (new 5th profile) =====
-
-void cmd_scan_temp() {
-    printf("scan_temp: listing main, hidden, corrupted_files (if present):\n");
-    system("ls -R main hidden corrupted_files 2>/dev/null");
-}
-
-void cmd_secure_backup() {
-    printf("secure_backup: creating archive backup_good_files.tar.gz (if backup_good_files exists)...\n");
-    int status = system("tar -czf backup_good_files.tar.gz backup_good_files 2>/dev/null");
-    if (status == 0) {
-        printf("secure_backup: archive created.\n");
-    } else {
-        printf("secure_backup: archive creation failed.\n");
-    }
-}
-
-void cmd_clean_temp() {
-    printf("clean_temp: removing temporary *_temp.txt files in current directory.\n");
-    int status = system("rm -f *_temp.txt 2>/dev/null");
-    if (status == 0) {
-        printf("clean_temp: cleanup attempted.\n");
-    } else {
-        printf("clean_temp: cleanup may have failed or no files.\n");
-    }
-}
-
-void displayHelp_Sec(const char *command) {
-    printf("\n==== Sec Profile Help ====\n");
-    if (strcmp(command, "scan_temp") == 0) {
-        printf("scan_temp: list files in main, hidden, corrupted_files.\n");
-    } else if (strcmp(command, "secure_backup") == 0) {
-        printf("secure_backup: create tar.gz archive of backup_good_files.\n");
-    } else if (strcmp(command, "clean_temp") == 0) {
-        printf("clean_temp: remove *_temp.txt files in current directory.\n");
-    } else if (strcmp(command, "all") == 0) {
-        printf("Available commands:\n");
-        printf("  scan_temp      - list key directories\n");
-        printf("  secure_backup  - archive backup_good_files\n");
-        printf("  clean_temp     - remove temporary temp files\n");
-        printf("  cd             - change directory\n");
-        printf("  history        - show command history\n");
-        printf("  exit           - exit shell\n");
-    } else {
-        printf("Unknown command '%s'. Type 'help all' for list.\n", command);
-    }
-    printf("=========================\n");
-}
-
-int secShell(char **parsed) {
-    if (parsed[0] == NULL) return 1;
-
-    if (handleCommonBuiltins(parsed)) return 1;
-
-    if (strcmp(parsed[0], "scan_temp") == 0) {
-        cmd_scan_temp();
-        return 1;
-    } else if (strcmp(parsed[0], "secure_backup") == 0) {
-        cmd_secure_backup();
-        return 1;
-    } else if (strcmp(parsed[0], "clean_temp") == 0) {
-        cmd_clean_temp();
-        return 1;
-    } else if (strcmp(parsed[0], "help") == 0) {
-        if (parsed[1] != NULL)
-            displayHelp_Sec(parsed[1]);
-        else
-            displayHelp_Sec("all");
-        return 1;
-    } else if (strcmp(parsed[0], "exit") == 0) {
-        printf("Exiting Sec profile shell. Goodbye!\n");
-        exit(0);
-    } else {
-        if (isLinuxCommand(parsed[0])) {
-            return 0;
-        } else {
-            displayError();
-            return 1;
-        }
-    }
-}
-
-// ===== Parsing helpers =====
-
-// function for finding pipe
-int parsePipe(char *str, char **strpiped) {
-    int i;
-    for (i = 0; i < 2; i++) {
-        strpiped[i] = strsep(&str, "|");
-        if (strpiped[i] == NULL)
-            break;
-    }
-
-    if (strpiped[1] == NULL)
-        return 0; // no pipe
-    else
-        return 1;
-}
-
-// function for parsing command words
-void parseSpace(char *str, char **parsed) {
-    int i;
-    for (i = 0; i < MAXLIST; i++) {
-        parsed[i] = strsep(&str, " ");
-        if (parsed[i] == NULL)
-            break;
-        if (strlen(parsed[i]) == 0)
-            i--;
-    }
-}
-
-// Main command processing: choose profile shell, decide if external command needed
-int processString(char *str, char **parsed, char **parsedpipe, int profile) {
-    char *strpiped[2];
-    int piped = 0;
-
-    piped = parsePipe(str, strpiped);
-
-    if (piped) {
-        parseSpace(strpiped[0], parsed);
-        parseSpace(strpiped[1], parsedpipe);
-    } else {
-        parseSpace(str, parsed);
-    }
-
-    int handled = 0;
-
-    if (profile == 0) {
-        handled = coreShell(parsed);
-    } else if (profile == 1) {
-        handled = opsShell(parsed);
-    } else if (profile == 2) {
-        handled = dataShell(parsed);
-    } else if (profile == 3) {
-        handled = netShell(parsed);
-    } else {
-        handled = secShell(parsed);
-    }
-
-    if (handled) {
-        return 0;
-    } else {
-        return 1 + piped; // 1 for simple, 2 for piped
-    }
-}
-
-// Run a single command (with optional pipe), return status code
-int runSingleCommand(char *commandStr, int profile) {
-    char *parsedArgs[MAXLIST];
-    char *parsedArgsPiped[MAXLIST];
-    int execFlag = processString(commandStr, parsedArgs, parsedArgsPiped, profile);
-
-    if (execFlag == 0) {
-        // handled by built-in/profile
-        return 0;
-    } else if (execFlag == 1) {
-        return execArgs(parsedArgs);
-    } else if (execFlag == 2) {
-        return execArgsPiped(parsedArgs, parsedArgsPiped);
-    }
-    return 1;
-}
-
-// Split on "&&": left and right are pointers inside input
-int splitAnd(char *input, char **left, char **right) {
-    char *pos = strstr(input, "&&");
-    if (!pos) return 0;
-
-    *pos = '\0';
-    pos += 2;
-
-    char *leftTrim = trimWhitespace(input);
-    char *rightTrim = trimWhitespace(pos);
-
-    if (leftTrim == NULL || rightTrim == NULL || strlen(leftTrim) == 0 || strlen(rightTrim) == 0)
-        return 0;
-
-    *left = leftTrim;
-    *right = rightTrim;
-    return 1;
-}
-
-// Mapping profile index to name and color
-const char *profileName(int p) {
-    switch (p) {
-        case 0: return "Core";
-        case 1: return "Ops";
-        case 2: return "Data";
-        case 3: return "Net";
-        case 4: return "Sec";
-        default: return "Unknown";
-    }
-}
-
-const char *profileColor(int p) {
-    switch (p) {
-        case 0: return COLOR_RED;
-        case 1: return COLOR_GREEN;
-        case 2: return COLOR_YELLOW;
-        case 3: return COLOR_BLUE;
-        case 4: return COLOR_MAGENTA;
-        default: return COLOR_RESET;
-    }
-}
-
-// Shell loop
-int shell_cmds(int profile) {
-    char inputString[MAXCOM];
-    printf("%sProfile selected: %s%s\n",
-           profileColor(profile), profileName(profile), COLOR_RESET);
-
-    // Short summary of commands per profile
-    if (profile == 0) {
-        printf("Commands: sanitize, backup, unhide, cd, history, help, exit\n");
-    } else if (profile == 1) {
-        printf("Commands: truncate_important, generate_corrupt, hide_main, cd, history, help, exit\n");
-    } else if (profile == 2) {
-        printf("Commands: mkdata, motivate, tips, cd, history, help, exit\n");
-    } else if (profile == 3) {
-        printf("Commands: netquote, netquiz, find_target, cd, history, help, exit\n");
-    } else {
-        printf("Commands: scan_temp, secure_backup, clean_temp, cd, history, help, exit\n");
-    }
-
-    while (1) {
-        const char *color = profileColor(profile);
-        const char *name = profileName(profile);
-
-        printf("%s%s>%s ", color, name, COLOR_RESET);
-        fflush(stdout);
-
-        if (takeInput(inputString))
-            continue;
-
-        char *left = NULL;
-        char *right = NULL;
-        int hasAnd = splitAnd(inputString, &left, &right);
-
-        if (hasAnd) {
-            int status = runSingleCommand(left, profile);
-            if (status == 0) {
-                runSingleCommand(right, profile);
-            } else {
-                // first failed, skip second
-            }
-        } else {
-            runSingleCommand(inputString, profile);
-        }
-    }
-    return 0;
-}
-
-// Simple profile selection instead of sorting hat
-const char *selectProfile() {
-    int core = 0, ops = 0, data = 0, net = 0, sec = 0;
-    char answer[16];
-
-    printf("Profile selection wizard (answer yes/no):\n");
-
-    printf("Q1: Do you like cleaning, organizing and maintaining systems? ");
-    fflush(stdout);
-    if (fgets(answer, sizeof(answer), stdin) && strncmp(answer, "yes", 3) == 0) core++;
-
-    printf("Q2: Do you enjoy automation, deployment and operations? ");
-    fflush(stdout);
-    if (fgets(answer, sizeof(answer), stdin) && strncmp(answer, "yes", 3) == 0) ops++;
-
-    printf("Q3: Do you like working with data and logs? ");
-    fflush(stdout);
-    if (fgets(answer, sizeof(answer), stdin) && strncmp(answer, "yes", 3) == 0) data++;
-
-    printf("Q4: Are you interested in networking and connectivity? ");
-    fflush(stdout);
-    if (fgets(answer, sizeof(answer), stdin) && strncmp(answer, "yes", 3) == 0) net++;
-
-    printf("Q5: Are you interested in security and monitoring? ");
-    fflush(stdout);
-    if (fgets(answer, sizeof(answer), stdin) && strncmp(answer, "yes", 3) == 0) sec++;
-
-    int maxScore = core;
-    const char *profile = "Core";
-    if (ops > maxScore) { maxScore = ops; profile = "Ops"; }
-    if (data > maxScore) { maxScore = data; profile = "Data"; }
-    if (net > maxScore) { maxScore = net; profile = "Net"; }
-    if (sec > maxScore) { maxScore = sec; profile = "Sec"; }
-
-    printf("\nSelected profile: %s\n\n", profile);
-    return profile;
-}
-
-int main() {
-    init_shell();
-    createFiles();
-
-    const char *profile = selectProfile();
-
-    if (strcmp(profile, "Core") == 0) shell_cmds(0);
-    else if (strcmp(profile, "Ops") == 0) shell_cmds(1);
-    else if (strcmp(profile, "Data") == 0) shell_cmds(2);
-    else if (strcmp(profile, "Net") == 0) shell_cmds(3);
-    else if (strcmp(profile, "Sec") == 0) shell_cmds(4);
-    else shell_cmds(0);
-
-    return 0;
-}
-
+// Custom Multi-Profile Linux Shell
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <readline/readline.h>
+#include <readline/history.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <stdatomic.h>
+#include <linux/fs.h>
+#include <stdarg.h>
+#include <fnmatch.h>
+#include <sys/inotify.h>
+#include <zlib.h>
+#include <openssl/sha.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <stdio_ext.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Clearing the shell using escape sequences
+#define clear() printf("\033[H\033[J")
+
+// Colors
+#define COLOR_RESET   "\033[0m"
+#define COLOR_RED     "\033[31m"
+#define COLOR_GREEN   "\033[32m"
+#define COLOR_YELLOW  "\033[33m"
+#define COLOR_BLUE    "\033[34m"
+#define COLOR_MAGENTA "\033[35m"
+#define COLOR_CYAN    "\033[36m"
+
+// Redirections can name descriptors 0-9; whatever the shell keeps open
+// lives at REDIR_FD_MIN and up
+#define REDIR_FD_MAX 9
+#define REDIR_FD_MIN 10
+
+const char *HISTORY_FILE = ".custom_shell_history";
+
+int interactive = 1;    // 0 for -c, script files and piped stdin
+int jobControl = 0;     // jobs get their own process group and the terminal
+int lastStatus = 0;     // exit status of the last command line
+int currentProfile = 0; // profile the shell is running
+
+extern char **environ;
+
+// Forward declarations
+int execArgs(char **parsed);
+typedef struct Redir Redir;
+int execArgsPiped(char ***stages, Redir **redirs, int nstages, int profile);
+int processString(char *str, int profile);
+typedef struct Builtin Builtin;
+const Builtin *findBuiltin(const char *name, int profile);
+int runBuiltin(const Builtin *b, char **parsed);
+const char *profileName(int p);
+int initHistoryStore(void);
+void historyStoreShutdown(void);
+void storeLoadReadline(void);
+int storeRecordUse(const char *text, size_t len, int64_t when);
+void storeQueueRecord(const char *text, size_t len, int64_t when);
+size_t storeAppendTail(const char *buf, size_t len);
+void historySearch(const char *pattern);
+char *readLineEvents(const char *prompt);
+double elapsedSince(const struct timespec *start);
+void markJobProc(pid_t pid, int wstatus, const struct rusage *ru);
+int runJob(char ***stages, Redir **redirs, int nstages, int profile, int background);
+int64_t parseSize(const char *s);
+
+// Helper: trim whitespace in place
+char *trimWhitespace(char *str) {
+    if (str == NULL) return NULL;
+    while (isspace((unsigned char)*str)) str++;
+    if (*str == '\0') return str;
+    char *end = str + strlen(str) - 1;
+    while (end > str && isspace((unsigned char)*end)) end--;
+    end[1] = '\0';
+    return str;
+}
+
+// Helper: write all of buf, retrying short writes; returns bytes written
+size_t writeFully(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char *)buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// Helper: move a descriptor the shell keeps open to REDIR_FD_MIN or above,
+// where "5>log" on a builtin cannot land on it. Returns the new descriptor
+// (close-on-exec), or fd itself if it cannot be moved.
+int keepFdHigh(int fd) {
+    if (fd == -1 || fd >= REDIR_FD_MIN) return fd;
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, REDIR_FD_MIN);
+    if (moved == -1) return fd;
+    close(fd);
+    return moved;
+}
+
+// Greeting shell during startup
+void init_shell() {
+    clear();
+    printf(COLOR_CYAN "\n\n  ===============================\n" COLOR_RESET);
+    printf(COLOR_CYAN "      Custom Multi-Profile Shell\n" COLOR_RESET);
+    printf(COLOR_CYAN "  ===============================\n" COLOR_RESET);
+    char *username = getenv("USER");
+    if (username) {
+        printf("User: %s\n", username);
+    }
+
+    printf("Initializing shell");
+    fflush(stdout);
+    for (int i = 0; i < 3; i++) {
+        printf(".");
+        fflush(stdout);
+        usleep(300000); // 0.3s
+    }
+    printf("\n");
+    sleep(1);
+    clear();
+}
+
+// ===== Tracing =====
+// With CUSTOM_SHELL_TRACE=file (or --trace=file) the shell records a span
+// for each step of running a command line: parsing, builtin dispatch, PATH
+// lookup, pipe setup, spawn/fork and wait, plus one span per child process
+// on a track of its own. The spans are written as Chrome Trace Event JSON,
+// which chrome://tracing and Perfetto open. Recording a span is a slot
+// claim in a bounded lock-free ring (Vyukov's MPMC queue) and a copy; a
+// writer thread drains the ring and formats the JSON. When the ring is
+// full the span is dropped and counted, never waited for. With tracing off
+// every probe is one branch.
+
+#define TRACE_SLOTS 65536 // must be a power of two
+#define TRACE_ARG   48
+
+typedef struct TraceEvent {
+    _Atomic uint64_t seq; // ring position the slot is ready for
+    const char *name;     // a string literal, or NULL to use arg as the name
+    char arg[TRACE_ARG];  // e.g. the command name, may be empty
+    char ph;              // 'X' complete span, 'M' track name
+    int tid;
+    int64_t ts, dur;      // ns
+} TraceEvent;
+
+typedef struct Trace {
+    TraceEvent *ring;
+    _Atomic uint64_t head; // next position to claim
+    uint64_t tail;         // next position to write out, writer only
+    _Atomic uint64_t dropped;
+    atomic_int stop;
+    FILE *out;
+    pthread_t writer;
+    pid_t owner;
+    int first;             // no event written yet
+} Trace;
+
+static Trace trace = {.ring = NULL};
+static __thread int traceTid = 0;
+
+int64_t monoNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Start of a span: the time, or 0 when tracing is off
+int64_t traceStart() {
+    return trace.ring != NULL ? monoNs() : 0;
+}
+
+int traceThreadId() {
+    if (traceTid == 0) traceTid = (int)syscall(SYS_gettid);
+    return traceTid;
+}
+
+void traceEvent(char ph, const char *name, const char *arg, int tid, int64_t ts, int64_t dur) {
+    uint64_t pos = atomic_load_explicit(&trace.head, memory_order_relaxed);
+    TraceEvent *e;
+    for (;;) {
+        e = &trace.ring[pos & (TRACE_SLOTS - 1)];
+        uint64_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&trace.head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&trace.dropped, 1, memory_order_relaxed);
+            return; // full
+        } else {
+            pos = atomic_load_explicit(&trace.head, memory_order_relaxed);
+        }
+    }
+
+    e->ph = ph;
+    e->name = name;
+    e->tid = tid;
+    e->ts = ts;
+    e->dur = dur;
+    size_t len = 0;
+    if (arg != NULL) {
+        len = strnlen(arg, TRACE_ARG - 1);
+        // do not cut a UTF-8 sequence in half
+        if (arg[len] != '\0')
+            while (len > 0 && ((unsigned char)arg[len] & 0xc0) == 0x80) len--;
+        memcpy(e->arg, arg, len);
+    }
+    e->arg[len] = '\0';
+    atomic_store_explicit(&e->seq, pos + 1, memory_order_release);
+}
+
+// End a span begun with traceStart() on the calling thread's track
+void traceEnd(const char *name, const char *arg, int64_t start) {
+    if (start == 0 || trace.ring == NULL) return;
+    traceEvent('X', name, arg, traceThreadId(), start, monoNs() - start);
+}
+
+// A child process's lifetime, on a track named after it
+void traceChild(pid_t pid, const char *name, int64_t start) {
+    if (start == 0 || trace.ring == NULL || pid <= 0) return;
+    char track[TRACE_ARG];
+    snprintf(track, sizeof(track), "%s [%d]", name, (int)pid);
+    traceEvent('M', "thread_name", track, (int)pid, start, 0);
+    traceEvent('X', NULL, name, (int)pid, start, monoNs() - start); // name is not a literal
+}
+
+void jsonString(FILE *out, const char *s);
+
+void traceWrite(const TraceEvent *e) {
+    fputs(trace.first ? "\n" : ",\n", trace.out);
+    trace.first = 0;
+    if (e->ph == 'M') {
+        fprintf(trace.out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":", (int)trace.owner, e->tid);
+        jsonString(trace.out, e->arg);
+        fputs("}}", trace.out);
+        return;
+    }
+    fprintf(trace.out, "{\"name\":");
+    jsonString(trace.out, e->name != NULL ? e->name : e->arg);
+    fprintf(trace.out, ",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+            (int)trace.owner, e->tid, e->ts / 1e3, e->dur / 1e3);
+    if (e->name != NULL && e->arg[0] != '\0') {
+        fputs(",\"args\":{\"arg\":", trace.out);
+        jsonString(trace.out, e->arg);
+        fputc('}', trace.out);
+    }
+    fputc('}', trace.out);
+}
+
+// Writer thread: drain the ring in order, napping while it is empty
+void *traceWriter(void *arg) {
+    (void)arg;
+    for (;;) {
+        TraceEvent *e = &trace.ring[trace.tail & (TRACE_SLOTS - 1)];
+        if (atomic_load_explicit(&e->seq, memory_order_acquire) == trace.tail + 1) {
+            traceWrite(e);
+            atomic_store_explicit(&e->seq, trace.tail + TRACE_SLOTS, memory_order_release);
+            trace.tail++;
+            continue;
+        }
+        if (atomic_load(&trace.stop)) break;
+        fflush(trace.out);
+        usleep(1000);
+    }
+    return NULL;
+}
+
+void traceShutdown() {
+    if (trace.ring == NULL || trace.owner != getpid()) return;
+    atomic_store(&trace.stop, 1);
+    pthread_join(trace.writer, NULL);
+    fprintf(trace.out, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%llu}}\n",
+            (unsigned long long)atomic_load(&trace.dropped));
+    fclose(trace.out);
+    if (atomic_load(&trace.dropped) > 0)
+        fprintf(stderr, "trace: %llu events dropped\n", (unsigned long long)atomic_load(&trace.dropped));
+    free(trace.ring);
+    trace.ring = NULL;
+}
+
+// Start tracing to path. Called after initJobs(), so the writer thread
+// inherits the blocked SIGCHLD.
+void initTrace(const char *path) {
+    if (path == NULL || *path == '\0') return;
+    int fd = keepFdHigh(open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    trace.out = fd == -1 ? NULL : fdopen(fd, "w");
+    if (trace.out == NULL) {
+        perror(path);
+        if (fd != -1) close(fd);
+        return;
+    }
+    TraceEvent *ring = aligned_alloc(64, TRACE_SLOTS * sizeof(TraceEvent));
+    if (ring == NULL) {
+        fclose(trace.out);
+        return;
+    }
+    for (uint64_t i = 0; i < TRACE_SLOTS; i++) atomic_init(&ring[i].seq, i);
+    trace.owner = getpid();
+    trace.first = 1;
+    trace.ring = ring;
+    fputs("{\"traceEvents\":[", trace.out);
+    if (pthread_create(&trace.writer, NULL, traceWriter, NULL) != 0) {
+        trace.ring = NULL;
+        fclose(trace.out);
+        free(ring);
+        return;
+    }
+    traceEvent('M', "thread_name", "shell", traceThreadId(), monoNs(), 0);
+    atexit(traceShutdown);
+}
+
+// ===== Command lookup cache =====
+// Maps command names to absolute paths found on $PATH so that we can exec
+// them directly instead of asking `which` (which costs a shell + a process).
+// The table is rebuilt when PATH changes or when any PATH directory's mtime
+// changes (i.e. something was installed or removed).
+
+#define CMD_HASH_SIZE 4096 // number of buckets, must be a power of two
+
+typedef struct CmdEntry {
+    char *name;
+    char *path;
+    unsigned hits;
+    struct CmdEntry *next;
+} CmdEntry;
+
+typedef struct PathDir {
+    char *dir;
+    struct timespec mtime;
+} PathDir;
+
+static CmdEntry *cmdTable[CMD_HASH_SIZE];
+static PathDir *pathDirs = NULL;
+static int pathDirCount = 0;
+static char *cachedPath = NULL;
+static int cmdTableValid = 0;
+// Bumped for every command line; PATH directories are stat'd at most once
+// per generation
+static unsigned cmdLineGen = 1;
+static unsigned cmdCheckedGen = 0;
+
+// FNV-1a string hash
+unsigned hashString(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+CmdEntry *findCommandEntry(const char *name) {
+    CmdEntry *e = cmdTable[hashString(name) & (CMD_HASH_SIZE - 1)];
+    while (e != NULL && strcmp(e->name, name) != 0) e = e->next;
+    return e;
+}
+
+void addCommandEntry(const char *name, const char *dir) {
+    size_t nlen = strlen(name), dlen = strlen(dir);
+    // entry, name and path live in one allocation
+    CmdEntry *e = malloc(sizeof(CmdEntry) + nlen + 1 + dlen + 1 + nlen + 1);
+    if (e == NULL) return;
+    e->name = (char *)(e + 1);
+    memcpy(e->name, name, nlen + 1);
+    e->path = e->name + nlen + 1;
+    memcpy(e->path, dir, dlen);
+    e->path[dlen] = '/';
+    memcpy(e->path + dlen + 1, name, nlen + 1);
+    e->hits = 0;
+
+    unsigned b = hashString(name) & (CMD_HASH_SIZE - 1);
+    e->next = cmdTable[b];
+    cmdTable[b] = e;
+}
+
+void clearCommandCache() {
+    for (int i = 0; i < CMD_HASH_SIZE; i++) {
+        CmdEntry *e = cmdTable[i];
+        while (e != NULL) {
+            CmdEntry *next = e->next;
+            free(e);
+            e = next;
+        }
+        cmdTable[i] = NULL;
+    }
+    for (int i = 0; i < pathDirCount; i++) free(pathDirs[i].dir);
+    free(pathDirs);
+    pathDirs = NULL;
+    pathDirCount = 0;
+    free(cachedPath);
+    cachedPath = NULL;
+    cmdTableValid = 0;
+}
+
+// Scan every PATH directory once; the first directory containing a name wins.
+void rebuildCommandCache() {
+    clearCommandCache();
+
+    const char *path = getenv("PATH");
+    if (path == NULL) path = "/usr/local/bin:/usr/bin:/bin";
+    cachedPath = strdup(path);
+    if (cachedPath == NULL) return;
+
+    int ndirs = 1;
+    for (const char *p = path; *p; p++)
+        if (*p == ':') ndirs++;
+    pathDirs = calloc(ndirs, sizeof(PathDir));
+    if (pathDirs == NULL) return;
+
+    char *copy = strdup(path);
+    char *rest = copy;
+    char *dir;
+    while (copy != NULL && (dir = strsep(&rest, ":")) != NULL) {
+        if (*dir == '\0') dir = "."; // empty PATH entry means cwd
+
+        PathDir *pd = &pathDirs[pathDirCount++];
+        pd->dir = strdup(dir);
+
+        DIR *d = opendir(dir);
+        if (d == NULL) continue; // mtime stays zero; picked up if created later
+        struct stat st;
+        if (fstat(dirfd(d), &st) == 0) pd->mtime = st.st_mtim;
+
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            if (de->d_name[0] == '.' &&
+                (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+                continue;
+            if (de->d_type == DT_DIR) continue;
+            if (findCommandEntry(de->d_name) != NULL) continue;
+            if (faccessat(dirfd(d), de->d_name, X_OK, 0) != 0) continue;
+            if (de->d_type != DT_REG) {
+                // symlinks and unknown types: make sure it resolves to a file
+                if (fstatat(dirfd(d), de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+                    continue;
+            }
+            addCommandEntry(de->d_name, dir);
+        }
+        closedir(d);
+    }
+    free(copy);
+    cmdTableValid = 1;
+    cmdCheckedGen = cmdLineGen;
+}
+
+// Called before each command line runs
+void commandCacheNewLine() {
+    cmdLineGen++;
+}
+
+// Cheap validity check: compare the PATH string, and each directory's mtime
+// once per command line or when force is set.
+int commandCacheStale(int force) {
+    if (!cmdTableValid) return 1;
+
+    const char *path = getenv("PATH");
+    if (path == NULL) path = "/usr/local/bin:/usr/bin:/bin";
+    if (strcmp(path, cachedPath) != 0) return 1;
+    if (!force && cmdCheckedGen == cmdLineGen) return 0;
+    cmdCheckedGen = cmdLineGen;
+
+    struct stat st;
+    for (int i = 0; i < pathDirCount; i++) {
+        struct timespec now = {0, 0};
+        if (stat(pathDirs[i].dir, &st) == 0) now = st.st_mtim;
+        if (now.tv_sec != pathDirs[i].mtime.tv_sec || now.tv_nsec != pathDirs[i].mtime.tv_nsec)
+            return 1;
+    }
+    return 0;
+}
+
+// Resolve a command name to the path that should be exec'd, or NULL.
+// countHit is set by callers that are about to exec the result.
+const char *lookupCommand(const char *name, int countHit) {
+    if (name == NULL || *name == '\0') return NULL;
+
+    // Explicit paths are never looked up on PATH
+    if (strchr(name, '/') != NULL) {
+        struct stat st;
+        if (stat(name, &st) == 0 && S_ISREG(st.st_mode) && access(name, X_OK) == 0)
+            return name;
+        return NULL;
+    }
+
+    if (commandCacheStale(0)) rebuildCommandCache();
+
+    CmdEntry *e = findCommandEntry(name);
+    // maybe installed earlier in this line: look at the directories again
+    if (e == NULL && commandCacheStale(1)) {
+        rebuildCommandCache();
+        e = findCommandEntry(name);
+    }
+    if (e == NULL) return NULL;
+    if (countHit) e->hits++;
+    return e->path;
+}
+
+int isLinuxCommand(char *cmd) {
+    int64_t t = traceStart();
+    const char *path = lookupCommand(cmd, 0);
+    traceEnd("path lookup", cmd, t);
+    return path != NULL;
+}
+
+// hash builtin: "hash" lists remembered commands, "hash -r" forgets them all,
+// "hash name..." looks the names up now.
+int cmd_hash(char **parsed) {
+    if (parsed[1] != NULL && strcmp(parsed[1], "-r") == 0) {
+        clearCommandCache();
+        return 0;
+    }
+
+    if (parsed[1] != NULL) {
+        int status = 0;
+        for (int i = 1; parsed[i] != NULL; i++) {
+            if (lookupCommand(parsed[i], 0) == NULL) {
+                printf("hash: %s: not found\n", parsed[i]);
+                status = 1;
+            }
+        }
+        return status;
+    }
+
+    if (commandCacheStale(1)) rebuildCommandCache();
+    int shown = 0;
+    for (int i = 0; i < CMD_HASH_SIZE; i++) {
+        for (CmdEntry *e = cmdTable[i]; e != NULL; e = e->next) {
+            if (e->hits == 0) continue;
+            if (!shown) printf("hits\tcommand\n");
+            printf("%4u\t%s\n", e->hits, e->path);
+            shown++;
+        }
+    }
+    if (!shown) printf("hash: hash table empty\n");
+    return 0;
+}
+
+// ===== History journal =====
+// The history file is mapped once at startup and indexed by line, and it is
+// appended through one long-lived descriptor. New entries go into an
+// in-memory ring and a pending buffer; a writer thread drains the buffer in
+// batches so the prompt never waits on the file system (unless the flush
+// policy asks for it). CUSTOM_SHELL_HISTFLUSH selects the policy:
+//   batch  - write within a second or once HIST_BATCH_BYTES are queued (default)
+//   sync   - write before the next prompt
+//   fsync  - write and fdatasync before the next prompt
+
+#define HISTORY_RING 1024      // session entries kept in memory
+#define HISTORY_LOAD_MAX 10000 // lines handed to readline at startup
+#define HIST_BATCH_BYTES 4096
+
+#define HIST_FLUSH_BATCH 0
+#define HIST_FLUSH_SYNC  1
+#define HIST_FLUSH_FSYNC 2
+
+typedef struct HistLine {
+    off_t offset;
+    size_t len; // without the newline
+} HistLine;
+
+typedef struct HistoryJournal {
+    int fd;
+    int policy;
+    pid_t owner; // only the shell process itself flushes at exit
+
+    char *map; // file contents as of startup
+    size_t mapLen;
+    int mappedLines;
+
+    HistLine *index; // every line known to be on disk, in order
+    int indexCount;
+    int indexCap;
+
+    char *ring[HISTORY_RING];
+    int sessionCount;
+
+    char *pending; // queued for the writer, newline separated
+    size_t pendingLen;
+    size_t pendingCap;
+    int pendingLines;
+    char *idxPending; // HISTORY_FILE.idx tail records, written alongside
+    size_t idxPendingLen;
+    size_t idxPendingCap;
+    uint64_t idxWritten;
+    int writing;
+    int flushRequested;
+    int stop;
+
+    pthread_t writer;
+    int writerStarted;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t drained;
+} HistoryJournal;
+
+static HistoryJournal hist = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .drained = PTHREAD_COND_INITIALIZER,
+};
+
+
+int historyIndexAdd(off_t offset, size_t len) {
+    if (hist.indexCount == hist.indexCap) {
+        int cap = hist.indexCap ? hist.indexCap * 2 : 1024;
+        HistLine *idx = realloc(hist.index, cap * sizeof(HistLine));
+        if (idx == NULL) return -1;
+        hist.index = idx;
+        hist.indexCap = cap;
+    }
+    hist.index[hist.indexCount].offset = offset;
+    hist.index[hist.indexCount].len = len;
+    hist.indexCount++;
+    return 0;
+}
+
+// Write out everything pending. Called with hist.lock held; the lock is
+// dropped around the actual write so appends can continue meanwhile.
+void historyWritePending() {
+    if ((hist.pendingLen == 0 && hist.idxPendingLen == 0) || hist.fd == -1) return;
+
+    char *buf = hist.pending;
+    size_t len = hist.pendingLen;
+    char *idxBuf = hist.idxPending;
+    size_t idxLen = hist.idxPendingLen;
+    hist.pending = hist.idxPending = NULL;
+    hist.pendingLen = hist.pendingCap = 0;
+    hist.idxPendingLen = hist.idxPendingCap = 0;
+    hist.pendingLines = 0;
+    hist.writing = 1;
+    pthread_mutex_unlock(&hist.lock);
+
+    size_t done = writeFully(hist.fd, buf, len);
+    if (hist.policy == HIST_FLUSH_FSYNC) fdatasync(hist.fd);
+    // With O_APPEND the offset now sits right after our data, even if other
+    // shells appended to the same file in between.
+    off_t end = lseek(hist.fd, 0, SEEK_CUR);
+    if (idxLen > 0) idxLen = storeAppendTail(idxBuf, idxLen);
+
+    pthread_mutex_lock(&hist.lock);
+    hist.idxWritten += idxLen;
+    if (done == len && end >= (off_t)len) {
+        off_t base = end - len;
+        size_t start = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (buf[i] == '\n') {
+                historyIndexAdd(base + start, i - start);
+                start = i + 1;
+            }
+        }
+    }
+    free(buf);
+    free(idxBuf);
+    hist.writing = 0;
+    pthread_cond_broadcast(&hist.drained);
+}
+
+void *historyWriterThread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&hist.lock);
+    while (1) {
+        while (!hist.stop && !hist.flushRequested) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += 1;
+            if (pthread_cond_timedwait(&hist.wake, &hist.lock, &until) == ETIMEDOUT &&
+                hist.pendingLen > 0)
+                break;
+        }
+        hist.flushRequested = 0;
+        historyWritePending();
+        if (hist.stop && hist.pendingLen == 0 && hist.idxPendingLen == 0) break;
+    }
+    pthread_mutex_unlock(&hist.lock);
+    return NULL;
+}
+
+// Keep the lock consistent across fork() for built-ins run in a child
+void historyAtforkPrepare() { pthread_mutex_lock(&hist.lock); }
+void historyAtforkRelease() { pthread_mutex_unlock(&hist.lock); }
+
+void historyShutdown() {
+    if (hist.owner != getpid()) return;
+    pthread_mutex_lock(&hist.lock);
+    hist.stop = 1;
+    pthread_cond_signal(&hist.wake);
+    pthread_mutex_unlock(&hist.lock);
+    if (hist.writerStarted) {
+        pthread_join(hist.writer, NULL);
+        hist.writerStarted = 0;
+    } else {
+        pthread_mutex_lock(&hist.lock);
+        historyWritePending();
+        pthread_mutex_unlock(&hist.lock);
+    }
+    historyStoreShutdown();
+}
+
+// Map the history file, index its lines, open the store and feed readline
+void initHistory() {
+    const char *policy = getenv("CUSTOM_SHELL_HISTFLUSH");
+    if (policy != NULL && strcmp(policy, "sync") == 0) hist.policy = HIST_FLUSH_SYNC;
+    else if (policy != NULL && strcmp(policy, "fsync") == 0) hist.policy = HIST_FLUSH_FSYNC;
+    else hist.policy = HIST_FLUSH_BATCH;
+
+    hist.owner = getpid();
+    hist.fd = keepFdHigh(open(HISTORY_FILE, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600));
+    if (hist.fd == -1) {
+        perror("history");
+        return;
+    }
+
+    struct stat st;
+    if (fstat(hist.fd, &st) == 0 && st.st_size > 0) {
+        hist.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, hist.fd, 0);
+        if (hist.map == MAP_FAILED) {
+            hist.map = NULL;
+        } else {
+            hist.mapLen = st.st_size;
+            madvise(hist.map, hist.mapLen, MADV_SEQUENTIAL);
+            const char *p = hist.map, *end = hist.map + hist.mapLen;
+            while (p < end) {
+                const char *nl = memchr(p, '\n', end - p);
+                const char *stop = nl ? nl : end;
+                if (historyIndexAdd(p - hist.map, stop - p) < 0) break;
+                p = stop + 1;
+            }
+            hist.mappedLines = hist.indexCount;
+        }
+    }
+
+    if (initHistoryStore() == 0) {
+        storeLoadReadline();
+    } else {
+        int first = hist.mappedLines > HISTORY_LOAD_MAX ? hist.mappedLines - HISTORY_LOAD_MAX : 0;
+        for (int i = first; i < hist.mappedLines; i++) {
+            HistLine *l = &hist.index[i];
+            if (l->len == 0) continue;
+            char *entry = strndup(hist.map + l->offset, l->len);
+            if (entry == NULL) break;
+            add_history(entry);
+            free(entry);
+        }
+    }
+
+    pthread_atfork(historyAtforkPrepare, historyAtforkRelease, historyAtforkRelease);
+    if (pthread_create(&hist.writer, NULL, historyWriterThread, NULL) == 0)
+        hist.writerStarted = 1;
+    atexit(historyShutdown);
+}
+
+// Record one command line. Returns 1 if the same command was used before.
+int historyAppend(const char *line) {
+    size_t len = strlen(line);
+    int64_t now = time(NULL);
+    pthread_mutex_lock(&hist.lock);
+
+    int seen = storeRecordUse(line, len, now);
+    storeQueueRecord(line, len, now);
+
+    char *copy = strdup(line);
+    int slot = hist.sessionCount % HISTORY_RING;
+    free(hist.ring[slot]);
+    hist.ring[slot] = copy;
+    hist.sessionCount++;
+
+    if (hist.fd != -1) {
+        if (hist.pendingLen + len + 1 > hist.pendingCap) {
+            size_t cap = hist.pendingCap ? hist.pendingCap : HIST_BATCH_BYTES;
+            while (cap < hist.pendingLen + len + 1) cap *= 2;
+            char *p = realloc(hist.pending, cap);
+            if (p != NULL) {
+                hist.pending = p;
+                hist.pendingCap = cap;
+            }
+        }
+        if (hist.pendingLen + len + 1 <= hist.pendingCap) {
+            memcpy(hist.pending + hist.pendingLen, line, len);
+            hist.pending[hist.pendingLen + len] = '\n';
+            hist.pendingLen += len + 1;
+            hist.pendingLines++;
+        }
+
+        // Never let more lines pile up than the ring can still show
+        int urgent = hist.pendingLen >= HIST_BATCH_BYTES || hist.pendingLines >= HISTORY_RING / 2;
+        if (hist.policy != HIST_FLUSH_BATCH || urgent) {
+            if (hist.writerStarted) {
+                hist.flushRequested = 1;
+                pthread_cond_signal(&hist.wake);
+            } else {
+                historyWritePending();
+            }
+        }
+        if (hist.policy != HIST_FLUSH_BATCH) {
+            while (hist.pendingLen > 0 || hist.writing)
+                pthread_cond_wait(&hist.drained, &hist.lock);
+        }
+    }
+    pthread_mutex_unlock(&hist.lock);
+    return seen;
+}
+
+// Force pending entries to disk (history -w)
+void historyFlush() {
+    pthread_mutex_lock(&hist.lock);
+    if (hist.writerStarted) {
+        hist.flushRequested = 1;
+        pthread_cond_signal(&hist.wake);
+        while (hist.pendingLen > 0 || hist.writing)
+            pthread_cond_wait(&hist.drained, &hist.lock);
+    } else {
+        historyWritePending();
+    }
+    pthread_mutex_unlock(&hist.lock);
+}
+
+// Print line i (0-based over file + session). Called with hist.lock held.
+void printHistoryLine(int i) {
+    if (i < hist.mappedLines) {
+        HistLine *l = &hist.index[i];
+        printf("%4d  %.*s\n", i + 1, (int)l->len, hist.map + l->offset);
+        return;
+    }
+
+    int j = i - hist.mappedLines; // session entry number
+    if (j >= hist.sessionCount - HISTORY_RING) {
+        printf("%4d  %s\n", i + 1, hist.ring[j % HISTORY_RING] ? hist.ring[j % HISTORY_RING] : "");
+        return;
+    }
+
+    // Older session entries have fallen out of the ring but are on disk
+    if (i < hist.indexCount) {
+        HistLine *l = &hist.index[i];
+        char *buf = malloc(l->len + 1);
+        if (buf == NULL) return;
+        ssize_t n = pread(hist.fd, buf, l->len, l->offset);
+        if (n < 0) n = 0;
+        buf[n] = '\0';
+        printf("%4d  %s\n", i + 1, buf);
+        free(buf);
+    }
+}
+
+// History display: "history" prints everything, "history N" the last N
+// lines, "history -w" writes pending entries to the file now and
+// "history search [^]pattern" lists distinct matching commands.
+int showHistory(char **parsed) {
+    if (parsed[1] != NULL && strcmp(parsed[1], "-w") == 0) {
+        historyFlush();
+        return 0;
+    }
+    if (parsed[1] != NULL && strcmp(parsed[1], "search") == 0) {
+        if (parsed[2] == NULL) {
+            printf("history: usage: history search [^]pattern\n");
+            return 1;
+        }
+        // the rest of the line is the pattern, so quoting is optional
+        size_t len = 0;
+        for (int i = 2; parsed[i] != NULL; i++) len += strlen(parsed[i]) + 1;
+        char *pattern = malloc(len);
+        if (pattern == NULL) return 1;
+        pattern[0] = '\0';
+        for (int i = 2; parsed[i] != NULL; i++) {
+            if (i > 2) strcat(pattern, " ");
+            strcat(pattern, parsed[i]);
+        }
+        pthread_mutex_lock(&hist.lock);
+        historySearch(pattern);
+        pthread_mutex_unlock(&hist.lock);
+        free(pattern);
+        return 0;
+    }
+
+    pthread_mutex_lock(&hist.lock);
+    int total = hist.mappedLines + hist.sessionCount;
+    if (total == 0) {
+        pthread_mutex_unlock(&hist.lock);
+        printf("No history available.\n");
+        return 0;
+    }
+
+    int first = 0;
+    if (parsed[1] != NULL) {
+        int n = atoi(parsed[1]);
+        if (n <= 0) {
+            pthread_mutex_unlock(&hist.lock);
+            printf("history: usage: history [N | -w | search pattern]\n");
+            return 1;
+        }
+        if (n < total) first = total - n;
+    }
+    for (int i = first; i < total; i++) printHistoryLine(i);
+    pthread_mutex_unlock(&hist.lock);
+    return 0;
+}
+
+// ===== History store =====
+// A deduplicated view of the history with use counts and last-used times,
+// kept in HISTORY_FILE.idx next to the journal. The file has two parts:
+//
+//   base - immutable and mmap'd: entries sorted by last use, a trigram
+//          table with posting lists of entry ids, an open-addressing hash
+//          of the entry texts and the texts themselves
+//   tail - one HidxRecord per command appended since the base was written
+//
+// At startup the tail is replayed into a small in-memory overlay, so nothing
+// proportional to the base is read. Substring search intersects the posting
+// lists of the pattern's trigrams and only verifies the survivors. When the
+// tail grows large compared to the base, the two are merged into a new base
+// at exit.
+
+#define HIDX_MAGIC "CSHIDX1"
+#define HIDX_RECORD_MAGIC 0x43455248u // "HREC"
+#define HIDX_COMPACT_MIN (256 * 1024)
+#define HIST_SEARCH_MAX 50
+
+typedef struct HidxHeader {
+    char magic[8];
+    uint32_t nentries;
+    uint32_t ntrigrams;
+    uint32_t hashSlots;
+    uint32_t reserved;
+    uint64_t entriesOff;
+    uint64_t trigramsOff;
+    uint64_t postingsOff;
+    uint64_t hashOff;
+    uint64_t textOff;
+    uint64_t baseEnd;
+    uint64_t histBytes; // bytes of HISTORY_FILE the base accounts for
+} HidxHeader;
+
+typedef struct HidxEntry {
+    uint64_t textOff;
+    uint32_t len;
+    uint32_t freq;
+    int64_t lastUsed;
+} HidxEntry;
+
+typedef struct HidxTrigram {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t postOff;
+} HidxTrigram;
+
+typedef struct HidxRecord {
+    uint32_t magic;
+    uint32_t len;
+    int64_t when;
+} HidxRecord;
+
+// Uses seen since the base was written
+typedef struct HistUse {
+    char *text;
+    uint32_t len;
+    int64_t baseId; // -1 when the text is not in the base
+    uint32_t freq;  // uses on top of the base count
+    int64_t last;
+    struct HistUse *next;
+} HistUse;
+
+// One search result / merge item
+typedef struct HistItem {
+    const char *text;
+    uint32_t len;
+    uint32_t freq;
+    int64_t last;
+} HistItem;
+
+typedef struct HistoryStore {
+    char *path;
+    int fd; // tail appends, O_APPEND
+    char *map;
+    size_t mapLen;
+    const HidxHeader *hdr; // NULL when there is no usable base
+    const HidxEntry *entries;
+    const HidxTrigram *trigrams;
+    const uint32_t *postings;
+    const uint32_t *hash;
+    const char *text;
+    uint64_t covered; // journal bytes accounted for by base + tail
+    uint64_t tailBytes;
+
+    HistUse **uses;
+    size_t useBuckets;
+    size_t useCount;
+} HistoryStore;
+
+static HistoryStore store = {.fd = -1};
+
+uint64_t hash64(const char *s, size_t len) {
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Base entry id holding text, or -1
+int64_t storeFindBase(const char *text, size_t len) {
+    if (store.hdr == NULL || store.hdr->hashSlots == 0) return -1;
+    uint32_t mask = store.hdr->hashSlots - 1;
+    for (uint32_t i = hash64(text, len) & mask;; i = (i + 1) & mask) {
+        uint32_t slot = store.hash[i];
+        if (slot == 0) return -1;
+        const HidxEntry *e = &store.entries[slot - 1];
+        if (e->len == len && memcmp(store.text + e->textOff, text, len) == 0)
+            return slot - 1;
+    }
+}
+
+HistUse *storeFindUse(const char *text, size_t len) {
+    if (store.useBuckets == 0) return NULL;
+    HistUse *u = store.uses[hash64(text, len) & (store.useBuckets - 1)];
+    while (u != NULL && (u->len != len || memcmp(u->text, text, len) != 0)) u = u->next;
+    return u;
+}
+
+// Count one use of text at time when. Returns 1 if the text was seen before.
+int storeRecordUse(const char *text, size_t len, int64_t when) {
+    HistUse *u = storeFindUse(text, len);
+    int seen = u != NULL;
+    if (u == NULL) {
+        if (store.useCount >= store.useBuckets) {
+            size_t nb = store.useBuckets ? store.useBuckets * 2 : 256;
+            HistUse **b = calloc(nb, sizeof(HistUse *));
+            if (b == NULL) return 0;
+            for (size_t i = 0; i < store.useBuckets; i++) {
+                HistUse *x = store.uses[i];
+                while (x != NULL) {
+                    HistUse *next = x->next;
+                    size_t k = hash64(x->text, x->len) & (nb - 1);
+                    x->next = b[k];
+                    b[k] = x;
+                    x = next;
+                }
+            }
+            free(store.uses);
+            store.uses = b;
+            store.useBuckets = nb;
+        }
+        u = malloc(sizeof(HistUse) + len + 1);
+        if (u == NULL) return 0;
+        u->text = (char *)(u + 1);
+        memcpy(u->text, text, len);
+        u->text[len] = '\0';
+        u->len = len;
+        u->baseId = storeFindBase(text, len);
+        u->freq = 0;
+        u->last = 0;
+        seen = u->baseId >= 0;
+        size_t k = hash64(text, len) & (store.useBuckets - 1);
+        u->next = store.uses[k];
+        store.uses[k] = u;
+        store.useCount++;
+    }
+    u->freq++;
+    if (when > u->last) u->last = when;
+    store.covered += len + 1;
+    return seen;
+}
+
+void storeFreeUses() {
+    for (size_t i = 0; i < store.useBuckets; i++) {
+        HistUse *u = store.uses[i];
+        while (u != NULL) {
+            HistUse *next = u->next;
+            free(u);
+            u = next;
+        }
+    }
+    free(store.uses);
+    store.uses = NULL;
+    store.useBuckets = store.useCount = 0;
+}
+
+// Collect the distinct trigrams of s into out (sorted, unique); returns count
+int extractTrigrams(const char *s, size_t len, uint32_t *out) {
+    int n = 0;
+    for (size_t i = 0; i + 2 < len; i++) {
+        out[n++] = ((uint32_t)(unsigned char)s[i] << 16) |
+                   ((uint32_t)(unsigned char)s[i + 1] << 8) | (unsigned char)s[i + 2];
+    }
+    // insertion sort: command lines are short
+    for (int i = 1; i < n; i++) {
+        uint32_t v = out[i];
+        int j = i - 1;
+        while (j >= 0 && out[j] > v) {
+            out[j + 1] = out[j];
+            j--;
+        }
+        out[j + 1] = v;
+    }
+    int u = 0;
+    for (int i = 0; i < n; i++) {
+        if (u == 0 || out[u - 1] != out[i]) out[u++] = out[i];
+    }
+    return u;
+}
+
+int compareItemsByLast(const void *a, const void *b) {
+    const HistItem *x = a, *y = b;
+    if (x->last != y->last) return x->last < y->last ? -1 : 1;
+    return 0;
+}
+
+// Write items (already ordered by last use) as a fresh base with no tail
+int storeWriteBase(HistItem *items, uint32_t n, uint64_t histBytes) {
+    uint32_t slots = 16;
+    while (slots < n * 2) slots <<= 1;
+
+    // (trigram << 32 | id) pairs; ids are pushed in order, and the radix
+    // sort below is stable, so every posting list comes out sorted
+    size_t npairs = 0, cap = 0, textBytes = 0;
+    uint64_t *pairs = NULL;
+    uint32_t *tri = NULL;
+    size_t triCap = 0;
+    for (uint32_t id = 0; id < n; id++) {
+        textBytes += items[id].len;
+        if (items[id].len > triCap) {
+            triCap = items[id].len;
+            uint32_t *t = realloc(tri, triCap * sizeof(uint32_t));
+            if (t == NULL) goto fail;
+            tri = t;
+        }
+        int k = extractTrigrams(items[id].text, items[id].len, tri);
+        if (npairs + k > cap) {
+            cap = (npairs + k) * 2;
+            uint64_t *p = realloc(pairs, cap * sizeof(uint64_t));
+            if (p == NULL) goto fail;
+            pairs = p;
+        }
+        for (int j = 0; j < k; j++) pairs[npairs++] = ((uint64_t)tri[j] << 32) | id;
+    }
+
+    if (npairs > 0) {
+        uint64_t *tmp = malloc(npairs * sizeof(uint64_t));
+        if (tmp == NULL) goto fail;
+        for (int shift = 32; shift < 56; shift += 8) {
+            size_t count[257] = {0};
+            for (size_t i = 0; i < npairs; i++) count[((pairs[i] >> shift) & 0xff) + 1]++;
+            for (int b = 0; b < 256; b++) count[b + 1] += count[b];
+            for (size_t i = 0; i < npairs; i++) tmp[count[(pairs[i] >> shift) & 0xff]++] = pairs[i];
+            uint64_t *swap = pairs;
+            pairs = tmp;
+            tmp = swap;
+        }
+        free(tmp);
+    }
+
+    uint32_t ntri = 0;
+    for (size_t i = 0; i < npairs; i++) {
+        if (i == 0 || (pairs[i] >> 32) != (pairs[i - 1] >> 32)) ntri++;
+    }
+
+    HidxHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, HIDX_MAGIC, sizeof(h.magic));
+    h.nentries = n;
+    h.ntrigrams = ntri;
+    h.hashSlots = slots;
+    h.entriesOff = sizeof(HidxHeader);
+    h.trigramsOff = h.entriesOff + (uint64_t)n * sizeof(HidxEntry);
+    h.postingsOff = h.trigramsOff + (uint64_t)ntri * sizeof(HidxTrigram);
+    h.hashOff = h.postingsOff + (uint64_t)npairs * sizeof(uint32_t);
+    h.textOff = h.hashOff + (uint64_t)slots * sizeof(uint32_t);
+    h.baseEnd = h.textOff + textBytes;
+    h.histBytes = histBytes;
+
+    uint32_t *hashTab = calloc(slots, sizeof(uint32_t));
+    if (hashTab == NULL) goto fail;
+    for (uint32_t id = 0; id < n; id++) {
+        uint32_t i = hash64(items[id].text, items[id].len) & (slots - 1);
+        while (hashTab[i] != 0) i = (i + 1) & (slots - 1);
+        hashTab[i] = id + 1;
+    }
+
+    char tmpPath[PATH_MAX];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp.%d", store.path, (int)getpid());
+    FILE *f = fopen(tmpPath, "w");
+    if (f == NULL) {
+        free(hashTab);
+        goto fail;
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    uint64_t off = 0;
+    for (uint32_t id = 0; id < n; id++) {
+        HidxEntry e = {off, items[id].len, items[id].freq, items[id].last};
+        fwrite(&e, sizeof(e), 1, f);
+        off += items[id].len;
+    }
+    uint64_t postOff = 0;
+    for (size_t i = 0; i < npairs;) {
+        size_t j = i;
+        while (j < npairs && (pairs[j] >> 32) == (pairs[i] >> 32)) j++;
+        HidxTrigram t = {(uint32_t)(pairs[i] >> 32), (uint32_t)(j - i), postOff};
+        fwrite(&t, sizeof(t), 1, f);
+        postOff += j - i;
+        i = j;
+    }
+    for (size_t i = 0; i < npairs; i++) {
+        uint32_t id = (uint32_t)pairs[i];
+        fwrite(&id, sizeof(id), 1, f);
+    }
+    fwrite(hashTab, sizeof(uint32_t), slots, f);
+    for (uint32_t id = 0; id < n; id++) fwrite(items[id].text, 1, items[id].len, f);
+    free(hashTab);
+
+    int bad = ferror(f);
+    if (fclose(f) != 0 || bad || rename(tmpPath, store.path) != 0) {
+        unlink(tmpPath);
+        goto fail;
+    }
+    free(pairs);
+    free(tri);
+    return 0;
+
+fail:
+    free(pairs);
+    free(tri);
+    return -1;
+}
+
+void storeUnmap() {
+    if (store.map != NULL) munmap(store.map, store.mapLen);
+    store.map = NULL;
+    store.mapLen = 0;
+    store.hdr = NULL;
+}
+
+// Check the base laid out by storeWriteBase: every region inside the file,
+// and every text offset, posting and hash slot inside its region. A
+// truncated or corrupt index fails and is rebuilt, rather than read out of
+// bounds by history search.
+int storeValid(const char *map, uint64_t size) {
+    const HidxHeader *h = (const HidxHeader *)map;
+    if (memcmp(h->magic, HIDX_MAGIC, sizeof(h->magic)) != 0 || h->baseEnd > size) return 0;
+    if (h->hashSlots <= h->nentries || (h->hashSlots & (h->hashSlots - 1)) != 0) return 0;
+    if (h->entriesOff != sizeof(HidxHeader) ||
+        h->trigramsOff != h->entriesOff + (uint64_t)h->nentries * sizeof(HidxEntry) ||
+        h->postingsOff != h->trigramsOff + (uint64_t)h->ntrigrams * sizeof(HidxTrigram) ||
+        h->hashOff < h->postingsOff || h->hashOff > h->baseEnd ||
+        (h->hashOff - h->postingsOff) % sizeof(uint32_t) != 0 ||
+        h->textOff != h->hashOff + (uint64_t)h->hashSlots * sizeof(uint32_t) ||
+        h->textOff > h->baseEnd)
+        return 0;
+
+    uint64_t textBytes = h->baseEnd - h->textOff;
+    uint64_t npostings = (h->hashOff - h->postingsOff) / sizeof(uint32_t);
+    const HidxEntry *entries = (const HidxEntry *)(map + h->entriesOff);
+    for (uint32_t i = 0; i < h->nentries; i++) {
+        if (entries[i].textOff > textBytes || entries[i].len > textBytes - entries[i].textOff)
+            return 0;
+    }
+    const HidxTrigram *trigrams = (const HidxTrigram *)(map + h->trigramsOff);
+    for (uint32_t i = 0; i < h->ntrigrams; i++) {
+        if (trigrams[i].postOff > npostings || trigrams[i].count > npostings - trigrams[i].postOff)
+            return 0;
+    }
+    const uint32_t *postings = (const uint32_t *)(map + h->postingsOff);
+    for (uint64_t i = 0; i < npostings; i++)
+        if (postings[i] >= h->nentries) return 0;
+    // at most nentries slots in use, so every probe reaches an empty one
+    const uint32_t *hash = (const uint32_t *)(map + h->hashOff);
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < h->hashSlots; i++) {
+        if (hash[i] > h->nentries) return 0;
+        if (hash[i] != 0) used++;
+    }
+    return used <= h->nentries;
+}
+
+// Map HISTORY_FILE.idx and replay its tail. Returns -1 if it is unusable.
+int storeMap() {
+    int fd = open(store.path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(HidxHeader)) {
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    if (!storeValid(map, st.st_size)) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    const HidxHeader *h = (const HidxHeader *)map;
+
+    store.map = map;
+    store.mapLen = st.st_size;
+    store.hdr = h;
+    store.entries = (const HidxEntry *)(map + h->entriesOff);
+    store.trigrams = (const HidxTrigram *)(map + h->trigramsOff);
+    store.postings = (const uint32_t *)(map + h->postingsOff);
+    store.hash = (const uint32_t *)(map + h->hashOff);
+    store.text = map + h->textOff;
+    store.covered = h->histBytes;
+
+    uint64_t off = h->baseEnd;
+    while (off + sizeof(HidxRecord) <= store.mapLen) {
+        HidxRecord r;
+        memcpy(&r, map + off, sizeof(r));
+        if (r.magic != HIDX_RECORD_MAGIC || off + sizeof(r) + r.len > store.mapLen) break;
+        storeRecordUse(map + off + sizeof(r), r.len, r.when);
+        off += sizeof(r) + r.len;
+    }
+    store.tailBytes = off - h->baseEnd;
+    return 0;
+}
+
+// Append queued tail records; called by the history writer
+size_t storeAppendTail(const char *buf, size_t len) {
+    if (store.fd == -1) return 0;
+    return writeFully(store.fd, buf, len);
+}
+
+// Queue a tail record for text. Called with hist.lock held.
+void storeQueueRecord(const char *text, size_t len, int64_t when) {
+    if (store.fd == -1) return;
+    size_t need = hist.idxPendingLen + sizeof(HidxRecord) + len;
+    if (need > hist.idxPendingCap) {
+        size_t cap = hist.idxPendingCap ? hist.idxPendingCap : HIST_BATCH_BYTES;
+        while (cap < need) cap *= 2;
+        char *p = realloc(hist.idxPending, cap);
+        if (p == NULL) return;
+        hist.idxPending = p;
+        hist.idxPendingCap = cap;
+    }
+    HidxRecord r = {HIDX_RECORD_MAGIC, (uint32_t)len, when};
+    memcpy(hist.idxPending + hist.idxPendingLen, &r, sizeof(r));
+    memcpy(hist.idxPending + hist.idxPendingLen + sizeof(r), text, len);
+    hist.idxPendingLen = need;
+}
+
+// Merge base and overlay into a new base
+int storeCompact(uint64_t histBytes) {
+    uint32_t nbase = store.hdr ? store.hdr->nentries : 0;
+    HistItem *items = malloc(((size_t)nbase + store.useCount + 1) * sizeof(HistItem));
+    if (items == NULL) return -1;
+
+    uint32_t n = 0;
+    for (uint32_t id = 0; id < nbase; id++) {
+        const HidxEntry *e = &store.entries[id];
+        items[n].text = store.text + e->textOff;
+        items[n].len = e->len;
+        items[n].freq = e->freq;
+        items[n].last = e->lastUsed;
+        n++;
+    }
+    for (size_t b = 0; b < store.useBuckets; b++) {
+        for (HistUse *u = store.uses[b]; u != NULL; u = u->next) {
+            if (u->baseId >= 0) {
+                items[u->baseId].freq += u->freq;
+                if (u->last > items[u->baseId].last) items[u->baseId].last = u->last;
+            } else {
+                items[n].text = u->text;
+                items[n].len = u->len;
+                items[n].freq = u->freq;
+                items[n].last = u->last;
+                n++;
+            }
+        }
+    }
+    // keep ids in last-use order so the newest entries sit at the end
+    qsort(items, n, sizeof(HistItem), compareItemsByLast);
+    int rc = storeWriteBase(items, n, histBytes);
+    free(items);
+    return rc;
+}
+
+// Build the store from the journal when there is no usable index
+int storeBuildFromJournal() {
+    storeUnmap();
+    storeFreeUses();
+
+    struct stat st;
+    int64_t mtime = (hist.fd != -1 && fstat(hist.fd, &st) == 0) ? st.st_mtime : time(NULL);
+    for (int i = 0; i < hist.mappedLines; i++) {
+        const HistLine *l = &hist.index[i];
+        if (l->len == 0) {
+            store.covered += 1;
+            continue;
+        }
+        // the journal has no timestamps; spread uses over the seconds
+        // before the file's mtime to keep their order
+        storeRecordUse(hist.map + l->offset, l->len, mtime - (hist.mappedLines - 1 - i));
+    }
+    int rc = storeCompact(hist.mapLen);
+    storeFreeUses();
+    return rc;
+}
+
+// Open (or build) the store. Returns 0 when the store is usable.
+int initHistoryStore() {
+    size_t plen = strlen(HISTORY_FILE) + 5;
+    store.path = malloc(plen);
+    if (store.path == NULL) return -1;
+    snprintf(store.path, plen, "%s.idx", HISTORY_FILE);
+
+    if (storeMap() != 0 || store.covered > hist.mapLen) {
+        // missing, corrupt, or the journal was truncated: start over
+        storeUnmap();
+        storeFreeUses();
+        store.covered = 0;
+        if (storeBuildFromJournal() != 0 || storeMap() != 0) {
+            storeUnmap();
+            return -1;
+        }
+    }
+
+    store.fd = keepFdHigh(open(store.path, O_WRONLY | O_APPEND | O_CLOEXEC));
+
+    // Journal lines written by a shell that could not update the index
+    if (store.covered < hist.mapLen) {
+        time_t now = time(NULL);
+        for (int i = 0; i < hist.mappedLines; i++) {
+            const HistLine *l = &hist.index[i];
+            if ((uint64_t)l->offset < store.covered) continue;
+            storeRecordUse(hist.map + l->offset, l->len, now);
+            storeQueueRecord(hist.map + l->offset, l->len, now);
+        }
+    }
+    return 0;
+}
+
+// Compact at exit when the tail has outgrown the base
+void historyStoreShutdown() {
+    if (store.path == NULL || store.hdr == NULL) return;
+    uint64_t limit = store.hdr->baseEnd / 4;
+    if (limit < HIDX_COMPACT_MIN) limit = HIDX_COMPACT_MIN;
+    if (store.tailBytes + hist.idxWritten < limit) return;
+
+    struct stat st;
+    if (fstat(hist.fd, &st) == 0 && (uint64_t)st.st_size == store.covered)
+        storeCompact(store.covered);
+}
+
+// Give readline the most recently used distinct entries, oldest first
+void storeLoadReadline() {
+    uint32_t nbase = store.hdr ? store.hdr->nentries : 0;
+    size_t max = HISTORY_LOAD_MAX + store.useCount;
+    HistItem *items = malloc(max * sizeof(HistItem));
+    if (items == NULL) return;
+
+    size_t n = 0;
+    // base ids are ordered by last use, so only the tail can qualify
+    uint32_t first = nbase > HISTORY_LOAD_MAX ? nbase - HISTORY_LOAD_MAX : 0;
+    for (uint32_t id = first; id < nbase; id++) {
+        const HidxEntry *e = &store.entries[id];
+        HistUse *u = storeFindUse(store.text + e->textOff, e->len);
+        if (u != NULL) continue; // added below with its newer time
+        items[n].text = store.text + e->textOff;
+        items[n].len = e->len;
+        items[n].last = e->lastUsed;
+        n++;
+    }
+    for (size_t b = 0; b < store.useBuckets; b++) {
+        for (HistUse *u = store.uses[b]; u != NULL; u = u->next) {
+            items[n].text = u->text;
+            items[n].len = u->len;
+            items[n].last = u->last;
+            n++;
+        }
+    }
+    qsort(items, n, sizeof(HistItem), compareItemsByLast);
+    size_t start = n > HISTORY_LOAD_MAX ? n - HISTORY_LOAD_MAX : 0;
+    for (size_t i = start; i < n; i++) {
+        char *entry = strndup(items[i].text, items[i].len);
+        if (entry == NULL) break;
+        add_history(entry);
+        free(entry);
+    }
+    free(items);
+}
+
+// Posting list of one trigram in the base, or NULL
+const uint32_t *storePostings(uint32_t trigram, uint32_t *count) {
+    uint32_t lo = 0, hi = store.hdr->ntrigrams;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (store.trigrams[mid].trigram < trigram) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == store.hdr->ntrigrams || store.trigrams[lo].trigram != trigram) return NULL;
+    *count = store.trigrams[lo].count;
+    return store.postings + store.trigrams[lo].postOff;
+}
+
+int historyMatches(const char *text, size_t len, const char *pat, size_t plen, int prefix) {
+    if (prefix) return len >= plen && memcmp(text, pat, plen) == 0;
+    return memmem(text, len, pat, plen) != NULL;
+}
+
+int addSearchResult(HistItem **res, size_t *n, size_t *cap, HistItem item) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        HistItem *r = realloc(*res, *cap * sizeof(HistItem));
+        if (r == NULL) return -1;
+        *res = r;
+    }
+    (*res)[(*n)++] = item;
+    return 0;
+}
+
+// history search [^]pattern: distinct matching commands, most recent last
+void historySearch(const char *pattern) {
+    int prefix = pattern[0] == '^';
+    if (prefix) pattern++;
+    size_t plen = strlen(pattern);
+
+    HistItem *res = NULL;
+    size_t n = 0, cap = 0;
+
+    if (store.hdr != NULL && store.hdr->nentries > 0) {
+        uint32_t *cand = NULL;
+        uint32_t ncand = 0;
+        int all = plen < 3;
+
+        if (!all) {
+            uint32_t *tri = malloc(plen * sizeof(uint32_t));
+            int k = tri ? extractTrigrams(pattern, plen, tri) : 0;
+            // start from the shortest posting list and intersect the rest
+            const uint32_t *lists[k > 0 ? k : 1];
+            uint32_t counts[k > 0 ? k : 1];
+            int best = -1;
+            for (int i = 0; i < k; i++) {
+                lists[i] = storePostings(tri[i], &counts[i]);
+                if (lists[i] == NULL) {
+                    best = -2; // a trigram nobody has: no base matches
+                    break;
+                }
+                if (best == -1 || counts[i] < counts[best]) best = i;
+            }
+            if (best >= 0) {
+                cand = malloc(counts[best] * sizeof(uint32_t));
+                if (cand != NULL) {
+                    memcpy(cand, lists[best], counts[best] * sizeof(uint32_t));
+                    ncand = counts[best];
+                    for (int i = 0; i < k && ncand > 0; i++) {
+                        if (i == best) continue;
+                        uint32_t a = 0, b = 0, out = 0;
+                        while (a < ncand && b < counts[i]) {
+                            if (cand[a] < lists[i][b]) a++;
+                            else if (cand[a] > lists[i][b]) b++;
+                            else {
+                                cand[out++] = cand[a++];
+                                b++;
+                            }
+                        }
+                        ncand = out;
+                    }
+                }
+            }
+            free(tri);
+        }
+
+        uint32_t total = all ? store.hdr->nentries : ncand;
+        for (uint32_t i = 0; i < total; i++) {
+            uint32_t id = all ? i : cand[i];
+            const HidxEntry *e = &store.entries[id];
+            const char *text = store.text + e->textOff;
+            if (!historyMatches(text, e->len, pattern, plen, prefix)) continue;
+            HistItem item = {text, e->len, e->freq, e->lastUsed};
+            HistUse *u = storeFindUse(text, e->len);
+            if (u != NULL) {
+                item.freq += u->freq;
+                if (u->last > item.last) item.last = u->last;
+            }
+            addSearchResult(&res, &n, &cap, item);
+        }
+        free(cand);
+    }
+
+    for (size_t b = 0; b < store.useBuckets; b++) {
+        for (HistUse *u = store.uses[b]; u != NULL; u = u->next) {
+            if (u->baseId >= 0 || !historyMatches(u->text, u->len, pattern, plen, prefix))
+                continue;
+            HistItem item = {u->text, u->len, u->freq, u->last};
+            addSearchResult(&res, &n, &cap, item);
+        }
+    }
+
+    if (n == 0) {
+        printf("history: no match for '%s'\n", pattern);
+        free(res);
+        return;
+    }
+    qsort(res, n, sizeof(HistItem), compareItemsByLast);
+    size_t start = n > HIST_SEARCH_MAX ? n - HIST_SEARCH_MAX : 0;
+    for (size_t i = start; i < n; i++) {
+        char when[32];
+        time_t t = (time_t)res[i].last;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+        printf("%6u  %s  %.*s\n", res[i].freq, when, (int)res[i].len, res[i].text);
+    }
+    free(res);
+}
+
+// Drop the older copy of line from readline's in-memory history
+void removeReadlineDuplicate(const char *line) {
+    HIST_ENTRY **list = history_list();
+    if (list == NULL) return;
+    for (int i = history_length - 1; i >= 0; i--) {
+        if (list[i] != NULL && strcmp(list[i]->line, line) == 0) {
+            HIST_ENTRY *old = remove_history(i);
+            if (old != NULL) free_history_entry(old);
+            return;
+        }
+    }
+}
+
+// Function to take input. On success *line owns the readline buffer, sized
+// to the input, and the caller frees it. Returns 1 for an empty line and
+// -1 at end of input (Ctrl-D).
+int takeInput(char **line, const char *prompt) {
+    char *buf;
+    buf = readLineEvents(prompt);
+    if (buf && strlen(buf) != 0) {
+        // Keep readline's list (and so Ctrl-R) free of duplicates
+        if (historyAppend(buf)) removeReadlineDuplicate(buf);
+        add_history(buf);
+
+        *line = buf;
+        return 0;
+    } else if (buf == NULL) {
+        return -1;
+    } else {
+        free(buf);
+        return 1;
+    }
+}
+
+// Function to print Current Directory.
+void printDir() {
+    char cwd[1024];
+    getcwd(cwd, sizeof(cwd));
+    printf("\nDir: %s", cwd);
+}
+
+// Generic unknown command error
+void displayError() {
+    printf("Unknown command. Type 'help' to see the list of commands.\n");
+}
+
+// ===== Command accounting =====
+// Every command the shell runs is measured. For an external command, or a
+// builtin run in a forked pipeline stage, wait4() returns the child's
+// rusage. A builtin run in the shell itself is measured with a
+// getrusage(RUSAGE_SELF) delta, so its max RSS is the shell's own. The
+// samples are kept per command name for the session ("stats"). The
+// pipeline evaluated last is also summed into pipeUsage, which the "time"
+// keyword prints.
+
+#define STAT_HASH_SIZE 256 // buckets, must be a power of two
+
+typedef struct CmdUsage {
+    double real, user, sys; // seconds
+    long maxrss;            // KB, the largest of the processes
+    long nvcsw, nivcsw;     // voluntary / involuntary context switches
+    long minflt, majflt;
+} CmdUsage;
+
+typedef struct CmdStat {
+    char *name;
+    double *wall; // every run's wall time in seconds
+    size_t n, cap;
+    CmdUsage total;
+    struct CmdStat *next;
+} CmdStat;
+
+static CmdStat *cmdStats[STAT_HASH_SIZE];
+static CmdUsage pipeUsage;
+
+double timevalSecs(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Add a process's rusage to u
+void usageAdd(CmdUsage *u, const struct rusage *ru) {
+    u->user += timevalSecs(ru->ru_utime);
+    u->sys += timevalSecs(ru->ru_stime);
+    if (ru->ru_maxrss > u->maxrss) u->maxrss = ru->ru_maxrss;
+    u->nvcsw += ru->ru_nvcsw;
+    u->nivcsw += ru->ru_nivcsw;
+    u->minflt += ru->ru_minflt;
+    u->majflt += ru->ru_majflt;
+}
+
+// What the shell process itself used between two getrusage() calls
+void rusageDelta(struct rusage *d, const struct rusage *before, const struct rusage *after) {
+    *d = *after;
+    timersub(&after->ru_utime, &before->ru_utime, &d->ru_utime);
+    timersub(&after->ru_stime, &before->ru_stime, &d->ru_stime);
+    d->ru_nvcsw -= before->ru_nvcsw;
+    d->ru_nivcsw -= before->ru_nivcsw;
+    d->ru_minflt -= before->ru_minflt;
+    d->ru_majflt -= before->ru_majflt;
+}
+
+// Add b's times and counts to a, keeping the larger max RSS
+void rusageAdd(struct rusage *a, const struct rusage *b) {
+    timeradd(&a->ru_utime, &b->ru_utime, &a->ru_utime);
+    timeradd(&a->ru_stime, &b->ru_stime, &a->ru_stime);
+    if (b->ru_maxrss > a->ru_maxrss) a->ru_maxrss = b->ru_maxrss;
+    a->ru_nvcsw += b->ru_nvcsw;
+    a->ru_nivcsw += b->ru_nivcsw;
+    a->ru_minflt += b->ru_minflt;
+    a->ru_majflt += b->ru_majflt;
+}
+
+// Add one run of name, which took wall seconds, to the session statistics
+void recordStat(const char *name, double wall, const struct rusage *ru) {
+    if (name == NULL) return;
+    CmdStat **bucket = &cmdStats[hashString(name) & (STAT_HASH_SIZE - 1)];
+    CmdStat *s = *bucket;
+    while (s != NULL && strcmp(s->name, name) != 0) s = s->next;
+    if (s == NULL) {
+        s = calloc(1, sizeof(CmdStat));
+        if (s == NULL) return;
+        s->name = strdup(name);
+        s->next = *bucket;
+        *bucket = s;
+    }
+    if (s->n == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 16;
+        double *w = realloc(s->wall, cap * sizeof(double));
+        if (w == NULL) return;
+        s->wall = w;
+        s->cap = cap;
+    }
+    s->wall[s->n++] = wall;
+    s->total.real += wall;
+    usageAdd(&s->total, ru);
+}
+
+void printUsage(FILE *out, const char *label, const CmdUsage *u) {
+    fprintf(out, "%s: real %.3f s, user %.3f s, sys %.3f s, max RSS %.1f MB, "
+            "ctx switches %ld vol / %ld invol, page faults %ld major / %ld minor\n",
+            label, u->real, u->user, u->sys, u->maxrss / 1024.0, u->nvcsw, u->nivcsw,
+            u->majflt, u->minflt);
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile (pct in 1..100) of n sorted values
+double percentileSorted(const double *v, size_t n, int pct) {
+    if (n == 0) return 0;
+    size_t k = (n * pct + 99) / 100;
+    return v[k > 0 ? k - 1 : 0];
+}
+
+int compareStatsByTotal(const void *a, const void *b) {
+    double x = (*(CmdStat *const *)a)->total.real, y = (*(CmdStat *const *)b)->total.real;
+    return x > y ? -1 : x < y;
+}
+
+// Wall time distribution of one command: a bar per power-of-two bucket
+void printStatHistogram(const CmdStat *s, const double *sorted) {
+    int lo = 0, hi = 0;
+    int bucket[64] = {0};
+    for (size_t i = 0; i < s->n; i++) {
+        // bucket b holds [2^b, 2^(b+1)) microseconds
+        long long us = (long long)(sorted[i] * 1e6);
+        int b = 0;
+        while (b < 63 && (1ll << (b + 1)) <= us) b++;
+        bucket[b]++;
+        if (i == 0) lo = b;
+        hi = b;
+    }
+    int peak = 1;
+    for (int b = lo; b <= hi; b++)
+        if (bucket[b] > peak) peak = bucket[b];
+    for (int b = lo; b <= hi; b++) {
+        int bar = bucket[b] * 50 / peak;
+        printf("  [%10.3f ms, %10.3f ms) %8d%s%.*s\n", (1ll << b) / 1e3, (1ll << (b + 1)) / 1e3,
+               bucket[b], bar ? "  " : "", bar, "##################################################");
+    }
+}
+
+// stats builtin: per-command run counts and wall time percentiles for the
+// session, with CPU time, max RSS, context switches and page faults
+int cmd_stats(char **parsed) {
+    if (parsed[1] != NULL && strcmp(parsed[1], "-r") == 0) {
+        for (int b = 0; b < STAT_HASH_SIZE; b++) {
+            while (cmdStats[b] != NULL) {
+                CmdStat *s = cmdStats[b];
+                cmdStats[b] = s->next;
+                free(s->name);
+                free(s->wall);
+                free(s);
+            }
+        }
+        return 0;
+    }
+
+    size_t n = 0, cap = 0;
+    CmdStat **list = NULL;
+    for (int b = 0; b < STAT_HASH_SIZE; b++) {
+        for (CmdStat *s = cmdStats[b]; s != NULL; s = s->next) {
+            int wanted = parsed[1] == NULL;
+            for (int i = 1; parsed[i] != NULL && !wanted; i++) wanted = strcmp(parsed[i], s->name) == 0;
+            if (!wanted) continue;
+            if (n == cap) {
+                cap = cap ? cap * 2 : 32;
+                CmdStat **l = realloc(list, cap * sizeof(CmdStat *));
+                if (l == NULL) break;
+                list = l;
+            }
+            list[n++] = s;
+        }
+    }
+    if (n == 0) {
+        printf("stats: no commands recorded%s\n", parsed[1] != NULL ? " under that name" : "");
+        free(list);
+        return parsed[1] != NULL;
+    }
+    qsort(list, n, sizeof(CmdStat *), compareStatsByTotal);
+
+    printf("%-16s %6s %9s %9s %9s %9s %9s %8s %8s %8s %9s %9s\n", "command", "runs", "total s",
+           "p50 ms", "p95 ms", "p99 ms", "max ms", "user s", "sys s", "RSS MB", "ctxsw", "faults");
+    for (size_t i = 0; i < n; i++) {
+        CmdStat *s = list[i];
+        double *sorted = malloc(s->n * sizeof(double));
+        if (sorted == NULL) continue;
+        memcpy(sorted, s->wall, s->n * sizeof(double));
+        qsort(sorted, s->n, sizeof(double), compareDoubles);
+        printf("%-16.16s %6zu %9.3f %9.3f %9.3f %9.3f %9.3f %8.3f %8.3f %8.1f %9ld %9ld\n", s->name,
+               s->n, s->total.real, percentileSorted(sorted, s->n, 50) * 1e3,
+               percentileSorted(sorted, s->n, 95) * 1e3, percentileSorted(sorted, s->n, 99) * 1e3,
+               sorted[s->n - 1] * 1e3, s->total.user, s->total.sys, s->total.maxrss / 1024.0,
+               s->total.nvcsw + s->total.nivcsw, s->total.majflt + s->total.minflt);
+        // named commands also get their distribution
+        if (parsed[1] != NULL) printStatHistogram(s, sorted);
+        free(sorted);
+    }
+    free(list);
+    return 0;
+}
+
+// ===== Redirection =====
+// "<", ">", ">>", "n>&m" and "n>&-" on a command. The parser keeps them as
+// a list per pipeline stage, in the order written, and they are applied
+// after the stage's pipe ends, so "cmd > f | wc" leaves wc nothing to
+// read, as in sh. The shell opens the files itself: a bad path is reported
+// before anything starts, and the child only has dup2()s to do (spawn file
+// actions, or plain calls after fork). The shell's copies, like every
+// descriptor it keeps open (keepFdHigh), are moved to REDIR_FD_MIN and up,
+// clear of the 0-9 a redirection can name.
+
+typedef enum {
+    REDIR_IN,     // n<file
+    REDIR_OUT,    // n>file
+    REDIR_APPEND, // n>>file
+    REDIR_DUP     // n>&m, n<&m, n>&-
+} RedirOp;
+
+struct Redir {
+    RedirOp op;
+    int fd;             // descriptor redirected
+    const char *target; // the word after the operator
+    int src;            // set by redirOpen(): what fd becomes a copy of, -1 to close it
+    struct Redir *next;
+};
+
+// Close the files redirOpen() opened
+void redirClose(Redir *list) {
+    for (Redir *r = list; r != NULL; r = r->next) {
+        if (r->op != REDIR_DUP && r->src != -1) close(r->src);
+        r->src = -1;
+    }
+}
+
+// Open the files of list in the shell. On failure nothing is left open
+// and -1 is returned after an sh-style message.
+int redirOpen(Redir *list) {
+    for (Redir *r = list; r != NULL; r = r->next) {
+        if (r->op == REDIR_DUP) {
+            r->src = strcmp(r->target, "-") == 0 ? -1 : atoi(r->target);
+            continue;
+        }
+        int flags = r->op == REDIR_IN    ? O_RDONLY
+                  : r->op == REDIR_OUT   ? O_WRONLY | O_CREAT | O_TRUNC
+                                         : O_WRONLY | O_CREAT | O_APPEND;
+        int fd = open(r->target, flags | O_CLOEXEC, 0666);
+        if (fd != -1 && fd < REDIR_FD_MIN) {
+            int moved = fcntl(fd, F_DUPFD_CLOEXEC, REDIR_FD_MIN);
+            int err = errno;
+            close(fd);
+            fd = moved;
+            errno = err;
+        }
+        if (fd == -1) {
+            fprintf(stderr, "%s: %s\n", r->target, strerror(errno));
+            r->src = -1;
+            for (Redir *o = list; o != r; o = o->next) {
+                if (o->op != REDIR_DUP) close(o->src);
+                o->src = -1;
+            }
+            return -1;
+        }
+        r->src = fd;
+    }
+    return 0;
+}
+
+// Carry out an opened list in a forked child; -1 if a dup failed
+int redirApply(const Redir *list) {
+    for (const Redir *r = list; r != NULL; r = r->next) {
+        if (r->src == -1) {
+            close(r->fd);
+        } else if (r->src != r->fd && dup2(r->src, r->fd) == -1) {
+            fprintf(stderr, "%s: %s\n", r->target, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// The same as posix_spawn file actions
+void redirSpawnActions(posix_spawn_file_actions_t *fa, const Redir *list) {
+    for (const Redir *r = list; r != NULL; r = r->next) {
+        if (r->src == -1) posix_spawn_file_actions_addclose(fa, r->fd);
+        else if (r->src != r->fd) posix_spawn_file_actions_adddup2(fa, r->src, r->fd);
+    }
+}
+
+// A builtin run in the shell itself gets its redirections on the shell's
+// own descriptors; those it touches are saved first and put back after.
+// While fd 0 is redirected, stdin is a stream of its own, so the builtin
+// does not read what the shell had buffered of its input (a script on a
+// pipe) and the shell's stream is not left at EOF.
+typedef struct RedirSaved {
+    int copy[REDIR_FD_MAX + 1]; // -1 untouched, -2 was closed, else the saved descriptor
+    FILE *shellStdin;           // NULL unless stdin was swapped
+} RedirSaved;
+
+void redirRestore(RedirSaved *saved) {
+    fflush(stdout);
+    fflush(stderr);
+    if (saved->shellStdin != NULL) {
+        fclose(stdin);
+        stdin = saved->shellStdin;
+        saved->shellStdin = NULL;
+    }
+    for (int fd = 0; fd <= REDIR_FD_MAX; fd++) {
+        if (saved->copy[fd] == -2) {
+            close(fd);
+        } else if (saved->copy[fd] >= 0) {
+            dup2(saved->copy[fd], fd);
+            close(saved->copy[fd]);
+        }
+        saved->copy[fd] = -1;
+    }
+}
+
+// Apply an opened list to the shell; -1 (with everything restored) on failure
+int redirShell(const Redir *list, RedirSaved *saved) {
+    for (int fd = 0; fd <= REDIR_FD_MAX; fd++) saved->copy[fd] = -1;
+    saved->shellStdin = NULL;
+    fflush(stdout);
+    fflush(stderr);
+    for (const Redir *r = list; r != NULL; r = r->next) {
+        if (saved->copy[r->fd] != -1) continue;
+        int copy = fcntl(r->fd, F_DUPFD_CLOEXEC, REDIR_FD_MIN);
+        if (copy == -1 && errno != EBADF) {
+            perror("redirection");
+            redirRestore(saved);
+            return -1;
+        }
+        saved->copy[r->fd] = copy == -1 ? -2 : copy;
+    }
+    if (redirApply(list) != 0) {
+        redirRestore(saved);
+        return -1;
+    }
+    if (saved->copy[0] != -1) {
+        int fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, REDIR_FD_MIN);
+        FILE *in = fd == -1 ? NULL : fdopen(fd, "r");
+        if (in != NULL) {
+            saved->shellStdin = stdin;
+            stdin = in;
+        } else if (fd != -1) {
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+// " 2>&1", " > out.txt", ... for job listings
+size_t redirTextLen(const Redir *list) {
+    size_t len = 0;
+    for (const Redir *r = list; r != NULL; r = r->next) len += strlen(r->target) + 6;
+    return len;
+}
+
+char *redirText(char *p, const Redir *list) {
+    for (const Redir *r = list; r != NULL; r = r->next) {
+        switch (r->op) {
+            case REDIR_IN:
+                p += r->fd == 0 ? sprintf(p, " < %s", r->target) : sprintf(p, " %d< %s", r->fd, r->target);
+                break;
+            case REDIR_OUT:
+            case REDIR_APPEND: {
+                const char *op = r->op == REDIR_OUT ? ">" : ">>";
+                p += r->fd == 1 ? sprintf(p, " %s %s", op, r->target)
+                                : sprintf(p, " %d%s %s", r->fd, op, r->target);
+                break;
+            }
+            case REDIR_DUP:
+                p += sprintf(p, " %d%s%s", r->fd, r->fd == 0 ? "<&" : ">&", r->target);
+                break;
+        }
+    }
+    return p;
+}
+
+// ===== Process launcher =====
+// External commands are started through posix_spawn by default. glibc
+// implements it with clone(CLONE_VM|CLONE_VFORK), so the cost does not grow
+// with the shell's resident set the way fork() page-table copying does.
+// The fork backend is kept for code that must run shell code in the child
+// and so it can be selected for comparison ("launcher fork").
+
+#define LAUNCH_SPAWN 0
+#define LAUNCH_FORK  1
+
+static int launchBackend = LAUNCH_SPAWN;
+
+// Buffer size for the pipes the shell makes, 0 for the kernel's default
+// (64KB). Bigger pipes mean fewer context switches per MB in a pipeline
+// that streams a lot of data; the memory is only taken as data is queued.
+// Set by CUSTOM_SHELL_PIPESIZE or "pipesize".
+#define PIPE_SIZE_DEFAULT (1 << 20)
+
+static int pipeSize = 0;
+
+const char *launcherName(int backend) {
+    return backend == LAUNCH_FORK ? "fork" : "spawn";
+}
+
+// Give a new pipe the configured size. Past /proc/sys/fs/pipe-max-size, or
+// the per-user pipe quota, the kernel refuses and the pipe keeps its
+// default, which is fine.
+void setPipeSize(int fd) {
+    if (pipeSize > 0) fcntl(fd, F_SETPIPE_SZ, pipeSize);
+}
+
+// The size a pipe really gets for a request of size bytes (the kernel
+// rounds up to a power of two pages), or -1 with errno set
+int probePipeSize(int64_t size) {
+    int fds[2];
+    if (size <= 0 || size > INT_MAX || pipe2(fds, O_CLOEXEC) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    int got = fcntl(fds[1], F_SETPIPE_SZ, (int)size);
+    int err = errno;
+    close(fds[0]);
+    close(fds[1]);
+    errno = err;
+    return got;
+}
+
+// Pick the backend from CUSTOM_SHELL_LAUNCHER=spawn|fork and the pipe size
+// from CUSTOM_SHELL_PIPESIZE (e.g. 256k, 0 for the kernel's default)
+void initLauncher() {
+    const char *env = getenv("CUSTOM_SHELL_LAUNCHER");
+    if (env != NULL && strcmp(env, "fork") == 0) launchBackend = LAUNCH_FORK;
+    env = getenv("CUSTOM_SHELL_PIPESIZE");
+    int64_t want = env != NULL && *env != '\0' ? parseSize(env) : PIPE_SIZE_DEFAULT;
+    int got = want == 0 ? 0 : probePipeSize(want);
+    if (got >= 0) pipeSize = got;
+    else if (env != NULL) fprintf(stderr, "CUSTOM_SHELL_PIPESIZE: cannot use '%s': %s\n", env, strerror(errno));
+}
+
+// Process group placement for a launched child. pgid 0 starts a new group
+// led by the child, any other pgid joins that group. When tty is not -1 the
+// group is made the terminal's foreground group from inside the child, so
+// a program that touches the terminal at once is not stopped by SIGTTOU
+// before the shell gets to hand the terminal over.
+typedef struct LaunchGroup {
+    pid_t pgid;
+    int tty;
+} LaunchGroup;
+
+// The signal mask the shell started with, and the signals it ignores for
+// job control: children get both back to normal. Set by initJobs().
+static sigset_t childMask;
+static sigset_t childDefaults;
+static int jobSignalFd = -1; // the blocked signals, read by the shell
+
+// Undo the shell's job control signal setup in a forked child (the spawn
+// backend does the same through posix_spawnattr) and join grp
+void childSetup(const LaunchGroup *grp) {
+    if (grp != NULL) {
+        setpgid(0, grp->pgid);
+        // SIGTTOU is still ignored here, so this cannot stop us
+        if (grp->tty != -1) tcsetpgrp(grp->tty, getpgrp());
+    }
+    for (int sig = 1; sig < NSIG; sig++) {
+        if (sigismember(&childDefaults, sig) == 1) signal(sig, SIG_DFL);
+    }
+    pthread_sigmask(SIG_SETMASK, &childMask, NULL);
+    jobControl = 0; // shell code run in the child must not take the terminal
+    // signals reach the child as usual; the signalfd would never fire here
+    if (jobSignalFd != -1) {
+        close(jobSignalFd);
+        jobSignalFd = -1;
+    }
+}
+
+// Start path with argv. inFd/outFd replace stdin/stdout when they are not -1;
+// closeFds lists extra descriptors (e.g. the other pipe ends) the child must
+// not keep; redir, opened by redirOpen(), is applied after that; grp, if not
+// NULL, places the child in a process group. Returns the child pid or -1.
+pid_t launchProcess(const char *path, char **argv, int inFd, int outFd,
+                    const int *closeFds, int nclose, const Redir *redir,
+                    const LaunchGroup *grp) {
+    // built-in output must not be overtaken by the child's
+    fflush(NULL);
+
+    if (launchBackend == LAUNCH_SPAWN) {
+        posix_spawn_file_actions_t fa;
+        posix_spawnattr_t attr;
+        posix_spawn_file_actions_init(&fa);
+        posix_spawnattr_init(&attr);
+        short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+        posix_spawnattr_setsigmask(&attr, &childMask);
+        posix_spawnattr_setsigdefault(&attr, &childDefaults);
+        if (grp != NULL) {
+            flags |= POSIX_SPAWN_SETPGROUP;
+            posix_spawnattr_setpgroup(&attr, grp->pgid);
+#ifdef __GLIBC_PREREQ
+#if __GLIBC_PREREQ(2, 35)
+            // before the dup2()s, while tty still refers to the terminal
+            if (grp->tty != -1) posix_spawn_file_actions_addtcsetpgrp_np(&fa, grp->tty);
+#endif
+#endif
+        }
+        posix_spawnattr_setflags(&attr, flags);
+
+        if (inFd != -1 && inFd != STDIN_FILENO) {
+            posix_spawn_file_actions_adddup2(&fa, inFd, STDIN_FILENO);
+            posix_spawn_file_actions_addclose(&fa, inFd);
+        }
+        if (outFd != -1 && outFd != STDOUT_FILENO) {
+            posix_spawn_file_actions_adddup2(&fa, outFd, STDOUT_FILENO);
+            if (outFd != inFd) posix_spawn_file_actions_addclose(&fa, outFd);
+        }
+        for (int i = 0; i < nclose; i++) {
+            if (closeFds[i] != inFd && closeFds[i] != outFd)
+                posix_spawn_file_actions_addclose(&fa, closeFds[i]);
+        }
+        redirSpawnActions(&fa, redir);
+
+        pid_t pid;
+        int err = posix_spawn(&pid, path, &fa, &attr, argv, environ);
+        posix_spawn_file_actions_destroy(&fa);
+        posix_spawnattr_destroy(&attr);
+        if (err != 0) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+            return -1;
+        }
+        return pid;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    } else if (pid == 0) {
+        childSetup(grp);
+        for (int i = 0; i < nclose; i++) {
+            if (closeFds[i] != inFd && closeFds[i] != outFd) close(closeFds[i]);
+        }
+        if (inFd != -1 && inFd != STDIN_FILENO) {
+            dup2(inFd, STDIN_FILENO);
+            close(inFd);
+        }
+        if (outFd != -1 && outFd != STDOUT_FILENO) {
+            dup2(outFd, STDOUT_FILENO);
+            if (outFd != inFd) close(outFd);
+        }
+        if (redirApply(redir) != 0) _exit(1);
+        execv(path, argv);
+        perror("execv");
+        _exit(127);
+    }
+    return pid;
+}
+
+// Convert a waitpid status into a shell exit code
+int exitCode(int status) {
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 1;
+}
+
+// launcher builtin: show or switch the process launch backend
+int cmd_launcher(char **parsed) {
+    if (parsed[1] == NULL) {
+        printf("launcher: %s\n", launcherName(launchBackend));
+    } else if (strcmp(parsed[1], "spawn") == 0) {
+        launchBackend = LAUNCH_SPAWN;
+    } else if (strcmp(parsed[1], "fork") == 0) {
+        launchBackend = LAUNCH_FORK;
+    } else {
+        printf("launcher: unknown backend '%s' (use spawn or fork)\n", parsed[1]);
+        return 1;
+    }
+    return 0;
+}
+
+// Exit status of every stage of the last command, like bash's PIPESTATUS
+static int *pipeStatus = NULL;
+static int pipeStatusCount = 0;
+
+void setPipeStatus(const int *statuses, int n) {
+    int *ps = realloc(pipeStatus, (n > 0 ? n : 1) * sizeof(int));
+    if (ps == NULL) return;
+    pipeStatus = ps;
+    memcpy(pipeStatus, statuses, n * sizeof(int));
+    pipeStatusCount = n;
+}
+
+// pipestatus builtin: print the exit status of each stage of the last command
+int cmd_pipestatus(char **parsed) {
+    (void)parsed;
+    for (int i = 0; i < pipeStatusCount; i++)
+        printf(i == 0 ? "%d" : " %d", pipeStatus[i]);
+    printf("\n");
+    return 0;
+}
+
+// Run a builtin as a pipeline stage. Builtins have no binary to spawn, so
+// this is where the fork fallback is needed. Nothing is exec'd, so
+// O_CLOEXEC does not help: the pipe ends in closeFds are closed by hand,
+// or a builtin reading stdin would hold its own writer open forever.
+pid_t launchBuiltin(const Builtin *b, char **argv, int inFd, int outFd,
+                    const int *closeFds, int nclose, const Redir *redir,
+                    const LaunchGroup *grp) {
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    } else if (pid == 0) {
+        childSetup(grp);
+        if (inFd != -1) dup2(inFd, STDIN_FILENO);
+        if (outFd != -1) dup2(outFd, STDOUT_FILENO);
+        for (int i = 0; i < nclose; i++) close(closeFds[i]);
+        if (redirApply(redir) != 0) _exit(1);
+        // what stdin has buffered is the shell's input, not this stage's
+        if (inFd != -1 || redir != NULL) __fpurge(stdin);
+        int status = runBuiltin(b, argv);
+        fflush(NULL);
+        _exit(status);
+    }
+    return pid;
+}
+
+// Start every stage of a pipeline. All pipes are created up front with
+// O_CLOEXEC, so each child only keeps the two ends it dup2()s onto
+// stdin/stdout. Stages naming a builtin of profile run in a forked child;
+// profile -1 runs everything as an external command. redirs, if not NULL,
+// has each stage's redirections. inFd, if not -1, is the first stage's
+// stdin. pids[i] is -1 for a stage that could not be started, or
+// STAGE_REDIR_FAILED if one of its files could not be opened. With grp, the
+// stages share one new process group, whose id is returned (0 if nothing
+// started).
+#define STAGE_REDIR_FAILED -2
+
+// Exit status of a stage that never started: 1 when its redirection
+// failed, as in sh, else 127
+int stageFailStatus(pid_t pid) {
+    return pid == STAGE_REDIR_FAILED ? 1 : 127;
+}
+
+pid_t launchStages(char ***stages, Redir **redirs, int nstages, int profile, pid_t *pids,
+                   const LaunchGroup *grp, int inFd) {
+    for (int i = 0; i < nstages; i++) pids[i] = -1;
+
+    int (*pipes)[2] = malloc((nstages > 1 ? nstages - 1 : 1) * sizeof(*pipes));
+    if (pipes == NULL) return 0;
+    int64_t t = traceStart();
+    int npipes = 0;
+    for (; npipes < nstages - 1; npipes++) {
+        if (pipe2(pipes[npipes], O_CLOEXEC) < 0) {
+            perror("pipe");
+            break;
+        }
+        setPipeSize(pipes[npipes][1]);
+    }
+    if (nstages > 1) traceEnd("pipe setup", NULL, t);
+
+    LaunchGroup g = {0, -1};
+    if (grp != NULL) g = *grp;
+    if (npipes == nstages - 1) {
+        for (int i = 0; i < nstages; i++) {
+            int in = i > 0 ? pipes[i - 1][0] : inFd;
+            int outFd = i < nstages - 1 ? pipes[i][1] : -1;
+            Redir *redir = redirs != NULL ? redirs[i] : NULL;
+            if (redirOpen(redir) != 0) {
+                pids[i] = STAGE_REDIR_FAILED;
+                continue;
+            }
+
+            const Builtin *b = profile >= 0 ? findBuiltin(stages[i][0], profile) : NULL;
+            const char *path = NULL;
+            if (b == NULL) {
+                t = traceStart();
+                path = lookupCommand(stages[i][0], 1);
+                traceEnd("path lookup", stages[i][0], t);
+            }
+            const LaunchGroup *lg = grp != NULL ? &g : NULL;
+            t = traceStart();
+            if (b != NULL) {
+                pids[i] = launchBuiltin(b, stages[i], in, outFd, &pipes[0][0], 2 * npipes, redir, lg);
+                traceEnd("fork", stages[i][0], t);
+            } else if (path != NULL) {
+                pids[i] = launchProcess(path, stages[i], in, outFd, NULL, 0, redir, lg);
+                traceEnd(launchBackend == LAUNCH_FORK ? "fork" : "spawn", stages[i][0], t);
+            } else if (profile < 0) {
+                // spawn and execv do no PATH search: a bare name would run ./name
+                fprintf(stderr, "%s: command not found\n", stages[i][0]);
+            } else {
+                displayError();
+            }
+            redirClose(redir);
+            if (pids[i] != -1 && grp != NULL) {
+                // also from this side, so the group exists before the next
+                // stage joins it whichever process runs first
+                setpgid(pids[i], g.pgid != 0 ? g.pgid : pids[i]);
+                if (g.pgid == 0) {
+                    g.pgid = pids[i];
+                    if (g.tty != -1) tcsetpgrp(g.tty, g.pgid);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < npipes; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    free(pipes);
+    return g.pgid;
+}
+
+// Function where a simple system command is executed
+int execArgs(char **parsed) {
+    return execArgsPiped(&parsed, NULL, 1, -1);
+}
+
+// Function where the piped system commands are executed. Under job control
+// the pipeline becomes a foreground job; otherwise every stage is launched
+// and then all of them are reaped by one wait loop.
+int execArgsPiped(char ***stages, Redir **redirs, int nstages, int profile) {
+    if (nstages < 1) return 0;
+    if (jobControl) return runJob(stages, redirs, nstages, profile, 0);
+
+    pid_t *pids = malloc(nstages * sizeof(pid_t));
+    int *statuses = calloc(nstages, sizeof(int));
+    if (pids == NULL || statuses == NULL) {
+        free(pids);
+        free(statuses);
+        return 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int64_t t0 = traceStart();
+    launchStages(stages, redirs, nstages, profile, pids, NULL, -1);
+    int64_t tw = traceStart();
+    // Reap whatever exits first: a background job ending meanwhile is
+    // marked done at the right time, so its stats are not inflated
+    int left = 0;
+    for (int i = 0; i < nstages; i++) {
+        statuses[i] = stageFailStatus(pids[i]);
+        if (pids[i] > 0) left++;
+    }
+    while (left > 0) {
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &status, 0, &ru);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        int i = 0;
+        while (i < nstages && pids[i] != pid) i++;
+        if (i == nstages) {
+            markJobProc(pid, status, &ru);
+            continue;
+        }
+        statuses[i] = exitCode(status);
+        usageAdd(&pipeUsage, &ru);
+        recordStat(stages[i][0], elapsedSince(&start), &ru);
+        traceChild(pid, stages[i][0], t0);
+        left--;
+    }
+    traceEnd("wait", NULL, tw);
+    int last = statuses[nstages - 1];
+    setPipeStatus(statuses, nstages);
+
+    free(pids);
+    free(statuses);
+    return last;
+}
+
+// ===== Job control =====
+// A pipeline started with '&' is a job, and under job control so is every
+// foreground pipeline: its processes share a process group, the terminal
+// is handed to that group while it runs in the foreground (tcsetpgrp), and
+// Ctrl-C / Ctrl-Z reach the whole pipeline and not the shell. SIGCHLD is
+// blocked and only ever read from a signalfd, which the prompt polls next
+// to stdin through readline's callback interface: background jobs are
+// reaped the moment they change state and reported without waiting for
+// the current line to be finished. Processes are found by pid through a
+// hash table, so a state change costs the same with one job or thousands.
+
+#define JOB_HASH_SIZE 1024 // buckets, must be a power of two
+
+#define PROC_RUNNING 0
+#define PROC_STOPPED 1
+#define PROC_DONE    2
+
+typedef struct Job Job;
+
+typedef struct JobProc {
+    pid_t pid;     // -1 if the stage never started
+    int state;     // PROC_*
+    int status;    // exit code once done
+    int signal;    // signal that killed it, or 0
+    char *name;    // command name, for stats
+    struct rusage ru; // once done
+    Job *job;
+    struct JobProc *hashNext;
+} JobProc;
+
+struct Job {
+    int id;          // the n of %n
+    pid_t pgid;      // 0 without job control
+    int nprocs;
+    int running;     // processes neither stopped nor done
+    int stopped;
+    int foreground;
+    int notified;    // the latest stop or exit has been reported
+    int hasTmodes;
+    struct termios tmodes; // terminal settings when it was stopped
+    struct timespec start;
+    int64_t traceStart;
+    char *text;
+    JobProc procs[];
+};
+
+static Job **jobTable = NULL; // jobTable[id - 1], NULL for a free id
+static int jobCap = 0;
+static int jobHigh = 0;       // highest id in use
+static int currentJob = 0;    // %+ and %-
+static int previousJob = 0;
+static JobProc *jobPids[JOB_HASH_SIZE];
+
+static int shellTty = -1;
+static pid_t shellPgid = 0;
+static struct termios shellTmodes;
+static int stoppedWarned = 0;
+
+// Block SIGCHLD so that it is only read from jobSignalFd. In an interactive
+// session on a terminal, also wait to be in the foreground, ignore the
+// job control signals, take a process group of our own and turn on job
+// control. SIGINT is blocked and read from the signalfd too: at the prompt
+// it clears the line, and it never interrupts the shell itself.
+void initJobs() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigemptyset(&childDefaults);
+
+    if (interactive && isatty(STDIN_FILENO)) {
+        shellTty = STDIN_FILENO;
+        while (tcgetpgrp(shellTty) != (shellPgid = getpgrp())) kill(-shellPgid, SIGTTIN);
+
+        const int ignored[] = {SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+        for (size_t i = 0; i < sizeof(ignored) / sizeof(ignored[0]); i++) {
+            signal(ignored[i], SIG_IGN);
+            sigaddset(&childDefaults, ignored[i]);
+        }
+        sigaddset(&mask, SIGINT);
+
+        setpgid(0, 0); // fails harmlessly if we already lead a session
+        shellPgid = getpgrp();
+        if (tcsetpgrp(shellTty, shellPgid) == 0 && tcgetattr(shellTty, &shellTmodes) == 0)
+            jobControl = 1;
+        rl_catch_signals = 0;
+    }
+
+    // before any thread exists, so that every thread inherits the mask
+    pthread_sigmask(SIG_BLOCK, &mask, &childMask);
+    jobSignalFd = keepFdHigh(signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC));
+    if (jobSignalFd == -1) perror("signalfd");
+}
+
+// A command line for display, e.g. "sort data.txt | uniq -c > counts"
+char *stagesText(char ***stages, Redir **redirs, int nstages) {
+    size_t len = 1;
+    for (int i = 0; i < nstages; i++) {
+        for (char **a = stages[i]; *a != NULL; a++) len += strlen(*a) + 1;
+        if (redirs != NULL) len += redirTextLen(redirs[i]);
+        len += 2;
+    }
+    char *text = malloc(len);
+    if (text == NULL) return NULL;
+    char *p = text;
+    for (int i = 0; i < nstages; i++) {
+        if (i > 0) p = stpcpy(p, " | ");
+        for (char **a = stages[i]; *a != NULL; a++) {
+            if (a != stages[i]) *p++ = ' ';
+            p = stpcpy(p, *a);
+        }
+        if (redirs != NULL) p = redirText(p, redirs[i]);
+    }
+    *p = '\0';
+    return text;
+}
+
+// A new job with nprocs process slots, under the next free id
+Job *newJob(const char *text, int nprocs) {
+    if (jobHigh == jobCap) {
+        int cap = jobCap ? jobCap * 2 : 16;
+        Job **t = realloc(jobTable, cap * sizeof(Job *));
+        if (t == NULL) return NULL;
+        memset(t + jobCap, 0, (cap - jobCap) * sizeof(Job *));
+        jobTable = t;
+        jobCap = cap;
+    }
+    Job *job = calloc(1, sizeof(Job) + nprocs * sizeof(JobProc));
+    if (job == NULL) return NULL;
+    job->text = strdup(text != NULL ? text : "");
+    job->id = ++jobHigh;
+    job->nprocs = nprocs;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job->traceStart = traceStart();
+    jobTable[job->id - 1] = job;
+    return job;
+}
+
+// Record the pid that runs slot i of job (negative: it failed to start)
+void jobSetProc(Job *job, int i, pid_t pid, const char *name) {
+    JobProc *p = &job->procs[i];
+    p->job = job;
+    p->pid = pid > 0 ? pid : -1;
+    p->name = strdup(name);
+    if (pid <= 0) {
+        p->state = PROC_DONE;
+        p->status = stageFailStatus(pid);
+        return;
+    }
+    p->state = PROC_RUNNING;
+    job->running++;
+    unsigned h = (unsigned)pid & (JOB_HASH_SIZE - 1);
+    p->hashNext = jobPids[h];
+    jobPids[h] = p;
+}
+
+JobProc *findJobProc(pid_t pid) {
+    JobProc *p = jobPids[(unsigned)pid & (JOB_HASH_SIZE - 1)];
+    while (p != NULL && p->pid != pid) p = p->hashNext;
+    return p;
+}
+
+Job *findJob(int id) {
+    return id >= 1 && id <= jobHigh ? jobTable[id - 1] : NULL;
+}
+
+int jobDone(const Job *job) {
+    return job->running == 0 && job->stopped == 0;
+}
+
+// Exit status of a job: that of its last process
+int jobStatus(const Job *job) {
+    return job->procs[job->nprocs - 1].status;
+}
+
+// Make id the current job (%+), the old current one becomes %-
+void setCurrentJob(int id) {
+    if (id == currentJob) return;
+    previousJob = currentJob;
+    currentJob = id;
+}
+
+void removeJob(Job *job) {
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].pid == -1) continue;
+        JobProc **pp = &jobPids[(unsigned)job->procs[i].pid & (JOB_HASH_SIZE - 1)];
+        while (*pp != NULL && *pp != &job->procs[i]) pp = &(*pp)->hashNext;
+        if (*pp != NULL) *pp = job->procs[i].hashNext;
+    }
+    for (int i = 0; i < job->nprocs; i++) free(job->procs[i].name);
+    jobTable[job->id - 1] = NULL;
+    while (jobHigh > 0 && jobTable[jobHigh - 1] == NULL) jobHigh--;
+
+    if (job->id == currentJob) {
+        currentJob = previousJob;
+        previousJob = 0;
+    } else if (job->id == previousJob) {
+        previousJob = 0;
+    }
+    // fall back to the newest remaining jobs
+    for (int id = jobHigh; id >= 1 && (currentJob == 0 || previousJob == 0); id--) {
+        if (jobTable[id - 1] == NULL || id == currentJob || id == previousJob) continue;
+        if (currentJob == 0) currentJob = id;
+        else previousJob = id;
+    }
+    free(job->text);
+    free(job);
+}
+
+// Apply a wait4() result to the process it is about
+void markJobProc(pid_t pid, int wstatus, const struct rusage *ru) {
+    JobProc *p = findJobProc(pid);
+    if (p == NULL) return;
+    Job *job = p->job;
+    int state = PROC_RUNNING;
+    if (WIFEXITED(wstatus) || WIFSIGNALED(wstatus)) {
+        state = PROC_DONE;
+        p->status = exitCode(wstatus);
+        p->signal = WIFSIGNALED(wstatus) ? WTERMSIG(wstatus) : 0;
+        p->ru = *ru;
+        recordStat(p->name, elapsedSince(&job->start), ru);
+        traceChild(pid, p->name, job->traceStart);
+    } else if (WIFSTOPPED(wstatus)) {
+        state = PROC_STOPPED;
+    }
+    if (state == p->state) return;
+
+    if (p->state == PROC_RUNNING) job->running--;
+    else if (p->state == PROC_STOPPED) job->stopped--;
+    if (state == PROC_RUNNING) job->running++;
+    else if (state == PROC_STOPPED) job->stopped++;
+    p->state = state;
+
+    if (job->running == 0) {
+        job->notified = 0;
+        if (job->stopped > 0) setCurrentJob(job->id);
+    }
+}
+
+// Read pending signals off jobSignalFd; returns 1 if SIGINT was among them
+int drainJobSignals() {
+    struct signalfd_siginfo si;
+    int interrupted = 0;
+    if (jobSignalFd == -1) return 0;
+    while (read(jobSignalFd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+        if (si.ssi_signo == SIGINT) interrupted = 1;
+    }
+    return interrupted;
+}
+
+// Set once Ctrl-C reaches the shell while a built-in runs in it. SIGINT
+// is blocked in the shell, so the long built-ins and their pool tasks
+// poll for it here and give up with status 130.
+#define INTERRUPT_POLL_NS 10000000LL // read the signalfd at most every 10 ms
+static atomic_int builtinInterrupted;
+static atomic_llong interruptNextPoll;
+
+// Ctrl-C seen: record it, and end the line the terminal echoed ^C on so
+// that what the built-in prints next starts on a line of its own
+void markInterrupted() {
+    if (atomic_exchange(&builtinInterrupted, 1) != 0) return;
+    int fd = isatty(STDOUT_FILENO) ? STDOUT_FILENO : isatty(STDERR_FILENO) ? STDERR_FILENO : -1;
+    if (fd != -1) writeFully(fd, "\n", 1);
+}
+
+// 1 if Ctrl-C was pressed since the current built-in started. Callable
+// from any thread, and cheap enough to call once per file.
+int interruptRequested() {
+    if (atomic_load(&builtinInterrupted)) return 1;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    long long now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    long long next = atomic_load(&interruptNextPoll);
+    if (now < next || !atomic_compare_exchange_strong(&interruptNextPoll, &next, now + INTERRUPT_POLL_NS))
+        return 0;
+    if (!drainJobSignals()) return 0;
+    markInterrupted();
+    return 1;
+}
+
+// Wait until fd, a built-in's input and perhaps the terminal, can be
+// read. Returns 0, or -1 with errno ECANCELED if Ctrl-C came first. Only
+// the interactive shell waits: elsewhere SIGINT is delivered, and a
+// background job must reach read() to be stopped by SIGTTIN.
+int waitReadable(int fd) {
+    if (shellTty == -1 || jobSignalFd == -1) return 0;
+    while (!atomic_load(&builtinInterrupted)) {
+        struct pollfd pfds[2] = {{fd, POLLIN, 0}, {jobSignalFd, POLLIN, 0}};
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (pfds[1].revents != 0 && drainJobSignals()) markInterrupted();
+        else if (pfds[0].revents != 0) return 0;
+    }
+    errno = ECANCELED;
+    return -1;
+}
+
+ssize_t readInterruptible(int fd, void *buf, size_t n) {
+    return waitReadable(fd) == 0 ? read(fd, buf, n) : -1;
+}
+
+// Collect every state change of a child without blocking. Several exits
+// can share one SIGCHLD, so this loops until nothing is left.
+void reapJobs() {
+    pid_t pid;
+    int status;
+    struct rusage ru;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0)
+        markJobProc(pid, status, &ru);
+}
+
+// Block until a child changes state or SIGINT arrives; 1 on SIGINT
+int waitJobEvent() {
+    if (jobSignalFd == -1) {
+        siginfo_t info;
+        if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WNOWAIT) != 0 && errno == ECHILD)
+            return 1;
+        return 0;
+    }
+    struct pollfd pfd = {jobSignalFd, POLLIN, 0};
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR) continue;
+    return drainJobSignals();
+}
+
+void printJob(const Job *job, int withPid) {
+    char state[64];
+    const JobProc *last = &job->procs[job->nprocs - 1];
+    if (job->running > 0)
+        snprintf(state, sizeof(state), "Running");
+    else if (job->stopped > 0)
+        snprintf(state, sizeof(state), "Stopped");
+    else if (last->signal != 0)
+        snprintf(state, sizeof(state), "%s", strsignal(last->signal));
+    else if (last->status != 0)
+        snprintf(state, sizeof(state), "Exit %d", last->status);
+    else
+        snprintf(state, sizeof(state), "Done");
+
+    char mark = job->id == currentJob ? '+' : job->id == previousJob ? '-' : ' ';
+    if (withPid)
+        printf("[%d]%c %d %-22s%s%s\n", job->id, mark, (int)job->procs[0].pid, state,
+               job->text, job->running > 0 ? " &" : "");
+    else
+        printf("[%d]%c  %-24s%s%s\n", job->id, mark, state, job->text,
+               job->running > 0 ? " &" : "");
+}
+
+// Report background jobs that stopped or finished since the last report,
+// forgetting the finished ones. With redraw, readline is showing a prompt:
+// it is cleared first and drawn again, with the input so far, below the
+// notices.
+static const char *eventPrompt = "";
+
+void notifyJobs(int redraw) {
+    int pending = 0;
+    for (int id = 1; id <= jobHigh && !pending; id++) {
+        Job *job = jobTable[id - 1];
+        pending = job != NULL && !job->notified && !job->foreground && job->running == 0;
+    }
+    if (!pending) return;
+
+    char *saved = NULL;
+    int point = 0;
+    if (redraw) {
+        saved = rl_copy_text(0, rl_end);
+        point = rl_point;
+        rl_set_prompt("");
+        rl_replace_line("", 0);
+        rl_redisplay();
+    }
+
+    for (int id = 1; id <= jobHigh; id++) {
+        Job *job = jobTable[id - 1];
+        if (job == NULL || job->notified || job->foreground || job->running > 0) continue;
+        printJob(job, 0);
+        job->notified = 1;
+        if (jobDone(job)) removeJob(job);
+    }
+    fflush(stdout);
+
+    if (redraw) {
+        rl_set_prompt(eventPrompt);
+        rl_replace_line(saved != NULL ? saved : "", 0);
+        rl_point = point;
+        rl_on_new_line();
+        rl_redisplay();
+        free(saved);
+    }
+}
+
+static char *eventLine = NULL;
+static int eventLineDone = 0;
+
+void eventLineHandler(char *line) {
+    eventLine = line;
+    eventLineDone = 1;
+    rl_callback_handler_remove(); // or readline prints the prompt again
+}
+
+// Ctrl-C at the prompt: drop the line being edited and start a fresh one
+void interruptLine() {
+    rl_callback_sigcleanup(); // abandon a half-typed key sequence or search
+    rl_point = rl_end;
+    rl_redisplay();
+    printf("^C\n");
+    rl_replace_line("", 1);
+    rl_on_new_line();
+    rl_redisplay();
+    lastStatus = 130;
+}
+
+// readline(prompt) as an event loop: keystrokes are fed to readline's
+// callback interface as they arrive, and a child changing state is
+// handled in between them. Returns the line, or NULL at end of input.
+char *readLineEvents(const char *prompt) {
+    reapJobs();
+    notifyJobs(0);
+
+    eventPrompt = prompt;
+    eventLine = NULL;
+    eventLineDone = 0;
+    rl_callback_handler_install(prompt, eventLineHandler);
+    while (!eventLineDone) {
+        struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {jobSignalFd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            rl_callback_handler_remove();
+            return NULL;
+        }
+        if (fds[1].revents & POLLIN) {
+            if (drainJobSignals()) interruptLine();
+            reapJobs();
+            notifyJobs(1);
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) rl_callback_read_char();
+    }
+    return eventLine;
+}
+
+// Wait for the foreground job to finish or stop, then take the terminal
+// back. Returns its exit status; a job that stopped stays in the table.
+int waitForeground(Job *job) {
+    int64_t t = traceStart();
+    while (job->running > 0) {
+        // any child: background jobs finishing meanwhile are seen on time
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &status, WUNTRACED, &ru);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        markJobProc(pid, status, &ru);
+    }
+    traceEnd("wait", NULL, t);
+
+    tcsetpgrp(shellTty, shellPgid);
+    job->foreground = 0;
+    if (job->running == 0 && job->stopped > 0) {
+        job->hasTmodes = tcgetattr(shellTty, &job->tmodes) == 0;
+        tcsetattr(shellTty, TCSADRAIN, &shellTmodes);
+        printf("\n");
+        printJob(job, 0);
+        job->notified = 1;
+        return 128 + SIGTSTP;
+    }
+    tcsetattr(shellTty, TCSADRAIN, &shellTmodes);
+
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].pid != -1) usageAdd(&pipeUsage, &job->procs[i].ru);
+    }
+    int *statuses = malloc(job->nprocs * sizeof(int));
+    if (statuses != NULL) {
+        for (int i = 0; i < job->nprocs; i++) statuses[i] = job->procs[i].status;
+        setPipeStatus(statuses, job->nprocs);
+        free(statuses);
+    }
+    int status = jobStatus(job);
+    // killed by Ctrl-C: the prompt should not follow ^C on the same line
+    if (job->procs[job->nprocs - 1].signal == SIGINT) printf("\n");
+    removeJob(job);
+    return status;
+}
+
+// A job just put in the background: announce it like bash does
+int backgroundStarted(Job *job) {
+    setCurrentJob(job->id);
+    if (interactive) {
+        pid_t pid = job->procs[job->nprocs - 1].pid;
+        printf("[%d] %d\n", job->id, (int)pid);
+    }
+    int status = 0;
+    setPipeStatus(&status, 1);
+    return 0;
+}
+
+// Run a pipeline as a job, in the foreground (returning its status) or in
+// the background (returning 0 at once). Without job control a background
+// job reads /dev/null, as it cannot be stopped when it reads the terminal.
+int runJob(char ***stages, Redir **redirs, int nstages, int profile, int background) {
+    char *text = stagesText(stages, redirs, nstages);
+    Job *job = newJob(text, nstages);
+    free(text);
+    pid_t *pids = malloc(nstages * sizeof(pid_t));
+    if (job == NULL || pids == NULL) {
+        if (job != NULL) removeJob(job);
+        free(pids);
+        return 1;
+    }
+
+    int inFd = -1;
+    if (background && !jobControl) inFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    LaunchGroup grp = {0, background ? -1 : shellTty};
+    job->foreground = !background;
+    job->pgid = launchStages(stages, redirs, nstages, profile, pids, jobControl ? &grp : NULL, inFd);
+    if (inFd != -1) close(inFd);
+    for (int i = 0; i < nstages; i++) jobSetProc(job, i, pids[i], stages[i][0]);
+    free(pids);
+
+    if (!background) return waitForeground(job);
+    if (job->running == 0) { // nothing could be started
+        int status = jobStatus(job);
+        setPipeStatus(&status, 1);
+        removeJob(job);
+        return status;
+    }
+    return backgroundStarted(job);
+}
+
+// Put a job that ran in the background or was stopped back to work
+void continueJob(Job *job) {
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].state != PROC_STOPPED) continue;
+        job->procs[i].state = PROC_RUNNING;
+        job->stopped--;
+        job->running++;
+    }
+    if (job->pgid > 0) kill(-job->pgid, SIGCONT);
+}
+
+// Job for a %n, %+, %- or plain n argument (default: the current job)
+Job *jobFromSpec(const char *cmd, const char *spec) {
+    int id = currentJob;
+    if (spec != NULL && strcmp(spec, "%%") != 0 && strcmp(spec, "%+") != 0) {
+        if (strcmp(spec, "%-") == 0) {
+            id = previousJob;
+        } else {
+            const char *s = spec[0] == '%' ? spec + 1 : spec;
+            char *end;
+            long n = strtol(s, &end, 10);
+            id = *s != '\0' && *end == '\0' && n > 0 && n <= INT_MAX ? (int)n : -1;
+        }
+    }
+    Job *job = findJob(id);
+    if (job == NULL) printf("%s: %s: no such job\n", cmd, spec != NULL ? spec : "current");
+    return job;
+}
+
+int hasStoppedJobs() {
+    for (int id = 1; id <= jobHigh; id++) {
+        if (jobTable[id - 1] != NULL && jobTable[id - 1]->stopped > 0) return 1;
+    }
+    return 0;
+}
+
+// jobs builtin: list the jobs, forgetting those reported as finished
+int cmd_jobs(char **parsed) {
+    int withPid = parsed[1] != NULL && strcmp(parsed[1], "-l") == 0;
+    reapJobs();
+    for (int id = 1; id <= jobHigh; id++) {
+        Job *job = jobTable[id - 1];
+        if (job == NULL) continue;
+        printJob(job, withPid);
+        job->notified = 1;
+        if (jobDone(job)) removeJob(job);
+    }
+    return 0;
+}
+
+// fg builtin: continue a job in the foreground and wait for it
+int cmd_fg(char **parsed) {
+    if (!jobControl) {
+        printf("fg: no job control\n");
+        return 1;
+    }
+    reapJobs();
+    Job *job = jobFromSpec("fg", parsed[1]);
+    if (job == NULL) return 1;
+    if (jobDone(job)) {
+        printf("fg: job %d has terminated\n", job->id);
+        removeJob(job);
+        return 1;
+    }
+
+    printf("%s\n", job->text);
+    fflush(stdout);
+    job->foreground = 1;
+    tcsetpgrp(shellTty, job->pgid);
+    if (job->hasTmodes) tcsetattr(shellTty, TCSADRAIN, &job->tmodes);
+    continueJob(job);
+    return waitForeground(job);
+}
+
+// bg builtin: continue a stopped job in the background
+int cmd_bg(char **parsed) {
+    if (!jobControl) {
+        printf("bg: no job control\n");
+        return 1;
+    }
+    reapJobs();
+    Job *job = jobFromSpec("bg", parsed[1]);
+    if (job == NULL) return 1;
+    if (job->stopped == 0) {
+        printf("bg: job %d already in background\n", job->id);
+        return 0;
+    }
+    continueJob(job);
+    setCurrentJob(job->id);
+    printf("[%d]+ %s &\n", job->id, job->text);
+    return 0;
+}
+
+// wait builtin: wait for the given jobs (%n) or pids, or for all jobs.
+// Returns the status of the last one; Ctrl-C gives up waiting.
+int cmd_wait(char **parsed) {
+    int nargs = 0;
+    while (parsed[nargs + 1] != NULL) nargs++;
+    int n = nargs > 0 ? nargs : jobHigh;
+    Job **targets = calloc(n > 0 ? n : 1, sizeof(Job *));
+    if (targets == NULL) return 1;
+
+    reapJobs();
+    int status = 0;
+    if (nargs == 0) {
+        for (int id = 1; id <= jobHigh; id++) targets[id - 1] = jobTable[id - 1];
+    } else {
+        for (int i = 0; i < nargs; i++) {
+            const char *arg = parsed[i + 1];
+            if (arg[0] == '%') {
+                targets[i] = jobFromSpec("wait", arg);
+            } else {
+                char *end;
+                long pid = strtol(arg, &end, 10);
+                JobProc *p = *arg != '\0' && *end == '\0' ? findJobProc((pid_t)pid) : NULL;
+                if (p != NULL) targets[i] = p->job;
+                else printf("wait: pid %s is not a child of this shell\n", arg);
+            }
+            if (targets[i] == NULL) status = 127;
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (targets[i] == NULL) continue;
+        // a stopped job will not finish by itself
+        while (targets[i]->running > 0) {
+            if (waitJobEvent()) {
+                free(targets);
+                return 130;
+            }
+            reapJobs();
+        }
+        status = jobStatus(targets[i]);
+    }
+
+    // finished jobs that were waited for need no notice; a job named
+    // twice is only removed once
+    for (int i = 0; i < n; i++) {
+        Job *job = targets[i];
+        if (job == NULL || !jobDone(job)) continue;
+        for (int j = i + 1; j < n; j++) {
+            if (targets[j] == job) targets[j] = NULL;
+        }
+        removeJob(job);
+    }
+    free(targets);
+    return status;
+}
+
+// ===== Work pool =====
+// A fixed set of worker threads sized to the online CPUs. Every worker owns
+// a deque of tasks: a task submitted from a worker (a directory scan
+// queueing its subdirectories) goes on that worker's own deque and is
+// taken back newest-first, which keeps a depth-first walk's working set
+// small, while an idle worker steals the oldest task from another deque,
+// which tends to be the biggest remaining subtree. Tasks submitted from
+// outside the pool are dealt round-robin. poolWait() returns once no task
+// is queued or running. The bulk file commands share this pool type.
+
+typedef void (*PoolTaskFn)(void *arg);
+
+typedef struct PoolTask {
+    PoolTaskFn fn;
+    void *arg;
+    struct PoolTask *prev, *next;
+} PoolTask;
+
+typedef struct PoolDeque {
+    pthread_mutex_t lock;
+    PoolTask *head, *tail; // thieves take the head, the owner the tail
+} PoolDeque;
+
+typedef struct WorkPool {
+    pthread_t *threads;
+    PoolDeque *deques;
+    int nthreads;
+    atomic_int queued;   // tasks sitting in deques
+    atomic_int active;   // queued + running tasks
+    atomic_int sleepers;
+    atomic_uint nextDeque;
+    int stopping;
+    pthread_mutex_t lock; // sleeping and waiting only
+    pthread_cond_t work;
+    pthread_cond_t idle;
+} WorkPool;
+
+typedef struct PoolWorkerArg {
+    WorkPool *pool;
+    int index;
+} PoolWorkerArg;
+
+// The pool and deque of the worker running on this thread, if any
+static __thread WorkPool *poolSelf = NULL;
+static __thread int poolSelfIndex = -1;
+
+// One worker per online CPU, or CUSTOM_SHELL_THREADS
+int poolDefaultThreads() {
+    const char *env = getenv("CUSTOM_SHELL_THREADS");
+    long n = env != NULL ? atol(env) : 0;
+    if (n < 1) n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > 64) n = 64;
+    return (int)n;
+}
+
+PoolTask *dequeTake(WorkPool *p, PoolDeque *d, int fromTail) {
+    pthread_mutex_lock(&d->lock);
+    PoolTask *t = fromTail ? d->tail : d->head;
+    if (t != NULL) {
+        if (t->prev) t->prev->next = t->next;
+        else d->head = t->next;
+        if (t->next) t->next->prev = t->prev;
+        else d->tail = t->prev;
+        atomic_fetch_sub(&p->queued, 1);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return t;
+}
+
+// Own deque first, then steal, starting after ourselves
+PoolTask *poolFindTask(WorkPool *p, int self) {
+    PoolTask *t = dequeTake(p, &p->deques[self], 1);
+    for (int i = 1; t == NULL && i < p->nthreads; i++) {
+        if (atomic_load(&p->queued) == 0) break;
+        t = dequeTake(p, &p->deques[(self + i) % p->nthreads], 0);
+    }
+    return t;
+}
+
+void *poolWorker(void *arg) {
+    PoolWorkerArg *wa = arg;
+    WorkPool *p = wa->pool;
+    int self = wa->index;
+    free(wa);
+    poolSelf = p;
+    poolSelfIndex = self;
+
+    for (;;) {
+        PoolTask *t = poolFindTask(p, self);
+        if (t != NULL) {
+            t->fn(t->arg);
+            free(t);
+            if (atomic_fetch_sub(&p->active, 1) == 1) {
+                pthread_mutex_lock(&p->lock);
+                pthread_cond_broadcast(&p->idle);
+                pthread_mutex_unlock(&p->lock);
+            }
+            continue;
+        }
+
+        // sleepers is raised before queued is rechecked, and submitters
+        // raise queued before they check sleepers, so no wakeup is lost
+        pthread_mutex_lock(&p->lock);
+        atomic_fetch_add(&p->sleepers, 1);
+        while (atomic_load(&p->queued) == 0 && !p->stopping)
+            pthread_cond_wait(&p->work, &p->lock);
+        atomic_fetch_sub(&p->sleepers, 1);
+        int done = p->stopping && atomic_load(&p->queued) == 0;
+        pthread_mutex_unlock(&p->lock);
+        if (done) break;
+    }
+    return NULL;
+}
+
+// Start nthreads workers (0: one per CPU). Returns 0, or -1 on failure.
+int poolStart(WorkPool *p, int nthreads) {
+    memset(p, 0, sizeof(*p));
+    if (nthreads <= 0) nthreads = poolDefaultThreads();
+    p->threads = malloc(nthreads * sizeof(pthread_t));
+    p->deques = calloc(nthreads, sizeof(PoolDeque));
+    if (p->threads == NULL || p->deques == NULL) {
+        free(p->threads);
+        free(p->deques);
+        return -1;
+    }
+    atomic_init(&p->queued, 0);
+    atomic_init(&p->active, 0);
+    atomic_init(&p->sleepers, 0);
+    atomic_init(&p->nextDeque, 0);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->idle, NULL);
+    for (int i = 0; i < nthreads; i++) pthread_mutex_init(&p->deques[i].lock, NULL);
+
+    // nthreads is final before any worker looks at another deque
+    p->nthreads = nthreads;
+    int started = 0;
+    for (; started < nthreads; started++) {
+        PoolWorkerArg *wa = malloc(sizeof(PoolWorkerArg));
+        if (wa == NULL) break;
+        *wa = (PoolWorkerArg){p, started};
+        if (pthread_create(&p->threads[started], NULL, poolWorker, wa) != 0) {
+            free(wa);
+            break;
+        }
+    }
+    if (started == nthreads) return 0;
+
+    pthread_mutex_lock(&p->lock);
+    p->stopping = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < started; i++) pthread_join(p->threads[i], NULL);
+    for (int i = 0; i < nthreads; i++) pthread_mutex_destroy(&p->deques[i].lock);
+    free(p->threads);
+    free(p->deques);
+    return -1;
+}
+
+// Queue fn(arg). If the task cannot be queued it runs on the caller.
+void poolSubmit(WorkPool *p, PoolTaskFn fn, void *arg) {
+    PoolTask *t = malloc(sizeof(PoolTask));
+    if (t == NULL) {
+        fn(arg);
+        return;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    t->next = NULL;
+
+    int self = poolSelf == p ? poolSelfIndex
+                             : (int)(atomic_fetch_add(&p->nextDeque, 1) % (unsigned)p->nthreads);
+    PoolDeque *d = &p->deques[self];
+    atomic_fetch_add(&p->active, 1);
+    pthread_mutex_lock(&d->lock);
+    t->prev = d->tail;
+    if (d->tail) d->tail->next = t;
+    else d->head = t;
+    d->tail = t;
+    atomic_fetch_add(&p->queued, 1);
+    pthread_mutex_unlock(&d->lock);
+
+    if (atomic_load(&p->sleepers) > 0) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_signal(&p->work);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+// Block until every submitted task (and the tasks they submitted) is done
+void poolWait(WorkPool *p) {
+    pthread_mutex_lock(&p->lock);
+    while (atomic_load(&p->active) > 0)
+        pthread_cond_wait(&p->idle, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void poolStop(WorkPool *p) {
+    poolWait(p);
+    pthread_mutex_lock(&p->lock);
+    p->stopping = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->nthreads; i++) pthread_join(p->threads[i], NULL);
+    for (int i = 0; i < p->nthreads; i++) pthread_mutex_destroy(&p->deques[i].lock);
+    free(p->threads);
+    free(p->deques);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->idle);
+}
+
+double elapsedSince(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// ================= Profile-specific commands =================
+
+// ===== Workspace =====
+// The directories and sample files the profile commands work on live under
+// one workspace root: the directory the shell was started in, or
+// CUSTOM_SHELL_WORKSPACE. Nothing is created at startup; each item is made
+// with mkdirat/openat relative to the cached root descriptor the first time
+// a command needs it. Sample files are only ever created with O_EXCL, and
+// the manifest file remembers which items were seeded so a sample the user
+// deleted is not brought back.
+
+#define WS_MANIFEST ".custom_shell_workspace"
+
+#define WS_BACKUP          0
+#define WS_CORRUPTED       1
+#define WS_GOOD            2
+#define WS_HIDDEN          3
+#define WS_MAIN            4
+#define WS_TARGET          5
+#define WS_TARGET_LOCATION 6
+#define WS_STORE           7
+#define WS_COUNT           8
+
+typedef struct WsItem {
+    const char *name;     // relative to the workspace root
+    int isDir;
+    const char *seedName; // sample file inside a directory item, or NULL
+    const char *seedText;
+} WsItem;
+
+static const WsItem wsItems[WS_COUNT] = {
+    {"backup_good_files", 1, NULL, NULL},
+    {"corrupted_files", 1, "temp_corrupt.txt", ""},
+    {"good_files", 1, "base.txt", "Base data file\n"},
+    {"hidden", 1, "temp_hidden.txt", "Hidden temp file\n"},
+    {"main", 1, "temp_main.txt", "Main temp file\n"},
+    {"target.txt", 0, NULL, "Target file\n"},
+    {"target_location.txt", 0, NULL, ""},
+    {".secure_store", 1, NULL, NULL},
+};
+
+static int wsRootFd = -1;
+static int wsDirFds[WS_COUNT] = {-1, -1, -1, -1, -1, -1, -1, -1};
+static unsigned wsSeeded = 0; // bit per item, mirrors the manifest
+static int wsManifestLoaded = 0;
+
+// Remember where the workspace is; one open(), no other file system work
+void initWorkspace() {
+    const char *root = getenv("CUSTOM_SHELL_WORKSPACE");
+    if (root == NULL) root = ".";
+    wsRootFd = keepFdHigh(open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (wsRootFd == -1) perror(root);
+}
+
+int workspaceRoot() {
+    return wsRootFd;
+}
+
+void loadWorkspaceManifest() {
+    wsManifestLoaded = 1;
+    int fd = openat(wsRootFd, WS_MANIFEST, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    char buf[1024];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return;
+    buf[n] = '\0';
+
+    char *rest = buf, *line;
+    while ((line = strsep(&rest, "\n")) != NULL) {
+        for (int i = 0; i < WS_COUNT; i++) {
+            if (strcmp(line, wsItems[i].name) == 0) wsSeeded |= 1u << i;
+        }
+    }
+}
+
+void markWorkspaceSeeded(int item) {
+    wsSeeded |= 1u << item;
+    int fd = openat(wsRootFd, WS_MANIFEST, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) return;
+    dprintf(fd, "%s\n", wsItems[item].name);
+    close(fd);
+}
+
+// Create name under dirFd with text unless something is already there
+void seedWorkspaceFile(int dirFd, const char *name, const char *text) {
+    int fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1) return;
+    writeFully(fd, text, strlen(text));
+    close(fd);
+}
+
+// Directory fd for a workspace directory item, created on first use.
+// Returns -1 if it cannot be created.
+int workspaceDir(int item) {
+    if (wsRootFd == -1) return -1;
+
+    int fd = wsDirFds[item];
+    if (fd != -1) {
+        // still valid unless someone removed the directory behind our back
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_nlink > 0) return fd;
+        close(fd);
+        wsDirFds[item] = -1;
+    }
+
+    const WsItem *it = &wsItems[item];
+    fd = openat(wsRootFd, it->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT) {
+        if (mkdirat(wsRootFd, it->name, 0700) != 0 && errno != EEXIST) {
+            perror(it->name);
+            return -1;
+        }
+        fd = openat(wsRootFd, it->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd == -1) {
+        perror(it->name);
+        return -1;
+    }
+    fd = keepFdHigh(fd);
+    wsDirFds[item] = fd;
+
+    if (!wsManifestLoaded) loadWorkspaceManifest();
+    if (!(wsSeeded & (1u << item))) {
+        if (it->seedName != NULL) seedWorkspaceFile(fd, it->seedName, it->seedText);
+        markWorkspaceSeeded(item);
+    }
+    return fd;
+}
+
+// Make sure a workspace file item exists; returns 0 on success
+int workspaceFile(int item) {
+    if (wsRootFd == -1) return -1;
+    if (!wsManifestLoaded) loadWorkspaceManifest();
+    if (!(wsSeeded & (1u << item))) {
+        seedWorkspaceFile(wsRootFd, wsItems[item].name, wsItems[item].seedText);
+        markWorkspaceSeeded(item);
+    }
+    return 0;
+}
+
+// Drop a cached directory fd after removing the directory ourselves
+void workspaceForget(int item) {
+    if (wsDirFds[item] != -1) close(wsDirFds[item]);
+    wsDirFds[item] = -1;
+}
+
+// ===== Parallel tree walk =====
+// Walks a directory tree on a work pool. Each directory is read by its own
+// task, which queues its subdirectories as further tasks and hands its
+// other entries to onFile in batches, so wide and deep trees both spread
+// over the workers. Paths given to the callbacks are relative to rootFd.
+
+#define WALK_BATCH 64 // entries per onFile task
+
+typedef struct TreeWalk TreeWalk;
+
+struct TreeWalk {
+    WorkPool *pool;
+    int rootFd;
+    const char *name; // command name for messages
+    // called for every directory but the root; return 0 to descend
+    int (*onDir)(TreeWalk *w, const char *rel, int fd);
+    // called for every non-directory entry; type is a DT_* value
+    void (*onFile)(TreeWalk *w, const char *rel, unsigned char type);
+    void *ctx;
+    atomic_llong dirs, errors;
+};
+
+typedef struct WalkDirTask {
+    TreeWalk *w;
+    char *rel; // "." for the root
+} WalkDirTask;
+
+typedef struct WalkFileTask {
+    TreeWalk *w;
+    int n;
+    char *rel[WALK_BATCH];
+    unsigned char type[WALK_BATCH];
+} WalkFileTask;
+
+void walkError(TreeWalk *w, const char *rel, const char *what) {
+    fprintf(stderr, "%s: %s: %s: %s\n", w->name, rel, what, strerror(errno));
+    atomic_fetch_add(&w->errors, 1);
+}
+
+char *joinRel(const char *dir, const char *name) {
+    if (strcmp(dir, ".") == 0) return strdup(name);
+    size_t dl = strlen(dir), nl = strlen(name);
+    char *s = malloc(dl + nl + 2);
+    if (s == NULL) return NULL;
+    memcpy(s, dir, dl);
+    s[dl] = '/';
+    memcpy(s + dl + 1, name, nl + 1);
+    return s;
+}
+
+void walkFileTask(void *arg) {
+    WalkFileTask *t = arg;
+    for (int i = 0; i < t->n; i++) {
+        if (!interruptRequested()) t->w->onFile(t->w, t->rel[i], t->type[i]);
+        free(t->rel[i]);
+    }
+    free(t);
+}
+
+void walkDirTask(void *arg);
+
+void queueWalkDir(TreeWalk *w, char *rel) {
+    WalkDirTask *t = malloc(sizeof(WalkDirTask));
+    if (t == NULL) {
+        errno = ENOMEM;
+        walkError(w, rel, "queue");
+        free(rel);
+        return;
+    }
+    t->w = w;
+    t->rel = rel;
+    poolSubmit(w->pool, walkDirTask, t);
+}
+
+void walkDirTask(void *arg) {
+    WalkDirTask *t = arg;
+    TreeWalk *w = t->w;
+    struct stat st;
+    if (interruptRequested()) goto out;
+
+    int fd = openat(w->rootFd, t->rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        walkError(w, t->rel, "opendir");
+        if (fd != -1) close(fd);
+        goto out;
+    }
+    if (strcmp(t->rel, ".") != 0) {
+        atomic_fetch_add(&w->dirs, 1);
+        if (w->onDir != NULL && w->onDir(w, t->rel, fd) != 0) {
+            closedir(dir);
+            goto out;
+        }
+    }
+
+    WalkFileTask *batch = NULL;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        unsigned char type = de->d_type;
+        if (type == DT_UNKNOWN && fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            type = IFTODT(st.st_mode);
+
+        char *rel = joinRel(t->rel, de->d_name);
+        if (rel == NULL) continue;
+        if (type == DT_DIR) {
+            queueWalkDir(w, rel);
+            continue;
+        }
+        if (batch == NULL) {
+            batch = malloc(sizeof(WalkFileTask));
+            if (batch == NULL) {
+                w->onFile(w, rel, type);
+                free(rel);
+                continue;
+            }
+            batch->w = w;
+            batch->n = 0;
+        }
+        batch->rel[batch->n] = rel;
+        batch->type[batch->n++] = type;
+        if (batch->n == WALK_BATCH) {
+            poolSubmit(w->pool, walkFileTask, batch);
+            batch = NULL;
+            if (interruptRequested()) break;
+        }
+    }
+    if (batch != NULL) poolSubmit(w->pool, walkFileTask, batch);
+    closedir(dir);
+out:
+    free(t->rel);
+    free(t);
+}
+
+// Walk everything under w->rootFd and wait for all callbacks to finish.
+// After Ctrl-C the remaining entries are skipped; see interruptRequested().
+void walkTree(TreeWalk *w) {
+    atomic_init(&w->dirs, 0);
+    atomic_init(&w->errors, 0);
+    queueWalkDir(w, strdup("."));
+    poolWait(w->pool);
+}
+
+// ===== Backup engine =====
+// backup mirrors good_files into backup_good_files in-process on a tree
+// walk. A file whose size and mtime match the existing copy is skipped;
+// otherwise it is cloned with FICLONE when the file system supports
+// reflinks, else copied in the kernel with copy_file_range, else with
+// read/write. The copy gets the source's mode and timestamps, which is
+// what makes the next run's size+mtime check work.
+
+#define COPY_CHUNK (1 << 20) // bytes per copy_file_range/read call
+
+typedef struct CopyJob {
+    int dstRoot;
+    atomic_int cloneOk; // cleared after the first unsupported FICLONE
+    atomic_int rangeOk; // same for copy_file_range
+    atomic_llong files, skipped, bytes;
+} CopyJob;
+
+// Copy the rest of in to out; 0 on success, -1 with errno ECANCELED
+// after Ctrl-C
+int copyData(CopyJob *job, int in, int out, off_t size) {
+#ifdef FICLONE
+    if (atomic_load(&job->cloneOk)) {
+        if (ioctl(out, FICLONE, in) == 0) return 0;
+        if (errno == EOPNOTSUPP || errno == EXDEV || errno == EINVAL || errno == ENOTTY)
+            atomic_store(&job->cloneOk, 0);
+        else
+            return -1;
+    }
+#endif
+    off_t done = 0;
+    if (atomic_load(&job->rangeOk)) {
+        while (done < size) {
+            if (interruptRequested()) {
+                errno = ECANCELED;
+                return -1;
+            }
+            ssize_t n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+            if (n < 0) {
+                if (done == 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    atomic_store(&job->rangeOk, 0);
+                    break;
+                }
+                return -1;
+            }
+            if (n == 0) return 0; // source shrank
+            done += n;
+        }
+        if (done >= size) return 0;
+    }
+
+    char *buf = malloc(COPY_CHUNK);
+    if (buf == NULL) return -1;
+    ssize_t n;
+    while ((n = read(in, buf, COPY_CHUNK)) > 0) {
+        if (interruptRequested()) {
+            free(buf);
+            errno = ECANCELED;
+            return -1;
+        }
+        if (writeFully(out, buf, n) != (size_t)n) {
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+    return n < 0 ? -1 : 0;
+}
+
+int copyDir(TreeWalk *w, const char *rel, int fd) {
+    CopyJob *job = w->ctx;
+    struct stat st;
+    if (fstat(fd, &st) == -1 ||
+        (mkdirat(job->dstRoot, rel, (st.st_mode & 07777) | 0700) == -1 && errno != EEXIST)) {
+        walkError(w, rel, "mkdir");
+        return -1;
+    }
+    return 0;
+}
+
+void copyFile(TreeWalk *w, const char *rel, unsigned char type) {
+    CopyJob *job = w->ctx;
+    struct stat st, dst;
+    if (type != DT_REG && type != DT_LNK) return; // devices, fifos and sockets are not backed up
+    if (fstatat(w->rootFd, rel, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        walkError(w, rel, "stat");
+        return;
+    }
+
+    int have = fstatat(job->dstRoot, rel, &dst, AT_SYMLINK_NOFOLLOW) == 0;
+    if (have && (st.st_mode & S_IFMT) == (dst.st_mode & S_IFMT) && st.st_size == dst.st_size &&
+        st.st_mtim.tv_sec == dst.st_mtim.tv_sec && st.st_mtim.tv_nsec == dst.st_mtim.tv_nsec) {
+        atomic_fetch_add(&job->skipped, 1);
+        return;
+    }
+
+    if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlinkat(w->rootFd, rel, target, sizeof(target) - 1);
+        if (len < 0) {
+            walkError(w, rel, "readlink");
+            return;
+        }
+        target[len] = '\0';
+        if (have) unlinkat(job->dstRoot, rel, 0);
+        if (symlinkat(target, job->dstRoot, rel) == -1) {
+            walkError(w, rel, "symlink");
+            return;
+        }
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        utimensat(job->dstRoot, rel, times, AT_SYMLINK_NOFOLLOW);
+        atomic_fetch_add(&job->files, 1);
+        return;
+    }
+    if (!S_ISREG(st.st_mode)) return;
+
+    int in = openat(w->rootFd, rel, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (in == -1) {
+        walkError(w, rel, "open");
+        return;
+    }
+    if (have && !S_ISREG(dst.st_mode)) unlinkat(job->dstRoot, rel, 0);
+    int out = openat(job->dstRoot, rel, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (out == -1) {
+        walkError(w, rel, "create");
+        close(in);
+        return;
+    }
+
+    if (copyData(job, in, out, st.st_size) == -1) {
+        if (errno != ECANCELED) walkError(w, rel, "copy");
+    } else {
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        fchmod(out, st.st_mode & 07777);
+        futimens(out, times);
+        atomic_fetch_add(&job->files, 1);
+        atomic_fetch_add(&job->bytes, st.st_size);
+    }
+    close(in);
+    close(out);
+}
+
+// Mirror the tree under srcRoot into dstRoot and print throughput.
+// Returns 0 when every file was copied or already up to date.
+int copyTree(const char *name, int srcRoot, int dstRoot) {
+    WorkPool pool;
+    if (poolStart(&pool, 0) == -1) {
+        fprintf(stderr, "%s: cannot start worker threads\n", name);
+        return 1;
+    }
+
+    CopyJob job = {.dstRoot = dstRoot};
+    atomic_init(&job.cloneOk, 1);
+    atomic_init(&job.rangeOk, 1);
+    atomic_init(&job.files, 0);
+    atomic_init(&job.skipped, 0);
+    atomic_init(&job.bytes, 0);
+    TreeWalk w = {.pool = &pool, .rootFd = srcRoot, .name = name,
+                  .onDir = copyDir, .onFile = copyFile, .ctx = &job};
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    walkTree(&w);
+    poolStop(&pool);
+    double secs = elapsedSince(&start);
+    if (secs <= 0) secs = 1e-9;
+
+    long long files = atomic_load(&job.files), bytes = atomic_load(&job.bytes);
+    printf("%s: %lld copied, %lld unchanged, %lld dirs, %.1f MB in %.2fs "
+           "(%.0f files/s, %.1f MB/s, %d threads)\n",
+           name, files, (long long)atomic_load(&job.skipped), (long long)atomic_load(&w.dirs),
+           bytes / 1e6, secs, files / secs, bytes / 1e6 / secs, pool.nthreads);
+    long long errors = atomic_load(&w.errors);
+    if (errors > 0) printf("%s: %lld errors\n", name, errors);
+    if (interruptRequested()) return 130;
+    return errors > 0;
+}
+
+// ===== Snapshot store =====
+// secure_backup stores backup_good_files as content-addressed snapshots in
+// .secure_store:
+//
+//   chunks/ab/abcd...   one file per distinct chunk, named by the SHA-256
+//                       of its contents: a 'Z' (zlib) or 'R' (raw) byte,
+//                       then the data
+//   snapshots/<id>      one manifest per snapshot
+//
+// Files are cut into chunks with a gear rolling hash (content-defined, so
+// an insertion only changes the chunks around it), and a chunk already in
+// the store is never written again. A file whose mode, size and mtime
+// match the previous snapshot reuses its chunk list without being read,
+// so a repeat backup costs a directory walk plus the changed data. Files
+// are hashed on the tree walk's workers and every new chunk is compressed
+// as its own pool task, so one large file also spreads over the cores.
+//
+// Manifests are text, one record per line with tab-separated fields and
+// '%'-escaped names:
+//   csnap 1 <created> <files> <bytes>
+//   d <mode> <mtime-sec> <mtime-nsec> <path>
+//   f <mode> <mtime-sec> <mtime-nsec> <size> <nchunks> <path>
+//   c <sha256> <length>                 (nchunks of these follow each f)
+//   l <mtime-sec> <mtime-nsec> <path> <target>
+
+#define SNAP_DIR "snapshots"
+#define CHUNK_DIR "chunks"
+#define CDC_MIN (2 * 1024)
+#define CDC_AVG (8 * 1024)
+#define CDC_MAX (64 * 1024)
+// FastCDC-style normalized chunking: a harder mask below the average size
+// and an easier one above it keeps chunk sizes close to CDC_AVG
+#define CDC_MASK_HARD 0xfffe000000000000ull // 15 bits
+#define CDC_MASK_EASY 0xffe0000000000000ull // 11 bits
+
+static uint64_t gearTable[256];
+static pthread_once_t gearOnce = PTHREAD_ONCE_INIT;
+
+void initGearTable() {
+    uint64_t x = 0x9e3779b97f4a7c15ull; // splitmix64, fixed seed: chunk
+    for (int i = 0; i < 256; i++) {     // boundaries must not change
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        gearTable[i] = z ^ (z >> 31);
+    }
+}
+
+// Length of the chunk starting at p (n bytes left)
+size_t cdcChunk(const unsigned char *p, size_t n) {
+    if (n <= CDC_MIN) return n;
+    size_t end = n < CDC_MAX ? n : CDC_MAX;
+    size_t mid = end < CDC_AVG ? end : CDC_AVG;
+    uint64_t h = 0;
+    size_t i = CDC_MIN;
+    for (; i < mid; i++) {
+        h = (h << 1) + gearTable[p[i]];
+        if (!(h & CDC_MASK_HARD)) return i + 1;
+    }
+    for (; i < end; i++) {
+        h = (h << 1) + gearTable[p[i]];
+        if (!(h & CDC_MASK_EASY)) return i + 1;
+    }
+    return end;
+}
+
+void hexDigest(const unsigned char *d, char *out) {
+    static const char hex[] = "0123456789abcdef";
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        out[2 * i] = hex[d[i] >> 4];
+        out[2 * i + 1] = hex[d[i] & 15];
+    }
+    out[2 * SHA256_DIGEST_LENGTH] = '\0';
+}
+
+// printf onto a growing buffer
+int bufAppend(char **buf, size_t *len, size_t *cap, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+int bufAppend(char **buf, size_t *len, size_t *cap, const char *fmt, ...) {
+    va_list ap;
+    for (;;) {
+        va_start(ap, fmt);
+        int n = vsnprintf(*buf ? *buf + *len : NULL, *buf ? *cap - *len : 0, fmt, ap);
+        va_end(ap);
+        if (n < 0) return -1;
+        if (*buf != NULL && *len + n < *cap) {
+            *len += n;
+            return 0;
+        }
+        size_t want = *cap ? *cap * 2 : 256;
+        while (want <= *len + n) want *= 2;
+        char *b = realloc(*buf, want);
+        if (b == NULL) return -1;
+        *buf = b;
+        *cap = want;
+    }
+}
+
+// Manifest names: '%', tab and newline become %XX
+void snapEscape(char **buf, size_t *len, size_t *cap, const char *s) {
+    for (; *s; s++) {
+        if (*s == '%' || *s == '\t' || *s == '\n')
+            bufAppend(buf, len, cap, "%%%02X", (unsigned char)*s);
+        else
+            bufAppend(buf, len, cap, "%c", *s);
+    }
+}
+
+void snapUnescape(char *s) {
+    char *o = s;
+    for (; *s; s++) {
+        if (*s == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+            char h[3] = {s[1], s[2], 0};
+            *o++ = (char)strtol(h, NULL, 16);
+            s += 2;
+        } else {
+            *o++ = *s;
+        }
+    }
+    *o = '\0';
+}
+
+// Split line at tabs into at most max fields; returns the count
+int splitFields(char *line, char **f, int max) {
+    int n = 0;
+    while (n < max) {
+        f[n++] = line;
+        char *tab = strchr(line, '\t');
+        if (tab == NULL) break;
+        *tab = '\0';
+        line = tab + 1;
+    }
+    return n;
+}
+
+// Set of chunk digests seen during one command, shared by the workers
+typedef struct DigestSet {
+    unsigned char (*keys)[SHA256_DIGEST_LENGTH];
+    uint32_t *lens;
+    unsigned char *used;
+    size_t cap, count;
+    pthread_mutex_t lock;
+} DigestSet;
+
+void digestSetInit(DigestSet *s) {
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_init(&s->lock, NULL);
+}
+
+void digestSetFree(DigestSet *s) {
+    free(s->keys);
+    free(s->lens);
+    free(s->used);
+    pthread_mutex_destroy(&s->lock);
+}
+
+size_t digestSlot(const DigestSet *s, const unsigned char *d) {
+    uint64_t h;
+    memcpy(&h, d, sizeof(h)); // already uniformly distributed
+    size_t i = h & (s->cap - 1);
+    while (s->used[i] && memcmp(s->keys[i], d, SHA256_DIGEST_LENGTH) != 0)
+        i = (i + 1) & (s->cap - 1);
+    return i;
+}
+
+// Insert d; returns 1 if it was new, 0 if already present, -1 on ENOMEM
+int digestSetAdd(DigestSet *s, const unsigned char *d, uint32_t len) {
+    pthread_mutex_lock(&s->lock);
+    if ((s->count + 1) * 2 > s->cap) {
+        DigestSet old = *s;
+        s->cap = old.cap ? old.cap * 2 : 1024;
+        s->keys = malloc(s->cap * SHA256_DIGEST_LENGTH);
+        s->lens = malloc(s->cap * sizeof(uint32_t));
+        s->used = calloc(s->cap, 1);
+        if (s->keys == NULL || s->lens == NULL || s->used == NULL) {
+            free(s->keys);
+            free(s->lens);
+            free(s->used);
+            s->keys = old.keys;
+            s->lens = old.lens;
+            s->used = old.used;
+            s->cap = old.cap;
+            pthread_mutex_unlock(&s->lock);
+            return -1;
+        }
+        for (size_t i = 0; i < old.cap; i++) {
+            if (!old.used[i]) continue;
+            size_t j = digestSlot(s, old.keys[i]);
+            memcpy(s->keys[j], old.keys[i], SHA256_DIGEST_LENGTH);
+            s->lens[j] = old.lens[i];
+            s->used[j] = 1;
+        }
+        free(old.keys);
+        free(old.lens);
+        free(old.used);
+    }
+    size_t i = digestSlot(s, d);
+    int added = !s->used[i];
+    if (added) {
+        memcpy(s->keys[i], d, SHA256_DIGEST_LENGTH);
+        s->lens[i] = len;
+        s->used[i] = 1;
+        s->count++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return added;
+}
+
+// "chunks/ab/<hex>" for a digest
+void chunkPath(const char *hex, char *out, size_t size) {
+    snprintf(out, size, CHUNK_DIR "/%.2s/%s", hex, hex);
+}
+
+// Read and decompress a chunk into out (len bytes). 0 on success, -1 when
+// missing or unreadable (errno set), -2 when the data is damaged.
+int readChunk(int storeFd, const char *hex, unsigned char *out, uint32_t len) {
+    char path[128];
+    chunkPath(hex, path, sizeof(path));
+    int fd = openat(storeFd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    struct stat st;
+    unsigned char *raw = NULL;
+    int rc = -2;
+    if (fstat(fd, &st) == -1 || st.st_size < 1) goto out;
+    raw = malloc(st.st_size);
+    if (raw == NULL || pread(fd, raw, st.st_size, 0) != st.st_size) goto out;
+
+    if (raw[0] == 'R') {
+        if ((uint64_t)st.st_size - 1 != len) goto out;
+        memcpy(out, raw + 1, len);
+    } else if (raw[0] == 'Z') {
+        uLongf outLen = len;
+        if (uncompress(out, &outLen, raw + 1, st.st_size - 1) != Z_OK || outLen != len) goto out;
+    } else {
+        goto out;
+    }
+    rc = 0;
+out:
+    free(raw);
+    close(fd);
+    return rc;
+}
+
+typedef struct SnapPrev {
+    char *text;          // previous manifest, fields split in place
+    char **paths;        // f records sorted by path
+    char **records;      // start of the matching f line
+    size_t *recLens;     // f line plus its c lines
+    size_t count;
+} SnapPrev;
+
+typedef struct SnapRecord {
+    char *path;
+    char *text;
+    size_t len;
+} SnapRecord;
+
+typedef struct SnapJob {
+    WorkPool *pool;
+    int storeFd;
+    SnapPrev prev;
+    DigestSet seen;
+    pthread_mutex_t lock; // records
+    SnapRecord *records;
+    size_t nrecords, capRecords;
+    atomic_llong files, reused, bytes, newChunks, newBytes, storedBytes, errors;
+} SnapJob;
+
+// A new chunk: its own copy of exactly the bytes that were hashed, so a
+// file written meanwhile cannot put other data under the digest
+typedef struct ChunkTask {
+    SnapJob *job;
+    size_t len;
+    char hex[2 * SHA256_DIGEST_LENGTH + 1];
+    unsigned char data[];
+} ChunkTask;
+
+#define SNAP_READ (1 << 20) // read size; chunking needs CDC_MAX ahead
+
+// Compress one new chunk and publish it under its digest
+void storeChunkTask(void *arg) {
+    ChunkTask *t = arg;
+    SnapJob *job = t->job;
+    const unsigned char *src = t->data;
+    uLongf zlen = compressBound(t->len);
+    unsigned char *out = malloc(zlen + 1);
+    char path[128], tmp[160];
+
+    if (out == NULL) goto fail;
+    if (compress2(out + 1, &zlen, src, t->len, Z_DEFAULT_COMPRESSION) == Z_OK && zlen < t->len) {
+        out[0] = 'Z';
+    } else {
+        out[0] = 'R';
+        memcpy(out + 1, src, t->len);
+        zlen = t->len;
+    }
+
+    chunkPath(t->hex, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%lx.tmp", path, (unsigned long)pthread_self());
+    char dir[16];
+    snprintf(dir, sizeof(dir), CHUNK_DIR "/%.2s", t->hex);
+    mkdirat(job->storeFd, dir, 0700);
+    int fd = openat(job->storeFd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) goto fail;
+    if (writeFully(fd, out, zlen + 1) != zlen + 1 || close(fd) == -1 ||
+        renameat(job->storeFd, tmp, job->storeFd, path) == -1) {
+        unlinkat(job->storeFd, tmp, 0);
+        goto fail;
+    }
+    atomic_fetch_add(&job->newChunks, 1);
+    atomic_fetch_add(&job->newBytes, t->len);
+    atomic_fetch_add(&job->storedBytes, zlen + 1);
+    goto done;
+fail:
+    fprintf(stderr, "secure_backup: chunk %s: %s\n", t->hex, strerror(errno));
+    atomic_fetch_add(&job->errors, 1);
+done:
+    free(out);
+    free(t);
+}
+
+void snapAddRecord(SnapJob *job, const char *rel, char *text, size_t len) {
+    char *path = strdup(rel);
+    pthread_mutex_lock(&job->lock);
+    if (job->nrecords == job->capRecords) {
+        size_t cap = job->capRecords ? job->capRecords * 2 : 1024;
+        SnapRecord *r = realloc(job->records, cap * sizeof(SnapRecord));
+        if (r == NULL) {
+            pthread_mutex_unlock(&job->lock);
+            free(path);
+            free(text);
+            atomic_fetch_add(&job->errors, 1);
+            return;
+        }
+        job->records = r;
+        job->capRecords = cap;
+    }
+    job->records[job->nrecords++] = (SnapRecord){path, text, len};
+    pthread_mutex_unlock(&job->lock);
+}
+
+// The previous snapshot's record for rel if its mode, size and mtime match
+const char *snapPrevMatch(const SnapPrev *p, const char *rel, const struct stat *st, size_t *len) {
+    size_t lo = 0, hi = p->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = strcmp(p->paths[mid], rel);
+        if (c == 0) {
+            char want[96];
+            int n = snprintf(want, sizeof(want), "f\t%o\t%lld\t%ld\t%lld\t",
+                             (unsigned)(st->st_mode & 07777), (long long)st->st_mtim.tv_sec,
+                             st->st_mtim.tv_nsec, (long long)st->st_size);
+            if (strncmp(p->records[mid], want, n) != 0) return NULL;
+            *len = p->recLens[mid];
+            return p->records[mid];
+        }
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+int snapDir(TreeWalk *w, const char *rel, int fd) {
+    SnapJob *job = w->ctx;
+    struct stat st;
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    if (fstat(fd, &st) == -1) {
+        walkError(w, rel, "stat");
+        return 0;
+    }
+    bufAppend(&buf, &len, &cap, "d\t%o\t%lld\t%ld\t", (unsigned)(st.st_mode & 07777),
+              (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    snapEscape(&buf, &len, &cap, rel);
+    bufAppend(&buf, &len, &cap, "\n");
+    snapAddRecord(job, rel, buf, len);
+    return 0;
+}
+
+void snapFile(TreeWalk *w, const char *rel, unsigned char type) {
+    SnapJob *job = w->ctx;
+    struct stat st;
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+
+    if (type != DT_REG && type != DT_LNK) return;
+    if (fstatat(w->rootFd, rel, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        walkError(w, rel, "stat");
+        return;
+    }
+
+    if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlinkat(w->rootFd, rel, target, sizeof(target) - 1);
+        if (n < 0) {
+            walkError(w, rel, "readlink");
+            return;
+        }
+        target[n] = '\0';
+        bufAppend(&buf, &len, &cap, "l\t%lld\t%ld\t", (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+        snapEscape(&buf, &len, &cap, rel);
+        bufAppend(&buf, &len, &cap, "\t");
+        snapEscape(&buf, &len, &cap, target);
+        bufAppend(&buf, &len, &cap, "\n");
+        snapAddRecord(job, rel, buf, len);
+        atomic_fetch_add(&job->files, 1);
+        return;
+    }
+    if (!S_ISREG(st.st_mode)) return;
+
+    atomic_fetch_add(&job->files, 1);
+    atomic_fetch_add(&job->bytes, st.st_size);
+
+    size_t prevLen;
+    const char *prev = snapPrevMatch(&job->prev, rel, &st, &prevLen);
+    if (prev != NULL) {
+        buf = malloc(prevLen);
+        if (buf == NULL) return;
+        memcpy(buf, prev, prevLen);
+        snapAddRecord(job, rel, buf, prevLen);
+        atomic_fetch_add(&job->reused, 1);
+        return;
+    }
+
+    int fd = openat(w->rootFd, rel, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd == -1) {
+        walkError(w, rel, "open");
+        return;
+    }
+    // Read rather than map: a file that shrinks meanwhile is a short read,
+    // not a SIGBUS. Chunk boundaries are the same, as a chunk never looks
+    // past CDC_MAX.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    unsigned char *data = malloc(SNAP_READ + CDC_MAX);
+    if (data == NULL) {
+        close(fd);
+        atomic_fetch_add(&job->errors, 1);
+        return;
+    }
+
+    // the f line is written once the chunk count is known
+    char *chunks = NULL;
+    size_t clen = 0, ccap = 0;
+    long nchunks = 0;
+    size_t size = st.st_size, done = 0, start = 0, have = 0;
+    int failed = 0, changed = 0;
+    for (;;) {
+        if (have - start < CDC_MAX && done < size) {
+            memmove(data, data + start, have - start);
+            have -= start;
+            start = 0;
+        }
+        while (have < CDC_MAX && done < size) {
+            if (interruptRequested()) {
+                failed = 1; // no snapshot is written after Ctrl-C
+                break;
+            }
+            size_t room = SNAP_READ + CDC_MAX - have;
+            ssize_t r = pread(fd, data + have, size - done < room ? size - done : room, done);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                if (r < 0) walkError(w, rel, "read");
+                failed = r < 0;
+                changed = r == 0; // shrank
+                break;
+            }
+            have += r;
+            done += r;
+        }
+        if (failed || changed || start == have) break;
+        size_t n = cdcChunk(data + start, have - start);
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        char hex[2 * SHA256_DIGEST_LENGTH + 1];
+        SHA256(data + start, n, digest);
+        hexDigest(digest, hex);
+        bufAppend(&chunks, &clen, &ccap, "c\t%s\t%zu\n", hex, n);
+        nchunks++;
+
+        if (digestSetAdd(&job->seen, digest, n) == 1) {
+            char path[128];
+            chunkPath(hex, path, sizeof(path));
+            if (faccessat(job->storeFd, path, F_OK, 0) != 0) {
+                ChunkTask *t = malloc(sizeof(ChunkTask) + n);
+                if (t == NULL) {
+                    // the digest is claimed, so this snapshot must not be written
+                    atomic_fetch_add(&job->errors, 1);
+                } else {
+                    t->job = job;
+                    t->len = n;
+                    memcpy(t->hex, hex, sizeof(hex));
+                    memcpy(t->data, data + start, n);
+                    poolSubmit(job->pool, storeChunkTask, t);
+                }
+            }
+        }
+        start += n;
+    }
+    free(data);
+
+    // a file written while it was read is not snapshotted half old, half new
+    struct stat now;
+    if (!failed && fstat(fd, &now) != 0) {
+        walkError(w, rel, "stat");
+        failed = 1;
+    } else if (!failed && (changed || now.st_size != st.st_size ||
+                           now.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+                           now.st_mtim.tv_nsec != st.st_mtim.tv_nsec)) {
+        fprintf(stderr, "%s: %s: changed while being read\n", w->name, rel);
+        atomic_fetch_add(&w->errors, 1);
+        failed = 1;
+    }
+    close(fd);
+    if (failed) {
+        free(chunks);
+        return;
+    }
+
+    bufAppend(&buf, &len, &cap, "f\t%o\t%lld\t%ld\t%lld\t%ld\t", (unsigned)(st.st_mode & 07777),
+              (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (long long)st.st_size, nchunks);
+    snapEscape(&buf, &len, &cap, rel);
+    bufAppend(&buf, &len, &cap, "\n");
+    if (clen > 0) bufAppend(&buf, &len, &cap, "%.*s", (int)clen, chunks);
+    free(chunks);
+    snapAddRecord(job, rel, buf, len);
+}
+
+// Open (creating) the store and its subdirectories; returns the store fd
+int openSnapStore() {
+    int fd = workspaceDir(WS_STORE);
+    if (fd == -1) return -1;
+    if ((mkdirat(fd, SNAP_DIR, 0700) == -1 && errno != EEXIST) ||
+        (mkdirat(fd, CHUNK_DIR, 0700) == -1 && errno != EEXIST)) {
+        perror(wsItems[WS_STORE].name);
+        return -1;
+    }
+    return fd;
+}
+
+int compareNames(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Sorted snapshot ids; the caller frees each and the array
+char **listSnapshots(int storeFd, size_t *count) {
+    *count = 0;
+    int fd = openat(storeFd, SNAP_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        if (fd != -1) close(fd);
+        return NULL;
+    }
+    char **ids = NULL;
+    size_t cap = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 16;
+            char **n = realloc(ids, cap * sizeof(char *));
+            if (n == NULL) break;
+            ids = n;
+        }
+        ids[(*count)++] = strdup(de->d_name);
+    }
+    closedir(dir);
+    if (*count > 0) qsort(ids, *count, sizeof(char *), compareNames);
+    return ids;
+}
+
+// Read a whole manifest; NULL if it does not exist or is not a snapshot
+char *readManifest(int storeFd, const char *id, size_t *len) {
+    if (strchr(id, '/') != NULL || id[0] == '.') {
+        errno = ENOENT;
+        return NULL;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), SNAP_DIR "/%s", id);
+    int fd = openat(storeFd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    struct stat st;
+    char *text = NULL;
+    if (fstat(fd, &st) == 0 && (text = malloc(st.st_size + 1)) != NULL) {
+        if (pread(fd, text, st.st_size, 0) != st.st_size || strncmp(text, "csnap\t1\t", 8) != 0) {
+            free(text);
+            text = NULL;
+            errno = EINVAL;
+        } else {
+            text[st.st_size] = '\0';
+            if (len) *len = st.st_size;
+        }
+    }
+    close(fd);
+    return text;
+}
+
+// Index the f records of the newest snapshot so unchanged files can reuse them
+void loadPrevSnapshot(int storeFd, SnapPrev *p) {
+    memset(p, 0, sizeof(*p));
+    size_t n;
+    char **ids = listSnapshots(storeFd, &n);
+    if (n > 0) p->text = readManifest(storeFd, ids[n - 1], NULL);
+    for (size_t i = 0; i < n; i++) free(ids[i]);
+    free(ids);
+    if (p->text == NULL) return;
+
+    size_t cap = 0;
+    char *line = p->text;
+    while (*line) {
+        char *eol = strchr(line, '\n');
+        char *next = eol ? eol + 1 : line + strlen(line);
+        if (line[0] == 'f' && line[1] == '\t') {
+            // record = this line and the c lines after it
+            char *end = next;
+            while (end[0] == 'c' && end[1] == '\t') {
+                char *e = strchr(end, '\n');
+                end = e ? e + 1 : end + strlen(end);
+            }
+            char *name = line;
+            for (int tabs = 0; tabs < 6 && name < next; name++)
+                if (*name == '\t') tabs++;
+            if (p->count == cap) {
+                cap = cap ? cap * 2 : 1024;
+                char **np = realloc(p->paths, cap * sizeof(char *));
+                char **nr = np ? realloc(p->records, cap * sizeof(char *)) : NULL;
+                size_t *nl = nr ? realloc(p->recLens, cap * sizeof(size_t)) : NULL;
+                if (np) p->paths = np;
+                if (nr) p->records = nr;
+                if (nl == NULL) break;
+                p->recLens = nl;
+            }
+            size_t plen = next - name - (eol ? 1 : 0);
+            char *path = malloc(plen + 1);
+            if (path == NULL) break;
+            memcpy(path, name, plen);
+            path[plen] = '\0';
+            snapUnescape(path);
+            p->paths[p->count] = path;
+            p->records[p->count] = line;
+            p->recLens[p->count++] = end - line;
+            next = end;
+        }
+        line = next;
+    }
+
+    // manifests are written sorted; anything else is not trusted for reuse
+    for (size_t i = 1; i < p->count; i++) {
+        if (strcmp(p->paths[i - 1], p->paths[i]) >= 0) {
+            for (size_t j = 0; j < p->count; j++) free(p->paths[j]);
+            p->count = 0;
+            break;
+        }
+    }
+}
+
+void freePrevSnapshot(SnapPrev *p) {
+    for (size_t i = 0; i < p->count; i++) free(p->paths[i]);
+    free(p->paths);
+    free(p->records);
+    free(p->recLens);
+    free(p->text);
+}
+
+int compareRecords(const void *a, const void *b) {
+    return strcmp(((const SnapRecord *)a)->path, ((const SnapRecord *)b)->path);
+}
+
+// Create a snapshot of srcFd; returns 0 on success
+int snapshotCreate(int srcFd, int storeFd) {
+    pthread_once(&gearOnce, initGearTable);
+    WorkPool pool;
+    if (poolStart(&pool, 0) == -1) {
+        fprintf(stderr, "secure_backup: cannot start worker threads\n");
+        return 1;
+    }
+
+    SnapJob job;
+    memset(&job, 0, sizeof(job));
+    job.pool = &pool;
+    job.storeFd = storeFd;
+    pthread_mutex_init(&job.lock, NULL);
+    digestSetInit(&job.seen);
+    loadPrevSnapshot(storeFd, &job.prev);
+    atomic_init(&job.files, 0);
+    atomic_init(&job.reused, 0);
+    atomic_init(&job.bytes, 0);
+    atomic_init(&job.newChunks, 0);
+    atomic_init(&job.newBytes, 0);
+    atomic_init(&job.storedBytes, 0);
+    atomic_init(&job.errors, 0);
+    TreeWalk w = {.pool = &pool, .rootFd = srcFd, .name = "secure_backup",
+                  .onDir = snapDir, .onFile = snapFile, .ctx = &job};
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    walkTree(&w);
+    poolStop(&pool);
+
+    long long errors = atomic_load(&job.errors) + atomic_load(&w.errors);
+    int status = 1;
+    char id[64], path[PATH_MAX], tmp[PATH_MAX];
+    if (interruptRequested()) {
+        // chunks already stored are reused by the next run
+        printf("secure_backup: interrupted, snapshot not written\n");
+        status = 130;
+        goto out;
+    }
+    if (errors > 0) {
+        printf("secure_backup: %lld errors, snapshot not written\n", errors);
+        goto out;
+    }
+
+    qsort(job.records, job.nrecords, sizeof(SnapRecord), compareRecords);
+
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(id, sizeof(id), "%Y%m%d-%H%M%S", &tm);
+    snprintf(path, sizeof(path), SNAP_DIR "/%s", id);
+    for (int n = 2; faccessat(storeFd, path, F_OK, 0) == 0; n++) {
+        size_t base = strlen("YYYYmmdd-HHMMSS");
+        snprintf(id + base, sizeof(id) - base, "-%03d", n);
+        snprintf(path, sizeof(path), SNAP_DIR "/%s", id);
+    }
+    snprintf(tmp, sizeof(tmp), SNAP_DIR "/.%s.tmp", id);
+
+    // Chunks are written without an fsync each. One syncfs makes them and
+    // their directory entries durable before a manifest can refer to them.
+    if (syncfs(storeFd) != 0) {
+        perror("secure_backup: syncfs");
+        goto out;
+    }
+    int fd = openat(storeFd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *out = fd == -1 ? NULL : fdopen(fd, "w");
+    if (out == NULL) {
+        perror("secure_backup");
+        if (fd != -1) close(fd);
+        goto out;
+    }
+    fprintf(out, "csnap\t1\t%lld\t%lld\t%lld\n", (long long)now,
+            (long long)atomic_load(&job.files), (long long)atomic_load(&job.bytes));
+    for (size_t i = 0; i < job.nrecords; i++)
+        fwrite(job.records[i].text, 1, job.records[i].len, out);
+    if (fflush(out) != 0 || fdatasync(fileno(out)) != 0 || fclose(out) != 0 ||
+        renameat(storeFd, tmp, storeFd, path) != 0) {
+        perror("secure_backup");
+        unlinkat(storeFd, tmp, 0);
+        goto out;
+    }
+    int dirFd = openat(storeFd, SNAP_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd == -1 || fsync(dirFd) != 0) {
+        perror("secure_backup: " SNAP_DIR);
+        if (dirFd != -1) close(dirFd);
+        goto out;
+    }
+    close(dirFd);
+    status = 0;
+
+    double secs = elapsedSince(&start);
+    if (secs <= 0) secs = 1e-9;
+    long long bytes = atomic_load(&job.bytes);
+    printf("secure_backup: snapshot %s: %lld files (%lld unchanged), %.1f MB in %.2fs (%.1f MB/s)\n",
+           id, (long long)atomic_load(&job.files), (long long)atomic_load(&job.reused),
+           bytes / 1e6, secs, bytes / 1e6 / secs);
+    printf("secure_backup: %lld new chunks, %.1f MB stored as %.1f MB (%d threads)\n",
+           (long long)atomic_load(&job.newChunks), atomic_load(&job.newBytes) / 1e6,
+           atomic_load(&job.storedBytes) / 1e6, pool.nthreads);
+out:
+    for (size_t i = 0; i < job.nrecords; i++) {
+        free(job.records[i].path);
+        free(job.records[i].text);
+    }
+    free(job.records);
+    freePrevSnapshot(&job.prev);
+    digestSetFree(&job.seen);
+    pthread_mutex_destroy(&job.lock);
+    return status;
+}
+
+// Verifying: each distinct chunk is read back, decompressed and rehashed
+
+typedef struct VerifyTask {
+    int storeFd;
+    int n;
+    unsigned char digest[WALK_BATCH][SHA256_DIGEST_LENGTH];
+    uint32_t len[WALK_BATCH];
+    atomic_llong *ok, *bad, *missing;
+} VerifyTask;
+
+void verifyChunksTask(void *arg) {
+    VerifyTask *t = arg;
+    unsigned char *buf = malloc(CDC_MAX);
+    for (int i = 0; i < t->n && !interruptRequested(); i++) {
+        char hex[2 * SHA256_DIGEST_LENGTH + 1];
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        hexDigest(t->digest[i], hex);
+        int rc = buf == NULL || t->len[i] > CDC_MAX ? -2 : readChunk(t->storeFd, hex, buf, t->len[i]);
+        if (rc == 0) {
+            SHA256(buf, t->len[i], digest);
+            if (memcmp(digest, t->digest[i], SHA256_DIGEST_LENGTH) != 0) rc = -2;
+        }
+        if (rc == 0) {
+            atomic_fetch_add(t->ok, 1);
+        } else {
+            printf("secure_verify: chunk %s %s\n", hex, rc == -1 ? "missing" : "damaged");
+            atomic_fetch_add(rc == -1 ? t->missing : t->bad, 1);
+        }
+    }
+    free(buf);
+    free(t);
+}
+
+int parseDigest(const char *hex, unsigned char *out) {
+    if (strlen(hex) != 2 * SHA256_DIGEST_LENGTH) return -1;
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        if (!isxdigit((unsigned char)hex[2 * i]) || !isxdigit((unsigned char)hex[2 * i + 1])) return -1;
+        char h[3] = {hex[2 * i], hex[2 * i + 1], 0};
+        out[i] = (unsigned char)strtol(h, NULL, 16);
+    }
+    return 0;
+}
+
+// Add the chunks referenced by a manifest to set; -1 if it is malformed
+int collectChunks(char *text, DigestSet *set) {
+    char *rest = text, *line;
+    while ((line = strsep(&rest, "\n")) != NULL) {
+        char *f[3];
+        unsigned char d[SHA256_DIGEST_LENGTH];
+        if (line[0] != 'c' || line[1] != '\t') continue;
+        if (splitFields(line, f, 3) != 3 || parseDigest(f[1], d) != 0) return -1;
+        if (digestSetAdd(set, d, (uint32_t)strtoul(f[2], NULL, 10)) < 0) return -1;
+    }
+    return 0;
+}
+
+// Restoring: directories are created up front, then files are rebuilt
+// from their chunks as pool tasks
+
+typedef struct RestoreJob {
+    int storeFd, dstFd;
+    atomic_llong files, bytes, errors;
+} RestoreJob;
+
+typedef struct RestoreTask {
+    RestoreJob *job;
+    char *path;
+    mode_t mode;
+    struct timespec mtime;
+    int nchunks;
+    char **chunks; // "c" lines, split in place
+} RestoreTask;
+
+void restoreFileTask(void *arg) {
+    RestoreTask *t = arg;
+    RestoreJob *job = t->job;
+    if (interruptRequested()) {
+        free(t->chunks);
+        free(t);
+        return;
+    }
+    unsigned char *buf = malloc(CDC_MAX);
+    long long bytes = 0;
+    int fd = openat(job->dstFd, t->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+    int ok = fd != -1 && buf != NULL;
+    for (int i = 0; ok && i < t->nchunks; i++) {
+        char *f[3];
+        if (splitFields(t->chunks[i], f, 3) != 3) {
+            ok = 0;
+            break;
+        }
+        uint32_t len = (uint32_t)strtoul(f[2], NULL, 10);
+        ok = len <= CDC_MAX && readChunk(job->storeFd, f[1], buf, len) == 0 &&
+             writeFully(fd, buf, len) == len;
+        bytes += len;
+    }
+    if (ok) {
+        struct timespec times[2] = {t->mtime, t->mtime};
+        fchmod(fd, t->mode);
+        futimens(fd, times);
+        atomic_fetch_add(&job->files, 1);
+        atomic_fetch_add(&job->bytes, bytes);
+    } else {
+        fprintf(stderr, "secure_restore: %s: %s\n", t->path, errno ? strerror(errno) : "bad chunk");
+        atomic_fetch_add(&job->errors, 1);
+    }
+    if (fd != -1) close(fd);
+    free(buf);
+    free(t->chunks);
+    free(t);
+}
+
+// Restore snapshot text (already read) into dstFd; returns 0 on success
+int snapshotRestore(char *text, int storeFd, int dstFd) {
+    WorkPool pool;
+    if (poolStart(&pool, 0) == -1) {
+        fprintf(stderr, "secure_restore: cannot start worker threads\n");
+        return 1;
+    }
+    RestoreJob job = {.storeFd = storeFd, .dstFd = dstFd};
+    atomic_init(&job.files, 0);
+    atomic_init(&job.bytes, 0);
+    atomic_init(&job.errors, 0);
+
+    // directory times are set last, after their contents are written
+    char **dirs = NULL;
+    size_t ndirs = 0, capDirs = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char *rest = strchr(text, '\n');
+    rest = rest ? rest + 1 : NULL;
+    char *line;
+    while ((line = strsep(&rest, "\n")) != NULL) {
+        char *f[7];
+        int n = splitFields(line, f, 7);
+        if (f[0][0] == 'd' && n == 5) {
+            snapUnescape(f[4]);
+            if (mkdirat(dstFd, f[4], 0700) == -1 && errno != EEXIST) {
+                fprintf(stderr, "secure_restore: %s: %s\n", f[4], strerror(errno));
+                atomic_fetch_add(&job.errors, 1);
+                continue;
+            }
+            if (ndirs == capDirs) {
+                capDirs = capDirs ? capDirs * 2 : 64;
+                char **d = realloc(dirs, capDirs * sizeof(char *));
+                if (d == NULL) continue;
+                dirs = d;
+            }
+            dirs[ndirs++] = f[1]; // mode, sec, nsec and path follow each other in text
+        } else if (f[0][0] == 'l' && n == 5) {
+            snapUnescape(f[3]);
+            snapUnescape(f[4]);
+            unlinkat(dstFd, f[3], 0);
+            if (symlinkat(f[4], dstFd, f[3]) == -1) {
+                fprintf(stderr, "secure_restore: %s: %s\n", f[3], strerror(errno));
+                atomic_fetch_add(&job.errors, 1);
+                continue;
+            }
+            struct timespec times[2] = {{atoll(f[1]), atol(f[2])}, {atoll(f[1]), atol(f[2])}};
+            utimensat(dstFd, f[3], times, AT_SYMLINK_NOFOLLOW);
+            atomic_fetch_add(&job.files, 1);
+        } else if (f[0][0] == 'f' && n == 7) {
+            RestoreTask *t = malloc(sizeof(RestoreTask));
+            int nchunks = atoi(f[5]);
+            char **chunks = malloc((nchunks > 0 ? nchunks : 1) * sizeof(char *));
+            if (t == NULL || chunks == NULL) {
+                free(t);
+                free(chunks);
+                atomic_fetch_add(&job.errors, 1);
+                break;
+            }
+            snapUnescape(f[6]);
+            *t = (RestoreTask){&job, f[6], (mode_t)strtoul(f[1], NULL, 8),
+                               {atoll(f[2]), atol(f[3])}, 0, chunks};
+            while (t->nchunks < nchunks && rest != NULL && rest[0] == 'c')
+                t->chunks[t->nchunks++] = strsep(&rest, "\n");
+            if (t->nchunks != nchunks) t->nchunks = -1;
+            if (t->nchunks < 0) {
+                fprintf(stderr, "secure_restore: %s: truncated manifest\n", f[6]);
+                atomic_fetch_add(&job.errors, 1);
+                free(chunks);
+                free(t);
+                continue;
+            }
+            poolSubmit(&pool, restoreFileTask, t);
+        }
+    }
+    poolStop(&pool);
+
+    // deepest first, so setting a child's time does not disturb its parent
+    for (size_t i = ndirs; i-- > 0;) {
+        char *mode = dirs[i];
+        char *sec = mode + strlen(mode) + 1;
+        char *nsec = sec + strlen(sec) + 1;
+        char *path = nsec + strlen(nsec) + 1;
+        struct timespec times[2] = {{atoll(sec), atol(nsec)}, {atoll(sec), atol(nsec)}};
+        fchmodat(dstFd, path, (mode_t)strtoul(mode, NULL, 8), 0);
+        utimensat(dstFd, path, times, AT_SYMLINK_NOFOLLOW);
+    }
+    free(dirs);
+
+    double secs = elapsedSince(&start);
+    if (secs <= 0) secs = 1e-9;
+    long long bytes = atomic_load(&job.bytes), errors = atomic_load(&job.errors);
+    printf("secure_restore: %lld files, %.1f MB in %.2fs (%.1f MB/s)\n",
+           (long long)atomic_load(&job.files), bytes / 1e6, secs, bytes / 1e6 / secs);
+    if (errors > 0) printf("secure_restore: %lld errors\n", errors);
+    if (interruptRequested()) return 130;
+    return errors > 0;
+}
+
+// ===== Parallel delete =====
+// removeTree deletes a directory tree without a shell or rm. Every
+// directory is scanned by its own pool task, which unlinks its files
+// through the open directory fd and queues its subdirectories, so wide
+// trees are spread over the workers by work stealing. A directory counts
+// its unfinished children; the task that finishes the last one removes it
+// and reports to the parent, so directories go bottom-up without a second
+// pass. With dryRun nothing is removed, only counted.
+
+typedef struct DelJob {
+    WorkPool *pool;
+    int rootFd;
+    int dryRun;
+    const char *name;
+    atomic_llong files, dirs, errors;
+} DelJob;
+
+typedef struct DelDir {
+    DelJob *job;
+    struct DelDir *parent;
+    char *rel;         // relative to rootFd
+    atomic_int pending; // unfinished subdirectories, plus one for the scan
+} DelDir;
+
+void delError(DelJob *job, const char *rel, const char *what) {
+    fprintf(stderr, "%s: %s: %s: %s\n", job->name, rel, what, strerror(errno));
+    atomic_fetch_add(&job->errors, 1);
+}
+
+// One reference to d is finished; remove it (and then its parents) when
+// nothing under it is left
+void delRelease(DelDir *d) {
+    while (d != NULL && atomic_fetch_sub(&d->pending, 1) == 1) {
+        DelJob *job = d->job;
+        if (interruptRequested()) {
+            // stopped by Ctrl-C: what is left under d stays
+        } else if (job->dryRun || unlinkat(job->rootFd, d->rel, AT_REMOVEDIR) == 0) {
+            atomic_fetch_add(&job->dirs, 1);
+        } else if (errno != ENOTEMPTY || atomic_load(&job->errors) == 0) {
+            // ENOTEMPTY after an earlier error is that error again
+            delError(job, d->rel, "rmdir");
+        }
+        DelDir *parent = d->parent;
+        free(d->rel);
+        free(d);
+        d = parent;
+    }
+}
+
+void delDirTask(void *arg) {
+    DelDir *d = arg;
+    DelJob *job = d->job;
+    if (interruptRequested()) {
+        delRelease(d);
+        return;
+    }
+    int fd = openat(job->rootFd, d->rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        delError(job, d->rel, "opendir");
+        if (fd != -1) close(fd);
+        delRelease(d);
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL && !interruptRequested()) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        unsigned char type = de->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN && fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            type = IFTODT(st.st_mode);
+
+        if (type == DT_DIR) {
+            DelDir *child = malloc(sizeof(DelDir));
+            char *rel = joinRel(d->rel, de->d_name);
+            if (child == NULL || rel == NULL) {
+                free(child);
+                free(rel);
+                errno = ENOMEM;
+                delError(job, de->d_name, "scan");
+                continue;
+            }
+            *child = (DelDir){job, d, rel, 1};
+            atomic_fetch_add(&d->pending, 1);
+            poolSubmit(job->pool, delDirTask, child);
+        } else if (job->dryRun || unlinkat(fd, de->d_name, 0) == 0) {
+            atomic_fetch_add(&job->files, 1);
+        } else if (errno != ENOENT) {
+            delError(job, de->d_name, "unlink");
+        }
+    }
+    closedir(dir);
+    delRelease(d);
+}
+
+// Remove parentFd/name and everything under it. Returns 0 on success.
+int removeTree(const char *cmd, int parentFd, const char *name, int dryRun) {
+    WorkPool pool;
+    if (poolStart(&pool, 0) == -1) {
+        fprintf(stderr, "%s: cannot start worker threads\n", cmd);
+        return 1;
+    }
+    DelJob job = {.pool = &pool, .rootFd = parentFd, .dryRun = dryRun, .name = cmd};
+    atomic_init(&job.files, 0);
+    atomic_init(&job.dirs, 0);
+    atomic_init(&job.errors, 0);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    DelDir *root = malloc(sizeof(DelDir));
+    char *rel = strdup(name);
+    if (root == NULL || rel == NULL) {
+        free(root);
+        free(rel);
+        poolStop(&pool);
+        return 1;
+    }
+    *root = (DelDir){&job, NULL, rel, 1};
+    poolSubmit(&pool, delDirTask, root);
+    poolStop(&pool);
+
+    double secs = elapsedSince(&start);
+    if (secs <= 0) secs = 1e-9;
+    long long files = atomic_load(&job.files), errors = atomic_load(&job.errors);
+    printf("%s: %s %lld files and %lld directories in %.2fs (%.0f files/s, %d threads)\n",
+           cmd, dryRun ? "would remove" : "removed", files, (long long)atomic_load(&job.dirs),
+           secs, files / secs, pool.nthreads);
+    if (errors > 0) printf("%s: %lld errors\n", cmd, errors);
+    if (interruptRequested()) return 130;
+    return errors > 0;
+}
+
+// Pattern delete: files whose name matches any of the glob patterns.
+// Matching is fnmatch() with FNM_PERIOD, so like the shell a leading '.'
+// is only matched explicitly.
+
+typedef struct MatchJob {
+    char **patterns;
+    int dryRun;
+    atomic_llong files;
+} MatchJob;
+
+int matchesAny(char **patterns, const char *name) {
+    for (int i = 0; patterns[i] != NULL; i++) {
+        if (fnmatch(patterns[i], name, FNM_PERIOD) == 0) return 1;
+    }
+    return 0;
+}
+
+int skipSubdirs(TreeWalk *w, const char *rel, int fd) {
+    (void)w;
+    (void)rel;
+    (void)fd;
+    return 1;
+}
+
+void removeMatching(TreeWalk *w, const char *rel, unsigned char type) {
+    MatchJob *job = w->ctx;
+    (void)type;
+    const char *base = strrchr(rel, '/');
+    base = base ? base + 1 : rel;
+    if (!matchesAny(job->patterns, base)) return;
+    if (job->dryRun) {
+        printf("%s\n", rel);
+    } else if (unlinkat(w->rootFd, rel, 0) != 0) {
+        if (errno != ENOENT) walkError(w, rel, "unlink");
+        return;
+    }
+    atomic_fetch_add(&job->files, 1);
+}
+
+// Remove files matching patterns under dirFd (only its top level unless
+// recursive). Returns 0 on success.
+int removeMatchingFiles(const char *cmd, int dirFd, char **patterns, int recursive, int dryRun) {
+    WorkPool pool;
+    if (poolStart(&pool, 0) == -1) {
+        fprintf(stderr, "%s: cannot start worker threads\n", cmd);
+        return 1;
+    }
+    MatchJob job = {.patterns = patterns, .dryRun = dryRun};
+    atomic_init(&job.files, 0);
+    TreeWalk w = {.pool = &pool, .rootFd = dirFd, .name = cmd,
+                  .onDir = recursive ? NULL : skipSubdirs, .onFile = removeMatching, .ctx = &job};
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    walkTree(&w);
+    poolStop(&pool);
+
+    double secs = elapsedSince(&start);
+    if (secs <= 0) secs = 1e-9;
+    long long files = atomic_load(&job.files), errors = atomic_load(&w.errors);
+    printf("%s: %s %lld files in %.2fs (%.0f files/s)\n",
+           cmd, dryRun ? "would remove" : "removed", files, secs, files / secs);
+    if (errors > 0) printf("%s: %lld errors\n", cmd, errors);
+    if (interruptRequested()) return 130;
+    return errors > 0;
+}
+
+// ===== Name index =====
+// find_target answers from a file-name index of the workspace instead of
+// running find. The index is kept in NAMES_FILE as a table of directories
+// (with their mtimes) and a table of (name, directory) entries sorted by
+// name, so an exact name or a glob with a literal prefix is a binary
+// search into the mapped file.
+//
+// While the shell runs, every indexed directory has an inotify watch. A
+// directory that reports a change is re-read and its entries are held in
+// memory in place of the ones in the file; once those replacements grow
+// past an eighth of the index it is rewritten. When the watches cannot be
+// set up (too many directories for fs.inotify.max_user_watches) each query
+// falls back to comparing every directory's mtime with the index, which is
+// still far cheaper than reading every directory. The same check runs
+// once when a saved index is loaded, to catch changes made while no shell
+// was watching.
+
+#define NAMES_FILE ".custom_shell_names"
+#define NAMES_MAGIC 0x454d414e // "NAME"
+#define NAMES_VERSION 1
+#define NAMES_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                          IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct NamesHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ndirs;
+    uint32_t nentries;
+    uint64_t strBytes;
+} NamesHeader;
+
+typedef struct NamesDirRec {
+    uint32_t path; // offset in the string pool
+    uint32_t pad;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+} NamesDirRec;
+
+typedef struct NamesEntry {
+    uint32_t name; // offset in the string pool
+    uint32_t dir;
+} NamesEntry;
+
+typedef struct NameDir {
+    char *rel;       // "." for the workspace root
+    int ownsRel;     // rel is heap memory rather than part of the map
+    struct timespec mtime;
+    int wd;          // inotify watch, or -1
+    int stale;       // the file's entries for this directory are out of date;
+    char **list;     // these replace them
+    int nlist;
+    int gone;
+    int queued;      // waiting for a rescan
+} NameDir;
+
+static struct {
+    int loaded;
+    int inotifyFd;
+    int watching;        // every live directory has a watch
+    char rootPath[PATH_MAX];
+    void *map;
+    size_t mapLen;
+    const NamesEntry *entries;
+    uint32_t nentries;
+    uint32_t baseDirs;   // directories the file's entries refer to
+    const char *strings;
+    NameDir *dirs;
+    int ndirs, capDirs;
+    int *slots;          // open addressing on rel: dir id + 1, or 0
+    int nslots;
+    int *wdDirs;         // inotify wd -> dir id + 1
+    int nwd;
+    long staleNames;
+    int dirty;           // directories were added since the last save
+    int npending;        // directories queued while there was no pool
+    pthread_mutex_t lock; // dirs and slots while scanning on the pool
+    WorkPool *pool;
+} names = {.inotifyFd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+int namesFindDir(const char *rel) {
+    if (names.nslots == 0) return -1;
+    unsigned i = hashString(rel) & (names.nslots - 1);
+    while (names.slots[i]) {
+        int id = names.slots[i] - 1;
+        if (strcmp(names.dirs[id].rel, rel) == 0) return id;
+        i = (i + 1) & (names.nslots - 1);
+    }
+    return -1;
+}
+
+void namesRehash() {
+    int n = 1024;
+    while (n < names.ndirs * 2) n <<= 1;
+    int *slots = calloc(n, sizeof(int));
+    if (slots == NULL) return;
+    free(names.slots);
+    names.slots = slots;
+    names.nslots = n;
+    for (int id = 0; id < names.ndirs; id++) {
+        unsigned i = hashString(names.dirs[id].rel) & (n - 1);
+        while (slots[i]) i = (i + 1) & (n - 1);
+        slots[i] = id + 1;
+    }
+}
+
+void namesMarkGone(int id);
+
+void namesWatch(int id) {
+    if (!names.watching) return;
+    char path[PATH_MAX * 2];
+    snprintf(path, sizeof(path), "%s/%s", names.rootPath, names.dirs[id].rel);
+    int wd = inotify_add_watch(names.inotifyFd, path, NAMES_WATCH_MASK);
+    if (wd == -1) {
+        if (errno == ENOSPC || errno == ENOMEM) {
+            // out of watches: fall back to mtime checks on every query
+            names.watching = 0;
+            close(names.inotifyFd);
+            names.inotifyFd = -1;
+            for (int i = 0; i < names.ndirs; i++) names.dirs[i].wd = -1;
+        }
+        return;
+    }
+    if (wd >= names.nwd) {
+        int n = names.nwd ? names.nwd : 1024;
+        while (n <= wd) n *= 2;
+        int *w = realloc(names.wdDirs, n * sizeof(int));
+        if (w == NULL) return;
+        memset(w + names.nwd, 0, (n - names.nwd) * sizeof(int));
+        names.wdDirs = w;
+        names.nwd = n;
+    }
+    // inotify hands back the existing watch when the inode is already
+    // watched: the directory was moved here from its old path
+    int old = names.wdDirs[wd] - 1;
+    if (old >= 0 && old != id && !names.dirs[old].gone) namesMarkGone(old);
+    names.wdDirs[wd] = id + 1;
+    names.dirs[id].wd = wd;
+}
+
+// Register a directory; the caller holds names.lock. Returns its id.
+int namesAddDir(char *rel) {
+    if (names.ndirs == names.capDirs) {
+        int cap = names.capDirs ? names.capDirs * 2 : 1024;
+        NameDir *d = realloc(names.dirs, cap * sizeof(NameDir));
+        if (d == NULL) return -1;
+        names.dirs = d;
+        names.capDirs = cap;
+    }
+    int id = names.ndirs++;
+    names.dirs[id] = (NameDir){.rel = rel, .ownsRel = 1, .wd = -1, .stale = 1};
+    names.dirty = 1;
+    if (names.ndirs * 2 > names.nslots) {
+        namesRehash();
+    } else {
+        unsigned i = hashString(rel) & (names.nslots - 1);
+        while (names.slots[i]) i = (i + 1) & (names.nslots - 1);
+        names.slots[i] = id + 1;
+    }
+    return id;
+}
+
+void namesSetList(NameDir *d, char **list, int n) {
+    if (d->stale) {
+        names.staleNames -= d->nlist;
+        for (int i = 0; i < d->nlist; i++) free(d->list[i]);
+        free(d->list);
+    }
+    d->stale = 1;
+    d->list = list;
+    d->nlist = n;
+    names.staleNames += n;
+}
+
+// A directory and everything below it disappeared (removed or moved away)
+void namesMarkGone(int id) {
+    const char *rel = names.dirs[id].rel;
+    size_t len = strlen(rel);
+    for (int i = 0; i < names.ndirs; i++) {
+        NameDir *d = &names.dirs[i];
+        if (i == id || (strncmp(d->rel, rel, len) == 0 && d->rel[len] == '/') ||
+            strcmp(rel, ".") == 0) {
+            d->gone = 1;
+            namesSetList(d, NULL, 0);
+            names.dirty = 1;
+        }
+    }
+}
+
+void namesScanTask(void *arg);
+
+// Without a pool the scan waits for namesRefresh to start one
+void namesQueueScan(int id) {
+    names.dirs[id].queued = 1;
+    if (names.pool != NULL) poolSubmit(names.pool, namesScanTask, (void *)(intptr_t)id);
+    else names.npending++;
+}
+
+// Re-read one directory. New (or returning) subdirectories are registered
+// and scanned in turn, on the pool.
+void namesScanTask(void *arg) {
+    int id = (int)(intptr_t)arg;
+    pthread_mutex_lock(&names.lock);
+    char *rel = names.dirs[id].rel;
+    pthread_mutex_unlock(&names.lock);
+
+    char **list = NULL;
+    int n = 0, cap = 0;
+    struct stat st;
+    int fd = openat(workspaceRoot(), rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        if (fd != -1) close(fd);
+        pthread_mutex_lock(&names.lock);
+        names.dirs[id].queued = 0;
+        if (errno == ENOENT || errno == ENOTDIR) namesMarkGone(id);
+        pthread_mutex_unlock(&names.lock);
+        return;
+    }
+    fstat(fd, &st);
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 32;
+            char **l = realloc(list, cap * sizeof(char *));
+            if (l == NULL) break;
+            list = l;
+        }
+        char *name = strdup(de->d_name);
+        if (name == NULL) break;
+        list[n++] = name;
+
+        unsigned char type = de->d_type;
+        struct stat cst;
+        if (type == DT_UNKNOWN && fstatat(fd, de->d_name, &cst, AT_SYMLINK_NOFOLLOW) == 0)
+            type = IFTODT(cst.st_mode);
+        if (type != DT_DIR) continue;
+
+        char *sub = joinRel(rel, de->d_name);
+        if (sub == NULL) continue;
+        pthread_mutex_lock(&names.lock);
+        int child = namesFindDir(sub);
+        if (child == -1) {
+            child = namesAddDir(sub);
+            sub = NULL;
+        } else if (names.dirs[child].gone) {
+            names.dirs[child].gone = 0; // moved back, or re-created
+        } else {
+            child = -1; // known and alive: its own watch or mtime covers it
+        }
+        if (child != -1 && !names.dirs[child].queued) {
+            namesWatch(child);
+            namesQueueScan(child);
+        }
+        pthread_mutex_unlock(&names.lock);
+        free(sub);
+    }
+    closedir(dir);
+
+    pthread_mutex_lock(&names.lock);
+    NameDir *d = &names.dirs[id];
+    d->mtime = st.st_mtim;
+    d->gone = 0;
+    d->queued = 0;
+    namesSetList(d, list, n);
+    pthread_mutex_unlock(&names.lock);
+}
+
+// Compare every directory's mtime with the index and queue the changed ones
+typedef struct NamesCheckTask {
+    int first, last;
+} NamesCheckTask;
+
+void namesCheckTask(void *arg) {
+    NamesCheckTask *t = arg;
+    for (int id = t->first; id < t->last; id++) {
+        pthread_mutex_lock(&names.lock);
+        NameDir d = names.dirs[id];
+        pthread_mutex_unlock(&names.lock);
+        if (d.gone) continue;
+
+        struct stat st;
+        int ok = fstatat(workspaceRoot(), d.rel, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        if (ok && st.st_mtim.tv_sec == d.mtime.tv_sec && st.st_mtim.tv_nsec == d.mtime.tv_nsec)
+            continue;
+        pthread_mutex_lock(&names.lock);
+        if (!ok) namesMarkGone(id);
+        else if (!names.dirs[id].queued) namesQueueScan(id);
+        pthread_mutex_unlock(&names.lock);
+    }
+    free(t);
+}
+
+void namesCheckAll() {
+    int n = names.ndirs; // directories found by the rescans are scanned anyway
+    for (int first = 0; first < n; first += 256) {
+        NamesCheckTask *t = malloc(sizeof(NamesCheckTask));
+        if (t == NULL) break;
+        t->first = first;
+        t->last = first + 256 < n ? first + 256 : n;
+        poolSubmit(names.pool, namesCheckTask, t);
+    }
+}
+
+// Apply queued inotify events. Returns -1 if events were lost.
+int namesDrainEvents() {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    int lost = 0;
+    while ((len = read(names.inotifyFd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                lost = 1;
+                continue;
+            }
+            pthread_mutex_lock(&names.lock); // scans queued here are already running
+            if (ev->wd < 0 || ev->wd >= names.nwd || names.wdDirs[ev->wd] == 0) {
+                pthread_mutex_unlock(&names.lock);
+                continue;
+            }
+            int id = names.wdDirs[ev->wd] - 1;
+            if (ev->len > 0 && strcmp(names.dirs[id].rel, ".") == 0 &&
+                strncmp(ev->name, NAMES_FILE, strlen(NAMES_FILE)) == 0) {
+                // the index being saved; rescanning for it would save it again
+                pthread_mutex_unlock(&names.lock);
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                names.wdDirs[ev->wd] = 0;
+                names.dirs[id].wd = -1;
+            } else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                // the watch may already have followed the directory to
+                // its new path; only an empty old path means it is gone
+                struct stat st;
+                if (fstatat(workspaceRoot(), names.dirs[id].rel, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+                    !S_ISDIR(st.st_mode))
+                    namesMarkGone(id);
+            } else if (!names.dirs[id].queued && !names.dirs[id].gone) {
+                namesQueueScan(id);
+            }
+            pthread_mutex_unlock(&names.lock);
+        }
+    }
+    return lost ? -1 : 0;
+}
+
+void namesUnmap() {
+    if (names.map != NULL) munmap(names.map, names.mapLen);
+    names.map = NULL;
+    names.entries = NULL;
+    names.nentries = 0;
+    names.baseDirs = 0;
+}
+
+// Map NAMES_FILE and take its directory table. Returns 0 on success.
+int namesLoad() {
+    int fd = openat(workspaceRoot(), NAMES_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(NamesHeader))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const NamesHeader *h = map;
+    size_t need = sizeof(NamesHeader) + (size_t)h->ndirs * sizeof(NamesDirRec) +
+                  (size_t)h->nentries * sizeof(NamesEntry) + h->strBytes;
+    if (h->magic != NAMES_MAGIC || h->version != NAMES_VERSION || need != (size_t)st.st_size ||
+        h->strBytes == 0 || ((const char *)map)[st.st_size - 1] != '\0') {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    const NamesDirRec *recs = (const NamesDirRec *)(h + 1);
+    const NamesEntry *entries = (const NamesEntry *)(recs + h->ndirs);
+    const char *strings = (const char *)(entries + h->nentries);
+    NameDir *dirs = calloc(h->ndirs ? h->ndirs : 1, sizeof(NameDir));
+    if (dirs == NULL) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    for (uint32_t i = 0; i < h->ndirs; i++) {
+        if (recs[i].path >= h->strBytes) {
+            free(dirs);
+            munmap(map, st.st_size);
+            return -1;
+        }
+        dirs[i] = (NameDir){.rel = (char *)strings + recs[i].path, .wd = -1,
+                            .mtime = {recs[i].mtimeSec, recs[i].mtimeNsec}};
+    }
+    for (uint32_t i = 0; i < h->nentries; i++) {
+        if (entries[i].name >= h->strBytes || entries[i].dir >= h->ndirs) {
+            free(dirs);
+            munmap(map, st.st_size);
+            return -1;
+        }
+    }
+
+    names.map = map;
+    names.mapLen = st.st_size;
+    names.entries = entries;
+    names.nentries = h->nentries;
+    names.baseDirs = h->ndirs;
+    names.strings = strings;
+    names.dirs = dirs;
+    names.ndirs = names.capDirs = h->ndirs;
+    namesRehash();
+    return 0;
+}
+
+typedef struct NameRef {
+    const char *name;
+    uint32_t dir;
+} NameRef;
+
+int compareNameRefs(const void *a, const void *b) {
+    return strcmp(((const NameRef *)a)->name, ((const NameRef *)b)->name);
+}
+
+// Write the current view (file entries of unchanged directories plus the
+// in-memory lists) as a new NAMES_FILE and switch to it
+int namesSave() {
+    int *newId = malloc((names.ndirs ? names.ndirs : 1) * sizeof(int));
+    size_t cap = names.staleNames + names.nentries + 1;
+    NameRef *refs = malloc(cap * sizeof(NameRef));
+    if (newId == NULL || refs == NULL) {
+        free(newId);
+        free(refs);
+        return -1;
+    }
+
+    uint32_t ndirs = 0;
+    uint64_t strBytes = 0;
+    for (int i = 0; i < names.ndirs; i++) {
+        newId[i] = names.dirs[i].gone ? -1 : (int)ndirs++;
+        if (newId[i] >= 0) strBytes += strlen(names.dirs[i].rel) + 1;
+    }
+    size_t n = 0;
+    for (uint32_t i = 0; i < names.nentries; i++) {
+        uint32_t dir = names.entries[i].dir;
+        if (dir >= names.baseDirs || names.dirs[dir].stale || newId[dir] < 0) continue;
+        refs[n++] = (NameRef){names.strings + names.entries[i].name, newId[dir]};
+    }
+    for (int i = 0; i < names.ndirs; i++) {
+        if (!names.dirs[i].stale || newId[i] < 0) continue;
+        for (int j = 0; j < names.dirs[i].nlist; j++)
+            refs[n++] = (NameRef){names.dirs[i].list[j], newId[i]};
+    }
+    qsort(refs, n, sizeof(NameRef), compareNameRefs);
+    for (size_t i = 0; i < n; i++) strBytes += strlen(refs[i].name) + 1;
+
+    NamesHeader h = {NAMES_MAGIC, NAMES_VERSION, ndirs, (uint32_t)n, strBytes};
+    size_t total = sizeof(h) + ndirs * sizeof(NamesDirRec) + n * sizeof(NamesEntry) + strBytes;
+    char *out = malloc(total);
+    int status = -1;
+    if (out == NULL || strBytes > UINT32_MAX) goto done;
+
+    memcpy(out, &h, sizeof(h));
+    NamesDirRec *recs = (NamesDirRec *)(out + sizeof(h));
+    NamesEntry *entries = (NamesEntry *)(recs + ndirs);
+    char *pool = (char *)(entries + n);
+    uint32_t off = 0;
+    for (int i = 0; i < names.ndirs; i++) {
+        if (newId[i] < 0) continue;
+        size_t len = strlen(names.dirs[i].rel) + 1;
+        recs[newId[i]] = (NamesDirRec){off, 0, names.dirs[i].mtime.tv_sec, names.dirs[i].mtime.tv_nsec};
+        memcpy(pool + off, names.dirs[i].rel, len);
+        off += len;
+    }
+    for (size_t i = 0; i < n; i++) {
+        size_t len = strlen(refs[i].name) + 1;
+        entries[i] = (NamesEntry){off, refs[i].dir};
+        memcpy(pool + off, refs[i].name, len);
+        off += len;
+    }
+
+    int fd = openat(workspaceRoot(), NAMES_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) goto done;
+    if (writeFully(fd, out, total) != total || close(fd) != 0 ||
+        renameat(workspaceRoot(), NAMES_FILE ".tmp", workspaceRoot(), NAMES_FILE) != 0) {
+        unlinkat(workspaceRoot(), NAMES_FILE ".tmp", 0);
+        goto done;
+    }
+
+    // switch to the new file, keeping the watches of the live directories
+    NameDir *old = names.dirs;
+    int oldCount = names.ndirs;
+    void *oldMap = names.map;
+    size_t oldLen = names.mapLen;
+    names.map = NULL;
+    names.dirs = NULL;
+    names.ndirs = names.capDirs = 0;
+    if (namesLoad() != 0) {
+        names.map = oldMap;
+        names.mapLen = oldLen;
+        names.dirs = old;
+        names.ndirs = names.capDirs = oldCount;
+        goto done;
+    }
+    for (int i = 0; i < oldCount; i++) {
+        // a gone directory's watch may belong to its new path by now
+        if (newId[i] < 0 && old[i].wd >= 0 && names.wdDirs[old[i].wd] == i + 1) {
+            inotify_rm_watch(names.inotifyFd, old[i].wd);
+            names.wdDirs[old[i].wd] = 0;
+        }
+    }
+    for (int i = 0; i < oldCount; i++) {
+        int id = newId[i];
+        if (id >= 0) {
+            names.dirs[id].wd = old[i].wd;
+            if (old[i].wd >= 0) names.wdDirs[old[i].wd] = id + 1;
+        }
+        if (old[i].stale) {
+            for (int j = 0; j < old[i].nlist; j++) free(old[i].list[j]);
+            free(old[i].list);
+        }
+        if (old[i].ownsRel) free(old[i].rel);
+    }
+    free(old);
+    if (oldMap != NULL) munmap(oldMap, oldLen);
+    names.staleNames = 0;
+    names.dirty = 0;
+    status = 0;
+done:
+    free(out);
+    free(newId);
+    free(refs);
+    return status;
+}
+
+// Bring the index up to date: load or build it on first use, then apply
+// the changes seen since the last query
+void namesRefresh() {
+    // With every directory watched, the events say what changed. A pool is
+    // only started when they left directories to rescan.
+    int lost = 0;
+    if (names.loaded && names.watching) {
+        lost = namesDrainEvents() != 0;
+        if (!lost && names.npending == 0) return;
+    }
+
+    WorkPool pool;
+    if (poolStart(&pool, 0) == -1) return;
+    names.pool = &pool;
+
+    if (!names.loaded) {
+        names.loaded = 1;
+        char link[64];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", workspaceRoot());
+        ssize_t len = readlink(link, names.rootPath, sizeof(names.rootPath) - 1);
+        names.rootPath[len > 0 ? len : 0] = '\0';
+        names.inotifyFd = len > 0 ? keepFdHigh(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) : -1;
+        names.watching = names.inotifyFd != -1;
+
+        if (namesLoad() == 0) {
+            for (int id = 0; id < names.ndirs; id++) namesWatch(id);
+            namesCheckAll();
+        } else {
+            names.slots = NULL;
+            names.nslots = 0;
+            int root = namesAddDir(strdup("."));
+            if (root == 0) {
+                namesWatch(root);
+                namesQueueScan(root);
+            }
+        }
+    } else {
+        pthread_mutex_lock(&names.lock); // rescans may add directories meanwhile
+        for (int id = 0; id < names.ndirs && names.npending > 0; id++) {
+            if (!names.dirs[id].queued) continue;
+            poolSubmit(&pool, namesScanTask, (void *)(intptr_t)id);
+            names.npending--;
+        }
+        names.npending = 0;
+        pthread_mutex_unlock(&names.lock);
+        if (!names.watching || lost) namesCheckAll();
+    }
+    poolStop(&pool);
+    names.pool = NULL;
+
+    if (names.dirty || names.staleNames > (long)names.nentries / 8) namesSave();
+}
+
+typedef struct NameHits {
+    char **paths;
+    size_t count, cap;
+} NameHits;
+
+void addNameHit(NameHits *h, const NameDir *d, const char *name) {
+    if (d->gone) return;
+    if (h->count == h->cap) {
+        size_t cap = h->cap ? h->cap * 2 : 64;
+        char **p = realloc(h->paths, cap * sizeof(char *));
+        if (p == NULL) return;
+        h->paths = p;
+        h->cap = cap;
+    }
+    size_t len = strlen(d->rel) + strlen(name) + 4;
+    char *path = malloc(len);
+    if (path == NULL) return;
+    if (strcmp(d->rel, ".") == 0) snprintf(path, len, "./%s", name);
+    else snprintf(path, len, "./%s/%s", d->rel, name);
+    h->paths[h->count++] = path;
+}
+
+// Every indexed path whose last component matches pattern (a name or glob)
+void namesLookup(const char *pattern, NameHits *hits) {
+    size_t prefix = strcspn(pattern, "*?[\\");
+    int glob = pattern[prefix] != '\0';
+
+    // first entry >= the literal prefix
+    size_t lo = 0, hi = names.nentries;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strncmp(names.strings + names.entries[mid].name, pattern, prefix) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    for (size_t i = lo; i < names.nentries; i++) {
+        const char *name = names.strings + names.entries[i].name;
+        if (strncmp(name, pattern, prefix) != 0) break;
+        const NameDir *d = &names.dirs[names.entries[i].dir];
+        if (d->stale) continue;
+        if (glob ? fnmatch(pattern, name, 0) == 0 : strcmp(name, pattern) == 0) addNameHit(hits, d, name);
+    }
+    for (int id = 0; id < names.ndirs; id++) {
+        const NameDir *d = &names.dirs[id];
+        if (!d->stale) continue;
+        for (int j = 0; j < d->nlist; j++) {
+            const char *name = d->list[j];
+            if (glob ? fnmatch(pattern, name, 0) == 0 : strcmp(name, pattern) == 0) addNameHit(hits, d, name);
+        }
+    }
+}
+
+// ===== Bulk move =====
+// moveEntries moves everything in one directory into another without a
+// shell: the source is read with getdents64 in large batches and each
+// entry is renamed with renameat2(RENAME_NOREPLACE) between the two
+// directory fds, so nothing depends on ARG_MAX or glob expansion and an
+// existing target is never replaced by accident. A name that is taken gets
+// a numbered suffix (a.txt -> a.1.txt) unless the policy says to skip or
+// overwrite it. Across file systems (EXDEV) files are copied under a
+// temporary name, renamed into place and then unlinked, and directories
+// are re-created and moved into recursively. Like the "dir/*" glob it
+// replaces, names starting with '.' stay put, but only at the top: below
+// it a directory is moved whole.
+// Renames within one directory pair serialize on the directory locks in
+// the kernel, so this runs on one thread.
+
+#define MOVE_SUFFIX    0 // rename the incoming entry to a free name
+#define MOVE_SKIP      1 // leave it in the source
+#define MOVE_OVERWRITE 2 // replace the target
+#define MOVE_BUF (1 << 20)
+
+typedef struct MoveJob {
+    const char *name;
+    int policy;
+    CopyJob copy; // for the EXDEV fallback
+    unsigned tmpSeq; // names the copies in progress
+    long long moved, renamed, skipped, copied, errors;
+} MoveJob;
+
+// renameat2 with RENAME_NOREPLACE, emulated where the file system lacks it
+int renameNoReplace(int srcFd, const char *src, int dstFd, const char *dst) {
+    if (renameat2(srcFd, src, dstFd, dst, RENAME_NOREPLACE) == 0) return 0;
+    if (errno != EINVAL && errno != ENOSYS) return -1;
+    struct stat st;
+    if (fstatat(dstFd, dst, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    return renameat(srcFd, src, dstFd, dst);
+}
+
+int moveDirContents(MoveJob *job, int srcFd, int dstFd, const char *where, int top);
+
+// Give a finished copy its real name under the job's policy. On failure
+// the copy is removed and errno is kept, so EEXIST still picks a new name.
+int movePlace(MoveJob *job, int dstFd, const char *tmp, const char *target) {
+    int rc = job->policy == MOVE_OVERWRITE ? renameat(dstFd, tmp, dstFd, target)
+                                           : renameNoReplace(dstFd, tmp, dstFd, target);
+    if (rc != 0) {
+        int err = errno;
+        unlinkat(dstFd, tmp, 0);
+        errno = err;
+    }
+    return rc;
+}
+
+// Move one entry across file systems: copy it, then remove the original
+int moveAcross(MoveJob *job, int srcFd, const char *name, int dstFd, const char *target) {
+    struct stat st;
+    if (fstatat(srcFd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) return -1;
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+
+    if (S_ISDIR(st.st_mode)) {
+        if (mkdirat(dstFd, target, (st.st_mode & 07777) | 0700) == -1 && errno != EEXIST) return -1;
+        int from = openat(srcFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+        int to = openat(dstFd, target, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+        int rc = -1;
+        if (from != -1 && to != -1 && moveDirContents(job, from, to, name, 0) == 0) {
+            fchmod(to, st.st_mode & 07777);
+            futimens(to, times);
+            rc = unlinkat(srcFd, name, AT_REMOVEDIR);
+        }
+        if (from != -1) close(from);
+        if (to != -1) close(to);
+        return rc;
+    }
+    // a taken name is found before copying anything; movePlace still
+    // settles a race
+    struct stat dst;
+    if (job->policy != MOVE_OVERWRITE && fstatat(dstFd, target, &dst, AT_SYMLINK_NOFOLLOW) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), ".move-%d-%u.tmp", (int)getpid(), job->tmpSeq++);
+    if (S_ISLNK(st.st_mode)) {
+        char link[PATH_MAX];
+        ssize_t len = readlinkat(srcFd, name, link, sizeof(link) - 1);
+        if (len < 0) return -1;
+        link[len] = '\0';
+        if (symlinkat(link, dstFd, tmp) == -1) return -1;
+        utimensat(dstFd, tmp, times, AT_SYMLINK_NOFOLLOW);
+        if (movePlace(job, dstFd, tmp, target) != 0) return -1;
+        return unlinkat(srcFd, name, 0);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = EXDEV; // fifos and devices cannot be copied meaningfully
+        return -1;
+    }
+
+    int in = openat(srcFd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (in == -1) return -1;
+    int out = openat(dstFd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (out == -1) {
+        close(in);
+        return -1;
+    }
+    int rc = copyData(&job->copy, in, out, st.st_size);
+    if (rc == 0) {
+        fchmod(out, st.st_mode & 07777);
+        futimens(out, times);
+    }
+    close(in);
+    if (close(out) != 0) rc = -1;
+    if (rc != 0) {
+        unlinkat(dstFd, tmp, 0);
+        return -1;
+    }
+    if (movePlace(job, dstFd, tmp, target) != 0) return -1;
+    return unlinkat(srcFd, name, 0);
+}
+
+// Move srcFd/name into dstFd under the job's collision policy.
+// Returns 1 if moved, 0 if skipped, -1 on error.
+int moveEntry(MoveJob *job, int srcFd, int dstFd, const char *name) {
+    char target[NAME_MAX + 32];
+    snprintf(target, sizeof(target), "%s", name);
+    int exdev = 0;
+
+    for (int n = 1;; n++) {
+        int rc;
+        if (exdev) {
+            rc = moveAcross(job, srcFd, name, dstFd, target);
+        } else if (job->policy == MOVE_OVERWRITE) {
+            rc = renameat(srcFd, name, dstFd, target);
+        } else {
+            rc = renameNoReplace(srcFd, name, dstFd, target);
+        }
+        if (rc == 0) {
+            if (exdev) job->copied++;
+            if (n > 1) job->renamed++;
+            job->moved++;
+            return 1;
+        }
+        if (errno == EXDEV && !exdev) {
+            exdev = 1;
+            n--;
+            continue;
+        }
+        if (errno != EEXIST || job->policy == MOVE_OVERWRITE || n > 10000) return -1;
+        if (job->policy == MOVE_SKIP) {
+            job->skipped++;
+            return 0;
+        }
+
+        // a.txt -> a.1.txt, a -> a.1
+        const char *dot = strrchr(name, '.');
+        if (dot == NULL || dot == name) dot = name + strlen(name);
+        snprintf(target, sizeof(target), "%.*s.%d%s", (int)(dot - name), name, n, dot);
+    }
+}
+
+// Move every entry of srcFd into dstFd in one pass. POSIX guarantees that
+// entries which are not themselves added or removed during the read are
+// returned exactly once, so renaming entries away as we go is safe. Only
+// the top level (top set) leaves names starting with '.' behind. After
+// Ctrl-C it stops and returns -1 with errno ECANCELED.
+int moveDirContents(MoveJob *job, int srcFd, int dstFd, const char *where, int top) {
+    char *buf = malloc(MOVE_BUF);
+    if (buf == NULL) return -1;
+    int status = 0;
+    ssize_t len;
+    while ((len = getdents64(srcFd, buf, MOVE_BUF)) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            struct dirent64 *de = (struct dirent64 *)p;
+            p += de->d_reclen;
+            if (de->d_name[0] == '.' &&
+                (top || de->d_name[1] == '\0' || strcmp(de->d_name, "..") == 0))
+                continue;
+            if (interruptRequested()) {
+                free(buf);
+                errno = ECANCELED;
+                return -1;
+            }
+            if (moveEntry(job, srcFd, dstFd, de->d_name) < 0 && errno != ECANCELED) {
+                fprintf(stderr, "%s: %s/%s: %s\n", job->name, where, de->d_name, strerror(errno));
+                job->errors++;
+                status = -1;
+            }
+        }
+    }
+    if (len < 0) {
+        fprintf(stderr, "%s: %s: %s\n", job->name, where, strerror(errno));
+        status = -1;
+    }
+    free(buf);
+    return status;
+}
+
+// Move the contents of workspace directory src into dst and report.
+// argv may hold -n (skip taken names) or -f (overwrite them).
+int moveWorkspaceItems(const char *cmd, char **argv, int src, int dst) {
+    MoveJob job = {.name = cmd, .policy = MOVE_SUFFIX};
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "-n") == 0) {
+            job.policy = MOVE_SKIP;
+        } else if (strcmp(argv[i], "-f") == 0) {
+            job.policy = MOVE_OVERWRITE;
+        } else {
+            printf("%s: usage: %s [-n | -f]\n", cmd, cmd);
+            return 1;
+        }
+    }
+    atomic_init(&job.copy.cloneOk, 0); // a reflink cannot cross file systems
+    atomic_init(&job.copy.rangeOk, 1);
+
+    int dstFd = workspaceDir(dst);
+    int srcFd = dstFd == -1 ? -1 : workspaceDir(src);
+    if (srcFd == -1) return 1;
+    // a private descriptor: the cached one is shared and getdents moves its offset
+    int fd = openat(srcFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        perror(wsItems[src].name);
+        return 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    moveDirContents(&job, fd, dstFd, wsItems[src].name, 1);
+    close(fd);
+    double secs = elapsedSince(&start);
+    if (secs <= 0) secs = 1e-9;
+
+    if (job.moved == 0 && job.skipped == 0 && job.errors == 0) {
+        if (interruptRequested()) return 130;
+        printf("%s: no files found to move.\n", cmd);
+        return 0;
+    }
+    printf("%s: moved %lld entries from %s to %s in %.2fs (%.0f files/s)",
+           cmd, job.moved, wsItems[src].name, wsItems[dst].name, secs, job.moved / secs);
+    if (job.renamed) printf(", %lld renamed to avoid overwriting", job.renamed);
+    if (job.skipped) printf(", %lld skipped (name taken)", job.skipped);
+    if (job.copied) printf(", %lld copied across file systems", job.copied);
+    printf("\n");
+    if (job.errors) printf("%s: %lld errors\n", cmd, job.errors);
+    if (interruptRequested()) return 130;
+    return job.errors > 0;
+}
+
+// ===== Data generator =====
+// generate builds synthetic fixture trees from a file count, a size
+// distribution, a directory fan-out and a content type. Files are written
+// by the work pool in ranges of GEN_BATCH; each worker fills one large
+// buffer from a xoshiro256** generator and writes it out in 1MB pieces,
+// with fallocate first for big files. A file's generator is seeded from
+// the run seed and the file's index, so a seed reproduces the same tree
+// whatever the thread count.
+
+#define GEN_BATCH 256
+#define GEN_BUF (1 << 20)
+#define GEN_FALLOCATE_MIN (256 * 1024)
+
+#define GEN_FIXED   0 // every file sizeMin bytes
+#define GEN_UNIFORM 1 // uniform in [sizeMin, sizeMax]
+#define GEN_EXP     2 // exponential with mean sizeMin, capped at sizeMax
+
+#define GEN_RANDOM       0
+#define GEN_TEXT         1
+#define GEN_COMPRESSIBLE 2
+
+typedef struct GenSpec {
+    size_t count;
+    int dist;
+    uint64_t sizeMin, sizeMax;
+    size_t fanout;      // entries per directory, 0 for one flat directory
+    int type;
+    uint64_t seed;
+    int threads;        // 0: CUSTOM_SHELL_THREADS or one per CPU
+    const char *prefix; // file names are prefix + index + ext
+    const char *ext;    // NULL: .txt for text, .dat otherwise
+    size_t start;       // first index
+    int width;          // zero padding of the index
+} GenSpec;
+
+typedef struct GenJob {
+    const GenSpec *spec;
+    int dirFd;
+    int depth;      // directory levels below dirFd
+    int digitWidth; // characters in a directory name's number
+    const char *ext;
+    atomic_llong files, bytes, errors;
+} GenJob;
+
+typedef struct GenTask {
+    GenJob *job;
+    size_t first, last;
+} GenTask;
+
+typedef struct Xoshiro {
+    uint64_t s[4];
+} Xoshiro;
+
+uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+void xoshiroSeed(Xoshiro *r, uint64_t seed) {
+    for (int i = 0; i < 4; i++) r->s[i] = splitmix64(&seed);
+}
+
+static inline uint64_t rotl64(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t xoshiroNext(Xoshiro *r) {
+    uint64_t *s = r->s;
+    uint64_t result = rotl64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    return result;
+}
+
+// -ln(u) for a uniform u in (0, 1], without pulling in libm: split off
+// the binary exponent, then a short atanh series for the mantissa.
+double negLogUniform(Xoshiro *r) {
+    uint64_t x = (xoshiroNext(r) >> 11) | 1; // 53 bits, never zero
+    int e = __builtin_clzll(x) - 11;          // u = x / 2^53 = m * 2^-(e+1)
+    double m = (double)(x << e) * 0x1.0p-52;  // in [1, 2)
+    double t = (m - 1) / (m + 1), t2 = t * t;
+    double lnm = 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7 + t2 / 9))));
+    return (e + 1) * 0.6931471805599453 - lnm;
+}
+
+// "4096", "4k", "1.5m", "2g" -> bytes; -1 if malformed
+int64_t parseSize(const char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || v < 0) return -1;
+    switch (tolower((unsigned char)*end)) {
+        case 'k': v *= 1024; end++; break;
+        case 'm': v *= 1024 * 1024; end++; break;
+        case 'g': v *= 1024.0 * 1024 * 1024; end++; break;
+    }
+    if (*end == 'b' || *end == 'B') end++;
+    return *end == '\0' ? (int64_t)v : -1;
+}
+
+// "4k" fixed, "1k-64k" uniform, "~8k" exponential around a mean
+int parseSizeSpec(const char *s, GenSpec *spec) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s", s);
+    if (buf[0] == '~') {
+        int64_t mean = parseSize(buf + 1);
+        if (mean < 0) return -1;
+        spec->dist = GEN_EXP;
+        spec->sizeMin = mean;
+        spec->sizeMax = mean * 64;
+        return 0;
+    }
+    char *dash = strchr(buf, '-');
+    if (dash != NULL) {
+        *dash = '\0';
+        int64_t lo = parseSize(buf), hi = parseSize(dash + 1);
+        if (lo < 0 || hi < lo) return -1;
+        spec->dist = GEN_UNIFORM;
+        spec->sizeMin = lo;
+        spec->sizeMax = hi;
+        return 0;
+    }
+    int64_t n = parseSize(buf);
+    if (n < 0) return -1;
+    spec->dist = GEN_FIXED;
+    spec->sizeMin = spec->sizeMax = n;
+    return 0;
+}
+
+uint64_t genFileSize(const GenSpec *spec, Xoshiro *r) {
+    switch (spec->dist) {
+        case GEN_UNIFORM:
+            return spec->sizeMin + xoshiroNext(r) % (spec->sizeMax - spec->sizeMin + 1);
+        case GEN_EXP: {
+            double v = negLogUniform(r) * spec->sizeMin;
+            return v > spec->sizeMax ? spec->sizeMax : (uint64_t)v;
+        }
+        default:
+            return spec->sizeMin;
+    }
+}
+
+static const char *const genWords[64] = {
+    "the", "of", "and", "data", "file", "shell", "profile", "backup",
+    "system", "record", "value", "index", "random", "test", "fixture", "line",
+    "network", "process", "memory", "disk", "buffer", "thread", "signal", "queue",
+    "cache", "table", "error", "result", "status", "event", "time", "user",
+    "server", "client", "request", "stream", "block", "chunk", "node", "tree",
+    "path", "name", "size", "count", "hash", "key", "map", "list",
+    "entry", "field", "alpha", "beta", "gamma", "delta", "omega", "north",
+    "south", "east", "west", "center", "red", "green", "blue", "black",
+};
+
+// Fill buf[0..len) with content of the given type
+void genFill(int type, Xoshiro *r, char *buf, size_t len) {
+    size_t i = 0;
+    if (type == GEN_TEXT) {
+        // words from a small vocabulary, twelve to a line
+        int words = 0;
+        while (i < len) {
+            const char *w = genWords[xoshiroNext(r) & 63];
+            while (*w && i < len) buf[i++] = *w++;
+            if (i < len) buf[i++] = (++words % 12 == 0) ? '\n' : ' ';
+        }
+    } else if (type == GEN_COMPRESSIBLE) {
+        // runs of a repeated 16-byte pattern: compresses well over 10:1
+        while (i < len) {
+            uint64_t pat[2] = {xoshiroNext(r), xoshiroNext(r)};
+            size_t run = 512 + (xoshiroNext(r) & 4095);
+            for (size_t k = 0; k < run && i < len; k++, i++) buf[i] = ((char *)pat)[k & 15];
+        }
+    } else {
+        for (; i + 8 <= len; i += 8) {
+            uint64_t x = xoshiroNext(r);
+            memcpy(buf + i, &x, 8);
+        }
+        if (i < len) {
+            uint64_t x = xoshiroNext(r);
+            memcpy(buf + i, &x, len - i);
+        }
+    }
+}
+
+// First `levels` directories of a leaf's path: leaf 3041 with fan-out 1000
+// and depth 2 is "d003/d041"
+size_t genDirPath(const GenJob *job, size_t leaf, int levels, char *out, size_t size) {
+    size_t fanout = job->spec->fanout, n = 0, div = 1;
+    out[0] = '\0';
+    for (int l = 1; l < job->depth; l++) div *= fanout;
+    for (int l = 0; l < levels; l++, div /= fanout) {
+        n += snprintf(out + n, size - n, "%sd%0*zu", l ? "/" : "", job->digitWidth,
+                      (leaf / div) % fanout);
+    }
+    return n;
+}
+
+void genPath(const GenJob *job, size_t index, char *out, size_t size) {
+    const GenSpec *spec = job->spec;
+    size_t n = 0;
+    if (job->depth > 0) {
+        n = genDirPath(job, (index - spec->start) / spec->fanout, job->depth, out, size);
+        out[n++] = '/';
+    }
+    snprintf(out + n, size - n, "%s%0*zu%s", spec->prefix, spec->width, index, job->ext);
+}
+
+void genTask(void *arg) {
+    GenTask *t = arg;
+    GenJob *job = t->job;
+    const GenSpec *spec = job->spec;
+    char *buf = malloc(GEN_BUF);
+    char path[PATH_MAX];
+
+    for (size_t i = t->first; i < t->last && !interruptRequested(); i++) {
+        Xoshiro r;
+        xoshiroSeed(&r, spec->seed ^ (i * 0xd1b54a32d192ed03ull));
+        uint64_t size = genFileSize(spec, &r);
+        genPath(job, i, path, sizeof(path));
+
+        int fd = buf == NULL ? -1
+               : openat(job->dirFd, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        int ok = fd != -1;
+        // best effort: one extent instead of many for big files
+        if (ok && size >= GEN_FALLOCATE_MIN) fallocate(fd, 0, 0, size);
+        for (uint64_t left = size; ok && left > 0;) {
+            size_t n = left < GEN_BUF ? left : GEN_BUF;
+            genFill(spec->type, &r, buf, n);
+            ok = writeFully(fd, buf, n) == n;
+            left -= n;
+        }
+        if (fd != -1 && close(fd) != 0) ok = 0;
+        if (!ok) {
+            fprintf(stderr, "generate: %s: %s\n", path, strerror(buf == NULL ? ENOMEM : errno));
+            atomic_fetch_add(&job->errors, 1);
+            continue;
+        }
+        atomic_fetch_add(&job->files, 1);
+        atomic_fetch_add(&job->bytes, size);
+    }
+    free(buf);
+    free(t);
+}
+
+// Write the files of spec under dirFd and report throughput. `where` is
+// only used in the report. Returns 0 if every file was written.
+int generateFiles(const char *cmd, const GenSpec *spec, int dirFd, const char *where) {
+    GenJob job = {.spec = spec, .dirFd = dirFd, .ext = spec->ext};
+    if (job.ext == NULL) job.ext = spec->type == GEN_TEXT ? ".txt" : ".dat";
+    atomic_init(&job.files, 0);
+    atomic_init(&job.bytes, 0);
+    atomic_init(&job.errors, 0);
+
+    // enough directory levels that none holds more than fanout entries;
+    // each directory is made once, when the first leaf under it comes up
+    size_t dirs = 0;
+    if (spec->fanout > 1 && spec->count > spec->fanout) {
+        size_t leaves = (spec->count + spec->fanout - 1) / spec->fanout, span = 1;
+        while (span < leaves) {
+            span *= spec->fanout;
+            job.depth++;
+        }
+        char digits[32];
+        job.digitWidth = snprintf(digits, sizeof(digits), "%zu", spec->fanout - 1);
+
+        for (size_t leaf = 0; leaf < leaves && !interruptRequested(); leaf++) {
+            size_t below = span;
+            for (int l = 0; l < job.depth; l++) {
+                below /= spec->fanout;
+                if (leaf % below != 0) continue;
+                char path[PATH_MAX];
+                genDirPath(&job, leaf, l + 1, path, sizeof(path));
+                if (mkdirat(dirFd, path, 0755) == 0) {
+                    dirs++;
+                } else if (errno != EEXIST) {
+                    fprintf(stderr, "%s: %s: %s\n", cmd, path, strerror(errno));
+                    return 1;
+                }
+            }
+        }
+    }
+
+    WorkPool pool;
+    if (poolStart(&pool, spec->threads) == -1) {
+        fprintf(stderr, "%s: cannot start worker threads\n", cmd);
+        return 1;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t end = spec->start + spec->count;
+    for (size_t first = spec->start; first < end; first += GEN_BATCH) {
+        GenTask *t = malloc(sizeof(GenTask));
+        if (t == NULL) {
+            atomic_fetch_add(&job.errors, end - first);
+            break;
+        }
+        t->job = &job;
+        t->first = first;
+        t->last = end - first > GEN_BATCH ? first + GEN_BATCH : end;
+        poolSubmit(&pool, genTask, t);
+    }
+    int threads = pool.nthreads;
+    poolStop(&pool);
+    double secs = elapsedSince(&start);
+    if (secs <= 0) secs = 1e-9;
+
+    long long files = atomic_load(&job.files), bytes = atomic_load(&job.bytes);
+    long long errors = atomic_load(&job.errors);
+    printf("%s: %lld files, %.1f MB", cmd, files, bytes / 1e6);
+    if (dirs) printf(" in %zu directories", dirs);
+    printf(" under %s in %.2fs (%.0f files/s, %.1f MB/s, %d threads)\n",
+           where, secs, files / secs, bytes / 1e6 / secs, threads);
+    if (errors) printf("%s: %lld files failed\n", cmd, errors);
+    if (interruptRequested()) return 130;
+    return errors > 0;
+}
+
+// Apply "-n count -s size -f fanout -t type -S seed -j threads -p prefix"
+// (and "-d dir" when dir is not NULL) from argv to spec. Returns 0, or -1
+// after saying what is wrong.
+int parseGenOptions(const char *cmd, char **argv, GenSpec *spec, const char **dir) {
+    for (int i = 1; argv[i] != NULL; i += 2) {
+        const char *opt = argv[i], *val = argv[i + 1];
+        if (opt[0] != '-' || opt[1] == '\0' || opt[2] != '\0' || val == NULL ||
+            strchr(dir != NULL ? "nsftSjpd" : "nsftSjp", opt[1]) == NULL) {
+            printf("%s: bad option '%s'. Type 'help %s' for usage.\n", cmd, opt, cmd);
+            return -1;
+        }
+        char *end = "";
+        int ok = 1;
+        switch (opt[1]) {
+            case 'n':
+                spec->count = strtoull(val, &end, 10);
+                break;
+            case 's':
+                ok = parseSizeSpec(val, spec) == 0;
+                break;
+            case 'f':
+                spec->fanout = strtoull(val, &end, 10);
+                ok = spec->fanout != 1;
+                break;
+            case 't':
+                if (strcmp(val, "random") == 0) spec->type = GEN_RANDOM;
+                else if (strcmp(val, "text") == 0) spec->type = GEN_TEXT;
+                else if (strcmp(val, "compressible") == 0) spec->type = GEN_COMPRESSIBLE;
+                else ok = 0;
+                break;
+            case 'S':
+                spec->seed = strtoull(val, &end, 0);
+                break;
+            case 'j':
+                spec->threads = (int)strtol(val, &end, 10);
+                ok = spec->threads >= 0 && spec->threads <= 64;
+                break;
+            case 'p':
+                spec->prefix = val;
+                ok = strchr(val, '/') == NULL;
+                break;
+            case 'd':
+                *dir = val;
+                break;
+        }
+        if (!ok || *end != '\0' || val[0] == '\0') {
+            printf("%s: bad value '%s' for %s. Type 'help %s' for usage.\n", cmd, val, opt, cmd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 1000 random 4KB files, 1000 to a directory, seeded from the clock
+void genDefaults(GenSpec *spec) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    *spec = (GenSpec){.count = 1000, .dist = GEN_FIXED, .sizeMin = 4096, .sizeMax = 4096,
+                      .fanout = 1000, .type = GEN_RANDOM,
+                      .seed = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec,
+                      .prefix = "file_", .width = 8};
+}
+
+// generate [-n count] [-s size] [-f fanout] [-t type] [-S seed] [-j threads]
+//          [-p prefix] [-d dir]
+int cmd_generate(char **parsed) {
+    GenSpec spec;
+    genDefaults(&spec);
+    const char *dir = NULL;
+    if (parseGenOptions("generate", parsed, &spec, &dir) != 0) return 1;
+
+    int base = AT_FDCWD;
+    if (dir == NULL) {
+        dir = "generated";
+        base = workspaceRoot();
+    }
+    if (mkdirat(base, dir, 0755) == -1 && errno != EEXIST) {
+        perror(dir);
+        return 1;
+    }
+    int fd = openat(base, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        perror(dir);
+        return 1;
+    }
+    int status = generateFiles("generate", &spec, fd, dir);
+    close(fd);
+    return status;
+}
+
+// ===== Tree scanner =====
+// scan_temp reads directories with getdents64 and sizes files with statx
+// on the work pool. A directory task queues its subdirectories and hands
+// its other entries to stat tasks in batches of SCAN_BATCH names, all
+// relative to the directory's own descriptor, so no path is resolved
+// twice. Results are folded into per-root totals as each batch finishes
+// and only the largest SCAN_TOP_MAX files are remembered, so memory stays
+// flat however big the tree is; -l streams every entry as it is found.
+
+#define SCAN_BUF (64 * 1024)
+#define SCAN_BATCH 256
+#define SCAN_NAMES (16 * 1024) // name bytes per batch
+#define SCAN_TOP_MAX 100
+#define SCAN_AGES 6
+
+static const char *const scanAgeNames[SCAN_AGES] = {"1h", "1d", "7d", "30d", "365d", "older"};
+static const int64_t scanAgeLimits[SCAN_AGES - 1] = {3600, 86400, 7 * 86400, 30 * 86400, 365 * 86400};
+
+typedef struct ScanStats {
+    long long files, dirs, links, other, errors;
+    long long bytes, allocated;
+    long long age[SCAN_AGES];
+} ScanStats;
+
+typedef struct ScanFile {
+    long long size;
+    char *path;
+} ScanFile;
+
+typedef struct ScanJob ScanJob;
+
+typedef struct ScanRoot {
+    ScanJob *job;
+    const char *path; // as given, used as the prefix of reported paths
+    ScanStats stats;
+} ScanRoot;
+
+struct ScanJob {
+    WorkPool *pool;
+    int64_t now;
+    int list;             // -l: print every entry
+    int top;              // how many of the largest files to keep
+    pthread_mutex_t lock; // stats, largest, output
+    ScanFile largest[SCAN_TOP_MAX];
+    int nlargest;
+    atomic_llong minLargest; // smallest size still worth taking the lock for
+};
+
+// An open directory shared by the tasks working on its entries
+typedef struct ScanDir {
+    ScanRoot *root;
+    int fd;
+    char *rel; // "." for the root
+    atomic_int refs;
+} ScanDir;
+
+typedef struct ScanDirTask {
+    ScanDir *parent; // NULL for a root
+    ScanRoot *root;
+    char *rel;
+    int fd;          // the root's descriptor when parent is NULL
+} ScanDirTask;
+
+typedef struct ScanBatch {
+    ScanDir *dir;
+    int n;
+    size_t used;
+    char names[SCAN_NAMES];
+} ScanBatch;
+
+void scanRelease(ScanDir *d) {
+    if (atomic_fetch_sub(&d->refs, 1) != 1) return;
+    close(d->fd);
+    free(d->rel);
+    free(d);
+}
+
+void scanMerge(ScanStats *into, const ScanStats *from) {
+    into->files += from->files;
+    into->dirs += from->dirs;
+    into->links += from->links;
+    into->other += from->other;
+    into->errors += from->errors;
+    into->bytes += from->bytes;
+    into->allocated += from->allocated;
+    for (int i = 0; i < SCAN_AGES; i++) into->age[i] += from->age[i];
+}
+
+// "root/rel/name" for reports, leaving out a "." rel
+char *scanPath(const ScanDir *d, const char *name) {
+    char *s = NULL;
+    size_t len = 0, cap = 0;
+    if (strcmp(d->rel, ".") == 0) bufAppend(&s, &len, &cap, "%s/%s", d->root->path, name);
+    else bufAppend(&s, &len, &cap, "%s/%s/%s", d->root->path, d->rel, name);
+    return s;
+}
+
+// Offer a file to the largest-files list; takes the lock only when the
+// file would make the cut
+void scanOfferLargest(ScanJob *job, ScanDir *d, const char *name, long long size) {
+    if (job->top == 0 || size <= atomic_load_explicit(&job->minLargest, memory_order_relaxed))
+        return;
+    char *path = scanPath(d, name);
+    if (path == NULL) return;
+    pthread_mutex_lock(&job->lock);
+    int slot = -1;
+    if (job->nlargest < job->top) {
+        slot = job->nlargest++;
+    } else if (size > job->largest[job->top - 1].size) {
+        slot = job->top - 1;
+        free(job->largest[slot].path);
+    }
+    if (slot >= 0) {
+        // insertion sort, largest first
+        while (slot > 0 && job->largest[slot - 1].size < size) {
+            job->largest[slot] = job->largest[slot - 1];
+            slot--;
+        }
+        job->largest[slot].size = size;
+        job->largest[slot].path = path;
+        path = NULL;
+        if (job->nlargest == job->top)
+            atomic_store(&job->minLargest, job->largest[job->top - 1].size);
+    }
+    pthread_mutex_unlock(&job->lock);
+    free(path);
+}
+
+void scanBatchTask(void *arg) {
+    ScanBatch *b = arg;
+    ScanDir *d = b->dir;
+    ScanRoot *root = d->root;
+    ScanJob *job = root->job;
+    ScanStats local = {0};
+    char *out = NULL;
+    size_t outLen = 0, outCap = 0;
+
+    const char *name = b->names;
+    for (int i = 0; i < b->n && !interruptRequested(); i++, name += strlen(name) + 1) {
+        struct statx stx;
+        if (statx(d->fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                  STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_BLOCKS, &stx) != 0) {
+            if (errno != ENOENT) {
+                fprintf(stderr, "scan_temp: %s/%s/%s: %s\n", root->path, d->rel, name, strerror(errno));
+                local.errors++;
+            }
+            continue;
+        }
+        if (S_ISREG(stx.stx_mode)) local.files++;
+        else if (S_ISLNK(stx.stx_mode)) local.links++;
+        else local.other++;
+        local.bytes += stx.stx_size;
+        local.allocated += stx.stx_blocks * 512;
+
+        int64_t age = job->now - stx.stx_mtime.tv_sec;
+        int bucket = 0;
+        while (bucket < SCAN_AGES - 1 && age >= scanAgeLimits[bucket]) bucket++;
+        local.age[bucket]++;
+
+        if (S_ISREG(stx.stx_mode)) scanOfferLargest(job, d, name, stx.stx_size);
+        if (job->list) {
+            char *path = scanPath(d, name);
+            if (path != NULL) bufAppend(&out, &outLen, &outCap, "%12lld  %s\n", (long long)stx.stx_size, path);
+            free(path);
+        }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    scanMerge(&root->stats, &local);
+    if (outLen > 0) fwrite(out, 1, outLen, stdout);
+    pthread_mutex_unlock(&job->lock);
+    free(out);
+    scanRelease(d);
+    free(b);
+}
+
+void scanDirTask(void *arg);
+
+void scanQueueDir(ScanJob *job, ScanDir *parent, ScanRoot *root, char *rel, int fd) {
+    ScanDirTask *t = malloc(sizeof(ScanDirTask));
+    if (t == NULL) {
+        fprintf(stderr, "scan_temp: %s/%s: %s\n", root->path, rel, strerror(ENOMEM));
+        free(rel);
+        pthread_mutex_lock(&job->lock);
+        root->stats.errors++;
+        pthread_mutex_unlock(&job->lock);
+        return;
+    }
+    if (parent != NULL) atomic_fetch_add(&parent->refs, 1);
+    t->parent = parent;
+    t->root = root;
+    t->rel = rel;
+    t->fd = fd;
+    poolSubmit(job->pool, scanDirTask, t);
+}
+
+void scanDirTask(void *arg) {
+    ScanDirTask *t = arg;
+    ScanRoot *root = t->root;
+    ScanJob *job = root->job;
+    ScanStats local = {0};
+    char *buf = NULL;
+
+    ScanDir *d = malloc(sizeof(ScanDir));
+    int fd = t->parent == NULL ? dup(t->fd)
+           : openat(t->parent->fd, strrchr(t->rel, '/') ? strrchr(t->rel, '/') + 1 : t->rel,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    int err = d == NULL ? ENOMEM : errno;
+    if (t->parent != NULL) scanRelease(t->parent);
+    if (d == NULL || fd == -1) {
+        if (err != ENOENT) {
+            fprintf(stderr, "scan_temp: %s/%s: %s\n", root->path, t->rel, strerror(err));
+            local.errors++;
+        }
+        if (fd != -1) close(fd);
+        free(d);
+        free(t->rel);
+        goto out;
+    }
+    d->root = root;
+    d->fd = fd;
+    d->rel = t->rel;
+    atomic_init(&d->refs, 1);
+    if (t->parent != NULL) local.dirs++;
+
+    buf = malloc(SCAN_BUF);
+    ScanBatch *b = NULL;
+    ssize_t len = -1;
+    while (buf != NULL && (len = getdents64(fd, buf, SCAN_BUF)) > 0 && !interruptRequested()) {
+        for (char *p = buf; p < buf + len;) {
+            struct dirent64 *de = (struct dirent64 *)p;
+            p += de->d_reclen;
+            const char *name = de->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+            unsigned char type = de->d_type;
+            struct stat st;
+            if (type == DT_UNKNOWN && fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                type = IFTODT(st.st_mode);
+            if (type == DT_DIR) {
+                char *rel = joinRel(d->rel, name);
+                if (rel != NULL) scanQueueDir(job, d, root, rel, -1);
+                continue;
+            }
+
+            size_t nl = strlen(name) + 1;
+            if (b != NULL && (b->n == SCAN_BATCH || b->used + nl > SCAN_NAMES)) {
+                poolSubmit(job->pool, scanBatchTask, b);
+                b = NULL;
+            }
+            if (b == NULL) {
+                b = malloc(sizeof(ScanBatch));
+                if (b == NULL) {
+                    local.errors++;
+                    continue;
+                }
+                atomic_fetch_add(&d->refs, 1);
+                b->dir = d;
+                b->n = 0;
+                b->used = 0;
+            }
+            memcpy(b->names + b->used, name, nl);
+            b->used += nl;
+            b->n++;
+        }
+    }
+    if (len < 0) {
+        fprintf(stderr, "scan_temp: %s/%s: %s\n", root->path, d->rel, strerror(buf ? errno : ENOMEM));
+        local.errors++;
+    }
+    if (b != NULL) poolSubmit(job->pool, scanBatchTask, b);
+    scanRelease(d);
+out:
+    free(buf);
+    free(t);
+    pthread_mutex_lock(&job->lock);
+    scanMerge(&root->stats, &local);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Write s as a JSON string literal
+void jsonString(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c == '\n') fputs("\\n", out);
+        else if (c == '\t') fputs("\\t", out);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+void scanPrintJsonStats(const ScanStats *s) {
+    printf("\"files\": %lld, \"dirs\": %lld, \"symlinks\": %lld, \"other\": %lld, "
+           "\"bytes\": %lld, \"allocated\": %lld, \"errors\": %lld, \"age\": {",
+           s->files, s->dirs, s->links, s->other, s->bytes, s->allocated, s->errors);
+    for (int i = 0; i < SCAN_AGES; i++)
+        printf("%s\"%s\": %lld", i ? ", " : "", scanAgeNames[i], s->age[i]);
+    printf("}");
+}
+
+void scanPrintStats(const char *label, const ScanStats *s) {
+    printf("%-16s %9lld files %7lld dirs %6lld links %10.1f MB (%.1f MB on disk)",
+           label, s->files, s->dirs, s->links, s->bytes / 1e6, s->allocated / 1e6);
+    if (s->other) printf(", %lld other", s->other);
+    if (s->errors) printf(", %lld errors", s->errors);
+    printf("\n");
+}
+
+// Scan paths (relative to baseFd) in parallel and print a summary or
+// JSON. Returns 0 if every entry could be read.
+int scanTrees(int baseFd, const char **paths, int npaths, int optional, int list, int top, int json) {
+    ScanJob job = {.list = list, .top = top};
+    pthread_mutex_init(&job.lock, NULL);
+    atomic_init(&job.minLargest, 0);
+    job.now = time(NULL);
+    ScanRoot *roots = calloc(npaths, sizeof(ScanRoot));
+    int *fds = malloc(npaths * sizeof(int));
+    WorkPool pool;
+    if (roots == NULL || fds == NULL || poolStart(&pool, 0) == -1) {
+        fprintf(stderr, "scan_temp: cannot start worker threads\n");
+        free(roots);
+        free(fds);
+        return 1;
+    }
+    job.pool = &pool;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = 0, nroots = 0;
+    for (int i = 0; i < npaths; i++) {
+        fds[i] = openat(baseFd, paths[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fds[i] == -1) {
+            // the default directories may simply not have been made yet
+            if (!(optional && errno == ENOENT)) {
+                fprintf(stderr, "scan_temp: %s: %s\n", paths[i], strerror(errno));
+                status = 1;
+            }
+            continue;
+        }
+        ScanRoot *r = &roots[nroots++];
+        r->job = &job;
+        r->path = paths[i];
+        scanQueueDir(&job, NULL, r, strdup("."), fds[i]);
+    }
+    poolWait(&pool);
+    double secs = elapsedSince(&start);
+    int threads = pool.nthreads;
+    poolStop(&pool);
+    for (int i = 0; i < npaths; i++)
+        if (fds[i] != -1) close(fds[i]);
+
+    ScanStats total = {0};
+    for (int i = 0; i < nroots; i++) scanMerge(&total, &roots[i].stats);
+    long long entries = total.files + total.dirs + total.links + total.other;
+    if (total.errors) status = 1;
+
+    if (json) {
+        printf("{\"roots\": [");
+        for (int i = 0; i < nroots; i++) {
+            printf("%s\n  {\"path\": ", i ? "," : "");
+            jsonString(stdout, roots[i].path);
+            printf(", ");
+            scanPrintJsonStats(&roots[i].stats);
+            printf("}");
+        }
+        printf("],\n \"total\": {");
+        scanPrintJsonStats(&total);
+        printf("},\n \"largest\": [");
+        for (int i = 0; i < job.nlargest; i++) {
+            printf("%s\n  {\"path\": ", i ? "," : "");
+            jsonString(stdout, job.largest[i].path);
+            printf(", \"bytes\": %lld}", job.largest[i].size);
+        }
+        printf("],\n \"seconds\": %.3f, \"threads\": %d}\n", secs, threads);
+    } else {
+        for (int i = 0; i < nroots; i++) scanPrintStats(roots[i].path, &roots[i].stats);
+        if (nroots > 1) scanPrintStats("total", &total);
+        printf("modified within:");
+        for (int i = 0; i < SCAN_AGES; i++)
+            printf("  %s%s %lld", i == SCAN_AGES - 1 ? "" : "<", scanAgeNames[i], total.age[i]);
+        printf("\n");
+        if (job.nlargest > 0) printf("largest files:\n");
+        for (int i = 0; i < job.nlargest; i++)
+            printf("  %14lld  %s\n", job.largest[i].size, job.largest[i].path);
+        printf("scan_temp: %lld entries in %.3fs (%.0f entries/s, %d threads)\n",
+               entries, secs, entries / (secs > 0 ? secs : 1e-9), threads);
+    }
+
+    for (int i = 0; i < job.nlargest; i++) free(job.largest[i].path);
+    pthread_mutex_destroy(&job.lock);
+    free(roots);
+    free(fds);
+    return interruptRequested() ? 130 : status;
+}
+
+// ===== Integrity scanner =====
+// baseline and verify hash every regular file under good_files,
+// backup_good_files and main. The hash is an XXH3-style 128-bit one:
+// eight 64-bit lanes take 64-byte stripes with a 32x32 multiply and add,
+// which the compiler turns into SIMD code (an AVX2 build of the loop is
+// picked at first use where the CPU has it). It catches accidental change, not a
+// deliberate forgery. Files are mmap'd and hashed on the work pool.
+// INTEG_CACHE keeps the (inode, size, mtime) each path had when it was
+// last hashed, so a rescan only reads files that changed.
+
+#define INTEG_BASELINE ".custom_shell_baseline"
+#define INTEG_CACHE    ".custom_shell_hashes"
+#define INTEG_STRIPES  16 // stripes per block; lanes are scrambled after each block
+
+typedef uint64_t U64x8 __attribute__((vector_size(64)));
+
+static U64x8 stripeKeys[INTEG_STRIPES + 1]; // one per stripe, then the scramble key
+static uint64_t stripeFinalKeys[16];
+static void (*stripeBlocks)(U64x8 *acc, const unsigned char *p, size_t len);
+static pthread_once_t stripeOnce = PTHREAD_ONCE_INIT;
+
+void stripeBlocksAvx2(U64x8 *acc, const unsigned char *p, size_t len);
+void stripeBlocksPortable(U64x8 *acc, const unsigned char *p, size_t len);
+
+void initStripeKeys() {
+    uint64_t x = 0x243f6a8885a308d3ull; // fixed: hashes are stored on disk
+    for (int s = 0; s <= INTEG_STRIPES; s++)
+        for (int i = 0; i < 8; i++) stripeKeys[s][i] = splitmix64(&x);
+    for (int i = 0; i < 16; i++) stripeFinalKeys[i] = splitmix64(&x);
+    __builtin_cpu_init();
+    stripeBlocks = __builtin_cpu_supports("avx2") ? stripeBlocksAvx2 : stripeBlocksPortable;
+}
+
+static inline void stripeAccumulate(U64x8 *acc, const unsigned char *p, const U64x8 *key) {
+    U64x8 d;
+    memcpy(&d, p, sizeof(d));
+    U64x8 k = d ^ *key;
+    *acc += __builtin_shuffle(d, (U64x8){1, 0, 3, 2, 5, 4, 7, 6}) + (k & 0xffffffffu) * (k >> 32);
+}
+
+static inline __attribute__((always_inline))
+void stripeBlocksBody(U64x8 *acc, const unsigned char *p, size_t len) {
+    size_t blocks = len / (64 * INTEG_STRIPES);
+    for (size_t b = 0; b < blocks; b++) {
+        for (int s = 0; s < INTEG_STRIPES; s++, p += 64) stripeAccumulate(acc, p, &stripeKeys[s]);
+        *acc ^= *acc >> 47;
+        *acc ^= stripeKeys[INTEG_STRIPES];
+        *acc *= 0x9e3779b1u;
+    }
+    // whole stripes of the last block, then the rest zero-padded
+    size_t rest = len % (64 * INTEG_STRIPES);
+    int s = 0;
+    for (; rest >= 64; rest -= 64, p += 64) stripeAccumulate(acc, p, &stripeKeys[s++]);
+    if (rest > 0) {
+        unsigned char last[64] = {0};
+        memcpy(last, p, rest);
+        stripeAccumulate(acc, last, &stripeKeys[s]);
+    }
+}
+
+__attribute__((target("avx2")))
+void stripeBlocksAvx2(U64x8 *acc, const unsigned char *p, size_t len) {
+    stripeBlocksBody(acc, p, len);
+}
+
+void stripeBlocksPortable(U64x8 *acc, const unsigned char *p, size_t len) {
+    stripeBlocksBody(acc, p, len);
+}
+
+static inline uint64_t mulFold(uint64_t a, uint64_t b) {
+    __uint128_t m = (__uint128_t)a * b;
+    return (uint64_t)m ^ (uint64_t)(m >> 64);
+}
+
+static inline uint64_t avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919e3779f9ull;
+    return h ^ (h >> 32);
+}
+
+void stripeHash(const void *data, size_t len, uint64_t out[2]) {
+    pthread_once(&stripeOnce, initStripeKeys);
+    U64x8 acc = {0xc2b2ae3d27d4eb4full, 0x9e3779b185ebca87ull, 0x165667b19e3779f9ull,
+                 0x85ebca77c2b2ae63ull, 0x27d4eb2f165667c5ull, 0x9e3779b97f4a7c15ull,
+                 0xff51afd7ed558ccdull, 0xc4ceb9fe1a85ec53ull};
+    stripeBlocks(&acc, data, len);
+    uint64_t lo = len * 0x9e3779b185ebca87ull, hi = ~len * 0xc2b2ae3d27d4eb4full;
+    for (int j = 0; j < 4; j++) {
+        lo += mulFold(acc[2 * j] ^ stripeFinalKeys[j], acc[2 * j + 1] ^ stripeFinalKeys[4 + j]);
+        hi += mulFold(acc[2 * j] ^ stripeFinalKeys[8 + j], acc[2 * j + 1] ^ stripeFinalKeys[12 + j]);
+    }
+    out[0] = avalanche(lo);
+    out[1] = avalanche(hi);
+}
+
+typedef struct IntegRecord {
+    char *path; // prefixed with its workspace directory
+    uint64_t ino, size;
+    int64_t mtime; // nanoseconds
+    uint64_t hash[2];
+} IntegRecord;
+
+typedef struct IntegSet {
+    IntegRecord *recs;
+    size_t count, cap;
+} IntegSet;
+
+typedef struct IntegJob {
+    const char *name;
+    IntegSet cache; // sorted, read-only during the walk
+    IntegSet found;
+    pthread_mutex_t lock; // found
+    atomic_llong hashed, cached, bytes, errors;
+} IntegJob;
+
+typedef struct IntegRoot {
+    IntegJob *job;
+    const char *prefix;
+} IntegRoot;
+
+int integAdd(IntegSet *set, const IntegRecord *r) {
+    if (set->count == set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : 1024;
+        IntegRecord *n = realloc(set->recs, cap * sizeof(IntegRecord));
+        if (n == NULL) return -1;
+        set->recs = n;
+        set->cap = cap;
+    }
+    set->recs[set->count++] = *r;
+    return 0;
+}
+
+void integFree(IntegSet *set) {
+    for (size_t i = 0; i < set->count; i++) free(set->recs[i].path);
+    free(set->recs);
+    memset(set, 0, sizeof(*set));
+}
+
+int compareIntegRecords(const void *a, const void *b) {
+    return strcmp(((const IntegRecord *)a)->path, ((const IntegRecord *)b)->path);
+}
+
+IntegRecord *integFind(const IntegSet *set, const char *path) {
+    IntegRecord key = {.path = (char *)path};
+    return set->count ? bsearch(&key, set->recs, set->count, sizeof(IntegRecord), compareIntegRecords)
+                      : NULL;
+}
+
+// Read a hash list written by integWrite. Returns 0, or -1 if the file is
+// missing or not of the given kind; *created gets the header's time.
+int integRead(const char *file, const char *magic, IntegSet *set, long long *created) {
+    memset(set, 0, sizeof(*set));
+    int fd = openat(workspaceRoot(), file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    struct stat st;
+    char *text = NULL;
+    if (fstat(fd, &st) == 0 && (text = malloc(st.st_size + 1)) != NULL &&
+        pread(fd, text, st.st_size, 0) != st.st_size) {
+        free(text);
+        text = NULL;
+    }
+    close(fd);
+    if (text == NULL) return -1;
+    text[st.st_size] = '\0';
+
+    char *rest = text, *line = strsep(&rest, "\n"), *f[6];
+    if (splitFields(line, f, 3) != 3 || strcmp(f[0], magic) != 0 || strcmp(f[1], "1") != 0) {
+        free(text);
+        return -1;
+    }
+    if (created) *created = atoll(f[2]);
+    while ((line = strsep(&rest, "\n")) != NULL) {
+        if (splitFields(line, f, 6) != 6) continue;
+        IntegRecord r = {.ino = strtoull(f[0], NULL, 10), .size = strtoull(f[1], NULL, 10),
+                         .mtime = strtoll(f[2], NULL, 10), .hash = {strtoull(f[3], NULL, 16),
+                                                                    strtoull(f[4], NULL, 16)}};
+        snapUnescape(f[5]);
+        if ((r.path = strdup(f[5])) == NULL || integAdd(set, &r) != 0) {
+            free(r.path);
+            break;
+        }
+    }
+    free(text);
+    qsort(set->recs, set->count, sizeof(IntegRecord), compareIntegRecords);
+    return 0;
+}
+
+// Replace file with set (sorted). Returns 0 on success.
+int integWrite(const char *file, const char *magic, const IntegSet *set) {
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    bufAppend(&buf, &len, &cap, "%s\t1\t%lld\n", magic, (long long)time(NULL));
+    for (size_t i = 0; i < set->count; i++) {
+        const IntegRecord *r = &set->recs[i];
+        bufAppend(&buf, &len, &cap, "%llu\t%llu\t%lld\t%016llx\t%016llx\t", (unsigned long long)r->ino,
+                  (unsigned long long)r->size, (long long)r->mtime, (unsigned long long)r->hash[0],
+                  (unsigned long long)r->hash[1]);
+        snapEscape(&buf, &len, &cap, r->path);
+        bufAppend(&buf, &len, &cap, "\n");
+    }
+
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    int root = workspaceRoot();
+    int fd = buf == NULL ? -1 : openat(root, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int ok = fd != -1 && writeFully(fd, buf, len) == len;
+    if (fd != -1 && close(fd) != 0) ok = 0;
+    if (!ok || renameat(root, tmp, root, file) != 0) {
+        perror(file);
+        unlinkat(root, tmp, 0);
+        ok = 0;
+    }
+    free(buf);
+    return ok ? 0 : -1;
+}
+
+// Hash one file; the cached hash is reused when inode, size and mtime match
+void integFile(TreeWalk *w, const char *rel, unsigned char type) {
+    IntegRoot *root = w->ctx;
+    IntegJob *job = root->job;
+    if (type != DT_REG) return;
+
+    IntegRecord r = {0};
+    char *path = joinRel(root->prefix, rel);
+    int fd = openat(w->rootFd, rel, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    if (path == NULL || fd == -1 || fstat(fd, &st) != 0) {
+        if (errno != ENOENT) walkError(w, rel, "open");
+        goto out;
+    }
+    r.path = path;
+    r.ino = st.st_ino;
+    r.size = st.st_size;
+    r.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+    const IntegRecord *c = integFind(&job->cache, path);
+    if (c != NULL && c->ino == r.ino && c->size == r.size && c->mtime == r.mtime) {
+        r.hash[0] = c->hash[0];
+        r.hash[1] = c->hash[1];
+        atomic_fetch_add(&job->cached, 1);
+    } else {
+        void *map = NULL;
+        if (st.st_size > 0) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                walkError(w, rel, "mmap");
+                goto out;
+            }
+            madvise(map, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+        }
+        stripeHash(map ? map : "", st.st_size, r.hash);
+        if (map != NULL) munmap(map, st.st_size);
+        atomic_fetch_add(&job->hashed, 1);
+        atomic_fetch_add(&job->bytes, st.st_size);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    int added = integAdd(&job->found, &r) == 0;
+    pthread_mutex_unlock(&job->lock);
+    if (added) path = NULL;
+out:
+    if (fd != -1) close(fd);
+    free(path);
+}
+
+// Hash the workspace directories into job->found (sorted), using and then
+// refreshing INTEG_CACHE. Returns 0 if every file could be read.
+int integScan(IntegJob *job) {
+    static const int items[] = {WS_GOOD, WS_BACKUP, WS_MAIN};
+    memset(&job->found, 0, sizeof(job->found));
+    pthread_mutex_init(&job->lock, NULL);
+    atomic_init(&job->hashed, 0);
+    atomic_init(&job->cached, 0);
+    atomic_init(&job->bytes, 0);
+    atomic_init(&job->errors, 0);
+    integRead(INTEG_CACHE, "chash", &job->cache, NULL);
+
+    WorkPool pool;
+    if (poolStart(&pool, 0) == -1) {
+        fprintf(stderr, "%s: cannot start worker threads\n", job->name);
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(items) / sizeof(items[0]) && !interruptRequested(); i++) {
+        const char *name = wsItems[items[i]].name;
+        int fd = openat(workspaceRoot(), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) continue; // not made yet: nothing to hash
+        IntegRoot root = {job, name};
+        TreeWalk w = {.pool = &pool, .rootFd = fd, .name = job->name, .onFile = integFile, .ctx = &root};
+        walkTree(&w);
+        atomic_fetch_add(&job->errors, atomic_load(&w.errors));
+        close(fd);
+    }
+    poolStop(&pool);
+    pthread_mutex_destroy(&job->lock);
+    integFree(&job->cache);
+    // a partial scan would drop the other files' hashes from the cache
+    if (interruptRequested()) return 130;
+
+    qsort(job->found.recs, job->found.count, sizeof(IntegRecord), compareIntegRecords);
+    integWrite(INTEG_CACHE, "chash", &job->found);
+    return atomic_load(&job->errors) > 0;
+}
+
+void integReport(IntegJob *job, double secs) {
+    printf("%s: %zu files (%lld hashed, %lld cached, %.1f MB read) in %.2fs",
+           job->name, job->found.count, atomic_load(&job->hashed), atomic_load(&job->cached),
+           atomic_load(&job->bytes) / 1e6, secs);
+    if (secs > 0 && atomic_load(&job->bytes) > 0) printf(", %.0f MB/s", atomic_load(&job->bytes) / 1e6 / secs);
+    printf("\n");
+}
+
+// ===== Text scanning =====
+// count, grep, topk and histogram read mmap'd files in place instead of
+// streaming them through pipes. Each file is cut into chunks at line
+// boundaries, every chunk is a pool task, and the per-chunk results are
+// merged in file order so the output is what a serial pass would print.
+// Newline counting and literal search use AVX2 where the CPU has it and
+// SSE2 otherwise (memchr/memmem off x86-64).
+
+#define TEXT_CHUNK_MIN (1 << 20)
+#define TEXT_CHUNK_MAX (16 << 20)
+#define TEXT_OUT_BUF (64 * 1024)
+
+typedef struct TextFile {
+    const char *name; // NULL for standard input
+    const char *data;
+    size_t size;
+    int mapped;
+} TextFile;
+
+typedef struct TextChunk TextChunk;
+typedef void (*TextChunkFn)(TextChunk *c);
+
+struct TextChunk {
+    TextFile *file;
+    const char *start, *end;
+    TextChunkFn fn;
+    const void *opts;
+    size_t lines; // newlines in the chunk, where the command needs them
+    size_t words, count;
+    void *out; // command specific results
+};
+
+static size_t (*countByte)(const char *p, size_t n, char c);
+static const char *(*findLiteral)(const char *h, size_t n, const char *s, size_t m);
+static pthread_once_t textSimdOnce = PTHREAD_ONCE_INIT;
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+size_t countByteAvx2(const char *p, size_t n, char c) {
+    size_t total = 0, i = 0;
+    __m256i needle = _mm256_set1_epi8(c), zero = _mm256_setzero_si256();
+    while (n - i >= 32) {
+        // byte counters, folded before they can wrap
+        __m256i acc = zero;
+        for (int k = 0; k < 255 && n - i >= 32; k++, i += 32)
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), needle));
+        __m256i sums = _mm256_sad_epu8(acc, zero);
+        total += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                 _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    }
+    for (; i < n; i++) total += p[i] == c;
+    return total;
+}
+
+size_t countByteSse2(const char *p, size_t n, char c) {
+    size_t total = 0, i = 0;
+    __m128i needle = _mm_set1_epi8(c), zero = _mm_setzero_si128();
+    while (n - i >= 16) {
+        __m128i acc = zero;
+        for (int k = 0; k < 255 && n - i >= 16; k++, i += 16)
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), needle));
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        total += _mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+    }
+    for (; i < n; i++) total += p[i] == c;
+    return total;
+}
+
+// Candidates are positions where both the first and the last byte of the
+// needle match, 32 at a time; only those are compared in full
+__attribute__((target("avx2")))
+const char *findLiteralAvx2(const char *h, size_t n, const char *s, size_t m) {
+    if (m == 1) return memchr(h, s[0], n);
+    __m256i first = _mm256_set1_epi8(s[0]), last = _mm256_set1_epi8(s[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(h + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(h + i + m - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                              _mm256_cmpeq_epi8(b, last)));
+        for (; mask != 0; mask &= mask - 1) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(h + i + bit + 1, s + 1, m - 2) == 0) return h + i + bit;
+        }
+    }
+    return i < n ? memmem(h + i, n - i, s, m) : NULL;
+}
+
+const char *findLiteralSse2(const char *h, size_t n, const char *s, size_t m) {
+    if (m == 1) return memchr(h, s[0], n);
+    __m128i first = _mm_set1_epi8(s[0]), last = _mm_set1_epi8(s[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(h + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(h + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        for (; mask != 0; mask &= mask - 1) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(h + i + bit + 1, s + 1, m - 2) == 0) return h + i + bit;
+        }
+    }
+    return i < n ? memmem(h + i, n - i, s, m) : NULL;
+}
+#else
+size_t countBytePortable(const char *p, size_t n, char c) {
+    size_t total = 0;
+    const char *end = p + n;
+    while ((p = memchr(p, c, end - p)) != NULL) {
+        total++;
+        p++;
+    }
+    return total;
+}
+
+const char *findLiteralPortable(const char *h, size_t n, const char *s, size_t m) {
+    return memmem(h, n, s, m);
+}
+#endif
+
+void initTextSimd() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    int avx2 = __builtin_cpu_supports("avx2");
+    countByte = avx2 ? countByteAvx2 : countByteSse2;
+    findLiteral = avx2 ? findLiteralAvx2 : findLiteralSse2;
+#else
+    countByte = countBytePortable;
+    findLiteral = findLiteralPortable;
+#endif
+}
+
+const char *textName(const TextFile *f) {
+    return f->name ? f->name : "(standard input)";
+}
+
+// Map a file, or read standard input (name NULL) or anything that cannot
+// be mapped into memory. Returns 0, or -1 after printing the error.
+int textOpen(const char *cmd, const char *name, TextFile *f) {
+    memset(f, 0, sizeof(*f));
+    f->name = name;
+    f->data = "";
+    int fd = name == NULL ? STDIN_FILENO : open(name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "%s: %s: %s\n", cmd, textName(f), strerror(errno));
+        if (fd > STDIN_FILENO) close(fd);
+        return -1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s: %s: %s\n", cmd, textName(f), strerror(EISDIR));
+        close(fd);
+        return -1;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+            f->data = map;
+            f->size = st.st_size;
+            f->mapped = 1;
+        }
+    }
+    if (!f->mapped && !(S_ISREG(st.st_mode) && st.st_size == 0)) {
+        char *buf = NULL;
+        size_t cap = 0;
+        ssize_t n = -1;
+        for (;;) {
+            if (f->size == cap) {
+                cap = cap ? cap * 2 : 1 << 20;
+                char *b = realloc(buf, cap);
+                if (b == NULL) {
+                    errno = ENOMEM;
+                    break;
+                }
+                buf = b;
+            }
+            n = readInterruptible(fd, buf + f->size, cap - f->size);
+            if (n > 0) f->size += n;
+            else if (n == 0 || errno != EINTR) break;
+        }
+        if (n != 0) {
+            if (errno != ECANCELED) fprintf(stderr, "%s: %s: %s\n", cmd, textName(f), strerror(errno));
+            free(buf);
+            if (fd > STDIN_FILENO) close(fd);
+            return -1;
+        }
+        if (f->size == 0) free(buf); // textClose only frees what holds data
+        else f->data = buf;
+    }
+    if (fd > STDIN_FILENO) close(fd);
+    return 0;
+}
+
+void textClose(TextFile *f) {
+    if (f->mapped) munmap((void *)f->data, f->size);
+    else if (f->size > 0) free((char *)f->data);
+}
+
+// Open every file named in argv (standard input if there are none).
+// Returns the number opened; *status is set to 2 if any failed.
+int textOpenAll(const char *cmd, char **argv, TextFile **files, int *status) {
+    int n = 0;
+    while (argv[n] != NULL) n++;
+    *files = calloc(n ? n : 1, sizeof(TextFile));
+    if (*files == NULL) return 0;
+    int opened = 0;
+    if (n == 0 && textOpen(cmd, NULL, &(*files)[opened]) == 0) opened++;
+    for (int i = 0; i < n; i++) {
+        if (textOpen(cmd, argv[i], &(*files)[opened]) == 0) opened++;
+        else *status = 2;
+    }
+    return opened;
+}
+
+void textCloseAll(TextFile *files, int n) {
+    for (int i = 0; i < n; i++) textClose(&files[i]);
+    free(files);
+}
+
+// After Ctrl-C the rest of the chunks are skipped, their out left NULL
+void textChunkTask(void *arg) {
+    TextChunk *c = arg;
+    if (!interruptRequested()) c->fn(c);
+}
+
+// Cut the files into line-aligned chunks, in order, and run fn on each
+// on the work pool. Returns the chunks (count in *nchunks), or NULL.
+TextChunk *textRun(const char *cmd, TextFile *files, int nfiles, TextChunkFn fn, const void *opts,
+                   size_t *nchunks) {
+    pthread_once(&textSimdOnce, initTextSimd);
+    int threads = poolDefaultThreads();
+    size_t total = 0;
+    for (int i = 0; i < nfiles; i++) total += files[i].size;
+    size_t target = total / (threads * 4);
+    if (target < TEXT_CHUNK_MIN) target = TEXT_CHUNK_MIN;
+    if (target > TEXT_CHUNK_MAX) target = TEXT_CHUNK_MAX;
+
+    size_t n = 0, cap = 0;
+    TextChunk *chunks = NULL;
+    for (int i = 0; i < nfiles; i++) {
+        const char *p = files[i].data, *end = p + files[i].size;
+        do {
+            const char *stop = end - p > (ptrdiff_t)target ? p + target : end;
+            if (stop < end) {
+                const char *nl = memchr(stop, '\n', end - stop);
+                stop = nl ? nl + 1 : end;
+            }
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                TextChunk *c = realloc(chunks, cap * sizeof(TextChunk));
+                if (c == NULL) {
+                    free(chunks);
+                    fprintf(stderr, "%s: %s\n", cmd, strerror(ENOMEM));
+                    return NULL;
+                }
+                chunks = c;
+            }
+            chunks[n++] = (TextChunk){.file = &files[i], .start = p, .end = stop, .fn = fn, .opts = opts};
+            p = stop;
+        } while (p < end);
+    }
+
+    WorkPool pool;
+    if (n == 1 || poolStart(&pool, threads) == -1) {
+        for (size_t i = 0; i < n; i++) textChunkTask(&chunks[i]);
+    } else {
+        for (size_t i = 0; i < n; i++) poolSubmit(&pool, textChunkTask, &chunks[i]);
+        poolStop(&pool);
+    }
+    *nchunks = n;
+    return chunks;
+}
+
+// Buffered writes to standard output that stop at the first failure
+// (a closed pipe, say) instead of printing an error per line
+typedef struct TextOut {
+    char buf[TEXT_OUT_BUF];
+    size_t len;
+    int failed;
+} TextOut;
+
+void textFlush(TextOut *o) {
+    if (!o->failed && o->len > 0 && writeFully(STDOUT_FILENO, o->buf, o->len) != o->len) o->failed = 1;
+    o->len = 0;
+}
+
+void textPut(TextOut *o, const char *p, size_t n) {
+    if (o->len + n > sizeof(o->buf)) {
+        textFlush(o);
+        if (n > sizeof(o->buf)) {
+            if (!o->failed && writeFully(STDOUT_FILENO, p, n) != n) o->failed = 1;
+            return;
+        }
+    }
+    memcpy(o->buf + o->len, p, n);
+    o->len += n;
+}
+
+// The nth (1-based) blank-separated field of [p, end), or NULL
+const char *lineField(const char *p, const char *end, int n, size_t *len) {
+    for (;;) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+        if (p == end) return NULL;
+        const char *f = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;
+        if (--n == 0) {
+            *len = p - f;
+            return f;
+        }
+    }
+}
+
+// ===== Parallel runner =====
+// parallel runs one command per input, up to N at a time, from the shell
+// itself: there is no xargs or GNU parallel in between, and profile
+// builtins work as the command. Each job's stdout goes to a pipe of its
+// own and is printed whole, in input order, once the job and every job
+// before it have finished. One poll loop watches the pipes together with
+// the SIGCHLD signalfd, so nothing is polled on a timer.
+
+#define PAR_FREE ((size_t)-1)
+
+typedef struct ParSlot {
+    size_t input; // index of the input it runs, PAR_FREE if unused
+    pid_t pid;    // -1 once reaped
+    int fd;       // read end of the output pipe, -1 at end of file
+    char *name;   // command name, for stats
+    struct timespec start;
+    int64_t traceStart;
+} ParSlot;
+
+typedef struct ParResult {
+    char *out;
+    size_t len, cap;
+    int status;
+    int done;
+} ParResult;
+
+// Expand one template word for an input: {} is the input, {.} the input
+// without its extension, {/} its base name and {#} the job number
+char *parExpand(const char *word, const char *input, size_t jobNo) {
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    const char *base = strrchr(input, '/');
+    base = base != NULL ? base + 1 : input;
+    const char *dot = strrchr(base, '.');
+    int stem = dot != NULL && dot != base ? (int)(dot - input) : (int)strlen(input);
+
+    bufAppend(&buf, &len, &cap, "%s", "");
+    for (const char *p = word; *p != '\0';) {
+        if (strncmp(p, "{}", 2) == 0) {
+            bufAppend(&buf, &len, &cap, "%s", input);
+            p += 2;
+        } else if (strncmp(p, "{.}", 3) == 0) {
+            bufAppend(&buf, &len, &cap, "%.*s", stem, input);
+            p += 3;
+        } else if (strncmp(p, "{/}", 3) == 0) {
+            bufAppend(&buf, &len, &cap, "%s", base);
+            p += 3;
+        } else if (strncmp(p, "{#}", 3) == 0) {
+            bufAppend(&buf, &len, &cap, "%zu", jobNo);
+            p += 3;
+        } else {
+            bufAppend(&buf, &len, &cap, "%c", *p++);
+        }
+    }
+    return buf;
+}
+
+int hasPlaceholder(const char *word) {
+    return strstr(word, "{}") || strstr(word, "{.}") || strstr(word, "{/}") || strstr(word, "{#}");
+}
+
+// Append the non-empty lines of in to *inputs
+int readInputs(FILE *in, char ***inputs, size_t *n, size_t *cap) {
+    char *line = NULL;
+    size_t lcap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &lcap, in)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+        if (len == 0) continue;
+        if (*n == *cap) {
+            *cap = *cap ? *cap * 2 : 256;
+            char **t = realloc(*inputs, *cap * sizeof(char *));
+            if (t == NULL) break;
+            *inputs = t;
+        }
+        (*inputs)[(*n)++] = strdup(line);
+    }
+    free(line);
+    return ferror(in) ? -1 : 0;
+}
+
+// Start the job for inputs[i] in slot s. Its stdin is /dev/null, so jobs
+// never compete with the input list for the terminal or a pipe.
+int parStart(ParSlot *s, char **tmpl, int ntmpl, const char *input, size_t i, int nullFd) {
+    int append = 1;
+    for (int w = 0; w < ntmpl; w++) {
+        if (hasPlaceholder(tmpl[w])) append = 0;
+    }
+    char **argv = calloc(ntmpl + 2, sizeof(char *));
+    if (argv == NULL) return -1;
+    for (int w = 0; w < ntmpl; w++) argv[w] = parExpand(tmpl[w], input, i + 1);
+    if (append) argv[ntmpl] = strdup(input);
+
+    int fds[2];
+    pid_t pid = -1;
+    if (pipe2(fds, O_CLOEXEC) == 0) {
+        const Builtin *b = findBuiltin(argv[0], currentProfile);
+        const char *path = b == NULL ? lookupCommand(argv[0], 1) : NULL;
+        if (b != NULL) {
+            pid = launchBuiltin(b, argv, nullFd, fds[1], &fds[0], 1, NULL, NULL);
+        } else if (path != NULL) {
+            pid = launchProcess(path, argv, nullFd, fds[1], NULL, 0, NULL, NULL);
+        } else {
+            fprintf(stderr, "parallel: %s: command not found\n", argv[0]);
+        }
+        close(fds[1]);
+        if (pid == -1) close(fds[0]);
+    } else {
+        perror("parallel: pipe");
+    }
+    if (pid != -1) s->name = argv[0];
+    else free(argv[0]);
+    for (int w = 1; w <= ntmpl; w++) free(argv[w]);
+    free(argv);
+    if (pid == -1) return -1;
+
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    s->input = i;
+    s->pid = pid;
+    s->fd = fds[0];
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+    s->traceStart = traceStart();
+    return 0;
+}
+
+// Read what is waiting in a job's pipe; closes it at end of file
+void parDrain(ParSlot *s, ParResult *r) {
+    for (;;) {
+        if (r->cap - r->len < 65536) {
+            size_t cap = r->cap ? r->cap * 2 : 65536;
+            while (cap - r->len < 65536) cap *= 2;
+            char *out = realloc(r->out, cap);
+            if (out == NULL) break;
+            r->out = out;
+            r->cap = cap;
+        }
+        ssize_t n = read(s->fd, r->out + r->len, r->cap - r->len);
+        if (n > 0) {
+            r->len += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return;
+        break;
+    }
+    close(s->fd);
+    s->fd = -1;
+}
+
+// parallel [-j N] [-a file] [--halt[=now]] command [arg...] [::: input...]
+int cmd_parallel(char **parsed) {
+    int jobs = poolDefaultThreads();
+    int halt = 0; // 1: start nothing new after a failure, 2: also kill the rest
+    const char *inputFile = NULL;
+    int i = 1;
+    for (; parsed[i] != NULL && parsed[i][0] == '-'; i++) {
+        const char *opt = parsed[i];
+        if (strcmp(opt, "--halt") == 0) {
+            halt = 1;
+        } else if (strcmp(opt, "--halt=now") == 0) {
+            halt = 2;
+        } else if ((opt[1] == 'j' || opt[1] == 'a') && (opt[2] != '\0' || parsed[i + 1] != NULL)) {
+            const char *val = opt[2] != '\0' ? opt + 2 : parsed[++i]; // -j4 or -j 4
+            if (opt[1] == 'a') {
+                inputFile = val;
+                continue;
+            }
+            char *end;
+            long n = strtol(val, &end, 10);
+            if (*end != '\0' || n < 1 || n > 4096) {
+                printf("parallel: bad value '%s' for -j. Type 'help parallel' for usage.\n", val);
+                return 2;
+            }
+            jobs = (int)n;
+        } else {
+            printf("parallel: bad option '%s'. Type 'help parallel' for usage.\n", opt);
+            return 2;
+        }
+    }
+
+    char **tmpl = &parsed[i];
+    int ntmpl = 0;
+    while (tmpl[ntmpl] != NULL && strcmp(tmpl[ntmpl], ":::") != 0) ntmpl++;
+    if (ntmpl == 0) {
+        printf("parallel: no command given. Type 'help parallel' for usage.\n");
+        return 2;
+    }
+
+    char **inputs = NULL;
+    size_t n = 0, cap = 0;
+    if (tmpl[ntmpl] != NULL) {
+        for (char **a = &tmpl[ntmpl + 1]; *a != NULL; a++) {
+            FILE *in = fmemopen(*a, strlen(*a), "r");
+            if (in == NULL) continue;
+            readInputs(in, &inputs, &n, &cap); // one input per argument
+            fclose(in);
+        }
+    } else {
+        FILE *in = inputFile != NULL ? fopen(inputFile, "r") : stdin;
+        if (in == NULL) {
+            perror(inputFile);
+            return 2;
+        }
+        if (readInputs(in, &inputs, &n, &cap) != 0) perror("parallel: read");
+        if (in != stdin) fclose(in);
+        else clearerr(stdin);
+    }
+    if (n == 0) {
+        free(inputs);
+        return 0;
+    }
+
+    ParResult *results = calloc(n, sizeof(ParResult));
+    double *latency = malloc(n * sizeof(double));
+    ParSlot *slots = malloc(jobs * sizeof(ParSlot));
+    struct pollfd *pfds = malloc((jobs + 1) * sizeof(struct pollfd));
+    int *pslot = malloc((jobs + 1) * sizeof(int));
+    int nullFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (results == NULL || latency == NULL || slots == NULL || pfds == NULL || pslot == NULL) {
+        fprintf(stderr, "parallel: out of memory\n");
+        n = 0;
+    }
+    for (int s = 0; s < jobs && slots != NULL; s++) slots[s].input = PAR_FREE;
+
+    // also when run as a pipeline stage, where it is not blocked yet:
+    // the signalfd only sees blocked signals
+    sigset_t chld, oldMask;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &chld, &oldMask);
+
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    size_t next = 0, printed = 0, finished = 0, failed = 0;
+    int running = 0, stop = 0, interrupted = 0;
+    while (n > 0) {
+        for (int s = 0; s < jobs && !stop && next < n && running < jobs; s++) {
+            if (slots[s].input != PAR_FREE) continue;
+            if (parStart(&slots[s], tmpl, ntmpl, inputs[next], next, nullFd) == 0) {
+                running++;
+            } else {
+                results[next].status = 127;
+                results[next].done = 1;
+                failed++;
+                if (halt) stop = 1;
+            }
+            next++;
+        }
+
+        int np = 0;
+        for (int s = 0; s < jobs; s++) {
+            if (slots[s].input == PAR_FREE || slots[s].fd == -1) continue;
+            pfds[np] = (struct pollfd){slots[s].fd, POLLIN, 0};
+            pslot[np++] = s;
+        }
+        if (running > 0) {
+            pfds[np] = (struct pollfd){jobSignalFd, POLLIN, 0};
+            // without a signalfd, look for exits every 10ms
+            if (poll(pfds, np + 1, jobSignalFd == -1 ? 10 : -1) < 0 && errno != EINTR) {
+                perror("parallel: poll");
+                break;
+            }
+            for (int k = 0; k < np; k++) {
+                if (pfds[k].revents != 0)
+                    parDrain(&slots[pslot[k]], &results[slots[pslot[k]].input]);
+            }
+            if (pfds[np].revents != 0 && drainJobSignals()) {
+                interrupted = stop = 1;
+            }
+        }
+
+        for (int s = 0; s < jobs; s++) {
+            ParSlot *sl = &slots[s];
+            if (sl->input == PAR_FREE) continue;
+            int st;
+            struct rusage ru;
+            if (sl->pid != -1 && wait4(sl->pid, &st, WNOHANG, &ru) == sl->pid) {
+                results[sl->input].status = exitCode(st);
+                latency[finished] = elapsedSince(&sl->start);
+                recordStat(sl->name, latency[finished++], &ru);
+                traceChild(sl->pid, sl->name, sl->traceStart);
+                free(sl->name);
+                sl->pid = -1;
+            }
+            if (sl->pid == -1 && sl->fd != -1 && stop && (halt == 2 || interrupted)) {
+                // killed: do not wait for its children to let go of the pipe
+                parDrain(sl, &results[sl->input]);
+                if (sl->fd != -1) close(sl->fd);
+                sl->fd = -1;
+            }
+            if (sl->pid != -1 || sl->fd != -1) continue;
+
+            ParResult *r = &results[sl->input];
+            r->done = 1;
+            if (r->status != 0) {
+                failed++;
+                if (halt) stop = 1;
+            }
+            sl->input = PAR_FREE;
+            running--;
+        }
+        if (stop && (halt == 2 || interrupted)) {
+            for (int s = 0; s < jobs; s++) {
+                if (slots[s].input != PAR_FREE && slots[s].pid != -1) kill(slots[s].pid, SIGTERM);
+            }
+        }
+
+        // print finished jobs in input order
+        fflush(stdout);
+        while (printed < n && results[printed].done) {
+            writeFully(STDOUT_FILENO, results[printed].out, results[printed].len);
+            free(results[printed].out);
+            results[printed].out = NULL;
+            printed++;
+        }
+        if (running == 0 && (stop || next == n)) break;
+    }
+    double secs = elapsedSince(&t0);
+
+    drainJobSignals(); // exits already handled here
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+
+    if (finished > 0) {
+        qsort(latency, finished, sizeof(double), compareDoubles);
+        fprintf(stderr, "parallel: %zu jobs, %zu failed", finished, failed);
+        if (next < n) fprintf(stderr, ", %zu not started", n - next);
+        fprintf(stderr, " in %.2f s (%.1f jobs/s); latency p50 %.3f s, p95 %.3f s, p99 %.3f s, max %.3f s\n",
+                secs, secs > 0 ? finished / secs : 0.0, percentileSorted(latency, finished, 50),
+                percentileSorted(latency, finished, 95), percentileSorted(latency, finished, 99),
+                latency[finished - 1]);
+    }
+
+    for (size_t k = 0; k < n; k++) {
+        free(inputs[k]);
+        if (results != NULL) free(results[k].out);
+    }
+    free(inputs);
+    free(results);
+    free(latency);
+    free(slots);
+    free(pfds);
+    free(pslot);
+    if (nullFd != -1) close(nullFd);
+    if (interrupted) return 130;
+    return failed > 101 ? 101 : (int)failed;
+}
+
+// ===== Zero-copy relay =====
+// cat and tee move data with splice(2), tee(2), copy_file_range(2) and
+// sendfile(2): bytes go from the page cache or a pipe buffer to the next
+// pipe or file inside the kernel, never through a user-space buffer. Which
+// call applies depends on both ends: splice needs a pipe on one side,
+// copy_file_range two regular files, sendfile a file to read. Where none
+// does (a terminal, or an O_APPEND file, which splice refuses) the data is
+// copied with read/write.
+
+#define RELAY_CHUNK (1 << 20) // most bytes asked of one call
+
+// Errors meaning "this call does not work for these two descriptors"
+int relayUnsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EBADF || err == EOPNOTSUPP;
+}
+
+// Copy the rest of in to out with read/write; 0 or -1
+int relayCopy(int in, int out) {
+    char *buf = malloc(RELAY_CHUNK);
+    if (buf == NULL) return -1;
+    ssize_t n;
+    while ((n = readInterruptible(in, buf, RELAY_CHUNK)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (writeFully(out, buf, n) != (size_t)n) {
+            n = -1;
+            break;
+        }
+    }
+    int err = errno;
+    free(buf);
+    errno = err;
+    return n == 0 ? 0 : -1;
+}
+
+// Copy the rest of in to out in the kernel where possible; 0, or -1 with
+// errno set
+int relayFd(int in, int out) {
+    struct stat si, so;
+    if (fstat(in, &si) != 0 || fstat(out, &so) != 0) return -1;
+    if (S_ISDIR(si.st_mode)) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    // one call per method: 1 = splice, 2 = copy_file_range, 3 = sendfile
+    for (int method = 1; method <= 3; method++) {
+        if (method == 1 && !S_ISFIFO(si.st_mode) && !S_ISFIFO(so.st_mode)) continue;
+        if (method == 2 && !(S_ISREG(si.st_mode) && S_ISREG(so.st_mode))) continue;
+        if (method == 3 && !S_ISREG(si.st_mode)) continue;
+        int moved = 0;
+        ssize_t n;
+        for (;;) {
+            if (interruptRequested()) {
+                errno = ECANCELED;
+                return -1;
+            }
+            // splice waits for a pipe or terminal without seeing Ctrl-C
+            if (method == 1 && waitReadable(in) != 0) n = -1;
+            else if (method == 1) n = splice(in, NULL, out, NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+            else if (method == 2) n = copy_file_range(in, NULL, out, NULL, RELAY_CHUNK, 0);
+            else n = sendfile(out, in, NULL, RELAY_CHUNK);
+            if (n > 0) {
+                moved = 1;
+            } else if (n == 0) {
+                return 0;
+            } else if (errno != EINTR) {
+                break;
+            }
+        }
+        if (moved || !relayUnsupported(errno)) return -1;
+    }
+    return relayCopy(in, out);
+}
+
+// Move exactly *len bytes from pipe in to out, by splice or, for an out
+// that refuses splice, read/write; *copy remembers that. 0, or -1 with
+// what is still in the pipe left in *len.
+int relayDrain(int in, int out, size_t *len, int *copy) {
+    char *buf = NULL;
+    while (*len > 0) {
+        ssize_t n;
+        if (!*copy) {
+            n = splice(in, NULL, out, NULL, *len, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno != EINTR && relayUnsupported(errno)) {
+                *copy = 1;
+                continue;
+            }
+        } else {
+            if (buf == NULL && (buf = malloc(RELAY_CHUNK)) == NULL) return -1;
+            n = read(in, buf, *len < RELAY_CHUNK ? *len : RELAY_CHUNK);
+            if (n > 0 && writeFully(out, buf, n) != (size_t)n) n = -1;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            int err = n == 0 ? EIO : errno;
+            free(buf);
+            errno = err;
+            return -1;
+        }
+        *len -= n;
+    }
+    free(buf);
+    return 0;
+}
+
+// Copy in to every one of outs. Each round splices what in has into a pipe
+// of our own, tee(2)s it into one more own pipe per further output and
+// splices every pipe to its output. The own pipes start each round empty
+// and as large as the round, so tee() always copies it whole. An output
+// that fails is reported, then fed to /dev/null so the others go on.
+// Returns 0, 130 after Ctrl-C, or 1 if anything failed.
+int relayTee(const char *cmd, int in, const int *outs, const char **names, int nouts) {
+    int (*pipes)[2] = calloc(nouts, sizeof(*pipes));
+    int *copy = calloc(nouts, sizeof(int));
+    int *dead = calloc(nouts, sizeof(int));
+    int status = 0, npipes = 0, null = -1;
+    if (pipes == NULL || copy == NULL || dead == NULL) {
+        status = 1;
+        goto done;
+    }
+    int chunk = RELAY_CHUNK;
+    for (; npipes < nouts; npipes++) {
+        if (pipe2(pipes[npipes], O_CLOEXEC) == -1) {
+            perror(cmd);
+            status = 1;
+            goto done;
+        }
+        setPipeSize(pipes[npipes][1]);
+        int size = fcntl(pipes[npipes][1], F_GETPIPE_SZ);
+        if (size > 0 && size < chunk) chunk = size;
+    }
+
+    int spliceIn = 1;
+    char *buf = NULL;
+    for (;;) {
+        ssize_t n;
+        if (waitReadable(in) != 0) { // Ctrl-C while waiting for input
+            n = -1;
+        } else if (spliceIn) {
+            n = splice(in, NULL, pipes[0][1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno != EINTR && relayUnsupported(errno)) {
+                spliceIn = 0; // a terminal, say: read it into the pipe
+                continue;
+            }
+        } else {
+            if (buf == NULL && (buf = malloc(chunk)) == NULL) break;
+            n = read(in, buf, chunk);
+            if (n > 0 && writeFully(pipes[0][1], buf, n) != (size_t)n) n = -1;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == ECANCELED) {
+            status = 130;
+        } else if (n < 0) {
+            fprintf(stderr, "%s: read error: %s\n", cmd, strerror(errno));
+            status = 1;
+        }
+        if (n <= 0) break;
+
+        for (int k = 1; k < nouts; k++) {
+            ssize_t m;
+            do m = tee(pipes[0][0], pipes[k][1], n, 0);
+            while (m < 0 && errno == EINTR);
+            if (m != n) {
+                fprintf(stderr, "%s: tee: %s\n", cmd, m < 0 ? strerror(errno) : "short copy");
+                free(buf);
+                status = 1;
+                goto done;
+            }
+        }
+        for (int k = 0; k < nouts; k++) {
+            size_t left = n;
+            while (relayDrain(pipes[k][0], dead[k] ? null : outs[k], &left, &copy[k]) != 0) {
+                if (dead[k]) {
+                    free(buf);
+                    status = 1;
+                    goto done;
+                }
+                fprintf(stderr, "%s: %s: %s\n", cmd, names[k], strerror(errno));
+                status = 1;
+                dead[k] = 1; // the rest goes to /dev/null
+                if (null == -1) null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+            }
+        }
+    }
+    free(buf);
+
+done:
+    for (int k = 0; k < npipes; k++) {
+        close(pipes[k][0]);
+        close(pipes[k][1]);
+    }
+    if (null != -1) close(null);
+    free(pipes);
+    free(copy);
+    free(dead);
+    return status;
+}
+
+// An option only the system's command knows about: hand it over
+int relayHasOption(char **parsed, const char *ours) {
+    for (int i = 1; parsed[i] != NULL; i++) {
+        if (strcmp(parsed[i], "--") == 0) return 0;
+        if (parsed[i][0] == '-' && parsed[i][1] != '\0' && (ours == NULL || strcmp(parsed[i], ours) != 0))
+            return 1;
+    }
+    return 0;
+}
+
+// cat [file...]: each file ("-", or none at all: standard input) in turn to
+// standard output
+int cmd_cat(char **parsed) {
+    if (relayHasOption(parsed, NULL)) {
+        fflush(stdout);
+        return execArgs(parsed);
+    }
+    fflush(stdout);
+    int i = parsed[1] != NULL && strcmp(parsed[1], "--") == 0 ? 2 : 1;
+    char *stdinOnly[] = {"-", NULL};
+    char **files = parsed[i] != NULL ? parsed + i : stdinOnly;
+    int status = 0, stop = 0;
+    struct stat out, in;
+    int haveOut = fstat(STDOUT_FILENO, &out) == 0;
+    for (; *files != NULL && !stop; files++) {
+        int isStdin = strcmp(*files, "-") == 0;
+        int fd = isStdin ? STDIN_FILENO : open(*files, O_RDONLY | O_CLOEXEC);
+        // cat f >> f would read its own output until the disk is full
+        if (fd != -1 && haveOut && fstat(fd, &in) == 0 && S_ISREG(in.st_mode) &&
+            in.st_dev == out.st_dev && in.st_ino == out.st_ino) {
+            fprintf(stderr, "cat: %s: input file is output file\n", *files);
+            status = 1;
+        } else if (fd == -1 || relayFd(fd, STDOUT_FILENO) != 0) {
+            int err = errno;
+            if (err == ECANCELED) { // Ctrl-C
+                status = 130;
+                stop = 1;
+            } else {
+                fprintf(stderr, "cat: %s: %s\n", *files, strerror(err));
+                status = 1;
+                if (err == EPIPE) stop = 1; // nobody reads any more
+            }
+        }
+        if (fd != -1 && !isStdin) close(fd);
+    }
+    return status;
+}
+
+// tee [-a] [file...]: standard input to standard output and every file,
+// appending with -a
+int cmd_tee(char **parsed) {
+    if (relayHasOption(parsed, "-a")) {
+        fflush(stdout);
+        return execArgs(parsed);
+    }
+    int append = 0, i = 1;
+    for (; parsed[i] != NULL && parsed[i][0] == '-' && parsed[i][1] != '\0'; i++) {
+        if (strcmp(parsed[i], "--") == 0) {
+            i++;
+            break;
+        }
+        append = 1;
+    }
+    int nfiles = 0;
+    while (parsed[i + nfiles] != NULL) nfiles++;
+    int *outs = malloc((nfiles + 1) * sizeof(int));
+    const char **names = malloc((nfiles + 1) * sizeof(char *));
+    if (outs == NULL || names == NULL) {
+        free(outs);
+        free(names);
+        return 1;
+    }
+
+    int status = 0, nouts = 1;
+    outs[0] = STDOUT_FILENO;
+    names[0] = "standard output";
+    for (int f = 0; f < nfiles; f++) {
+        int fd = open(parsed[i + f], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0666);
+        if (fd == -1) {
+            fprintf(stderr, "tee: %s: %s\n", parsed[i + f], strerror(errno));
+            status = 1;
+            continue;
+        }
+        outs[nouts] = fd;
+        names[nouts++] = parsed[i + f];
+    }
+    fflush(stdout);
+    int relayed = relayTee("tee", STDIN_FILENO, outs, names, nouts);
+    if (relayed != 0) status = relayed;
+    for (int k = 1; k < nouts; k++) {
+        if (close(outs[k]) != 0) {
+            fprintf(stderr, "tee: %s: %s\n", names[k], strerror(errno));
+            status = 1;
+        }
+    }
+    free(outs);
+    free(names);
+    return status;
+}
+
+// pipesize [size]: show or set the buffer size of the pipes the shell
+// makes for pipelines and tee; 0 is the kernel's default
+int cmd_pipesize(char **parsed) {
+    if (parsed[1] == NULL) {
+        if (pipeSize > 0) {
+            printf("pipesize: %d bytes\n", pipeSize);
+        } else {
+            int fds[2], size = 0;
+            if (pipe2(fds, O_CLOEXEC) == 0) {
+                size = fcntl(fds[1], F_GETPIPE_SZ);
+                close(fds[0]);
+                close(fds[1]);
+            }
+            printf("pipesize: %d bytes (kernel default)\n", size);
+        }
+        return 0;
+    }
+    int64_t want = parseSize(parsed[1]);
+    if (want == 0) {
+        pipeSize = 0;
+        return 0;
+    }
+    int got = probePipeSize(want);
+    if (got <= 0) {
+        printf("pipesize: cannot use '%s': %s\n", parsed[1], strerror(errno));
+        return 1;
+    }
+    pipeSize = got;
+    return 0;
+}
+
+// ===== Core profile commands (similar to original Gryffindor) =====
+
+// sanitize [-n]: remove corrupted_files (-n: only count what would go)
+int cmd_sanitize(char **parsed) {
+    int dryRun = parsed[1] != NULL && strcmp(parsed[1], "-n") == 0;
+    int root = workspaceRoot();
+    const char *name = wsItems[WS_CORRUPTED].name;
+    if (root == -1 || faccessat(root, name, F_OK, AT_SYMLINK_NOFOLLOW) != 0) {
+        printf("sanitize: no corrupted files found.\n");
+        return 0;
+    }
+    int status = removeTree("sanitize", root, name, dryRun);
+    if (!dryRun) workspaceForget(WS_CORRUPTED);
+    return status;
+}
+
+int cmd_backup(char **parsed) {
+    (void)parsed;
+    int src = workspaceDir(WS_GOOD);
+    int dst = workspaceDir(WS_BACKUP);
+    if (src == -1 || dst == -1) return 1;
+    return copyTree("backup", src, dst);
+}
+
+// unhide [-n | -f]: move everything in hidden/ to main/
+int cmd_unhide(char **parsed) {
+    return moveWorkspaceItems("unhide", parsed, WS_HIDDEN, WS_MAIN);
+}
+
+// ===== Ops profile commands (similar to original Slytherin) =====
+
+int cmd_truncate_important(char **parsed) {
+    (void)parsed;
+    int fd = openat(workspaceRoot(), "important.txt", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd != -1 && writeFully(fd, "\n", 1) == 1) {
+        close(fd);
+        printf("truncate_important: cleared important.txt.\n");
+        return 0;
+    } else {
+        if (fd != -1) close(fd);
+        printf("truncate_important: could not modify important.txt.\n");
+        return 1;
+    }
+}
+
+// generate_corrupt [generate options]: create file1.txt..file5.txt, empty,
+// in corrupted_files; options make it a generate run into that directory
+int cmd_generate_corrupt(char **parsed) {
+    int dir = workspaceDir(WS_CORRUPTED);
+    if (dir == -1) return 1;
+    GenSpec spec;
+    genDefaults(&spec);
+    spec.count = 5;
+    spec.sizeMin = spec.sizeMax = 0;
+    spec.fanout = 0;
+    spec.prefix = "file";
+    spec.ext = ".txt";
+    spec.start = 1;
+    spec.width = 0;
+    if (parsed[1] == NULL) spec.threads = 1;
+    else if (parseGenOptions("generate_corrupt", parsed, &spec, NULL) != 0) return 1;
+    return generateFiles("generate_corrupt", &spec, dir, wsItems[WS_CORRUPTED].name);
+}
+
+// hide_main [-n | -f]: move everything in main/ to hidden/
+int cmd_hide_main(char **parsed) {
+    return moveWorkspaceItems("hide_main", parsed, WS_MAIN, WS_HIDDEN);
+}
+
+// ===== Data profile commands (similar to original Hufflepuff) =====
+
+// mkdata [generate options]: one new data file in main; options make it a
+// generate run of text files into main instead
+int cmd_mkdata(char **parsed) {
+    int dir = workspaceDir(WS_MAIN);
+    if (dir == -1) return 1;
+
+    if (parsed[1] != NULL) {
+        GenSpec spec;
+        genDefaults(&spec);
+        spec.type = GEN_TEXT;
+        spec.fanout = 0;
+        spec.prefix = "data_";
+        if (parseGenOptions("mkdata", parsed, &spec, NULL) != 0) return 1;
+        return generateFiles("mkdata", &spec, dir, wsItems[WS_MAIN].name);
+    }
+
+    // time, pid and a counter make the name; O_EXCL and the retry cover
+    // whatever another shell in the same workspace picked
+    static unsigned counter = 0;
+    char name[128];
+    int fd = -1;
+    for (int tries = 0; fd == -1 && tries < 100; tries++) {
+        snprintf(name, sizeof(name), "data_%ld_%d_%u.txt", (long)time(NULL), (int)getpid(), counter++);
+        fd = openat(dir, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd == -1 && errno != EEXIST) break;
+    }
+    const char *text = "Data file generated by Data profile.\n";
+    if (fd == -1 || writeFully(fd, text, strlen(text)) != strlen(text)) {
+        perror("mkdata");
+        if (fd != -1) close(fd);
+        return 1;
+    }
+    close(fd);
+    printf("mkdata: created main/%s\n", name);
+    return 0;
+}
+
+// count [-l] [-w] [-c] [file...]: lines, words and bytes like wc
+typedef struct CountOpts {
+    int lines, words, bytes;
+} CountOpts;
+
+void countChunk(TextChunk *c) {
+    const CountOpts *o = c->opts;
+    if (o->lines) c->lines = countByte(c->start, c->end - c->start, '\n');
+    if (o->words) {
+        // chunks start after a newline, so only a file's start has no byte before it
+        int space = c->start == c->file->data || isspace((unsigned char)c->start[-1]);
+        for (const char *p = c->start; p < c->end; p++) {
+            int s = isspace((unsigned char)*p) != 0;
+            c->words += space && !s;
+            space = s;
+        }
+    }
+}
+
+// Columns as wc lays them out: wide enough for the total byte count
+void countPrint(const CountOpts *o, int width, size_t lines, size_t words, size_t bytes, const char *name) {
+    const char *sep = "";
+    if (o->lines) printf("%*zu", width, lines), sep = " ";
+    if (o->words) printf("%s%*zu", sep, width, words), sep = " ";
+    if (o->bytes) printf("%s%*zu", sep, width, bytes);
+    printf(name ? " %s\n" : "\n", name);
+}
+
+int cmd_count(char **parsed) {
+    CountOpts o = {0};
+    int i = 1;
+    for (; parsed[i] != NULL && parsed[i][0] == '-' && parsed[i][1] != '\0'; i++) {
+        if (strcmp(parsed[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *f = parsed[i] + 1; *f; f++) {
+            if (*f == 'l') o.lines = 1;
+            else if (*f == 'w') o.words = 1;
+            else if (*f == 'c') o.bytes = 1;
+            else {
+                printf("count: usage: count [-l] [-w] [-c] [file...]\n");
+                return 2;
+            }
+        }
+    }
+    if (!o.lines && !o.words && !o.bytes) o.lines = o.words = o.bytes = 1;
+
+    int status = 0, noperands = 0;
+    while (parsed[i + noperands] != NULL) noperands++;
+    TextFile *files;
+    int nfiles = textOpenAll("count", parsed + i, &files, &status);
+    if (status != 0) status = 1; // wc's status for a file it cannot read
+    size_t nchunks = 0;
+    TextChunk *chunks = nfiles ? textRun("count", files, nfiles, countChunk, &o, &nchunks) : NULL;
+    if (interruptRequested()) { // the counts would be short
+        free(chunks);
+        textCloseAll(files, nfiles);
+        return 130;
+    }
+    size_t k = 0, total[3] = {0};
+    if (nfiles > 0 && chunks == NULL) status = 1;
+    int width = 1;
+    size_t known = 0;
+    for (int f = 0; f < nfiles; f++) {
+        if (files[f].mapped) known += files[f].size;
+        else if (files[f].size > 0) width = 7; // read from a pipe: wc does not know its size either
+    }
+    char digits[32];
+    int need = snprintf(digits, sizeof(digits), "%zu", known);
+    if (need > width) width = need;
+    if (o.lines + o.words + o.bytes == 1 && nfiles == 1) width = 1;
+    for (int f = 0; f < nfiles; f++) {
+        size_t lines = 0, words = 0;
+        for (; k < nchunks && chunks[k].file == &files[f]; k++) {
+            lines += chunks[k].lines;
+            words += chunks[k].words;
+        }
+        countPrint(&o, width, lines, words, files[f].size, files[f].name);
+        total[0] += lines;
+        total[1] += words;
+        total[2] += files[f].size;
+    }
+    // like wc, a total whenever several files were named, even if some failed
+    if (noperands > 1) countPrint(&o, width, total[0], total[1], total[2], "total");
+    free(chunks);
+    textCloseAll(files, nfiles);
+    return status;
+}
+
+// grep [-c] [-v] [-n] [-F] pattern file...: fixed-string search. Regular
+// expressions, other options and standard input go to the real grep.
+typedef struct GrepOpts {
+    const char *pat;
+    size_t plen;
+    int invert, countOnly, number;
+} GrepOpts;
+
+typedef struct GrepHit {
+    size_t line; // within the chunk, from 0
+    const char *start;
+    size_t len;
+} GrepHit;
+
+typedef struct GrepHits {
+    GrepHit *v;
+    size_t n, cap;
+} GrepHits;
+
+void grepHit(TextChunk *c, size_t line, const char *start, size_t len) {
+    GrepHits *h = c->out;
+    c->count++;
+    if (h == NULL) return;
+    if (h->n == h->cap) {
+        size_t cap = h->cap ? h->cap * 2 : 256;
+        GrepHit *v = realloc(h->v, cap * sizeof(GrepHit));
+        if (v == NULL) return;
+        h->v = v;
+        h->cap = cap;
+    }
+    h->v[h->n++] = (GrepHit){line, start, len};
+}
+
+void grepChunk(TextChunk *c) {
+    const GrepOpts *o = c->opts;
+    c->out = o->countOnly ? NULL : calloc(1, sizeof(GrepHits));
+    const char *pos = c->start, *end = c->end;
+    size_t line = 0;
+    // pos is always the start of a line
+    while (pos < end) {
+        const char *m = findLiteral(pos, end - pos, o->pat, o->plen);
+        const char *ls = end, *le = end; // the line m is on
+        if (m != NULL) {
+            const char *nl = memrchr(pos, '\n', m - pos);
+            ls = nl ? nl + 1 : pos;
+            le = memchr(m, '\n', end - m);
+            if (le == NULL) le = end;
+        }
+        if (o->invert) {
+            for (const char *p = pos; p < ls;) {
+                const char *e = memchr(p, '\n', ls - p);
+                if (e == NULL) e = ls;
+                grepHit(c, line++, p, e - p);
+                p = e + 1;
+            }
+            line++;
+        } else if (m != NULL) {
+            if (o->number) line += countByte(pos, ls - pos, '\n');
+            grepHit(c, line++, ls, le - ls);
+        }
+        if (m == NULL) break;
+        pos = le < end ? le + 1 : end;
+    }
+    if (o->number) {
+        c->lines = o->invert ? countByte(c->start, end - c->start, '\n')
+                             : line + countByte(pos, end - pos, '\n');
+    }
+}
+
+int grepIsLiteral(const char *pat) {
+    return pat[0] != '\0' && strpbrk(pat, "\\.[]*^$\n") == NULL;
+}
+
+int cmd_grep(char **parsed) {
+    GrepOpts o = {0};
+    int fixed = 0, i = 1, native = 1;
+    for (; native && parsed[i] != NULL && parsed[i][0] == '-' && parsed[i][1] != '\0'; i++) {
+        if (strcmp(parsed[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *f = parsed[i] + 1; *f; f++) {
+            if (*f == 'c') o.countOnly = 1;
+            else if (*f == 'v') o.invert = 1;
+            else if (*f == 'n') o.number = 1;
+            else if (*f == 'F') fixed = 1;
+            else native = 0;
+        }
+    }
+    o.pat = parsed[i];
+    if (!native || o.pat == NULL || parsed[i + 1] == NULL || o.pat[0] == '\0' ||
+        strchr(o.pat, '\n') != NULL || (!fixed && !grepIsLiteral(o.pat))) {
+        fflush(stdout);
+        return execArgs(parsed);
+    }
+    o.plen = strlen(o.pat);
+
+    int status = 0;
+    TextFile *files;
+    int nfiles = textOpenAll("grep", parsed + i + 1, &files, &status);
+    int prefix = parsed[i + 2] != NULL;
+    size_t nchunks = 0, selected = 0;
+    TextChunk *chunks = nfiles ? textRun("grep", files, nfiles, grepChunk, &o, &nchunks) : NULL;
+    if (nfiles > 0 && chunks == NULL) status = 2;
+    int interrupted = interruptRequested();
+
+    fflush(stdout);
+    TextOut *out = malloc(sizeof(TextOut));
+    if (out != NULL) {
+        out->len = 0;
+        out->failed = 0;
+    }
+    size_t k = 0;
+    for (int f = 0; f < nfiles && chunks != NULL && out != NULL && !interrupted; f++) {
+        const char *name = textName(&files[f]);
+        size_t base = 0, count = 0;
+        char num[32];
+        for (; k < nchunks && chunks[k].file == &files[f]; k++) {
+            const TextChunk *c = &chunks[k];
+            const GrepHits *h = c->out;
+            for (size_t j = 0; h != NULL && j < h->n; j++) {
+                if (prefix) {
+                    textPut(out, name, strlen(name));
+                    textPut(out, ":", 1);
+                }
+                if (o.number) textPut(out, num, snprintf(num, sizeof(num), "%zu:", base + h->v[j].line + 1));
+                textPut(out, h->v[j].start, h->v[j].len);
+                textPut(out, "\n", 1);
+            }
+            if (h != NULL && h->n < c->count) status = 2; // ran out of memory for hits
+            base += c->lines;
+            count += c->count;
+        }
+        if (o.countOnly) {
+            if (prefix) {
+                textPut(out, name, strlen(name));
+                textPut(out, ":", 1);
+            }
+            textPut(out, num, snprintf(num, sizeof(num), "%zu\n", count));
+        }
+        selected += count;
+    }
+    if (out != NULL) textFlush(out);
+    for (size_t j = 0; j < nchunks; j++) {
+        GrepHits *h = chunks[j].out;
+        if (h != NULL) free(h->v);
+        free(h);
+    }
+    free(out);
+    free(chunks);
+    textCloseAll(files, nfiles);
+    if (interrupted) return 130;
+    return status ? status : selected ? 0 : 1;
+}
+
+// topk [-n N] [-f field] [file...]: the most frequent lines (or fields)
+// with their counts, like sort | uniq -c | sort -rn | head. Every chunk
+// counts into TOP_PARTS tables split by hash, so the merge runs one pool
+// task per part, each keeping only its own N best.
+#define TOP_PARTS 64
+
+typedef struct TopOpts {
+    int field; // 0: whole line
+    size_t n;
+} TopOpts;
+
+typedef struct TopEntry {
+    const char *key; // points into the file data
+    size_t len;
+    uint64_t hash, count;
+} TopEntry;
+
+typedef struct TopTable {
+    TopEntry *slots;
+    size_t cap, count;
+} TopTable;
+
+typedef struct TopMerge {
+    TextChunk *chunks;
+    size_t nchunks, n;
+    int part, failed;
+    TopTable table;
+    TopEntry **best; // heap of the n best, worst on top
+    size_t nbest;
+} TopMerge;
+
+int topAdd(TopTable *t, const char *key, size_t len, uint64_t hash, uint64_t count) {
+    if (2 * (t->count + 1) > t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 64;
+        TopEntry *slots = calloc(cap, sizeof(TopEntry));
+        if (slots == NULL) return -1;
+        for (size_t i = 0; i < t->cap; i++) {
+            if (t->slots[i].count == 0) continue;
+            size_t j = t->slots[i].hash & (cap - 1);
+            while (slots[j].count != 0) j = (j + 1) & (cap - 1);
+            slots[j] = t->slots[i];
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->cap = cap;
+    }
+    size_t j = hash & (t->cap - 1);
+    for (; t->slots[j].count != 0; j = (j + 1) & (t->cap - 1)) {
+        TopEntry *e = &t->slots[j];
+        if (e->hash == hash && e->len == len && memcmp(e->key, key, len) == 0) {
+            e->count += count;
+            return 0;
+        }
+    }
+    t->slots[j] = (TopEntry){key, len, hash, count};
+    t->count++;
+    return 0;
+}
+
+void topChunk(TextChunk *c) {
+    const TopOpts *o = c->opts;
+    TopTable *parts = calloc(TOP_PARTS, sizeof(TopTable));
+    c->out = parts;
+    for (const char *p = c->start; parts != NULL && p < c->end;) {
+        const char *e = memchr(p, '\n', c->end - p);
+        if (e == NULL) e = c->end;
+        const char *key = p;
+        size_t len = e - p;
+        if (o->field > 0) key = lineField(p, e, o->field, &len);
+        if (key != NULL) {
+            uint64_t h = hash64(key, len);
+            if (topAdd(&parts[h >> 58], key, len, h, 1) != 0) c->count++; // dropped
+        }
+        p = e + 1;
+    }
+}
+
+// Order of the output: higher counts first, then by key
+int compareTopEntries(const void *a, const void *b) {
+    const TopEntry *x = *(TopEntry *const *)a, *y = *(TopEntry *const *)b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    int c = memcmp(x->key, y->key, x->len < y->len ? x->len : y->len);
+    return c ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+// Keep e if it is among the m->n best seen so far
+void topOffer(TopMerge *m, TopEntry *e) {
+    TopEntry **h = m->best;
+    size_t i;
+    if (m->nbest < m->n) {
+        // sift up: parents rank after (are worse than) their children
+        for (i = m->nbest++; i > 0 && compareTopEntries(&h[(i - 1) / 2], &e) < 0; i = (i - 1) / 2)
+            h[i] = h[(i - 1) / 2];
+        h[i] = e;
+        return;
+    }
+    if (compareTopEntries(&e, &h[0]) >= 0) return;
+    for (i = 0;;) {
+        size_t c = 2 * i + 1;
+        if (c >= m->nbest) break;
+        if (c + 1 < m->nbest && compareTopEntries(&h[c + 1], &h[c]) > 0) c++;
+        if (compareTopEntries(&h[c], &e) <= 0) break;
+        h[i] = h[c];
+        i = c;
+    }
+    h[i] = e;
+}
+
+void topMergeTask(void *arg) {
+    TopMerge *m = arg;
+    TopTable *t = &m->table;
+    if (m->nchunks == 1) {
+        // nothing to merge: take the chunk's table over
+        TopTable *parts = m->chunks[0].out;
+        *t = parts[m->part];
+        memset(&parts[m->part], 0, sizeof(TopTable));
+    } else {
+        for (size_t k = 0; k < m->nchunks; k++) {
+            TopTable *src = &((TopTable *)m->chunks[k].out)[m->part];
+            for (size_t j = 0; j < src->cap; j++) {
+                TopEntry *e = &src->slots[j];
+                if (e->count != 0 && topAdd(t, e->key, e->len, e->hash, e->count) != 0) m->failed = 1;
+            }
+            free(src->slots);
+            memset(src, 0, sizeof(TopTable));
+        }
+    }
+    m->best = malloc(m->n * sizeof(TopEntry *));
+    for (size_t j = 0; m->best != NULL && j < t->cap; j++)
+        if (t->slots[j].count != 0) topOffer(m, &t->slots[j]);
+    if (m->best == NULL) m->failed = 1;
+}
+
+int cmd_topk(char **parsed) {
+    TopOpts o = {.field = 0, .n = 10};
+    int i = 1;
+    for (; parsed[i] != NULL && parsed[i][0] == '-' && parsed[i][1] != '\0'; i += 2) {
+        char *end = "";
+        long v = parsed[i + 1] ? strtol(parsed[i + 1], &end, 10) : -1;
+        if (strcmp(parsed[i], "-n") == 0 && *end == '\0' && v > 0 && v <= 1000000) o.n = v;
+        else if (strcmp(parsed[i], "-f") == 0 && *end == '\0' && v > 0 && v < INT_MAX) o.field = v;
+        else {
+            printf("topk: usage: topk [-n N] [-f field] [file...]\n");
+            return 2;
+        }
+    }
+
+    int status = 0;
+    TextFile *files;
+    int nfiles = textOpenAll("topk", parsed + i, &files, &status);
+    size_t nchunks = 0;
+    TextChunk *chunks = nfiles ? textRun("topk", files, nfiles, topChunk, &o, &nchunks) : NULL;
+    int interrupted = interruptRequested();
+    int failed = interrupted || (nfiles > 0 && chunks == NULL);
+    for (size_t k = 0; k < nchunks; k++)
+        if (chunks[k].out == NULL || chunks[k].count > 0) failed = 1;
+
+    TopMerge *merges = calloc(TOP_PARTS, sizeof(TopMerge));
+    WorkPool pool;
+    if (!failed && merges != NULL && poolStart(&pool, 0) == 0) {
+        for (int p = 0; p < TOP_PARTS; p++) {
+            merges[p] = (TopMerge){.chunks = chunks, .nchunks = nchunks, .n = o.n, .part = p};
+            poolSubmit(&pool, topMergeTask, &merges[p]);
+        }
+        poolStop(&pool);
+    } else {
+        failed = 1;
+    }
+
+    // the overall N best are among each part's N best
+    TopMerge all = {.n = o.n};
+    all.best = malloc(o.n * sizeof(TopEntry *));
+    for (int p = 0; !failed && p < TOP_PARTS; p++) {
+        failed |= merges[p].failed;
+        for (size_t j = 0; all.best != NULL && j < merges[p].nbest; j++) topOffer(&all, merges[p].best[j]);
+    }
+    if (all.best != NULL) {
+        qsort(all.best, all.nbest, sizeof(TopEntry *), compareTopEntries);
+        for (size_t j = 0; !failed && j < all.nbest; j++)
+            printf("%7llu %.*s\n", (unsigned long long)all.best[j]->count, (int)all.best[j]->len,
+                   all.best[j]->key);
+    }
+    if (interrupted) {
+        status = 130;
+    } else if (failed) {
+        fprintf(stderr, "topk: %s\n", strerror(ENOMEM));
+        status = 2;
+    }
+
+    for (int p = 0; merges != NULL && p < TOP_PARTS; p++) {
+        free(merges[p].table.slots);
+        free(merges[p].best);
+    }
+    for (size_t k = 0; k < nchunks; k++) {
+        TopTable *parts = chunks[k].out;
+        for (int p = 0; parts != NULL && p < TOP_PARTS; p++) free(parts[p].slots);
+        free(parts);
+    }
+    free(all.best);
+    free(merges);
+    free(chunks);
+    textCloseAll(files, nfiles);
+    return status;
+}
+
+// histogram [-f field] [-b buckets] [file...]: distribution of the numbers
+// in one field (default the first); lines without a number are skipped
+typedef struct HistOpts {
+    int field, buckets;
+    double lo, width; // bucket layout, set between the two passes
+} HistOpts;
+
+typedef struct HistPart {
+    size_t n, bad;
+    double sum, min, max;
+    size_t *bins;
+} HistPart;
+
+// The line's number in the chosen field; 0 on success
+int histValue(const HistOpts *o, const char *p, const char *e, double *v) {
+    size_t len;
+    const char *f = lineField(p, e, o->field, &len);
+    char buf[64];
+    if (f == NULL || len >= sizeof(buf)) return -1;
+    memcpy(buf, f, len);
+    buf[len] = '\0';
+    char *end;
+    *v = strtod(buf, &end);
+    return end == buf + len && *v == *v ? 0 : -1; // v != v: NaN
+}
+
+void histScanChunk(TextChunk *c) {
+    const HistOpts *o = c->opts;
+    HistPart *h = calloc(1, sizeof(HistPart));
+    c->out = h;
+    for (const char *p = c->start; h != NULL && p < c->end;) {
+        const char *e = memchr(p, '\n', c->end - p);
+        if (e == NULL) e = c->end;
+        double v;
+        if (histValue(o, p, e, &v) == 0) {
+            if (h->n == 0 || v < h->min) h->min = v;
+            if (h->n == 0 || v > h->max) h->max = v;
+            h->sum += v;
+            h->n++;
+        } else if (e > p) {
+            h->bad++;
+        }
+        p = e + 1;
+    }
+}
+
+void histBinChunk(TextChunk *c) {
+    const HistOpts *o = c->opts;
+    size_t *bins = calloc(o->buckets, sizeof(size_t));
+    c->out = bins;
+    for (const char *p = c->start; bins != NULL && p < c->end;) {
+        const char *e = memchr(p, '\n', c->end - p);
+        if (e == NULL) e = c->end;
+        double v;
+        if (histValue(o, p, e, &v) == 0) {
+            long b = o->width > 0 ? (long)((v - o->lo) / o->width) : 0;
+            bins[b < 0 ? 0 : b >= o->buckets ? o->buckets - 1 : b]++;
+        }
+        p = e + 1;
+    }
+}
+
+int cmd_histogram(char **parsed) {
+    HistOpts o = {.field = 1, .buckets = 10};
+    int i = 1;
+    for (; parsed[i] != NULL && parsed[i][0] == '-' && parsed[i][1] != '\0'; i += 2) {
+        char *end = "";
+        long v = parsed[i + 1] ? strtol(parsed[i + 1], &end, 10) : -1;
+        if (strcmp(parsed[i], "-f") == 0 && *end == '\0' && v > 0 && v < INT_MAX) o.field = v;
+        else if (strcmp(parsed[i], "-b") == 0 && *end == '\0' && v > 0 && v <= 1000) o.buckets = v;
+        else {
+            printf("histogram: usage: histogram [-f field] [-b buckets] [file...]\n");
+            return 2;
+        }
+    }
+
+    int status = 0;
+    TextFile *files;
+    int nfiles = textOpenAll("histogram", parsed + i, &files, &status);
+    size_t nchunks = 0;
+    TextChunk *chunks = nfiles ? textRun("histogram", files, nfiles, histScanChunk, &o, &nchunks) : NULL;
+    HistPart all = {0};
+    for (size_t k = 0; k < nchunks; k++) {
+        HistPart *h = chunks[k].out;
+        if (h == NULL) {
+            status = 2;
+            continue;
+        }
+        if (h->n > 0 && (all.n == 0 || h->min < all.min)) all.min = h->min;
+        if (h->n > 0 && (all.n == 0 || h->max > all.max)) all.max = h->max;
+        all.n += h->n;
+        all.bad += h->bad;
+        all.sum += h->sum;
+        free(h);
+    }
+    free(chunks);
+    if (interruptRequested()) {
+        textCloseAll(files, nfiles);
+        return 130;
+    }
+
+    if (all.n == 0) {
+        printf("histogram: no numbers in field %d\n", o.field);
+        textCloseAll(files, nfiles);
+        return status ? status : 1;
+    }
+    o.lo = all.min;
+    o.width = (all.max - all.min) / o.buckets;
+    chunks = textRun("histogram", files, nfiles, histBinChunk, &o, &nchunks);
+    size_t *bins = calloc(o.buckets, sizeof(size_t)), peak = 1;
+    for (size_t k = 0; chunks != NULL && k < nchunks; k++) {
+        size_t *b = chunks[k].out;
+        for (int j = 0; b != NULL && bins != NULL && j < o.buckets; j++) bins[j] += b[j];
+        if (b == NULL) status = 2;
+        free(b);
+    }
+    if (interruptRequested()) {
+        free(bins);
+        free(chunks);
+        textCloseAll(files, nfiles);
+        return 130;
+    }
+
+    printf("histogram: %zu values, min %g, max %g, mean %g", all.n, all.min, all.max, all.sum / all.n);
+    if (all.bad) printf(" (%zu lines skipped)", all.bad);
+    printf("\n");
+    for (int j = 0; bins != NULL && j < o.buckets; j++)
+        if (bins[j] > peak) peak = bins[j];
+    for (int j = 0; bins != NULL && j < o.buckets; j++) {
+        int bar = (int)(bins[j] * 50 / peak);
+        printf("  [%12g, %12g%c %10zu%s%.*s\n", o.lo + j * o.width,
+               j == o.buckets - 1 ? all.max : o.lo + (j + 1) * o.width, j == o.buckets - 1 ? ']' : ')',
+               bins[j], bar ? "  " : "", bar, "##################################################");
+    }
+    free(bins);
+    free(chunks);
+    textCloseAll(files, nfiles);
+    return status;
+}
+
+int cmd_motivate(char **parsed) {
+    (void)parsed;
+    printf("motivate: Keep going. Small consistent progress beats perfection.\n");
+    return 0;
+}
+
+int cmd_tips(char **parsed) {
+    (void)parsed;
+    printf("tips: File management best practices:\n");
+    printf("  - Keep directories organized by project/type.\n");
+    printf("  - Use clear filenames and dates.\n");
+    printf("  - Backup important data regularly.\n");
+    return 0;
+}
+
+// ===== Net profile commands (similar to original Ravenclaw) =====
+
+int cmd_net_quote(char **parsed) {
+    (void)parsed;
+    const char *wisdoms[] = {
+        "Networks are built on small, reliable links.",
+        "Debugging is like solving a mystery; logs are your clues.",
+        "A good script today beats a perfect script tomorrow.",
+        "Measure first, optimize later."
+    };
+    int numWisdoms = sizeof(wisdoms) / sizeof(wisdoms[0]);
+    srand(time(0));
+    printf("\nQuote: %s\n", wisdoms[rand() % numWisdoms]);
+    return 0;
+}
+
+int cmd_net_quiz(char **parsed) {
+    (void)parsed;
+    const char *riddles[] = {
+        "I connect machines but have no moving parts. What am I?",
+        "I identify a device in a network uniquely. What am I?"
+    };
+    const char *answers[] = {"network cable", "ip address"};
+    int numRiddles = sizeof(riddles) / sizeof(riddles[0]);
+
+    srand(time(0));
+    int index = rand() % numRiddles;
+
+    char userAnswer[100];
+    printf("\nRiddle: %s\nYour Answer: ", riddles[index]);
+    fflush(stdout);
+    // interactive, stdin's buffer is empty: readline reads the descriptor
+    if (waitReadable(STDIN_FILENO) != 0) return 130;
+    if (fgets(userAnswer, sizeof(userAnswer), stdin) == NULL) {
+        printf("\nNo answer provided.\n");
+        return 1;
+    }
+    userAnswer[strcspn(userAnswer, "\n")] = 0;
+
+    for (char *p = userAnswer; *p; p++) *p = (char)tolower((unsigned char)*p);
+
+    if (strcmp(userAnswer, answers[index]) == 0) {
+        printf("\nCorrect!\n");
+        return 0;
+    } else {
+        printf("\nIncorrect. The correct answer is: %s\n", answers[index]);
+        return 1;
+    }
+}
+
+int cmd_find_target(char **parsed) {
+    const char *pattern = parsed[1] != NULL ? parsed[1] : "target.txt";
+    if (workspaceRoot() == -1) return 1;
+    workspaceFile(WS_TARGET);
+    workspaceFile(WS_TARGET_LOCATION);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    namesRefresh();
+    NameHits hits = {NULL, 0, 0};
+    namesLookup(pattern, &hits);
+    if (hits.count > 1) qsort(hits.paths, hits.count, sizeof(char *), compareNames);
+    double ms = elapsedSince(&start) * 1e3;
+
+    // target_location.txt gets the same list, as find used to write it
+    int fd = openat(workspaceRoot(), wsItems[WS_TARGET_LOCATION].name,
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    FILE *out = fd == -1 ? NULL : fdopen(fd, "w");
+    for (size_t i = 0; i < hits.count; i++) {
+        printf("%s\n", hits.paths[i]);
+        if (out) fprintf(out, "%s\n", hits.paths[i]);
+        free(hits.paths[i]);
+    }
+    if (out) fclose(out);
+    else if (fd != -1) close(fd);
+    free(hits.paths);
+
+    if (hits.count == 0) {
+        printf("No target file found.\n");
+        return 1;
+    }
+    printf("find_target: %zu matches in %.1f ms (%u names indexed%s); saved to %s\n",
+           hits.count, ms, names.nentries, names.watching ? ", watching for changes" : "",
+           wsItems[WS_TARGET_LOCATION].name);
+    return 0;
+}
+
+// ===== Sec profile commands (new 5th profile) =====
+
+// scan_temp [-l] [-J] [-t N] [path...]: default paths are the workspace's
+// main, hidden and corrupted_files, skipped if they do not exist yet
+int cmd_scan_temp(char **parsed) {
+    int argc = 0;
+    while (parsed[argc] != NULL) argc++;
+    const char **paths = malloc((argc + 3) * sizeof(char *));
+    if (paths == NULL) return 1;
+
+    int npaths = 0, list = 0, json = 0, top = 10;
+    for (int i = 1; i < argc; i++) {
+        char *end = "";
+        if (strcmp(parsed[i], "-l") == 0) {
+            list = 1;
+        } else if (strcmp(parsed[i], "-J") == 0) {
+            json = 1;
+        } else if (strcmp(parsed[i], "-t") == 0) {
+            top = parsed[i + 1] ? (int)strtol(parsed[++i], &end, 10) : -1;
+            if (*end != '\0' || top < 0 || top > SCAN_TOP_MAX) {
+                printf("scan_temp: -t takes a count from 0 to %d\n", SCAN_TOP_MAX);
+                free(paths);
+                return 1;
+            }
+        } else if (parsed[i][0] == '-' && parsed[i][1] != '\0') {
+            printf("scan_temp: usage: scan_temp [-l] [-J] [-t N] [path...]\n");
+            free(paths);
+            return 1;
+        } else {
+            paths[npaths++] = parsed[i];
+        }
+    }
+
+    int status;
+    if (npaths > 0) {
+        status = scanTrees(AT_FDCWD, paths, npaths, 0, list, top, json);
+    } else {
+        paths[0] = wsItems[WS_MAIN].name;
+        paths[1] = wsItems[WS_HIDDEN].name;
+        paths[2] = wsItems[WS_CORRUPTED].name;
+        status = scanTrees(workspaceRoot(), paths, 3, 1, list, top, json);
+    }
+    free(paths);
+    return status;
+}
+
+int cmd_secure_backup(char **parsed) {
+    (void)parsed;
+    int src = workspaceDir(WS_BACKUP);
+    int store = openSnapStore();
+    if (src == -1 || store == -1) return 1;
+    return snapshotCreate(src, store);
+}
+
+// secure_list: one line per snapshot, oldest first
+int cmd_secure_list(char **parsed) {
+    (void)parsed;
+    int store = openSnapStore();
+    if (store == -1) return 1;
+    size_t n;
+    char **ids = listSnapshots(store, &n);
+    if (n == 0) printf("secure_list: no snapshots yet.\n");
+    for (size_t i = 0; i < n; i++) {
+        char *text = readManifest(store, ids[i], NULL);
+        if (text != NULL) {
+            char *f[5];
+            *strchrnul(text, '\n') = '\0';
+            if (splitFields(text, f, 5) == 5) {
+                time_t created = atoll(f[2]);
+                char when[32];
+                strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+                printf("%-20s %s  %8s files  %10.1f MB\n", ids[i], when, f[3], atoll(f[4]) / 1e6);
+            }
+        }
+        free(text);
+        free(ids[i]);
+    }
+    free(ids);
+    return 0;
+}
+
+// secure_verify [id...]: check every chunk the snapshots (default: all) use
+int cmd_secure_verify(char **parsed) {
+    int store = openSnapStore();
+    if (store == -1) return 1;
+
+    size_t n;
+    char **ids;
+    if (parsed[1] != NULL) {
+        for (n = 0; parsed[n + 1] != NULL; n++) {}
+        ids = malloc(n * sizeof(char *));
+        if (ids == NULL) return 1;
+        for (size_t i = 0; i < n; i++) ids[i] = strdup(parsed[i + 1]);
+    } else {
+        ids = listSnapshots(store, &n);
+    }
+
+    DigestSet set;
+    digestSetInit(&set);
+    int status = 0;
+    for (size_t i = 0; i < n; i++) {
+        char *text = readManifest(store, ids[i], NULL);
+        if (text == NULL || collectChunks(text, &set) != 0) {
+            printf("secure_verify: %s: %s\n", ids[i], text == NULL ? strerror(errno) : "damaged manifest");
+            status = 1;
+        }
+        free(text);
+        free(ids[i]);
+    }
+    free(ids);
+
+    WorkPool pool;
+    atomic_llong ok, bad, missing;
+    atomic_init(&ok, 0);
+    atomic_init(&bad, 0);
+    atomic_init(&missing, 0);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (poolStart(&pool, 0) == -1) {
+        digestSetFree(&set);
+        return 1;
+    }
+    VerifyTask *t = NULL;
+    for (size_t i = 0; i < set.cap; i++) {
+        if (!set.used[i]) continue;
+        if (t == NULL) {
+            t = malloc(sizeof(VerifyTask));
+            if (t == NULL) break;
+            t->storeFd = store;
+            t->n = 0;
+            t->ok = &ok;
+            t->bad = &bad;
+            t->missing = &missing;
+        }
+        memcpy(t->digest[t->n], set.keys[i], SHA256_DIGEST_LENGTH);
+        t->len[t->n++] = set.lens[i];
+        if (t->n == WALK_BATCH) {
+            poolSubmit(&pool, verifyChunksTask, t);
+            t = NULL;
+        }
+    }
+    if (t != NULL) poolSubmit(&pool, verifyChunksTask, t);
+    poolStop(&pool);
+    digestSetFree(&set);
+
+    long long problems = atomic_load(&bad) + atomic_load(&missing);
+    printf("secure_verify: %lld chunks ok, %lld damaged, %lld missing (%.2fs)\n",
+           (long long)atomic_load(&ok), (long long)atomic_load(&bad),
+           (long long)atomic_load(&missing), elapsedSince(&start));
+    if (interruptRequested()) return 130;
+    return status || problems > 0;
+}
+
+// secure_restore id [dir]: rebuild a snapshot into dir (default restore-<id>)
+int cmd_secure_restore(char **parsed) {
+    if (parsed[1] == NULL) {
+        printf("secure_restore: usage: secure_restore <snapshot> [dir]\n");
+        return 1;
+    }
+    int store = openSnapStore();
+    if (store == -1) return 1;
+    char *text = readManifest(store, parsed[1], NULL);
+    if (text == NULL) {
+        printf("secure_restore: %s: no such snapshot\n", parsed[1]);
+        return 1;
+    }
+
+    char dflt[PATH_MAX];
+    const char *target = parsed[2];
+    int base = AT_FDCWD;
+    if (target == NULL) {
+        snprintf(dflt, sizeof(dflt), "restore-%s", parsed[1]);
+        target = dflt;
+        base = workspaceRoot();
+    }
+    if (mkdirat(base, target, 0700) == -1 && errno != EEXIST) {
+        perror(target);
+        free(text);
+        return 1;
+    }
+    int dst = openat(base, target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dst == -1) {
+        perror(target);
+        free(text);
+        return 1;
+    }
+    int status = snapshotRestore(text, store, dst);
+    if (status == 0) printf("secure_restore: restored %s into %s\n", parsed[1], target);
+    close(dst);
+    free(text);
+    return status;
+}
+
+// baseline: record the hashes verify compares against
+int cmd_baseline(char **parsed) {
+    (void)parsed;
+    IntegJob job = {.name = "baseline"};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = integScan(&job);
+    integReport(&job, elapsedSince(&start));
+    if (status == 130) printf("baseline: interrupted, baseline not written\n");
+    else if (integWrite(INTEG_BASELINE, "cbase", &job.found) != 0) status = 1;
+    else printf("baseline: recorded %zu files in %s\n", job.found.count, INTEG_BASELINE);
+    integFree(&job.found);
+    return status;
+}
+
+// verify: list files added, removed or modified since the baseline
+int cmd_verify(char **parsed) {
+    (void)parsed;
+    IntegSet base;
+    long long created = 0;
+    if (integRead(INTEG_BASELINE, "cbase", &base, &created) != 0) {
+        printf("verify: no baseline yet; run 'baseline' first.\n");
+        return 1;
+    }
+    IntegJob job = {.name = "verify"};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = integScan(&job);
+    if (status == 130) { // a partial scan would report the rest as removed
+        integFree(&base);
+        integFree(&job.found);
+        return status;
+    }
+
+    size_t i = 0, j = 0, added = 0, removed = 0, modified = 0;
+    while (i < base.count || j < job.found.count) {
+        IntegRecord *b = i < base.count ? &base.recs[i] : NULL;
+        IntegRecord *f = j < job.found.count ? &job.found.recs[j] : NULL;
+        int cmp = b == NULL ? 1 : f == NULL ? -1 : strcmp(b->path, f->path);
+        if (cmp < 0) {
+            printf("  removed   %s\n", b->path);
+            removed++;
+            i++;
+        } else if (cmp > 0) {
+            printf("  added     %s\n", f->path);
+            added++;
+            j++;
+        } else {
+            if (b->size != f->size || b->hash[0] != f->hash[0] || b->hash[1] != f->hash[1]) {
+                printf("  modified  %s\n", f->path);
+                modified++;
+            }
+            i++;
+            j++;
+        }
+    }
+    integReport(&job, elapsedSince(&start));
+
+    time_t when = created;
+    char date[64];
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&when));
+    if (added + removed + modified == 0) {
+        printf("verify: everything matches the baseline of %s\n", date);
+    } else {
+        printf("verify: %zu added, %zu removed, %zu modified since the baseline of %s\n",
+               added, removed, modified, date);
+        status = 1;
+    }
+    integFree(&base);
+    integFree(&job.found);
+    return status;
+}
+
+// clean_temp [-n] [-r] [pattern...]: remove files matching the patterns
+// (default *_temp.txt) in the current directory; -r also searches
+// subdirectories, -n only lists them
+int cmd_clean_temp(char **parsed) {
+    int dryRun = 0, recursive = 0, i = 1;
+    for (; parsed[i] != NULL && parsed[i][0] == '-'; i++) {
+        if (strcmp(parsed[i], "-n") == 0) {
+            dryRun = 1;
+        } else if (strcmp(parsed[i], "-r") == 0) {
+            recursive = 1;
+        } else {
+            printf("clean_temp: usage: clean_temp [-n] [-r] [pattern...]\n");
+            return 1;
+        }
+    }
+    char *dflt[] = {"*_temp.txt", NULL};
+    char **patterns = parsed[i] != NULL ? &parsed[i] : dflt;
+
+    int dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir == -1) {
+        perror("clean_temp");
+        return 1;
+    }
+    int status = removeMatchingFiles("clean_temp", dir, patterns, recursive, dryRun);
+    close(dir);
+    return status;
+}
+
+// ===== Builtin registry =====
+// Every built-in is registered once here with the profiles it belongs to
+// and its help text; dispatch and "help" are both driven from this table.
+// Lookup goes through a perfect hash: at startup a seed is searched for
+// that gives every name its own slot, so a lookup is one hash, one probe
+// and one strcmp no matter how many built-ins are registered.
+
+#define PROFILE_CORE (1u << 0)
+#define PROFILE_OPS  (1u << 1)
+#define PROFILE_DATA (1u << 2)
+#define PROFILE_NET  (1u << 3)
+#define PROFILE_SEC  (1u << 4)
+#define PROFILE_ALL  0x1fu
+
+typedef int (*BuiltinFn)(char **parsed);
+
+struct Builtin {
+    const char *name;
+    BuiltinFn fn;
+    unsigned profiles;
+    const char *summary; // one line for "help"
+    const char *help;    // "help <name>"
+};
+
+int cmd_cd(char **parsed);
+int cmd_help(char **parsed);
+int cmd_exit(char **parsed);
+
+static const Builtin builtins[] = {
+    {"sanitize", cmd_sanitize, PROFILE_CORE, "remove corrupted files",
+     "sanitize [-n]: remove corrupted_files and everything in it (-n: only count)."},
+    {"backup", cmd_backup, PROFILE_CORE, "backup good_files",
+     "backup: copy ./good_files to ./backup_good_files."},
+    {"unhide", cmd_unhide, PROFILE_CORE, "move hidden files to main",
+     "unhide [-n | -f]: move files from ./hidden to ./main. A name already taken in\n"
+     "  main gets a numbered suffix; -n leaves such files in place, -f overwrites."},
+
+    {"truncate_important", cmd_truncate_important, PROFILE_OPS, "clear important.txt",
+     "truncate_important: clear contents of important.txt."},
+    {"generate_corrupt", cmd_generate_corrupt, PROFILE_OPS, "create corrupted_files",
+     "generate_corrupt [generate options]: create empty file1.txt..file5.txt in\n"
+     "  corrupted_files, or with options, generate files there (see 'help generate')."},
+    {"hide_main", cmd_hide_main, PROFILE_OPS, "move main/* to hidden/",
+     "hide_main [-n | -f]: move files from main to hidden directory. A name already\n"
+     "  taken gets a numbered suffix; -n leaves such files in place, -f overwrites."},
+
+    {"mkdata", cmd_mkdata, PROFILE_DATA, "create sample data file",
+     "mkdata [generate options]: create a new data text file in ./main, or with\n"
+     "  options, generate text files there (see 'help generate')."},
+    {"generate", cmd_generate, PROFILE_DATA | PROFILE_OPS, "write synthetic test files",
+     "generate [-n count] [-s size] [-f fanout] [-t type] [-S seed] [-j threads]\n"
+     "         [-p prefix] [-d dir]: write count files (default 1000) of size bytes\n"
+     "  into dir (default ./generated in the workspace). size is fixed (4k), a\n"
+     "  uniform range (1k-64k) or an exponential mean (~8k); k, m and g suffixes\n"
+     "  work. At most fanout entries go in one directory (default 1000, 0: flat).\n"
+     "  type is random (default), text or compressible. The same seed gives the\n"
+     "  same files."},
+    {"count", cmd_count, PROFILE_DATA, "count lines, words, bytes",
+     "count [-l] [-w] [-c] [file...]: print line, word and byte counts like wc,\n"
+     "  for standard input if no file is given."},
+    {"grep", cmd_grep, PROFILE_DATA, "search files for a string",
+     "grep [-c] [-v] [-n] [-F] pattern file...: print the lines containing pattern.\n"
+     "  Plain-string patterns are searched in-process on all cores; regular\n"
+     "  expressions, other options and standard input run the system grep."},
+    {"topk", cmd_topk, PROFILE_DATA, "most frequent lines",
+     "topk [-n N] [-f field] [file...]: the N (default 10) most frequent lines, or\n"
+     "  values of a blank-separated field, with their counts."},
+    {"histogram", cmd_histogram, PROFILE_DATA, "distribution of a numeric field",
+     "histogram [-f field] [-b buckets] [file...]: count, min, max and mean of the\n"
+     "  numbers in a field (default 1) and a bar chart over equal-width buckets."},
+    {"motivate", cmd_motivate, PROFILE_DATA, "print motivational message",
+     "motivate: print a motivational message."},
+    {"tips", cmd_tips, PROFILE_DATA, "show file tips",
+     "tips: show file management tips."},
+
+    {"netquote", cmd_net_quote, PROFILE_NET, "show a technical quote",
+     "netquote: print a random technical quote."},
+    {"netquiz", cmd_net_quiz, PROFILE_NET, "answer a riddle",
+     "netquiz: answer a simple riddle."},
+    {"find_target", cmd_find_target, PROFILE_NET, "search for target.txt",
+     "find_target [name|glob]: list paths in the workspace with that file name\n"
+     "  (default target.txt) from the name index, and save them to target_location.txt."},
+
+    {"scan_temp", cmd_scan_temp, PROFILE_SEC, "summarize key directories",
+     "scan_temp [-l] [-J] [-t N] [path...]: count files, bytes and ages and list the\n"
+     "  N (default 10) largest files under main, hidden and corrupted_files, or the\n"
+     "  given paths. -l also prints every entry, -J prints the summary as JSON."},
+    {"secure_backup", cmd_secure_backup, PROFILE_SEC, "snapshot backup_good_files",
+     "secure_backup: store a deduplicated, compressed snapshot of backup_good_files\n"
+     "  in .secure_store. Only changed data is read and stored again."},
+    {"secure_list", cmd_secure_list, PROFILE_SEC, "list snapshots",
+     "secure_list: list snapshots with their time, file count and size."},
+    {"secure_verify", cmd_secure_verify, PROFILE_SEC, "check snapshot chunks",
+     "secure_verify [snapshot...]: read back and rehash every chunk the snapshots\n"
+     "  (default: all) refer to."},
+    {"secure_restore", cmd_secure_restore, PROFILE_SEC, "restore a snapshot",
+     "secure_restore <snapshot> [dir]: rebuild a snapshot into dir\n"
+     "  (default: restore-<snapshot> in the workspace)."},
+    {"baseline", cmd_baseline, PROFILE_SEC, "record file hashes",
+     "baseline: hash every file in good_files, backup_good_files and main and keep\n"
+     "  the result as the baseline verify compares against."},
+    {"verify", cmd_verify, PROFILE_SEC, "compare files with the baseline",
+     "verify: hash the same files again and list those added, removed or modified\n"
+     "  since the baseline. Files whose inode, size and mtime are unchanged since\n"
+     "  they were last hashed are not read again."},
+    {"clean_temp", cmd_clean_temp, PROFILE_SEC, "remove temporary temp files",
+     "clean_temp [-n] [-r] [pattern...]: remove files matching the glob patterns\n"
+     "  (default *_temp.txt) in the current directory; -r includes subdirectories,\n"
+     "  -n only lists the files."},
+
+    {"cd", cmd_cd, PROFILE_ALL, "change directory",
+     "cd [dir]: change the current directory (default: $HOME)."},
+    {"history", showHistory, PROFILE_ALL, "show command history",
+     "history [N | -w | search [^]pattern]: show all or the last N commands, flush\n"
+     "  pending entries to disk, or list distinct commands matching a pattern."},
+    {"hash", cmd_hash, PROFILE_ALL, "show/reset command path cache",
+     "hash [-r | name...]: list cached command paths with hit counts, forget\n"
+     "  them all (-r), or look names up now."},
+    {"launcher", cmd_launcher, PROFILE_ALL, "choose spawn or fork launcher",
+     "launcher [spawn | fork]: show or select how external commands are started."},
+    {"pipestatus", cmd_pipestatus, PROFILE_ALL, "exit status of each pipeline stage",
+     "pipestatus: print the exit status of every stage of the last command."},
+    {"pipesize", cmd_pipesize, PROFILE_ALL, "show/set the pipe buffer size",
+     "pipesize [size]: show or set the buffer size of the pipes the shell makes for\n"
+     "  pipelines, cat and tee (default 1m, 0: the kernel's 64k). The kernel rounds\n"
+     "  it up to a power of two pages and caps it at /proc/sys/fs/pipe-max-size."},
+    {"cat", cmd_cat, PROFILE_ALL, "copy files to standard output",
+     "cat [file...]: write each file (- or none: standard input) to standard output.\n"
+     "  Data is moved in the kernel with splice, copy_file_range or sendfile, without\n"
+     "  a copy through the shell. Options are handed to the system cat."},
+    {"tee", cmd_tee, PROFILE_ALL, "copy standard input to output and files",
+     "tee [-a] [file...]: copy standard input to standard output and to every file\n"
+     "  (-a: append). Data is duplicated with tee(2) and moved with splice where the\n"
+     "  descriptors allow. Other options are handed to the system tee."},
+    {"parallel", cmd_parallel, PROFILE_ALL, "run a command over many inputs",
+     "parallel [-j N] [-a file] [--halt[=now]] command [arg...] [::: input...]:\n"
+     "  run command once per input (the words after :::, else the lines of file or\n"
+     "  standard input), N at a time (default: one per CPU). {} in an argument is\n"
+     "  replaced by the input, {.} by the input without extension, {/} by its base\n"
+     "  name and {#} by the job number; with none of them the input is appended.\n"
+     "  Each job's output is printed whole and in input order. --halt starts no new\n"
+     "  job after one fails, --halt=now also stops the running ones. A throughput\n"
+     "  and latency summary goes to stderr; the exit status is the number of\n"
+     "  failed jobs (at most 101)."},
+    {"stats", cmd_stats, PROFILE_ALL, "per-command timing for the session",
+     "stats [-r | command...]: runs, total and p50/p95/p99/max wall time, CPU time,\n"
+     "  max RSS, context switches and page faults of every command run this\n"
+     "  session, slowest in total first. Named commands also get a histogram of\n"
+     "  their wall times; -r forgets everything. Prefix a command with 'time' to\n"
+     "  see what one run cost."},
+    {"jobs", cmd_jobs, PROFILE_ALL, "list background and stopped jobs",
+     "jobs [-l]: list jobs started with '&' or stopped with Ctrl-Z (-l: with pids)."},
+    {"fg", cmd_fg, PROFILE_ALL, "bring a job to the foreground",
+     "fg [%n]: continue job n (default: the current job, %+) in the foreground."},
+    {"bg", cmd_bg, PROFILE_ALL, "continue a stopped job in the background",
+     "bg [%n]: continue stopped job n (default: the current job) in the background."},
+    {"wait", cmd_wait, PROFILE_ALL, "wait for background jobs",
+     "wait [%n | pid]...: wait for the given jobs, or all of them, to finish and\n"
+     "  return the status of the last one. Ctrl-C stops waiting."},
+    {"help", cmd_help, PROFILE_ALL, "show this help",
+     "help [command | all]: list the commands of this profile or explain one."},
+    {"exit", cmd_exit, PROFILE_ALL, "exit shell",
+     "exit [N]: leave the shell with status N (default: last status)."},
+};
+
+#define BUILTIN_COUNT ((int)(sizeof(builtins) / sizeof(builtins[0])))
+
+static const Builtin **builtinTable = NULL;
+static unsigned builtinMask = 0;
+static unsigned builtinSeed = 0;
+
+unsigned hashSeeded(const char *s, unsigned seed) {
+    unsigned h = 2166136261u ^ seed;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    h ^= h >> 15; // FNV's low bits mix poorly on short names
+    return h;
+}
+
+// Find a seed that puts every registered name in its own slot
+void initBuiltins() {
+    unsigned size = 1;
+    while (size < (unsigned)BUILTIN_COUNT * 2) size <<= 1;
+    builtinTable = calloc(size, sizeof(Builtin *));
+    if (builtinTable == NULL) return;
+    builtinMask = size - 1;
+
+    for (unsigned seed = 1;; seed++) {
+        int ok = 1;
+        memset(builtinTable, 0, size * sizeof(Builtin *));
+        for (int i = 0; i < BUILTIN_COUNT && ok; i++) {
+            unsigned slot = hashSeeded(builtins[i].name, seed) & builtinMask;
+            if (builtinTable[slot] != NULL) ok = 0;
+            else builtinTable[slot] = &builtins[i];
+        }
+        if (ok) {
+            builtinSeed = seed;
+            return;
+        }
+        if (seed % 1024 == 0) {
+            // dense table: give it more room
+            size <<= 1;
+            const Builtin **t = realloc(builtinTable, size * sizeof(Builtin *));
+            if (t == NULL) return;
+            builtinTable = t;
+            builtinMask = size - 1;
+        }
+    }
+}
+
+// The built-in called name in profile, or NULL
+const Builtin *findBuiltin(const char *name, int profile) {
+    if (builtinTable == NULL || name == NULL) return NULL;
+    const Builtin *b = builtinTable[hashSeeded(name, builtinSeed) & builtinMask];
+    if (b == NULL || !(b->profiles & (1u << profile)) || strcmp(b->name, name) != 0)
+        return NULL;
+    return b;
+}
+
+int runBuiltin(const Builtin *b, char **parsed) {
+    return b->fn(parsed);
+}
+
+int cmd_cd(char **parsed) {
+    const char *dir = parsed[1];
+    if (dir == NULL) {
+        dir = getenv("HOME");
+        if (dir == NULL) dir = "/";
+    }
+    if (chdir(dir) != 0) {
+        perror("cd");
+        return 1;
+    }
+    return 0;
+}
+
+// exit [N]: leave the shell with status N (default: status of the last command)
+int cmd_exit(char **parsed) {
+    if (interactive && hasStoppedJobs() && !stoppedWarned) {
+        // like bash, a second exit in a row really exits
+        printf("There are stopped jobs.\n");
+        stoppedWarned = 1;
+        return 1;
+    }
+    if (interactive)
+        printf("Exiting %s profile shell. Goodbye!\n", profileName(currentProfile));
+    exit(parsed[1] != NULL ? atoi(parsed[1]) : lastStatus);
+}
+
+// Help text is generated from the registry
+int cmd_help(char **parsed) {
+    const char *command = parsed[1] != NULL ? parsed[1] : "all";
+    unsigned mask = 1u << currentProfile;
+    char header[64];
+    int len = snprintf(header, sizeof(header), "==== %s Profile Help ====", profileName(currentProfile));
+    int status = 0;
+
+    printf("\n%s\n", header);
+    if (strcmp(command, "all") == 0) {
+        int width = 0;
+        for (int i = 0; i < BUILTIN_COUNT; i++) {
+            int w = strlen(builtins[i].name);
+            if ((builtins[i].profiles & mask) && w > width) width = w;
+        }
+        printf("Available commands:\n");
+        for (int i = 0; i < BUILTIN_COUNT; i++) {
+            if (builtins[i].profiles & mask)
+                printf("  %-*s - %s\n", width, builtins[i].name, builtins[i].summary);
+        }
+    } else {
+        const Builtin *b = findBuiltin(command, currentProfile);
+        if (b != NULL) {
+            printf("%s\n", b->help);
+        } else {
+            printf("Unknown command '%s'. Type 'help all' for list.\n", command);
+            status = 1;
+        }
+    }
+    for (int i = 0; i < len; i++) putchar('=');
+    putchar('\n');
+    return status;
+}
+
+// One-line list of the profile's commands for the greeting
+void printCommandSummary(int profile) {
+    printf("Commands:");
+    int first = 1;
+    for (int i = 0; i < BUILTIN_COUNT; i++) {
+        if (builtins[i].profiles & (1u << profile)) {
+            printf("%s %s", first ? "" : ",", builtins[i].name);
+            first = 0;
+        }
+    }
+    printf("\n");
+}
+
+// ===== Per-command arena =====
+// Tokens, argv vectors and AST nodes for one command line are bump-allocated
+// from a chunk list that is never freed; releasing a line just rewinds the
+// arena to the mark taken before parsing, so cleanup is O(1) and the chunks
+// are reused by the next line.
+
+#define ARENA_CHUNK 4096
+#define ARENA_ALIGN 16
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    char *last; // start of the most recent allocation, for arenaGrow()
+    char data[];
+} ArenaChunk;
+
+typedef struct Arena {
+    ArenaChunk *head;
+    ArenaChunk *cur;
+} Arena;
+
+typedef struct ArenaMark {
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+static Arena lineArena = {NULL, NULL};
+
+ArenaChunk *newArenaChunk(size_t size) {
+    ArenaChunk *c = malloc(sizeof(ArenaChunk) + size);
+    if (c == NULL) return NULL;
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    c->last = NULL;
+    return c;
+}
+
+void *arenaAlloc(Arena *a, size_t n) {
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (n == 0) n = ARENA_ALIGN;
+
+    if (a->cur == NULL) {
+        a->head = a->cur = newArenaChunk(n > ARENA_CHUNK ? n : ARENA_CHUNK);
+        if (a->cur == NULL) return NULL;
+    }
+
+    while (a->cur->used + n > a->cur->size) {
+        ArenaChunk *next = a->cur->next;
+        if (next == NULL || next->size < n) {
+            // insert a fresh chunk that is big enough right after cur
+            ArenaChunk *c = newArenaChunk(n > ARENA_CHUNK ? n : ARENA_CHUNK);
+            if (c == NULL) return NULL;
+            c->next = next;
+            a->cur->next = c;
+            next = c;
+        }
+        a->cur = next;
+        a->cur->used = 0;
+    }
+
+    char *p = a->cur->data + a->cur->used;
+    a->cur->used += n;
+    a->cur->last = p;
+    return p;
+}
+
+// Resize the most recent allocation in place when possible, otherwise copy
+void *arenaGrow(Arena *a, void *old, size_t oldSize, size_t newSize) {
+    if (old != NULL && a->cur != NULL && old == a->cur->last) {
+        size_t off = (char *)old - a->cur->data;
+        size_t n = (newSize + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if (off + n <= a->cur->size) {
+            a->cur->used = off + n;
+            return old;
+        }
+    }
+    void *p = arenaAlloc(a, newSize);
+    if (p != NULL && old != NULL) memcpy(p, old, oldSize);
+    return p;
+}
+
+ArenaMark arenaMark(Arena *a) {
+    ArenaMark m = {a->cur, a->cur ? a->cur->used : 0};
+    return m;
+}
+
+void arenaRelease(Arena *a, ArenaMark m) {
+    a->cur = m.chunk ? m.chunk : a->head;
+    if (a->cur != NULL) {
+        a->cur->used = m.used;
+        a->cur->last = NULL;
+    }
+}
+
+// ===== Parsing =====
+// A command line is tokenized once and parsed by recursive descent into a
+// small AST:
+//
+//   list     := and_or { (';' | '&') [and_or] }
+//   and_or   := pipeline { ('&&' | '||') pipeline }
+//   pipeline := ['time'] command { '|' command }
+//   command  := { WORD | redirect }, with at least one WORD
+//   redirect := [n] ('<' | '>' | '>>' | '<&' | '>&') WORD
+//
+// n is a single digit written right before the operator, as in "2>&1".
+// Quotes and backslash escapes are removed in place, so every argv entry
+// points into the caller's line buffer and no word is ever copied. All other
+// parser memory comes from lineArena. An and_or followed by '&' runs as a
+// background job. A leading "time" word followed by a command is the
+// keyword, as in sh.
+
+typedef enum {
+    TOK_WORD,
+    TOK_PIPE,
+    TOK_AND,
+    TOK_OR,
+    TOK_SEMI,
+    TOK_BG,
+    TOK_LESS,     // <
+    TOK_GREAT,    // >
+    TOK_DGREAT,   // >>
+    TOK_LESSAND,  // <&
+    TOK_GREATAND, // >&
+    TOK_END
+} TokenType;
+
+typedef struct Token {
+    TokenType type;
+    char *text; // only for TOK_WORD
+    int fd;     // redirections: the n of "n>", -1 if not given
+} Token;
+
+typedef enum {
+    NODE_PIPELINE,
+    NODE_AND,
+    NODE_OR,
+    NODE_SEQ,
+    NODE_BG
+} NodeType;
+
+typedef struct Node {
+    NodeType type;
+    struct Node *left;  // NODE_AND / NODE_OR / NODE_SEQ / NODE_BG
+    struct Node *right; // may be NULL for a trailing ';'
+    int nstages;        // NODE_PIPELINE
+    char ***stages;     // NODE_PIPELINE: one NULL-terminated argv per stage
+    Redir **redirs;     // NODE_PIPELINE: each stage's redirections, or NULL
+    int timed;          // NODE_PIPELINE: prefixed with "time"
+} Node;
+
+typedef struct Parser {
+    Token *tokens;
+    int ntokens;
+    int pos;
+    int error;
+} Parser;
+
+const char *tokenName(TokenType t) {
+    switch (t) {
+        case TOK_PIPE: return "|";
+        case TOK_AND: return "&&";
+        case TOK_OR: return "||";
+        case TOK_SEMI: return ";";
+        case TOK_BG: return "&";
+        case TOK_LESS: return "<";
+        case TOK_GREAT: return ">";
+        case TOK_DGREAT: return ">>";
+        case TOK_LESSAND: return "<&";
+        case TOK_GREATAND: return ">&";
+        case TOK_END: return "newline";
+        default: return "word";
+    }
+}
+
+int isOperatorChar(char c) {
+    return c == '|' || c == '&' || c == ';' || c == '<' || c == '>';
+}
+
+int isRedirToken(TokenType t) {
+    return t >= TOK_LESS && t <= TOK_GREATAND;
+}
+
+int addToken(Token **tokens, int *n, int *cap, TokenType type, char *text) {
+    if (*n == *cap) {
+        int newCap = *cap ? *cap * 2 : 16;
+        Token *t = arenaGrow(&lineArena, *tokens, *cap * sizeof(Token), newCap * sizeof(Token));
+        if (t == NULL) return -1;
+        *tokens = t;
+        *cap = newCap;
+    }
+    (*tokens)[*n].type = type;
+    (*tokens)[*n].text = text;
+    (*tokens)[*n].fd = -1;
+    (*n)++;
+    return 0;
+}
+
+// Split str into tokens, removing quotes in place. Returns the token count
+// (always ending with TOK_END) or -1 on a syntax error.
+int tokenize(char *str, Token **out) {
+    Token *tokens = NULL;
+    int n = 0, cap = 0;
+    char *r = str;
+    char c = *r; // current char; *r itself may already be overwritten
+
+    while (1) {
+        while (c == ' ' || c == '\t' || c == '\n') c = *++r;
+        if (c == '\0' || c == '#') break;
+
+        // a digit right before < or > is the descriptor to redirect
+        int ioFd = -1;
+        if (c >= '0' && c <= '9' && (r[1] == '<' || r[1] == '>')) {
+            ioFd = c - '0';
+            c = *++r;
+        }
+
+        if (isOperatorChar(c)) {
+            TokenType type;
+            int len = 1;
+            if (c == '<') {
+                type = r[1] == '&' ? TOK_LESSAND : TOK_LESS;
+                len = r[1] == '&' ? 2 : 1;
+            } else if (c == '>') {
+                type = r[1] == '>' ? TOK_DGREAT : r[1] == '&' ? TOK_GREATAND : TOK_GREAT;
+                len = r[1] == '>' || r[1] == '&' ? 2 : 1;
+            } else if (c == '|' && r[1] == '|') {
+                type = TOK_OR;
+                len = 2;
+            } else if (c == '|') {
+                type = TOK_PIPE;
+            } else if (c == '&' && r[1] == '&') {
+                type = TOK_AND;
+                len = 2;
+            } else if (c == ';') {
+                type = TOK_SEMI;
+            } else {
+                type = TOK_BG;
+            }
+            if (addToken(&tokens, &n, &cap, type, NULL) < 0) return -1;
+            tokens[n - 1].fd = ioFd;
+            r += len;
+            c = *r;
+            continue;
+        }
+
+        // A word: copy it down over itself while stripping quotes
+        char *start = r;
+        char *w = r;
+        while (c != '\0' && c != ' ' && c != '\t' && c != '\n' && !isOperatorChar(c)) {
+            if (c == '\'') {
+                r++;
+                while (*r != '\0' && *r != '\'') *w++ = *r++;
+                if (*r == '\0') {
+                    printf("syntax error: unterminated quote\n");
+                    return -1;
+                }
+                r++;
+            } else if (c == '"') {
+                r++;
+                while (*r != '\0' && *r != '"') {
+                    // inside double quotes only \\ \" \$ and \` are escapes
+                    if (*r == '\\' && (r[1] == '\\' || r[1] == '"' || r[1] == '$' || r[1] == '`'))
+                        r++;
+                    *w++ = *r++;
+                }
+                if (*r == '\0') {
+                    printf("syntax error: unterminated quote\n");
+                    return -1;
+                }
+                r++;
+            } else if (c == '\\' && r[1] != '\0') {
+                r++;
+                *w++ = *r++;
+            } else {
+                *w++ = *r++;
+            }
+            c = *r;
+        }
+        *w = '\0'; // may land on *r, which is why c is tracked separately
+        if (addToken(&tokens, &n, &cap, TOK_WORD, start) < 0) return -1;
+    }
+
+    if (addToken(&tokens, &n, &cap, TOK_END, NULL) < 0) return -1;
+    *out = tokens;
+    return n;
+}
+
+TokenType peekToken(Parser *ps) {
+    return ps->tokens[ps->pos].type;
+}
+
+void syntaxError(Parser *ps) {
+    if (!ps->error)
+        printf("syntax error near unexpected token `%s'\n", tokenName(peekToken(ps)));
+    ps->error = 1;
+}
+
+Node *newNode(NodeType type, Node *left, Node *right) {
+    Node *n = arenaAlloc(&lineArena, sizeof(Node));
+    if (n == NULL) return NULL;
+    memset(n, 0, sizeof(Node));
+    n->type = type;
+    n->left = left;
+    n->right = right;
+    return n;
+}
+
+// redirect := [n] ('<' | '>' | '>>' | '<&' | '>&') WORD
+Redir *parseRedirect(Parser *ps) {
+    Token *op = &ps->tokens[ps->pos++];
+    if (peekToken(ps) != TOK_WORD) {
+        syntaxError(ps);
+        return NULL;
+    }
+    Redir *r = arenaAlloc(&lineArena, sizeof(Redir));
+    if (r == NULL) return NULL;
+    r->target = ps->tokens[ps->pos++].text;
+    r->fd = op->fd != -1 ? op->fd : op->type == TOK_LESS || op->type == TOK_LESSAND ? 0 : 1;
+    r->op = op->type == TOK_LESS     ? REDIR_IN
+          : op->type == TOK_GREAT    ? REDIR_OUT
+          : op->type == TOK_DGREAT   ? REDIR_APPEND
+                                     : REDIR_DUP;
+    r->src = -1;
+    r->next = NULL;
+    // "n>&m" takes a descriptor 0-9, or "-" to close n
+    if (r->op == REDIR_DUP && strcmp(r->target, "-") != 0 &&
+        !(r->target[0] >= '0' && r->target[0] <= '9' && r->target[1] == '\0')) {
+        printf("syntax error: `%s': file descriptor expected after `%s'\n",
+               r->target, tokenName(op->type));
+        ps->error = 1;
+        return NULL;
+    }
+    return r;
+}
+
+// command := { WORD | redirect }, with at least one WORD. The redirections
+// go to *redir in the order written.
+char **parseCommand(Parser *ps, Redir **redir) {
+    int start = ps->pos, argc = 0;
+    Redir **tail = redir;
+    *redir = NULL;
+    while (1) {
+        TokenType t = peekToken(ps);
+        if (t == TOK_WORD) {
+            argc++;
+            ps->pos++;
+        } else if (isRedirToken(t)) {
+            Redir *r = parseRedirect(ps);
+            if (r == NULL) return NULL;
+            *tail = r;
+            tail = &r->next;
+        } else {
+            break;
+        }
+    }
+    if (argc == 0) {
+        ps->pos = start; // report the token the command should have started with
+        syntaxError(ps);
+        return NULL;
+    }
+
+    char **argv = arenaAlloc(&lineArena, (argc + 1) * sizeof(char *));
+    if (argv == NULL) return NULL;
+    int k = 0;
+    for (int i = start; i < ps->pos; i++) {
+        if (isRedirToken(ps->tokens[i].type)) i++; // and its target
+        else argv[k++] = ps->tokens[i].text;
+    }
+    argv[argc] = NULL;
+    return argv;
+}
+
+// pipeline := ['time'] command { '|' command }
+Node *parsePipeline(Parser *ps) {
+    Node *n = newNode(NODE_PIPELINE, NULL, NULL);
+    if (n == NULL) return NULL;
+
+    Token *t = &ps->tokens[ps->pos];
+    if (t[0].type == TOK_WORD && strcmp(t[0].text, "time") == 0 && t[1].type == TOK_WORD) {
+        n->timed = 1;
+        ps->pos++;
+    }
+
+    int cap = 0, anyRedir = 0;
+    while (1) {
+        Redir *redir;
+        char **argv = parseCommand(ps, &redir);
+        if (argv == NULL) return NULL;
+        if (n->nstages == cap) {
+            int newCap = cap ? cap * 2 : 2;
+            char ***st = arenaGrow(&lineArena, n->stages, cap * sizeof(char **),
+                                   newCap * sizeof(char **));
+            Redir **rd = arenaGrow(&lineArena, n->redirs, cap * sizeof(Redir *),
+                                   newCap * sizeof(Redir *));
+            if (st == NULL || rd == NULL) return NULL;
+            n->stages = st;
+            n->redirs = rd;
+            cap = newCap;
+        }
+        n->redirs[n->nstages] = redir;
+        n->stages[n->nstages++] = argv;
+        anyRedir |= redir != NULL;
+
+        if (peekToken(ps) != TOK_PIPE) break;
+        ps->pos++;
+    }
+    if (!anyRedir) n->redirs = NULL;
+    return n;
+}
+
+// and_or := pipeline { ('&&' | '||') pipeline }
+Node *parseAndOr(Parser *ps) {
+    Node *left = parsePipeline(ps);
+    while (left != NULL && (peekToken(ps) == TOK_AND || peekToken(ps) == TOK_OR)) {
+        NodeType type = peekToken(ps) == TOK_AND ? NODE_AND : NODE_OR;
+        ps->pos++;
+        Node *right = parsePipeline(ps);
+        if (right == NULL) return NULL;
+        left = newNode(type, left, right);
+    }
+    return left;
+}
+
+// list := and_or { (';' | '&') [and_or] }
+Node *parseList(Parser *ps) {
+    Node *left = NULL;
+    while (1) {
+        Node *item = parseAndOr(ps);
+        if (item != NULL && peekToken(ps) == TOK_BG) item = newNode(NODE_BG, item, NULL);
+        if (item == NULL) return NULL;
+        left = left == NULL ? item : newNode(NODE_SEQ, left, item);
+        if (left == NULL) return NULL;
+
+        if (peekToken(ps) != TOK_SEMI && peekToken(ps) != TOK_BG) break;
+        ps->pos++;
+        if (peekToken(ps) == TOK_END) break;
+    }
+    if (peekToken(ps) != TOK_END) {
+        syntaxError(ps);
+        return NULL;
+    }
+    return left;
+}
+
+// Run one command: a builtin of the profile, else a Linux command. A
+// builtin runs in the shell, with redir applied to the shell's own
+// descriptors for its duration.
+int execSimple(char **parsed, Redir *redir, int profile) {
+    const Builtin *b = findBuiltin(parsed[0], profile);
+    if (b == NULL && isLinuxCommand(parsed[0]))
+        return execArgsPiped(&parsed, redir != NULL ? &redir : NULL, 1, -1);
+
+    int status = 127;
+    RedirSaved saved;
+    if (b != NULL && redir != NULL && (redirOpen(redir) != 0 || redirShell(redir, &saved) != 0)) {
+        redirClose(redir);
+        status = 1;
+    } else if (b != NULL) {
+        // the children it waited for (parallel, wait) count as its cost
+        struct timespec start;
+        struct rusage before, after, used, kidsBefore, kidsAfter, kids;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        getrusage(RUSAGE_SELF, &before);
+        getrusage(RUSAGE_CHILDREN, &kidsBefore);
+        int64_t t = traceStart();
+        atomic_store(&builtinInterrupted, 0);
+        status = runBuiltin(b, parsed);
+        traceEnd("builtin", b->name, t);
+        getrusage(RUSAGE_SELF, &after);
+        getrusage(RUSAGE_CHILDREN, &kidsAfter);
+        rusageDelta(&used, &before, &after);
+        rusageDelta(&kids, &kidsBefore, &kidsAfter);
+        kids.ru_maxrss = 0; // a lifetime maximum, not this command's
+        rusageAdd(&used, &kids);
+        usageAdd(&pipeUsage, &used);
+        recordStat(b->name, elapsedSince(&start), &used);
+        if (redir != NULL) {
+            redirRestore(&saved);
+            redirClose(redir);
+        }
+    } else {
+        displayError();
+    }
+    setPipeStatus(&status, 1);
+    return status;
+}
+
+int runBackground(Node *n, int profile);
+
+// Evaluate an AST node and return its exit status
+int evalNode(Node *n, int profile) {
+    if (n == NULL) return 0;
+
+    switch (n->type) {
+        case NODE_SEQ:
+            evalNode(n->left, profile);
+            return evalNode(n->right, profile);
+        case NODE_AND: {
+            int status = evalNode(n->left, profile);
+            return status == 0 ? evalNode(n->right, profile) : status;
+        }
+        case NODE_OR: {
+            int status = evalNode(n->left, profile);
+            return status != 0 ? evalNode(n->right, profile) : status;
+        }
+        case NODE_PIPELINE: {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            memset(&pipeUsage, 0, sizeof(pipeUsage));
+            int status = n->nstages > 1 ? execArgsPiped(n->stages, n->redirs, n->nstages, profile)
+                                        : execSimple(n->stages[0], n->redirs ? n->redirs[0] : NULL, profile);
+            if (n->timed) {
+                fflush(stdout); // the report comes after the command's output
+                pipeUsage.real = elapsedSince(&start);
+                printUsage(stderr, "time", &pipeUsage);
+            }
+            return status;
+        }
+        case NODE_BG:
+            return runBackground(n->left, profile);
+    }
+    return 1;
+}
+
+// Append the command text of n to buf, for job listings
+void nodeText(Node *n, char **buf, size_t *len, size_t *cap) {
+    if (n->type == NODE_PIPELINE) {
+        char *text = stagesText(n->stages, n->redirs, n->nstages);
+        if (text != NULL) bufAppend(buf, len, cap, "%s", text);
+        free(text);
+        return;
+    }
+    nodeText(n->left, buf, len, cap);
+    bufAppend(buf, len, cap, "%s", n->type == NODE_AND ? " && " : " || ");
+    nodeText(n->right, buf, len, cap);
+}
+
+// Run an and_or list in the background. A pipeline is launched as a job
+// directly; a list with && or || needs the shell to decide what runs next,
+// so a forked copy of the shell evaluates it as a job of its own.
+int runBackground(Node *n, int profile) {
+    if (n->type == NODE_PIPELINE) return runJob(n->stages, n->redirs, n->nstages, profile, 1);
+
+    char *text = NULL;
+    size_t len = 0, cap = 0;
+    nodeText(n, &text, &len, &cap);
+    Job *job = newJob(text, 1);
+    free(text);
+    if (job == NULL) return 1;
+
+    LaunchGroup grp = {0, -1};
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        removeJob(job);
+        return 1;
+    } else if (pid == 0) {
+        int wasJobControl = jobControl;
+        childSetup(wasJobControl ? &grp : NULL);
+        if (!wasJobControl) {
+            int null = open("/dev/null", O_RDONLY);
+            if (null != -1) {
+                dup2(null, STDIN_FILENO);
+                close(null);
+            }
+        }
+        int status = evalNode(n, profile);
+        fflush(NULL);
+        _exit(status);
+    }
+    if (jobControl) {
+        setpgid(pid, pid);
+        job->pgid = pid;
+    }
+    Node *first = n;
+    while (first->type != NODE_PIPELINE) first = first->left;
+    jobSetProc(job, 0, pid, first->stages[0][0]);
+    return backgroundStarted(job);
+}
+
+// Main command processing: tokenize and parse the whole line, then evaluate
+// it. str is modified in place. Returns the exit status of the line.
+int processString(char *str, int profile) {
+    ArenaMark mark = arenaMark(&lineArena);
+    Token *tokens = NULL;
+    int status = 2;
+    commandCacheNewLine();
+    int64_t tline = traceStart();
+    char line[TRACE_ARG] = "";
+    if (tline != 0) snprintf(line, sizeof(line), "%s", str); // before quotes are removed
+
+    int ntokens = tokenize(str, &tokens);
+    if (ntokens == 1) { // only TOK_END: blank line or comment
+        status = 0;
+    } else if (ntokens > 1) {
+        Parser ps = {tokens, ntokens, 0, 0};
+        Node *root = parseList(&ps);
+        traceEnd("parse", NULL, tline);
+        if (root != NULL) status = evalNode(root, profile);
+    }
+
+    arenaRelease(&lineArena, mark);
+    traceEnd("command", line, tline);
+    lastStatus = status;
+    return status;
+}
+
+// Mapping profile index to name and color
+const char *profileName(int p) {
+    switch (p) {
+        case 0: return "Core";
+        case 1: return "Ops";
+        case 2: return "Data";
+        case 3: return "Net";
+        case 4: return "Sec";
+        default: return "Unknown";
+    }
+}
+
+const char *profileColor(int p) {
+    switch (p) {
+        case 0: return COLOR_RED;
+        case 1: return COLOR_GREEN;
+        case 2: return COLOR_YELLOW;
+        case 3: return COLOR_BLUE;
+        case 4: return COLOR_MAGENTA;
+        default: return COLOR_RESET;
+    }
+}
+
+// Shell loop
+int shell_cmds(int profile) {
+    char *inputString;
+    printf("%sProfile selected: %s%s\n",
+           profileColor(profile), profileName(profile), COLOR_RESET);
+
+    printCommandSummary(profile);
+
+    while (1) {
+        // \001 and \002 tell readline the color codes take no room
+        char prompt[64];
+        snprintf(prompt, sizeof(prompt), "\001%s\002%s>\001%s\002  ",
+                 profileColor(profile), profileName(profile), COLOR_RESET);
+
+        int rc = takeInput(&inputString, prompt);
+        if (rc < 0) {
+            printf("\n");
+            break;
+        } else if (rc > 0) {
+            continue;
+        }
+
+        processString(inputString, profile);
+        free(inputString);
+    }
+    return lastStatus;
+}
+
+// Non-interactive loop for script files and piped stdin: no prompt,
+// no banner, no history
+int runBatch(FILE *in, int profile) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, in)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') line[len - 1] = '\0';
+        reapJobs(); // no zombies from background jobs in long scripts
+        processString(line, profile);
+    }
+    free(line);
+    return lastStatus;
+}
+
+// Simple profile selection instead of sorting hat
+const char *selectProfile() {
+    int core = 0, ops = 0, data = 0, net = 0, sec = 0;
+    char answer[16];
+
+    printf("Profile selection wizard (answer yes/no):\n");
+
+    printf("Q1: Do you like cleaning, organizing and maintaining systems? ");
+    fflush(stdout);
+    if (fgets(answer, sizeof(answer), stdin) && strncmp(answer, "yes", 3) == 0) core++;
+
+    printf("Q2: Do you enjoy automation, deployment and operations? ");
+    fflush(stdout);
+    if (fgets(answer, sizeof(answer), stdin) && strncmp(answer, "yes", 3) == 0) ops++;
+
+    printf("Q3: Do you like working with data and logs? ");
+    fflush(stdout);
+    if (fgets(answer, sizeof(answer), stdin) && strncmp(answer, "yes", 3) == 0) data++;
+
+    printf("Q4: Are you interested in networking and connectivity? ");
+    fflush(stdout);
+    if (fgets(answer, sizeof(answer), stdin) && strncmp(answer, "yes", 3) == 0) net++;
+
+    printf("Q5: Are you interested in security and monitoring? ");
+    fflush(stdout);
+    if (fgets(answer, sizeof(answer), stdin) && strncmp(answer, "yes", 3) == 0) sec++;
+
+    int maxScore = core;
+    const char *profile = "Core";
+    if (ops > maxScore) { maxScore = ops; profile = "Ops"; }
+    if (data > maxScore) { maxScore = data; profile = "Data"; }
+    if (net > maxScore) { maxScore = net; profile = "Net"; }
+    if (sec > maxScore) { maxScore = sec; profile = "Sec"; }
+
+    printf("\nSelected profile: %s\n\n", profile);
+    return profile;
+}
+
+// Profile index for a name such as "Core", or -1
+int profileFromName(const char *name) {
+    for (int p = 0; p < 5; p++) {
+        if (strcasecmp(name, profileName(p)) == 0) return p;
+    }
+    return -1;
+}
+
+void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--profile=Core|Ops|Data|Net|Sec] [--trace=file] [-c command | script]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    int profile = -1;
+    char *command = NULL;
+    char *script = NULL;
+    char *traceFile = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profile = profileFromName(argv[i] + 10);
+            if (profile < 0) {
+                fprintf(stderr, "Unknown profile '%s'\n", argv[i] + 10);
+                return 2;
+            }
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            traceFile = argv[i] + 8;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            command = argv[++i];
+        } else if (argv[i][0] != '-' || strcmp(argv[i], "-") == 0) {
+            script = argv[i];
+            break; // anything after the script is left to it
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    // Only a terminal session gets the banner, the wizard and history
+    interactive = command == NULL && script == NULL && isatty(STDIN_FILENO);
+
+    initJobs();
+    initTrace(traceFile != NULL ? traceFile : getenv("CUSTOM_SHELL_TRACE"));
+    initLauncher();
+    initWorkspace();
+    initBuiltins();
+    if (interactive) {
+        init_shell();
+        initHistory();
+    }
+
+    if (profile < 0)
+        profile = interactive ? profileFromName(selectProfile()) : 0;
+    if (profile < 0) profile = 0;
+    currentProfile = profile;
+
+    if (command != NULL)
+        return processString(command, profile);
+
+    if (script != NULL && strcmp(script, "-") != 0) {
+        FILE *in = fopen(script, "r");
+        if (in == NULL) {
+            perror(script);
+            return 127;
+        }
+        int status = runBatch(in, profile);
+        fclose(in);
+        return status;
+    }
+
+    if (!interactive)
+        return runBatch(stdin, profile);
+
+    return shell_cmds(profile);
+}